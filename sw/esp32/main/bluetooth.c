@@ -1,14 +1,60 @@
 /**
  * @file Functions for communicating with Bluetooth LE light bulbs
+ *
+ * Every configured bulb has its own slot with a small reconnect state machine.
+ * Missing bulbs are connected to directly, which the controller completes as
+ * soon as the bulb advertises. Bulbs which do not answer are looked for by a
+ * single whitelist filtered scan. Connections are opened one at a time. GATT
+ * events are mapped to their bulb through tables indexed by conn_id and by a
+ * hash of the BDA.
+ *
+ * Bulbs whose characteristic can notify or indicate are subscribed to through
+ * its CCCD, so their state follows the bulb without reads. Other bulbs are
+ * read when a client asks for their state.
+ *
+ * The last value each bulb has reported or been sent is kept as its shadow.
+ * A value the shadow already holds is not written again, unless the shadow
+ * is older than the reassert interval or the command forced the write.
+ *
+ * Commands set the desired state of a bulb, while what the bulb has reported
+ * is its state. Writes go without response, so the write event only means
+ * the controller has sent the value: the state follows once the bulb
+ * notifies it or, when the writes to the bulb have settled, a read shows it.
+ * Whenever the two may have drifted apart (after a reconnect, a failed
+ * write, a read or a notification) the bulb is sent its desired state again.
+ *
+ * A link timer samples each connection. Its RSSI is read from the controller
+ * and a bulb which has been quiet for part of its supervision timeout is sent
+ * a probe read. Reads left unanswered and failed writes lower the bulb's
+ * health score, and a link found dead is dropped straight away rather than
+ * after the supervision timeout, so the bulb starts reconnecting sooner.
+ *
+ * The Bluedroid callbacks, the timers and the request handlers only copy
+ * their events for the bridge task. The bridge task is the one task which
+ * calls the GATT and GAP APIs and changes the connection state. Bluedroid
+ * events go through a lock-free ring of their own, as the connection state
+ * is wrong if one is lost: the BTC task is the ring's only writer and the
+ * bridge task its only reader, so the two indexes are all they share. When
+ * the ring is full the BTC task waits for room. Everything else goes through
+ * a queue where only frame, idle and link sample events, which the next one
+ * makes up for, and wake-ups are dropped when it is full.
  */
 
 /* system includes */
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
 
 /* local includes */
 #include "bluetooth.h"
+#include "boot_profile.h"
 #include "colours.h"
+#include "transition.h"
 
 
 const char * log_tag = "bluetoothle";
@@ -20,11 +66,9 @@ const char * log_tag = "bluetoothle";
 #define PROFILE_A_APP_ID     0
 #define INVALID_HANDLE       0
 
-/* MAC address of the BLE bulb to connect to */
-unsigned char mac_address[6];
-
-static bool connect    = false;
-static esp_gattc_char_elem_t *char_elem_result = NULL;
+/* the bulb service has a handful of characteristics, so the search result fits a fixed array */
+#define MAX_CHAR_ELEMS       8
+static esp_gattc_char_elem_t char_elem_result[MAX_CHAR_ELEMS];
 
 /* Bluetooth device scan duration (in seconds) */
 const uint32_t scan_duration = 30;
@@ -33,17 +77,34 @@ const uint32_t scan_duration = 30;
 static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param);
 static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t *param);
 static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t *param);
+static void read_bulb(const int bulb);
+static void reconcile_bulb(const int bulb);
+static void link_heard(const int bulb);
+static void link_report(const int bulb);
+static void link_drop_detected(const int bulb, const bool early);
 
-/* record the last known state of the bulb so we can update a single value at a time if required */
+/* record the last known state of each bulb so we can update a single value at a time if required */
 /* default to white (0 degrees, 0% saturation, 100% brightness, temperature 4000K) */
-struct light_state current_state =
+struct light_state bulb_state[BLUETOOTH_MAX_BULBS] =
 {
-    .colour = { .h = 0, .s = 0, .v = 100 },
-    .on_off = false,
-    .temperature = 4000,
-    .up_to_date = false,
+    [0 ... BLUETOOTH_MAX_BULBS - 1] = {
+        .colour = { .h = 0, .s = 0, .v = 100 },
+        .on_off = false,
+        .temperature = 4000,
+        .up_to_date = false,
+        .read_time = 0,
+        .version = 0,
+    },
 };
 
+/* the bridge task writes bulb_state under this lock, other tasks copy it out with bluetooth_reported_state */
+static portMUX_TYPE bulb_state_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* state each bulb was last told to reach, written by the request handlers (version 0 until first commanded) */
+/* and read by the bridge task, so it is only copied in or out under the lock */
+static portMUX_TYPE desired_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct light_state bulb_desired[BLUETOOTH_MAX_BULBS];
+
 static esp_bt_uuid_t smartbulb_ble_service_uuid = {
     .len = ESP_UUID_LEN_16,
     .uuid = {.uuid16 = SERVICE_UUID,},
@@ -55,23 +116,76 @@ static esp_bt_uuid_t smartbulb_ble_char_uuid = {
 };
 
 static esp_ble_scan_params_t ble_scan_params = {
+#ifdef CONFIG_SMARTBULB_SCAN_ACTIVE
     .scan_type              = BLE_SCAN_TYPE_ACTIVE,
+#else
+    .scan_type              = BLE_SCAN_TYPE_PASSIVE,     /* the bulb is found by its address, scan responses are not needed */
+#endif
     .own_addr_type          = BLE_ADDR_TYPE_PUBLIC,
-    .scan_filter_policy     = BLE_SCAN_FILTER_ALLOW_ALL,
+    .scan_filter_policy     = BLE_SCAN_FILTER_ALLOW_ONLY_WLST,  /* the controller only reports the bulbs */
     .scan_interval          = 0x50,
     .scan_window            = 0x30,
+#ifdef CONFIG_SMARTBULB_SCAN_FILTER_DUPLICATES
+    .scan_duplicate         = BLE_SCAN_DUPLICATE_ENABLE
+#else
     .scan_duplicate         = BLE_SCAN_DUPLICATE_DISABLE
+#endif
+};
+
+/**
+ * @brief Scan interval and window (in units of 0.625 ms)
+ */
+struct scan_duty {
+    uint16_t interval;
+    uint16_t window;
 };
 
+/* the first scan listens hard to find a bulb quickly, each scan which finds nothing listens less */
+/* so a bulb which is switched off at the wall does not keep taking airtime from Wi-Fi */
+static const struct scan_duty scan_duties[] = {
+    { .interval = 0x50,  .window = 0x30 },      /* 30 ms in 50 ms */
+    { .interval = 0x100, .window = 0x30 },      /* 30 ms in 160 ms */
+    { .interval = 0x640, .window = 0x30 },      /* 30 ms in 1 s */
+};
+#define SCAN_DUTY_LEVELS (sizeof(scan_duties) / sizeof(scan_duties[0]))
+
+/* consecutive scans which found no bulb, selects the duty cycle */
+static unsigned scan_misses = 0;
+
+/* start of the running scan, for the time counters */
+static int64_t scan_start_time = 0;
+
+static struct bluetooth_scan_stats scan_stats;
+
+/* the request handlers leave values in the bulb mailboxes, the bridge task sends them as the link allows */
+static portMUX_TYPE mailbox_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct bluetooth_tx_stats tx_stats;
+
+static struct bluetooth_conn_stats conn_stats;
+
+/* counted by the bridge task and by the request handlers waiting for fresh state */
+static portMUX_TYPE state_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct bluetooth_state_stats state_stats;
+
+static portMUX_TYPE command_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct bluetooth_command_stats command_stats;
+
+static struct bluetooth_link_stats link_stats;
+
+/* incremented whenever the reported link quality of a bulb changes, so cached replies are rebuilt */
+static uint32_t link_version = 0;
+
+/* one bit per bulb, set whenever a read of that bulb completes, for tasks waiting on fresh state */
+static EventGroupHandle_t read_events = NULL;
+
+/* a read is in flight for the bulb, so waiters share it instead of sending another */
+static portMUX_TYPE read_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool read_pending[BLUETOOTH_MAX_BULBS];
+
 struct gattc_profile_inst {
     esp_gattc_cb_t gattc_cb;
     uint16_t gattc_if;
     uint16_t app_id;
-    uint16_t conn_id;
-    uint16_t service_start_handle;
-    uint16_t service_end_handle;
-    uint16_t char_handle;
-    esp_bd_addr_t remote_bda;
 };
 
 /* One gatt-based profile one app_id and one gattc_if, this array will store the gattc_if returned by ESP_GATTS_REG_EVT */
@@ -82,344 +196,2080 @@ static struct gattc_profile_inst gl_profile_tab[PROFILE_NUM] = {
     },
 };
 
-static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t *param)
-{
-    esp_ble_gattc_cb_param_t *p_data = (esp_ble_gattc_cb_param_t *)param;
+/* reconnect backoff after failed attempts, doubling from the minimum up to the maximum */
+#define RECONNECT_MIN_DELAY_MS  500
+#define RECONNECT_MAX_DELAY_MS  30000
 
-    switch (event) {
-    case ESP_GATTC_REG_EVT:
-        ESP_LOGI(log_tag, "REG_EVT");
-        esp_err_t scan_ret = esp_ble_gap_set_scan_params(&ble_scan_params);
-        if (scan_ret){
-            ESP_LOGE(log_tag, "set scan params error, error code = %x", scan_ret);
-        }
-        break;
-    case ESP_GATTC_CONNECT_EVT:{
-        ESP_LOGI(log_tag, "ESP_GATTC_CONNECT_EVT conn_id %d, if %d", p_data->connect.conn_id, gattc_if);
-        gl_profile_tab[PROFILE_A_APP_ID].conn_id = p_data->connect.conn_id;
-        memcpy(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, p_data->connect.remote_bda, sizeof(esp_bd_addr_t));
-        ESP_LOGI(log_tag, "REMOTE BDA:");
-        esp_log_buffer_hex(log_tag, gl_profile_tab[PROFILE_A_APP_ID].remote_bda, sizeof(esp_bd_addr_t));
-        
-        esp_err_t mtu_ret = esp_ble_gattc_send_mtu_req (gattc_if, p_data->connect.conn_id);
-        if (mtu_ret){
-            ESP_LOGE(log_tag, "config MTU error, error code = %x", mtu_ret);
-        }
+/* how long to wait for the controller to free a buffer or for the next connection event */
+#define TX_CREDIT_POLL_MS       10
+#define TX_VALUE_LEN            4
 
-        /* update BLE connection parameters */
-        esp_ble_conn_update_params_t conn_params = {0};
-        memcpy(conn_params.bda, p_data->connect.remote_bda, sizeof(esp_bd_addr_t));
-        conn_params.latency = 0;
-        conn_params.max_int = 0x20;    // max_int = 0x20*1.25ms = 40ms
-        conn_params.min_int = 0x10;    // min_int = 0x10*1.25ms = 20ms
-        conn_params.timeout = 600;     // timeout = 600*10ms    = 6000ms
-        esp_ble_gap_update_conn_params(&conn_params);
+/* radio time of one write without response on the 1M PHY: preamble, access address, header, */
+/* L2CAP and ATT headers, the value and CRC, 21 bytes at 8 us per byte */
+#define TX_WRITE_AIRTIME_US     168
 
-        break;
-    }
-    case ESP_GATTC_OPEN_EVT:
-        if (param->open.status != ESP_GATT_OK){
-            ESP_LOGE(log_tag, "open failed, status %d", p_data->open.status);
-            break;
-        }
-        ESP_LOGI(log_tag, "open success");
-        break;
-    case ESP_GATTC_DIS_SRVC_CMPL_EVT:
-        if (param->dis_srvc_cmpl.status != ESP_GATT_OK){
-            ESP_LOGE(log_tag, "discover service failed, status %d", param->dis_srvc_cmpl.status);
-            break;
-        }
-        ESP_LOGI(log_tag, "discover service complete conn_id %d", param->dis_srvc_cmpl.conn_id);
-        esp_ble_gattc_search_service(gattc_if, param->cfg_mtu.conn_id, &smartbulb_ble_service_uuid);
-        break;
-    case ESP_GATTC_CFG_MTU_EVT:
-        if (param->cfg_mtu.status != ESP_GATT_OK){
-            ESP_LOGE(log_tag,"config mtu failed, error status = %x", param->cfg_mtu.status);
-        }
-        ESP_LOGI(log_tag, "ESP_GATTC_CFG_MTU_EVT, Status %d, MTU %d, conn_id %d", param->cfg_mtu.status, param->cfg_mtu.mtu, param->cfg_mtu.conn_id);
-        break;
-    case ESP_GATTC_SEARCH_RES_EVT: {
-        ESP_LOGI(log_tag, "SEARCH RES: conn_id = %x is primary service %d", p_data->search_res.conn_id, p_data->search_res.is_primary);
-        ESP_LOGI(log_tag, "start handle %d end handle %d current handle value %d", p_data->search_res.start_handle, p_data->search_res.end_handle, p_data->search_res.srvc_id.inst_id);
-        if (p_data->search_res.srvc_id.uuid.len == ESP_UUID_LEN_16 && p_data->search_res.srvc_id.uuid.uuid.uuid16 == SERVICE_UUID) {
-            ESP_LOGI(log_tag, "service found");
-            gl_profile_tab[PROFILE_A_APP_ID].service_start_handle = p_data->search_res.start_handle;
-            gl_profile_tab[PROFILE_A_APP_ID].service_end_handle = p_data->search_res.end_handle;
-            ESP_LOGI(log_tag, "UUID16: %x", p_data->search_res.srvc_id.uuid.uuid.uuid16);
-        }
-        break;
-    }
-    case ESP_GATTC_SEARCH_CMPL_EVT:
-        if (p_data->search_cmpl.status != ESP_GATT_OK){
-            ESP_LOGE(log_tag, "search service failed, error status = %x", p_data->search_cmpl.status);
-            break;
-        }
-        if(p_data->search_cmpl.searched_service_source == ESP_GATT_SERVICE_FROM_REMOTE_DEVICE) {
-            ESP_LOGI(log_tag, "Get service information from remote device");
-        } else if (p_data->search_cmpl.searched_service_source == ESP_GATT_SERVICE_FROM_NVS_FLASH) {
-            ESP_LOGI(log_tag, "Get service information from flash");
-        } else {
-            ESP_LOGI(log_tag, "unknown service source");
-        }
+/* writes handed to the stack whose write event is still to come, for the latency counters */
+#define IN_FLIGHT_DEPTH         4
 
-        uint16_t count = 0;
-        esp_gatt_status_t status = esp_ble_gattc_get_attr_count(
-            gl_profile_tab[PROFILE_A_APP_ID].gattc_if,
-            gl_profile_tab[PROFILE_A_APP_ID].conn_id,
-            ESP_GATT_DB_CHARACTERISTIC,
-            gl_profile_tab[PROFILE_A_APP_ID].service_start_handle,
-            gl_profile_tab[PROFILE_A_APP_ID].service_end_handle,
-            INVALID_HANDLE,
-            &count);
+/* a bulb which has not been written to for this long moves to the power saving connection parameters */
+#define CONN_IDLE_AFTER_MS      5000
 
-        if (status != ESP_GATT_OK) {
-            ESP_LOGE(log_tag, "esp_ble_gattc_get_attr_count error");
-            return;
-        }
+/* events waiting for the bridge task, and the largest characteristic value copied out of a read event */
+#define BRIDGE_QUEUE_LEN        32
+#define BRIDGE_VALUE_LEN        8
 
-        if (count > 0) {
-            char_elem_result = (esp_gattc_char_elem_t *)malloc(sizeof(esp_gattc_char_elem_t) * count);
-            if (!char_elem_result) {
-                ESP_LOGE(log_tag, "gattc no mem");
-            } else {
-                status = esp_ble_gattc_get_char_by_uuid(
-                    gl_profile_tab[PROFILE_A_APP_ID].gattc_if,
-                    gl_profile_tab[PROFILE_A_APP_ID].conn_id,
-                    gl_profile_tab[PROFILE_A_APP_ID].service_start_handle,
-                    gl_profile_tab[PROFILE_A_APP_ID].service_end_handle,
-                    smartbulb_ble_char_uuid,
-                    char_elem_result,
-                    &count);
-                if (status != ESP_GATT_OK) {
-                    ESP_LOGE(log_tag, "Error getting characteristic from service");
-                }
-            }
+/* Bluedroid events waiting for the bridge task, a power of two so the indexes can wrap, */
+/* and how long the BTC task waits for room before an event is lost */
+#define STACK_RING_LEN          32
+#define STACK_WAIT_MS           50
 
-            gl_profile_tab[PROFILE_A_APP_ID].char_handle = char_elem_result->char_handle;
-            ESP_LOGI(log_tag, "Found characteristic in service");
+/* the link monitor samples every connection this often, reading the RSSI of one bulb per sample */
+#define LINK_SAMPLE_MS          500
+/*
+ * Probe and response timing follow the parameters negotiated with each bulb.
+ * A read waits up to interval x (latency + 1) for the bulb to listen, and the
+ * response comes back at the same or the next event, so a round trip takes at
+ * most interval x (latency + 2). A read is given LINK_RESPONSE_EVENTS latency
+ * windows, interval x (latency + 1) each, but no less than LINK_RESPONSE_MIN_MS
+ * for the stack to queue it. A bulb is probed once it has been quiet for
+ * 1/LINK_PROBE_DIVISOR of the supervision timeout, and the response timeout is
+ * capped so that the probe, its timeout and one sample all fit within the
+ * supervision timeout, otherwise the controller would notice first.
+ * Idle (200 ms, latency 4, 6 s): probe after 2 s, dead 3 s later.
+ * Fast (7.5 ms, latency 0, 4 s): probe after 1.33 s, dead 250 ms later.
+ */
+#define LINK_PROBE_DIVISOR      3
+#define LINK_RESPONSE_EVENTS    3
+#define LINK_RESPONSE_MIN_MS    250
+/* RSSI mapped to a health of 0 and of 100 */
+#define LINK_RSSI_FLOOR         -95
+#define LINK_RSSI_GOOD          -60
+/* health lost by a sample for each write which failed since the last one */
+#define LINK_WRITE_FAILURE_PENALTY 25
+/* a link this unhealthy which is still failing writes is dropped and reconnected */
+#define LINK_HEALTH_RECONNECT   25
+/* smaller changes of the reported RSSI and health do not invalidate cached replies */
+#define LINK_REPORT_RSSI_STEP   5
+#define LINK_REPORT_HEALTH_STEP 10
 
-            /* now read the current state of the bulb so we can report what it is really doing */
-            bluetooth_request_bulb_state();
+/* conn_ids are connection indices below the ACL connection limit, which is at least the bulb count */
+#define CONN_ID_SLOTS           16
+/* the BDA table is the next power of two of at least twice the bulb count, so it is at most half full */
+#define POW2_SMEAR1(x)          ((x) | (x) >> 1)
+#define POW2_SMEAR2(x)          (POW2_SMEAR1(x) | POW2_SMEAR1(x) >> 2)
+#define POW2_SMEAR4(x)          (POW2_SMEAR2(x) | POW2_SMEAR2(x) >> 4)
+#define BDA_HASH_SLOTS          (POW2_SMEAR4(2 * BLUETOOTH_MAX_BULBS - 1) + 1)
 
-            /* free char_elem_result */
-            free(char_elem_result);
-        } else {
-            ESP_LOGE(log_tag, "Characteristic not found in service");
-        }
+_Static_assert(CONN_ID_SLOTS > BLUETOOTH_MAX_BULBS, "a conn_id may not fit the conn_id table");
+_Static_assert((BDA_HASH_SLOTS & (BDA_HASH_SLOTS - 1)) == 0, "the BDA table size must be a power of two");
+_Static_assert(BDA_HASH_SLOTS >= 2 * BLUETOOTH_MAX_BULBS, "the BDA table must be at most half full");
 
-        ESP_LOGI(log_tag, "ESP_GATTC_SEARCH_CMPL_EVT");
-        break;
-    case ESP_GATTC_WRITE_CHAR_EVT:
-        if (p_data->write.status != ESP_GATT_OK){
-            ESP_LOGE(log_tag, "write char failed, error status = %x", p_data->write.status);
-            break;
-        }
-        ESP_LOGI(log_tag, "write char success ");
-        break;
-    case ESP_GATTC_READ_CHAR_EVT:
-        if (param->read.status != ESP_GATT_OK) {
-            ESP_LOGW(log_tag, "Error reading char at handle %d, status=%d", param->read.handle, param->read.status);
-            break;
-        }
-        ESP_LOGI(log_tag, "ESP_GATTS_READ_EVT char_value:");
-        ESP_LOG_BUFFER_HEX_LEVEL(log_tag, param->read.value, param->read.value_len, ESP_LOG_INFO);
-        if ((param->read.value[0] == 0xD0) && (param->read.value_len == 4))
-        {
-            const struct rgb_colour rgb = { .r = param->read.value[1], .g = param->read.value[2], .b = param->read.value[3] };
-            const struct hsv_colour hsv = colours_rgb_to_hsv(rgb);
-            current_state.on_off = hsv.v > 0;
-            /* only save the colour of the bulb if it is on, otherwise we overwrite the last on state colour */
-            if ( current_state.on_off ) {
-                current_state.colour = hsv;
-            }
-            current_state.up_to_date = true;
-        }
-        break;
-    case ESP_GATTC_DISCONNECT_EVT:
-        connect = false;
-        ESP_LOGE(log_tag, "ESP_GATTC_DISCONNECT_EVT, reason = %d", p_data->disconnect.reason);
-        esp_ble_gap_start_scanning(scan_duration);
-        break;
-    default:
-        break;
-    }
+/**
+ * @brief Reconnect state machine of each bulb
+ */
+enum bulb_link_state {
+    BULB_WAITING,       /* not connected, the shared scan is looking for it */
+    BULB_CONNECTING,    /* seen by the scan, connection being opened */
+    BULB_DISCOVERING,   /* connected, looking for the characteristic */
+    BULB_READY,         /* characteristic found, commands can be sent */
+    BULB_BACKOFF,       /* attempt failed, waiting before looking for it again */
+};
+
+/**
+ * @brief GATT handles of a bulb, which do not change between connections
+ * Blobs saved before a field was added are the wrong length, so they are ignored and discovered again.
+ */
+struct gatt_handles {
+    uint16_t service_start_handle;
+    uint16_t service_end_handle;
+    uint16_t char_handle;
+    uint16_t cccd_handle;       /* client characteristic configuration, INVALID_HANDLE if it cannot notify */
+    uint8_t char_properties;
+};
+
+/* GATT handles are cached in NVS under the BDA of each bulb */
+static const char *nvs_namespace = "ble_handles";
+
+/**
+ * @brief Connection parameter sets, chosen by how busy a bulb is
+ */
+enum conn_mode {
+    CONN_MODE_FAST,     /* shortest interval while commands are arriving */
+    CONN_MODE_IDLE,     /* long interval with slave latency while nothing is happening */
+    CONN_MODES,         /* number of modes, also used for parameters not yet known */
+};
+
+static const esp_ble_conn_update_params_t conn_mode_params[CONN_MODES] = {
+    /* 7.5 ms, supervision timeout 4 s */
+    [CONN_MODE_FAST] = { .min_int = 0x06, .max_int = 0x06, .latency = 0, .timeout = 400 },
+    /* 100-200 ms and the bulb may skip 4 events, supervision timeout 6 s */
+    [CONN_MODE_IDLE] = { .min_int = 0x50, .max_int = 0xA0, .latency = 4, .timeout = 600 },
+};
+
+static const char * conn_mode_names[CONN_MODES] = { "fast", "idle" };
+
+/**
+ * @brief Newest value waiting to be written to a bulb
+ * A value posted before the last one is sent replaces it, so the bulb never works through stale colours.
+ */
+struct tx_mailbox {
+    uint8_t value[TX_VALUE_LEN];
+    int64_t posted_time;
+    bool full;
+};
+
+/**
+ * @brief Connection to one bulb, all bulbs share the one GATT client profile and are told apart by conn_id
+ */
+struct bulb_connection {
+    esp_bd_addr_t remote_bda;
+    enum bulb_link_state link_state;
+    uint16_t conn_id;
+    uint16_t service_start_handle;
+    uint16_t service_end_handle;
+    uint16_t char_handle;
+    uint16_t cccd_handle;
+    uint8_t char_properties;
+    bool notifying;     /* the bulb reports its state changes, so it never needs to be read */
+    uint8_t failures;   /* consecutive failed attempts, sets the backoff */
+    esp_timer_handle_t retry_timer;
+    struct gatt_handles cached_handles;
+    bool handles_cached;
+    esp_ble_addr_type_t addr_type;
+    bool direct_failed;     /* the last direct connect timed out, so look for the bulb with a scan */
+    bool direct_attempt;    /* the connection being opened is a direct connect rather than a scan result */
+    int64_t lost_time;      /* when a working connection dropped, to measure the recovery time */
+    uint8_t reconcile_attempts;     /* writes of the current desired state pushed by the reconciler */
+    struct tx_mailbox mailbox;      /* written by the request handlers, emptied by the bridge task */
+    uint8_t shadow[TX_VALUE_LEN];   /* value last reported by or sent to the bulb */
+    bool shadow_valid;
+    int64_t shadow_time;            /* when the shadow was last confirmed */
+    uint8_t unconfirmed[TX_VALUE_LEN];  /* value last sent, until the bulb reports it */
+    bool awaiting_confirmation;
+    int64_t next_send_time;         /* one value per connection interval, so the newest state goes out at each event */
+    uint16_t conn_interval;         /* interval granted by the bulb, units of 1.25 ms, 0 if not known */
+    uint16_t conn_latency;          /* connection events the bulb may skip */
+    uint16_t supervision_timeout;   /* units of 10 ms, 0 if not known */
+    /* writes handed to the stack, matched in order with their write events */
+    struct {
+        int64_t posted_time;
+        uint8_t value[TX_VALUE_LEN];
+    } in_flight[IN_FLIGHT_DEPTH];
+    uint8_t in_flight_head;
+    uint8_t in_flight_count;
+    enum conn_mode conn_mode;       /* parameters in force */
+    enum conn_mode wanted_mode;     /* parameters wanted for the current activity */
+    enum conn_mode requested_mode;  /* parameters of the update in progress */
+    bool conn_update_pending;
+    esp_timer_handle_t idle_timer;
+    int8_t rssi;                    /* last RSSI read from the controller, BLUETOOTH_RSSI_UNKNOWN if none */
+    uint8_t health;                 /* 0-100, smoothed over the link samples */
+    struct bluetooth_link_quality reported;     /* quality given to clients, only moved by whole steps */
+    int64_t last_heard;             /* last read response, notification or subscription from the bulb */
+    int64_t read_sent_time;         /* read still waiting for its response, 0 if none */
+    uint32_t reads_sent;            /* reads sent on this connection, which the bulb answers in order */
+    uint32_t reads_answered;
+    uint32_t shadow_reads;          /* reads sent when the shadow was set, only answers to later ones are newer */
+    uint8_t write_failures;         /* failed writes since the last link sample */
+    bool dropping;                  /* disconnected by the link monitor, the disconnect event is still to come */
+};
+
+/**
+ * @brief Sources of the work done by the bridge task
+ */
+enum bridge_event_type {
+    BRIDGE_EVENT_GAP,       /* GAP callback */
+    BRIDGE_EVENT_GATTC,     /* GATT client callback */
+    BRIDGE_EVENT_STACK,     /* GAP or GATT client events are waiting in the stack ring */
+    BRIDGE_EVENT_RETRY,     /* retry timer of a bulb expired, the bulb is marked in retry_pending */
+    BRIDGE_EVENT_IDLE,      /* idle timer of a bulb expired */
+    BRIDGE_EVENT_WRITE,     /* request handler has put a value in the empty mailbox of a bulb */
+    BRIDGE_EVENT_READ,      /* request handler wants the state of a bulb read */
+    BRIDGE_EVENT_COMMAND,   /* lighting command from a request handler */
+    BRIDGE_EVENT_LINK,      /* link timer expired */
+    BRIDGE_EVENT_FRAME,     /* transition frame timer expired */
+};
+
+/**
+ * @brief Copy of an event for the bridge task
+ */
+struct bridge_event {
+    enum bridge_event_type type;
+    int64_t posted_time;
+    union {
+        struct {
+            esp_gap_ble_cb_event_t event;
+            esp_ble_gap_cb_param_t param;
+        } gap;
+        struct {
+            esp_gattc_cb_event_t event;
+            esp_gatt_if_t gattc_if;
+            esp_ble_gattc_cb_param_t param;
+            uint8_t value[BRIDGE_VALUE_LEN];    /* read or notified value, which the stack frees once the callback returns */
+        } gattc;
+        struct {
+            int bulb;
+        } command;
+        struct bulb_command lighting;
+    };
+};
+
+static QueueHandle_t bridge_queue = NULL;
+static struct bluetooth_bridge_stats bridge_stats;
+
+/* the reconciler gives up on a desired state after this many writes which did not make the bulb show it */
+#define RECONCILE_MAX_ATTEMPTS  3
+
+/* events are dropped by the posting tasks, so those counters are kept apart under a lock */
+static portMUX_TYPE bridge_dropped_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t bridge_dropped = 0;
+static uint32_t stack_waits = 0;
+static uint32_t stack_dropped = 0;
+
+/* filled by the BTC task at the head and emptied by the bridge task at the tail, both only ever count up */
+static struct bridge_event stack_ring[STACK_RING_LEN];
+static atomic_uint stack_head = 0;
+static atomic_uint stack_tail = 0;
+/* a wake-up for the stack ring is waiting in the queue, so one covers every event behind it */
+static atomic_bool stack_posted = false;
+
+/* bulbs whose retry timer expired, the mark outlives a wake-up dropped on a full queue */
+static atomic_uint retry_pending = 0;
+
+static struct bulb_connection bulbs[BLUETOOTH_MAX_BULBS];
+static int bulb_count = 0;
+
+static esp_timer_handle_t link_timer = NULL;
+
+/* steps the fades while any is running, started and stopped by the bridge task */
+static esp_timer_handle_t frame_timer = NULL;
+static bool frame_timer_running = false;
+static uint64_t frame_period_us = 0;
+/* a frame event is waiting in the queue, so the timer does not pile up more behind it */
+static portMUX_TYPE frame_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool frame_posted = false;
+/* bulb whose RSSI is read next, the stack only reads one at a time */
+static int link_rssi_bulb = 0;
+
+/* events carry either a conn_id or a BDA, both are mapped straight to a bulb index (-1 for none) */
+static int8_t conn_id_to_bulb[CONN_ID_SLOTS];
+static int8_t bda_to_bulb[BDA_HASH_SLOTS];
+
+/* bulbs are reconnected directly, the controller connecting as soon as it sees the bulb advertise, */
+/* and one whitelist filtered scan looks for every bulb whose direct connect timed out */
+/* only one connection is opened at a time */
+static bool scanning = false;
+static bool opening = false;
+
+static unsigned bda_hash(const uint8_t * bda)
+{
+    /* the last bytes of a BDA are the least structured */
+    return (bda[3] ^ (bda[4] * 7) ^ (bda[5] * 31)) & (BDA_HASH_SLOTS - 1);
 }
 
-static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
+static void add_bulb_bda(const int bulb)
 {
-    switch (event) {
-    case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT: {
-        esp_ble_gap_start_scanning(scan_duration);
-        break;
-    }
-    case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:
-        //scan start complete event to indicate scan start successfully or failed
-        if (param->scan_start_cmpl.status != ESP_BT_STATUS_SUCCESS) {
-            ESP_LOGE(log_tag, "scan start failed, error status = %x", param->scan_start_cmpl.status);
-            break;
-        }
-        ESP_LOGI(log_tag, "scan start success");
-        break;
-    case ESP_GAP_BLE_SCAN_RESULT_EVT: {
-        esp_ble_gap_cb_param_t *scan_result = (esp_ble_gap_cb_param_t *)param;
-        switch (scan_result->scan_rst.search_evt) {
-        case ESP_GAP_SEARCH_INQ_RES_EVT:
-            // print MAC address of BLE device
-            esp_log_buffer_hex(log_tag, scan_result->scan_rst.bda, 6);
-            ESP_LOGI(log_tag, "Search result: Adv Data Len %d, Scan Response Len %d", scan_result->scan_rst.adv_data_len, scan_result->scan_rst.scan_rsp_len);
-
-            // check MAC address of scanned device matches what we are looking for
-            if ( memcmp(scan_result->scan_rst.bda, mac_address, 6) == 0 ) {
-                ESP_LOGI(log_tag, "Found requested BLE device");
-                if (connect == false) {
-                    connect = true;
-                    ESP_LOGI(log_tag, "connect to the remote device.");
-                    esp_ble_gap_stop_scanning();
-                    esp_ble_gattc_open(gl_profile_tab[PROFILE_A_APP_ID].gattc_if, scan_result->scan_rst.bda, scan_result->scan_rst.ble_addr_type, true);
-                }
-            }
-            break;
-        case ESP_GAP_SEARCH_INQ_CMPL_EVT:
-            break;
-        default:
-            break;
-        }
-        break;
+    unsigned slot = bda_hash(bulbs[bulb].remote_bda);
+    while (bda_to_bulb[slot] >= 0) {
+        slot = (slot + 1) & (BDA_HASH_SLOTS - 1);
     }
+    bda_to_bulb[slot] = bulb;
+}
 
-    case ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT:
-        if (param->scan_stop_cmpl.status != ESP_BT_STATUS_SUCCESS){
-            ESP_LOGE(log_tag, "scan stop failed, error status = %x", param->scan_stop_cmpl.status);
-            break;
-        }
-        ESP_LOGI(log_tag, "stop scan successfully");
-        break;
-
-    case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
-        if (param->adv_stop_cmpl.status != ESP_BT_STATUS_SUCCESS){
-            ESP_LOGE(log_tag, "adv stop failed, error status = %x", param->adv_stop_cmpl.status);
-            break;
+static int find_bulb_by_bda(const uint8_t * bda)
+{
+    /* open addressing, the table is at most half full so a probe ends quickly */
+    for (unsigned slot = bda_hash(bda); bda_to_bulb[slot] >= 0; slot = (slot + 1) & (BDA_HASH_SLOTS - 1)) {
+        const int bulb = bda_to_bulb[slot];
+        if (memcmp(bulbs[bulb].remote_bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+            return bulb;
         }
-        ESP_LOGI(log_tag, "stop adv successfully");
-        break;
-    case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
-         ESP_LOGI(log_tag, "update connection params status = %d, min_int = %d, max_int = %d,conn_int = %d,latency = %d, timeout = %d",
-                  param->update_conn_params.status,
-                  param->update_conn_params.min_int,
-                  param->update_conn_params.max_int,
-                  param->update_conn_params.conn_int,
-                  param->update_conn_params.latency,
-                  param->update_conn_params.timeout);
-        break;
-    default:
-        break;
     }
+    return -1;
 }
 
-static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t *param)
+static int find_bulb_by_conn_id(const uint16_t conn_id)
 {
-    /* If event is register event, store the gattc_if for each profile */
-    if (event == ESP_GATTC_REG_EVT) {
-        if (param->reg.status == ESP_GATT_OK) {
-            gl_profile_tab[param->reg.app_id].gattc_if = gattc_if;
-        } else {
-            ESP_LOGI(log_tag, "reg app failed, app_id %04x, status %d",
-                    param->reg.app_id,
-                    param->reg.status);
-            return;
-        }
-    }
+    return conn_id < CONN_ID_SLOTS ? conn_id_to_bulb[conn_id] : -1;
+}
 
-    /* If the gattc_if equal to profile A, call profile A cb handler,
-     * so here call each profile's callback */
-    do {
-        int idx;
-        for (idx = 0; idx < PROFILE_NUM; idx++) {
-            if (gattc_if == ESP_GATT_IF_NONE || /* ESP_GATT_IF_NONE, not specify a certain gatt_if, need to call every profile cb function */
-                    gattc_if == gl_profile_tab[idx].gattc_if) {
-                if (gl_profile_tab[idx].gattc_cb) {
-                    gl_profile_tab[idx].gattc_cb(event, gattc_if, param);
-                }
-            }
-        }
-    } while (0);
+static void handle_cache_key(const int bulb, char * key)
+{
+    const uint8_t * bda = bulbs[bulb].remote_bda;
+    snprintf(key, 13, "%02x%02x%02x%02x%02x%02x", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
 }
 
-bool bluetooth_set_bulb_colour(const struct rgb_colour rgb)
+static void handle_cache_load(const int bulb)
 {
-    if ( gl_profile_tab[PROFILE_A_APP_ID].char_handle == 0 ) {
-        return false;
+    char key[13];
+    nvs_handle_t nvs;
+    size_t len = sizeof(bulbs[bulb].cached_handles);
+
+    handle_cache_key(bulb, key);
+    if (nvs_open(nvs_namespace, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
     }
+    bulbs[bulb].handles_cached = nvs_get_blob(nvs, key, &bulbs[bulb].cached_handles, &len) == ESP_OK
+        && len == sizeof(bulbs[bulb].cached_handles);
+    nvs_close(nvs);
+}
 
-    /* write RGB value to characteristic */
-    uint8_t value [4] = { 0xD0, rgb.r, rgb.g, rgb.b };
-    esp_ble_gattc_write_char(
+static void handle_cache_store(const int bulb, const bool valid)
+{
+    char key[13];
+    nvs_handle_t nvs;
+
+    handle_cache_key(bulb, key);
+    bulbs[bulb].handles_cached = valid;
+    if (nvs_open(nvs_namespace, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (valid) {
+        nvs_set_blob(nvs, key, &bulbs[bulb].cached_handles, sizeof(bulbs[bulb].cached_handles));
+    } else {
+        nvs_erase_key(nvs, key);
+    }
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+/**
+ * @brief Forget the cached handles of a bulb after they have been found to be wrong
+ */
+static void handle_cache_invalidate(const int bulb)
+{
+    if (bulbs[bulb].handles_cached) {
+        ESP_LOGW(log_tag, "Cached GATT handles of bulb %d are stale", bulb);
+        handle_cache_store(bulb, false);
+    }
+}
+
+/**
+ * @brief Hand an event to the bridge task without blocking the posting task
+ * @return false if the queue was full and the event was dropped
+ */
+static bool post_event(struct bridge_event * event)
+{
+    event->posted_time = esp_timer_get_time();
+    if (xQueueSend(bridge_queue, event, 0) != pdTRUE) {
+        portENTER_CRITICAL(&bridge_dropped_lock);
+        bridge_dropped++;
+        portEXIT_CRITICAL(&bridge_dropped_lock);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Wake the bridge task for work which is already marked elsewhere
+ * A full queue is not counted as a drop, as every event in it makes the bridge task look for the work.
+ */
+static bool post_wake(const enum bridge_event_type type)
+{
+    struct bridge_event event = { .type = type, .posted_time = esp_timer_get_time() };
+    return xQueueSend(bridge_queue, &event, 0) == pdTRUE;
+}
+
+/**
+ * @brief Hand a Bluedroid event to the bridge task through the stack ring, only ever called by the BTC task
+ * A full ring holds up the stack until the bridge task makes room, the event is only lost after STACK_WAIT_MS.
+ */
+static void post_stack_event(struct bridge_event * event)
+{
+    const unsigned head = atomic_load_explicit(&stack_head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&stack_tail, memory_order_acquire) == STACK_RING_LEN) {
+        portENTER_CRITICAL(&bridge_dropped_lock);
+        stack_waits++;
+        portEXIT_CRITICAL(&bridge_dropped_lock);
+        const int64_t deadline = esp_timer_get_time() + STACK_WAIT_MS * 1000LL;
+        while (head - atomic_load_explicit(&stack_tail, memory_order_acquire) == STACK_RING_LEN) {
+            if (esp_timer_get_time() >= deadline) {
+                portENTER_CRITICAL(&bridge_dropped_lock);
+                stack_dropped++;
+                portEXIT_CRITICAL(&bridge_dropped_lock);
+                ESP_LOGE(log_tag, "Bridge task stalled, Bluedroid event lost");
+                return;
+            }
+            vTaskDelay(1);
+        }
+    }
+
+    event->posted_time = esp_timer_get_time();
+    stack_ring[head % STACK_RING_LEN] = *event;
+    atomic_store_explicit(&stack_head, head + 1, memory_order_release);
+    if (!atomic_exchange(&stack_posted, true) && !post_wake(BRIDGE_EVENT_STACK)) {
+        /* the bridge task is busy with a full queue and empties the ring at each of its events */
+        atomic_store(&stack_posted, false);
+    }
+}
+
+/**
+ * @brief Subscribe to a bulb's characteristic if it can notify or indicate
+ * The subscription is confirmed by the CCCD write event, until then the bulb is read as before.
+ */
+static void enable_notifications(const int bulb)
+{
+    struct bulb_connection * connection = &bulbs[bulb];
+    if (connection->cccd_handle == INVALID_HANDLE || connection->notifying) {
+        return;
+    }
+
+    /* notifications are preferred since they need no confirmation from us */
+    uint8_t cccd_value[2] = { 0x01, 0x00 };
+    if ((connection->char_properties & ESP_GATT_CHAR_PROP_BIT_NOTIFY) == 0) {
+        cccd_value[0] = 0x02;
+    }
+    esp_ble_gattc_register_for_notify(gl_profile_tab[PROFILE_A_APP_ID].gattc_if, connection->remote_bda, connection->char_handle);
+    esp_ble_gattc_write_char_descr(
         gl_profile_tab[PROFILE_A_APP_ID].gattc_if,
-        gl_profile_tab[PROFILE_A_APP_ID].conn_id,
-        gl_profile_tab[PROFILE_A_APP_ID].char_handle,
-        sizeof(value),
-        value,
-        ESP_GATT_WRITE_TYPE_NO_RSP,
+        connection->conn_id,
+        connection->cccd_handle,
+        sizeof(cccd_value),
+        cccd_value,
+        ESP_GATT_WRITE_TYPE_RSP,
         ESP_GATT_AUTH_REQ_NONE);
+}
+
+/**
+ * @brief Update the state of a bulb from a value read or notified from its characteristic
+ */
+static void apply_bulb_value(const int bulb, const uint8_t * value, const uint16_t value_len)
+{
+    if ((value[0] != 0xD0) || (value_len != 4)) {
+        return;
+    }
+
+    const struct rgb_colour rgb = { .r = value[1], .g = value[2], .b = value[3] };
+    const struct hsv_colour hsv = colours_rgb_to_hsv(rgb);
+    const int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&bulb_state_lock);
+    struct light_state * state = &bulb_state[bulb];
+    const struct light_state previous = *state;
+    state->on_off = hsv.v > 0;
+    /* only save the colour of the bulb if it is on, otherwise we overwrite the last on state colour */
+    if ( state->on_off ) {
+        state->colour = hsv;
+    }
+    state->up_to_date = true;
+    state->read_time = now;
+
+    /* the link monitor's probe reads mostly find nothing new, which should not invalidate cached replies */
+    if (!previous.up_to_date || previous.on_off != state->on_off
+        || memcmp(&previous.colour, &state->colour, sizeof(state->colour)) != 0) {
+        state->version++;
+    }
+    portEXIT_CRITICAL(&bulb_state_lock);
+
+    struct bulb_connection * connection = &bulbs[bulb];
+    memcpy(connection->shadow, value, TX_VALUE_LEN);
+    connection->shadow_valid = true;
+    connection->shadow_time = now;
+    connection->shadow_reads = connection->reads_sent;
+    /* whatever the bulb reports settles the last write, which the reconciler then judges by it */
+    if (connection->awaiting_confirmation) {
+        connection->awaiting_confirmation = false;
+        if (memcmp(value, connection->unconfirmed, TX_VALUE_LEN) == 0) {
+            command_stats.writes_confirmed++;
+        }
+    }
+}
+
+/**
+ * @brief Mark the last known state of a bulb as needing a read
+ */
+static void bulb_state_stale(const int bulb)
+{
+    portENTER_CRITICAL(&bulb_state_lock);
+    bulb_state[bulb].up_to_date = false;
+    portEXIT_CRITICAL(&bulb_state_lock);
+}
+
+/**
+ * @brief Wake the tasks waiting for a read of the bulb, whether or not it succeeded
+ */
+static void read_done(const int bulb)
+{
+    portENTER_CRITICAL(&read_lock);
+    read_pending[bulb] = false;
+    portEXIT_CRITICAL(&read_lock);
+    xEventGroupSetBits(read_events, BIT(bulb));
+}
+
+/**
+ * @brief Mark a bulb as ready to be driven once its characteristic handle is known
+ */
+static void bulb_ready(const int bulb)
+{
+    const int64_t now = esp_timer_get_time();
+    if (bulbs[bulb].lost_time > 0) {
+        const uint32_t recovery_ms = (now - bulbs[bulb].lost_time) / 1000;
+        ESP_LOGI(log_tag, "Bulb %d recovered %d ms after the connection dropped (%s)", bulb,
+            recovery_ms, bulbs[bulb].direct_attempt ? "direct" : "scan");
+        link_stats.recoveries++;
+        link_stats.recovery_total_ms += recovery_ms;
+        if (recovery_ms > link_stats.recovery_max_ms) link_stats.recovery_max_ms = recovery_ms;
+        bulbs[bulb].lost_time = 0;
+    }
+    bulbs[bulb].link_state = BULB_READY;
+    bulbs[bulb].failures = 0;
+    bulbs[bulb].health = 100;
+    bulbs[bulb].last_heard = now;
+    bulbs[bulb].read_sent_time = 0;
+    bulbs[bulb].write_failures = 0;
+    bulbs[bulb].dropping = false;
+    boot_profile_mark(BOOT_PHASE_BULB_CONNECTED);
+
+    /* subscribe to state changes if the bulb offers them, then read the current state once */
+    /* so we can report what it is really doing */
+    enable_notifications(bulb);
+    bulb_state_stale(bulb);
+    read_bulb(bulb);
+
+    /* replay whatever was asked for while the bulb was away */
+    bulbs[bulb].reconcile_attempts = 0;
+    reconcile_bulb(bulb);
+}
+
+/**
+ * @brief Ask the bulb for a set of connection parameters, one request at a time
+ */
+static void request_conn_mode(const int bulb, const enum conn_mode mode)
+{
+    struct bulb_connection * connection = &bulbs[bulb];
+    connection->wanted_mode = mode;
+    if (connection->conn_update_pending || connection->conn_mode == mode) {
+        return;
+    }
+
+    esp_ble_conn_update_params_t conn_params = conn_mode_params[mode];
+    memcpy(conn_params.bda, connection->remote_bda, sizeof(esp_bd_addr_t));
+    if (esp_ble_gap_update_conn_params(&conn_params) == ESP_OK) {
+        connection->conn_update_pending = true;
+        connection->requested_mode = mode;
+        conn_stats.requests[mode]++;
+    }
+}
+
+/**
+ * @brief Note that a bulb is being driven, so it gets the fast parameters until it goes quiet again
+ */
+static void bulb_activity(const int bulb)
+{
+    request_conn_mode(bulb, CONN_MODE_FAST);
+    esp_timer_stop(bulbs[bulb].idle_timer);
+    esp_timer_start_once(bulbs[bulb].idle_timer, CONN_IDLE_AFTER_MS * 1000ULL);
+}
+
+static void bulb_idle(const int bulb)
+{
+    if (bulbs[bulb].link_state != BULB_WAITING && bulbs[bulb].link_state != BULB_BACKOFF) {
+        request_conn_mode(bulb, CONN_MODE_IDLE);
+    }
+}
+
+static void idle_timer_callback(void * arg)
+{
+    struct bridge_event event = { .type = BRIDGE_EVENT_IDLE, .command.bulb = (int)(intptr_t)arg };
+    post_event(&event);
+}
+
+static void open_bulb(const int bulb, const bool direct)
+{
+    /* the controller cannot scan and initiate at the same time */
+    if (scanning) {
+        esp_ble_gap_stop_scanning();
+    }
+    esp_timer_stop(bulbs[bulb].retry_timer);
+    bulbs[bulb].link_state = BULB_CONNECTING;
+    bulbs[bulb].direct_attempt = direct;
+    opening = true;
+    ESP_LOGI(log_tag, "connect to bulb %d (%s)", bulb, direct ? "direct" : "scan");
+    esp_ble_gattc_open(gl_profile_tab[PROFILE_A_APP_ID].gattc_if, bulbs[bulb].remote_bda, bulbs[bulb].addr_type, true);
+}
+
+/**
+ * @brief Reconnect the next missing bulb directly, or start the shared scan for bulbs which did not answer
+ */
+static void connect_missing_bulbs(void)
+{
+    if (opening) {
+        return;
+    }
+
+    bool need_scan = false;
+    for (int i = 0; i < bulb_count; i++) {
+        if (bulbs[i].link_state != BULB_WAITING) {
+            continue;
+        }
+        /* a direct connect is bounded by the stack's link establishment timeout */
+        if (!bulbs[i].direct_failed) {
+            open_bulb(i, true);
+            return;
+        }
+        need_scan = true;
+    }
+
+    if (need_scan && !scanning) {
+        /* the scan starts once the parameters for the current duty cycle are set */
+        const struct scan_duty * duty = &scan_duties[scan_misses < SCAN_DUTY_LEVELS ? scan_misses : SCAN_DUTY_LEVELS - 1];
+        ble_scan_params.scan_interval = duty->interval;
+        ble_scan_params.scan_window = duty->window;
+        scanning = true;
+        if (esp_ble_gap_set_scan_params(&ble_scan_params) != ESP_OK) {
+            ESP_LOGE(log_tag, "set scan params error");
+            scanning = false;
+        }
+    }
+}
+
+/**
+ * @brief Add the time of the scan which has just ended to the counters
+ */
+static void scan_ended(void)
+{
+    if (scan_start_time > 0) {
+        const uint32_t elapsed_ms = (esp_timer_get_time() - scan_start_time) / 1000;
+        scan_stats.scan_time_ms += elapsed_ms;
+        scan_stats.radio_time_ms += (uint64_t)elapsed_ms * ble_scan_params.scan_window / ble_scan_params.scan_interval;
+        scan_start_time = 0;
+    }
+    scanning = false;
+}
+
+struct bluetooth_scan_stats bluetooth_get_scan_stats(void)
+{
+    return scan_stats;
+}
+
+/**
+ * @brief Give up on a bulb for now and look for it again after a delay which grows with each failure
+ */
+static void bulb_backoff(const int bulb)
+{
+    struct bulb_connection * connection = &bulbs[bulb];
+    uint32_t delay_ms = RECONNECT_MAX_DELAY_MS;
+    if (connection->failures < 16) {
+        delay_ms = RECONNECT_MIN_DELAY_MS << connection->failures;
+        if (delay_ms > RECONNECT_MAX_DELAY_MS) delay_ms = RECONNECT_MAX_DELAY_MS;
+    }
+    connection->failures++;
+    connection->link_state = BULB_BACKOFF;
+    ESP_LOGI(log_tag, "Bulb %d retry in %d ms", bulb, delay_ms);
+    esp_timer_stop(connection->retry_timer);
+    /* a retry already due is superseded by the new delay */
+    atomic_fetch_and(&retry_pending, ~(1u << bulb));
+    esp_timer_start_once(connection->retry_timer, delay_ms * 1000ULL);
+}
+
+static void retry_timer_callback(void * arg)
+{
+    atomic_fetch_or(&retry_pending, 1u << (int)(intptr_t)arg);
+    post_wake(BRIDGE_EVENT_RETRY);
+}
+
+static void bulb_retry(const int bulb)
+{
+    if (bulbs[bulb].link_state == BULB_BACKOFF) {
+        /* start again with the cheap direct connect */
+        bulbs[bulb].link_state = BULB_WAITING;
+        bulbs[bulb].direct_failed = false;
+        connect_missing_bulbs();
+    }
+}
+
+/**
+ * @brief Mark a bulb's connection as gone, reconnecting straight away if it had been working
+ */
+static void bulb_disconnected(const int bulb)
+{
+    struct bulb_connection * connection = &bulbs[bulb];
+    if (connection->conn_id < CONN_ID_SLOTS && conn_id_to_bulb[connection->conn_id] == bulb) {
+        conn_id_to_bulb[connection->conn_id] = -1;
+    }
+    connection->char_handle = INVALID_HANDLE;
+    connection->notifying = false;
+    connection->shadow_valid = false;
+    connection->awaiting_confirmation = false;
+    connection->read_sent_time = 0;
+    connection->reads_sent = 0;
+    connection->reads_answered = 0;
+    connection->shadow_reads = 0;
+    connection->rssi = BLUETOOTH_RSSI_UNKNOWN;
+    connection->health = 0;
+    link_report(bulb);
+    read_done(bulb);
+
+    /* a value for the old connection is stale by the time the bulb is back */
+    portENTER_CRITICAL(&mailbox_lock);
+    if (connection->mailbox.full) {
+        tx_stats.dropped++;
+        command_stats.writes_failed++;
+        connection->mailbox.full = false;
+    }
+    portEXIT_CRITICAL(&mailbox_lock);
+    /* writes handed to the stack may or may not have reached the bulb, the next read will tell */
+    command_stats.writes_failed += connection->in_flight_count;
+    connection->in_flight_count = 0;
+    connection->next_send_time = 0;
+    connection->conn_interval = 0;
+    connection->conn_latency = 0;
+    connection->supervision_timeout = 0;
+
+    esp_timer_stop(connection->idle_timer);
+    connection->conn_mode = CONN_MODES;
+    connection->conn_update_pending = false;
+
+    if (connection->link_state == BULB_READY) {
+        if (!connection->dropping) {
+            /* the controller gave up on the link, which is what the monitor tries to beat */
+            link_drop_detected(bulb, false);
+        }
+        connection->dropping = false;
+        connection->failures = 0;
+        connection->direct_failed = false;
+        connection->link_state = BULB_WAITING;
+    } else {
+        bulb_backoff(bulb);
+    }
+}
+
+/**
+ * @brief Give up on a connection which does not offer the characteristic
+ * The bulb is not ready, so its disconnect event backs off before the next attempt rather than
+ * reconnecting straight away to the same result.
+ */
+static void bulb_discovery_failed(const int bulb, const esp_gatt_if_t gattc_if)
+{
+    handle_cache_invalidate(bulb);
+    bulbs[bulb].char_handle = INVALID_HANDLE;
+    bulbs[bulb].link_state = BULB_DISCOVERING;
+    esp_ble_gattc_close(gattc_if, bulbs[bulb].conn_id);
+}
+
+/**
+ * @brief Account a write the stack has finished with, and its latency under the connection parameters in force
+ * A write without response is only known to have left the controller, so the bulb state waits for the bulb
+ * to report the value. Bulbs which notify may do so by themselves, the rest are read once the writes settle.
+ */
+static void write_complete(const int bulb, const bool sent)
+{
+    struct bulb_connection * connection = &bulbs[bulb];
+    if (connection->in_flight_count > 0) {
+        const int64_t now = esp_timer_get_time();
+        const uint8_t * value = connection->in_flight[connection->in_flight_head].value;
+        const uint32_t latency_us = now - connection->in_flight[connection->in_flight_head].posted_time;
+        if (sent) {
+            command_stats.writes_sent++;
+            /* not sent again while the bulb is thought to show it, and a read sent before now is older than it */
+            memcpy(connection->shadow, value, TX_VALUE_LEN);
+            connection->shadow_valid = true;
+            connection->shadow_time = now;
+            connection->shadow_reads = connection->reads_sent;
+            memcpy(connection->unconfirmed, value, TX_VALUE_LEN);
+            connection->awaiting_confirmation = true;
+        } else {
+            command_stats.writes_failed++;
+            connection->write_failures++;
+        }
+        connection->in_flight_head = (connection->in_flight_head + 1) % IN_FLIGHT_DEPTH;
+        connection->in_flight_count--;
+        if (connection->conn_mode < CONN_MODES) {
+            struct bluetooth_write_latency * latency = &conn_stats.latency[connection->conn_mode];
+            latency->writes++;
+            latency->total_us += latency_us;
+            if (latency_us > latency->max_us) latency->max_us = latency_us;
+        }
+        if (!sent) {
+            reconcile_bulb(bulb);
+        } else if (connection->in_flight_count == 0 && !connection->mailbox.full && !transition_active(bulb)) {
+            read_bulb(bulb);
+        }
+    }
+}
+
+static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t *param)
+{
+    esp_ble_gattc_cb_param_t *p_data = (esp_ble_gattc_cb_param_t *)param;
+    int bulb;
+
+    switch (event) {
+    case ESP_GATTC_REG_EVT:
+        ESP_LOGI(log_tag, "REG_EVT");
+        /* the fallback scan only reports bulbs in the whitelist, so other devices cost nothing */
+        for (int i = 0; i < bulb_count; i++) {
+            const esp_ble_wl_addr_type_t wl_addr_type =
+                bulbs[i].addr_type == BLE_ADDR_TYPE_PUBLIC ? BLE_WL_ADDR_TYPE_PUBLIC : BLE_WL_ADDR_TYPE_RANDOM;
+            if (esp_ble_gap_update_whitelist(true, bulbs[i].remote_bda, wl_addr_type) != ESP_OK) {
+                ESP_LOGE(log_tag, "Unable to add bulb %d to the whitelist", i);
+            }
+        }
+        connect_missing_bulbs();
+        break;
+    case ESP_GATTC_CONNECT_EVT:{
+        ESP_LOGI(log_tag, "ESP_GATTC_CONNECT_EVT conn_id %d, if %d", p_data->connect.conn_id, gattc_if);
+        ESP_LOGI(log_tag, "REMOTE BDA:");
+        esp_log_buffer_hex(log_tag, p_data->connect.remote_bda, sizeof(esp_bd_addr_t));
+        bulb = find_bulb_by_bda(p_data->connect.remote_bda);
+        if (bulb < 0) {
+            ESP_LOGW(log_tag, "Connected to unknown device");
+            break;
+        }
+        bulbs[bulb].conn_id = p_data->connect.conn_id;
+        bulbs[bulb].conn_interval = p_data->connect.conn_params.interval;
+        bulbs[bulb].conn_latency = p_data->connect.conn_params.latency;
+        bulbs[bulb].supervision_timeout = p_data->connect.conn_params.timeout;
+        if (bulbs[bulb].link_state != BULB_READY) {
+            bulbs[bulb].link_state = BULB_DISCOVERING;
+        }
+        if (p_data->connect.conn_id < CONN_ID_SLOTS) {
+            conn_id_to_bulb[p_data->connect.conn_id] = bulb;
+        } else {
+            ESP_LOGE(log_tag, "conn_id %d out of range", p_data->connect.conn_id);
+        }
+        
+        esp_err_t mtu_ret = esp_ble_gattc_send_mtu_req (gattc_if, p_data->connect.conn_id);
+        if (mtu_ret){
+            ESP_LOGE(log_tag, "config MTU error, error code = %x", mtu_ret);
+        }
+
+        /* discovery and the first read are done with the fast parameters, then the link relaxes when idle */
+        bulbs[bulb].conn_mode = CONN_MODES;
+        bulbs[bulb].conn_update_pending = false;
+        bulb_activity(bulb);
+
+        break;
+    }
+    case ESP_GATTC_OPEN_EVT:
+        opening = false;
+        bulb = find_bulb_by_bda(p_data->open.remote_bda);
+        if (param->open.status != ESP_GATT_OK){
+            ESP_LOGE(log_tag, "open failed, status %d", p_data->open.status);
+            if (bulb >= 0 && bulbs[bulb].link_state == BULB_CONNECTING) {
+                if (bulbs[bulb].direct_attempt) {
+                    /* the bulb did not advertise in time, fall back to the scan */
+                    bulbs[bulb].direct_failed = true;
+                    bulbs[bulb].link_state = BULB_WAITING;
+                } else {
+                    bulb_backoff(bulb);
+                }
+            }
+        } else {
+            ESP_LOGI(log_tag, "open success, bulb %d", bulb);
+            /* with the handles cached the bulb can be driven straight away, the service */
+            /* search below still runs and checks them in the background */
+            if (bulb >= 0 && bulbs[bulb].handles_cached && bulbs[bulb].link_state != BULB_READY) {
+                bulbs[bulb].conn_id = p_data->open.conn_id;
+                if (p_data->open.conn_id < CONN_ID_SLOTS) {
+                    conn_id_to_bulb[p_data->open.conn_id] = bulb;
+                }
+                bulbs[bulb].service_start_handle = bulbs[bulb].cached_handles.service_start_handle;
+                bulbs[bulb].service_end_handle = bulbs[bulb].cached_handles.service_end_handle;
+                bulbs[bulb].char_handle = bulbs[bulb].cached_handles.char_handle;
+                bulbs[bulb].cccd_handle = bulbs[bulb].cached_handles.cccd_handle;
+                bulbs[bulb].char_properties = bulbs[bulb].cached_handles.char_properties;
+                ESP_LOGI(log_tag, "Using cached GATT handles for bulb %d", bulb);
+                bulb_ready(bulb);
+            }
+        }
+        /* only one connection is opened at a time, so move on to any other missing bulbs */
+        connect_missing_bulbs();
+        break;
+    case ESP_GATTC_DIS_SRVC_CMPL_EVT:
+        if (param->dis_srvc_cmpl.status != ESP_GATT_OK){
+            ESP_LOGE(log_tag, "discover service failed, status %d", param->dis_srvc_cmpl.status);
+            break;
+        }
+        ESP_LOGI(log_tag, "discover service complete conn_id %d", param->dis_srvc_cmpl.conn_id);
+        esp_ble_gattc_search_service(gattc_if, param->dis_srvc_cmpl.conn_id, &smartbulb_ble_service_uuid);
+        break;
+    case ESP_GATTC_CFG_MTU_EVT:
+        if (param->cfg_mtu.status != ESP_GATT_OK){
+            ESP_LOGE(log_tag,"config mtu failed, error status = %x", param->cfg_mtu.status);
+        }
+        ESP_LOGI(log_tag, "ESP_GATTC_CFG_MTU_EVT, Status %d, MTU %d, conn_id %d", param->cfg_mtu.status, param->cfg_mtu.mtu, param->cfg_mtu.conn_id);
+        break;
+    case ESP_GATTC_SEARCH_RES_EVT: {
+        ESP_LOGI(log_tag, "SEARCH RES: conn_id = %x is primary service %d", p_data->search_res.conn_id, p_data->search_res.is_primary);
+        ESP_LOGI(log_tag, "start handle %d end handle %d current handle value %d", p_data->search_res.start_handle, p_data->search_res.end_handle, p_data->search_res.srvc_id.inst_id);
+        bulb = find_bulb_by_conn_id(p_data->search_res.conn_id);
+        if (bulb >= 0 && p_data->search_res.srvc_id.uuid.len == ESP_UUID_LEN_16 && p_data->search_res.srvc_id.uuid.uuid.uuid16 == SERVICE_UUID) {
+            ESP_LOGI(log_tag, "service found");
+            bulbs[bulb].service_start_handle = p_data->search_res.start_handle;
+            bulbs[bulb].service_end_handle = p_data->search_res.end_handle;
+            ESP_LOGI(log_tag, "UUID16: %x", p_data->search_res.srvc_id.uuid.uuid.uuid16);
+        }
+        break;
+    }
+    case ESP_GATTC_SEARCH_CMPL_EVT:
+        bulb = find_bulb_by_conn_id(p_data->search_cmpl.conn_id);
+        if (p_data->search_cmpl.status != ESP_GATT_OK){
+            ESP_LOGE(log_tag, "search service failed, error status = %x", p_data->search_cmpl.status);
+            if (bulb >= 0) {
+                bulb_discovery_failed(bulb, gattc_if);
+            }
+            break;
+        }
+        if(p_data->search_cmpl.searched_service_source == ESP_GATT_SERVICE_FROM_REMOTE_DEVICE) {
+            ESP_LOGI(log_tag, "Get service information from remote device");
+        } else if (p_data->search_cmpl.searched_service_source == ESP_GATT_SERVICE_FROM_NVS_FLASH) {
+            ESP_LOGI(log_tag, "Get service information from flash");
+        } else {
+            ESP_LOGI(log_tag, "unknown service source");
+        }
+
+        if (bulb < 0) {
+            break;
+        }
+
+        uint16_t count = 0;
+        esp_gatt_status_t status = esp_ble_gattc_get_attr_count(
+            gattc_if,
+            bulbs[bulb].conn_id,
+            ESP_GATT_DB_CHARACTERISTIC,
+            bulbs[bulb].service_start_handle,
+            bulbs[bulb].service_end_handle,
+            INVALID_HANDLE,
+            &count);
+
+        if (status != ESP_GATT_OK) {
+            ESP_LOGE(log_tag, "esp_ble_gattc_get_attr_count error");
+            bulb_discovery_failed(bulb, gattc_if);
+            break;
+        }
+
+        uint16_t char_handle = INVALID_HANDLE;
+        uint8_t char_properties = 0;
+        if (count > 0) {
+            if (count > MAX_CHAR_ELEMS) count = MAX_CHAR_ELEMS;
+            status = esp_ble_gattc_get_char_by_uuid(
+                gattc_if,
+                bulbs[bulb].conn_id,
+                bulbs[bulb].service_start_handle,
+                bulbs[bulb].service_end_handle,
+                smartbulb_ble_char_uuid,
+                char_elem_result,
+                &count);
+            if (status != ESP_GATT_OK || count == 0) {
+                ESP_LOGE(log_tag, "Error getting characteristic from service");
+            } else {
+                char_handle = char_elem_result[0].char_handle;
+                char_properties = char_elem_result[0].properties;
+            }
+        }
+
+        if (char_handle == INVALID_HANDLE) {
+            ESP_LOGE(log_tag, "Characteristic not found in service");
+            bulb_discovery_failed(bulb, gattc_if);
+            break;
+        }
+
+        bulbs[bulb].char_handle = char_handle;
+        bulbs[bulb].char_properties = char_properties;
+        ESP_LOGI(log_tag, "Found characteristic in service of bulb %d, properties 0x%02x", bulb, char_properties);
+
+        /* a characteristic which can notify or indicate has a CCCD to subscribe through */
+        uint16_t cccd_handle = INVALID_HANDLE;
+        if (char_properties & (ESP_GATT_CHAR_PROP_BIT_NOTIFY | ESP_GATT_CHAR_PROP_BIT_INDICATE)) {
+            esp_gattc_descr_elem_t descr_elem;
+            uint16_t descr_count = 1;
+            const esp_bt_uuid_t cccd_uuid = { .len = ESP_UUID_LEN_16, .uuid = { .uuid16 = ESP_GATT_UUID_CHAR_CLIENT_CONFIG } };
+            if (esp_ble_gattc_get_descr_by_char_handle(gattc_if, bulbs[bulb].conn_id, char_handle, cccd_uuid, &descr_elem, &descr_count) == ESP_GATT_OK
+                && descr_count > 0) {
+                cccd_handle = descr_elem.handle;
+            } else {
+                ESP_LOGW(log_tag, "Bulb %d can notify but has no CCCD", bulb);
+            }
+        }
+        bulbs[bulb].cccd_handle = cccd_handle;
+
+        /* remember the handles for the next connection, unless the cache already holds them */
+        const struct gatt_handles found = {
+            .service_start_handle = bulbs[bulb].service_start_handle,
+            .service_end_handle = bulbs[bulb].service_end_handle,
+            .char_handle = char_handle,
+            .cccd_handle = cccd_handle,
+            .char_properties = char_properties,
+        };
+        if (!bulbs[bulb].handles_cached || memcmp(&found, &bulbs[bulb].cached_handles, sizeof(found)) != 0) {
+            handle_cache_invalidate(bulb);
+            bulbs[bulb].cached_handles = found;
+            handle_cache_store(bulb, true);
+        }
+
+        if (bulbs[bulb].link_state != BULB_READY) {
+            bulb_ready(bulb);
+        } else {
+            /* the cached handles may not have offered notifications */
+            enable_notifications(bulb);
+        }
+
+        ESP_LOGI(log_tag, "ESP_GATTC_SEARCH_CMPL_EVT");
+        break;
+    case ESP_GATTC_WRITE_CHAR_EVT:
+        bulb = find_bulb_by_conn_id(p_data->write.conn_id);
+        if (bulb >= 0) {
+            write_complete(bulb, p_data->write.status == ESP_GATT_OK);
+        }
+        if (p_data->write.status != ESP_GATT_OK){
+            ESP_LOGE(log_tag, "write char failed, error status = %x", p_data->write.status);
+            if (bulb >= 0 && p_data->write.status == ESP_GATT_INVALID_HANDLE) {
+                handle_cache_invalidate(bulb);
+            }
+            break;
+        }
+        ESP_LOGD(log_tag, "write char success ");
+        break;
+    case ESP_GATTC_READ_CHAR_EVT:
+        if (param->read.status != ESP_GATT_OK) {
+            ESP_LOGW(log_tag, "Error reading char at handle %d, status=%d", param->read.handle, param->read.status);
+            bulb = find_bulb_by_conn_id(param->read.conn_id);
+            if (bulb >= 0) {
+                bulbs[bulb].reads_answered++;
+                link_heard(bulb);
+                read_done(bulb);
+                if (param->read.status == ESP_GATT_INVALID_HANDLE) {
+                    handle_cache_invalidate(bulb);
+                }
+            }
+            break;
+        }
+        ESP_LOGD(log_tag, "ESP_GATTS_READ_EVT char_value:");
+        ESP_LOG_BUFFER_HEX_LEVEL(log_tag, param->read.value, param->read.value_len, ESP_LOG_DEBUG);
+        bulb = find_bulb_by_conn_id(param->read.conn_id);
+        if (bulb >= 0) {
+            link_heard(bulb);
+            /* a write sent or a notification since the read was sent is newer than its answer */
+            const uint32_t answer = ++bulbs[bulb].reads_answered;
+            if (!bulbs[bulb].shadow_valid || answer > bulbs[bulb].shadow_reads) {
+                apply_bulb_value(bulb, param->read.value, param->read.value_len);
+            }
+            read_done(bulb);
+            reconcile_bulb(bulb);
+        }
+        break;
+    case ESP_GATTC_WRITE_DESCR_EVT:
+        bulb = find_bulb_by_conn_id(p_data->write.conn_id);
+        if (bulb < 0 || p_data->write.handle != bulbs[bulb].cccd_handle) {
+            break;
+        }
+        link_heard(bulb);
+        if (p_data->write.status != ESP_GATT_OK) {
+            /* keep reading the bulb instead */
+            ESP_LOGW(log_tag, "Bulb %d refused the subscription, status %x", bulb, p_data->write.status);
+            break;
+        }
+        ESP_LOGI(log_tag, "Bulb %d subscribed to state changes", bulb);
+        bulbs[bulb].notifying = true;
+        break;
+    case ESP_GATTC_NOTIFY_EVT:
+        bulb = find_bulb_by_conn_id(p_data->notify.conn_id);
+        if (bulb >= 0 && p_data->notify.handle == bulbs[bulb].char_handle) {
+            portENTER_CRITICAL(&state_stats_lock);
+            state_stats.notifications++;
+            portEXIT_CRITICAL(&state_stats_lock);
+            link_heard(bulb);
+            apply_bulb_value(bulb, p_data->notify.value, p_data->notify.value_len);
+            reconcile_bulb(bulb);
+        }
+        break;
+    case ESP_GATTC_DISCONNECT_EVT:
+        ESP_LOGE(log_tag, "ESP_GATTC_DISCONNECT_EVT, reason = %d", p_data->disconnect.reason);
+        bulb = find_bulb_by_bda(p_data->disconnect.remote_bda);
+        if (bulb >= 0) {
+            bulb_disconnected(bulb);
+        }
+        connect_missing_bulbs();
+        break;
+    default:
+        break;
+    }
+}
+
+static void handle_gap_event(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT: {
+        if (scanning) {
+            esp_ble_gap_start_scanning(scan_duration);
+        }
+        break;
+    }
+    case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:
+        //scan start complete event to indicate scan start successfully or failed
+        if (param->scan_start_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+            ESP_LOGE(log_tag, "scan start failed, error status = %x", param->scan_start_cmpl.status);
+            scanning = false;
+            break;
+        }
+        ESP_LOGI(log_tag, "scan start success, interval %d window %d", ble_scan_params.scan_interval, ble_scan_params.scan_window);
+        scan_stats.scans++;
+        scan_start_time = esp_timer_get_time();
+        boot_profile_mark(BOOT_PHASE_BLE_SCAN_STARTED);
+        break;
+    case ESP_GAP_BLE_SCAN_RESULT_EVT: {
+        esp_ble_gap_cb_param_t *scan_result = (esp_ble_gap_cb_param_t *)param;
+        switch (scan_result->scan_rst.search_evt) {
+        case ESP_GAP_SEARCH_INQ_RES_EVT: {
+            /* this runs for every advertisement heard, so it only counts and never logs */
+            const int64_t start = esp_timer_get_time();
+            scan_stats.reports++;
+
+            /* cheapest checks first: the bulb must be connectable and one of ours */
+            const esp_ble_evt_type_t evt_type = scan_result->scan_rst.ble_evt_type;
+            const int bulb = (evt_type == ESP_BLE_EVT_CONN_ADV || evt_type == ESP_BLE_EVT_CONN_DIR_ADV)
+                ? find_bulb_by_bda(scan_result->scan_rst.bda) : -1;
+            if ( bulb < 0 ) {
+                scan_stats.rejected++;
+            } else {
+                /* only one connection can be opened at a time, the scan resumes once it completes */
+                /* a bulb which is backing off is connected to anyway if it is seen advertising */
+                const enum bulb_link_state link_state = bulbs[bulb].link_state;
+                if ((link_state == BULB_WAITING || link_state == BULB_BACKOFF) && !opening) {
+                    scan_stats.matches++;
+                    scan_misses = 0;
+                    bulbs[bulb].addr_type = scan_result->scan_rst.ble_addr_type;
+                    open_bulb(bulb, false);
+                }
+            }
+            scan_stats.cpu_time_us += esp_timer_get_time() - start;
+            break;
+        }
+        case ESP_GAP_SEARCH_INQ_CMPL_EVT:
+            /* the scan ran its full duration, so back off the bulbs it did not find rather than scan for ever */
+            scan_ended();
+            scan_misses++;
+            for (int i = 0; i < bulb_count; i++) {
+                if (bulbs[i].link_state == BULB_WAITING && bulbs[i].direct_failed) {
+                    ESP_LOGW(log_tag, "Bulb %d not found", i);
+                    bulb_backoff(i);
+                }
+            }
+            break;
+        default:
+            break;
+        }
+        break;
+    }
+
+    case ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT:
+        if (param->scan_stop_cmpl.status != ESP_BT_STATUS_SUCCESS){
+            ESP_LOGE(log_tag, "scan stop failed, error status = %x", param->scan_stop_cmpl.status);
+            break;
+        }
+        ESP_LOGI(log_tag, "stop scan successfully");
+        scan_ended();
+        break;
+
+    case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
+        if (param->adv_stop_cmpl.status != ESP_BT_STATUS_SUCCESS){
+            ESP_LOGE(log_tag, "adv stop failed, error status = %x", param->adv_stop_cmpl.status);
+            break;
+        }
+        ESP_LOGI(log_tag, "stop adv successfully");
+        break;
+    case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT: {
+         ESP_LOGI(log_tag, "update connection params status = %d, min_int = %d, max_int = %d,conn_int = %d,latency = %d, timeout = %d",
+                  param->update_conn_params.status,
+                  param->update_conn_params.min_int,
+                  param->update_conn_params.max_int,
+                  param->update_conn_params.conn_int,
+                  param->update_conn_params.latency,
+                  param->update_conn_params.timeout);
+        const int bulb = find_bulb_by_bda(param->update_conn_params.bda);
+        if (bulb < 0) {
+            break;
+        }
+        struct bulb_connection * connection = &bulbs[bulb];
+        connection->conn_update_pending = false;
+        if (param->update_conn_params.status != ESP_BT_STATUS_SUCCESS) {
+            /* the bulb refused, so keep what it has and only try again on the next change of activity */
+            conn_stats.rejected++;
+            ESP_LOGW(log_tag, "Bulb %d refused %s connection parameters", bulb, conn_mode_names[connection->requested_mode]);
+            break;
+        }
+        /* the bulb may also have changed the parameters itself, so judge the mode by the interval granted */
+        connection->conn_interval = param->update_conn_params.conn_int;
+        connection->conn_latency = param->update_conn_params.latency;
+        connection->supervision_timeout = param->update_conn_params.timeout;
+        connection->conn_mode = param->update_conn_params.conn_int < conn_mode_params[CONN_MODE_IDLE].min_int
+            ? CONN_MODE_FAST : CONN_MODE_IDLE;
+        ESP_LOGI(log_tag, "Bulb %d connection now %s", bulb, conn_mode_names[connection->conn_mode]);
+        /* activity may have changed while the update was in progress */
+        if (connection->wanted_mode != connection->conn_mode) {
+            request_conn_mode(bulb, connection->wanted_mode);
+        }
+        break;
+    }
+    case ESP_GAP_BLE_READ_RSSI_COMPLETE_EVT: {
+        const int bulb = find_bulb_by_bda(param->read_rssi_cmpl.remote_addr);
+        if (bulb < 0 || bulbs[bulb].link_state != BULB_READY) {
+            break;
+        }
+        /* 127 is what the controller reports when it has no measurement */
+        if (param->read_rssi_cmpl.status == ESP_BT_STATUS_SUCCESS && param->read_rssi_cmpl.rssi != 127) {
+            bulbs[bulb].rssi = param->read_rssi_cmpl.rssi;
+            link_stats.rssi_reads++;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
 
+static void handle_gattc_event(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t *param)
+{
+    /* If event is register event, store the gattc_if for each profile */
+    if (event == ESP_GATTC_REG_EVT) {
+        if (param->reg.status == ESP_GATT_OK) {
+            gl_profile_tab[param->reg.app_id].gattc_if = gattc_if;
+        } else {
+            ESP_LOGI(log_tag, "reg app failed, app_id %04x, status %d",
+                    param->reg.app_id,
+                    param->reg.status);
+            return;
+        }
+    }
+
+    /* If the gattc_if equal to profile A, call profile A cb handler,
+     * so here call each profile's callback */
+    do {
+        int idx;
+        for (idx = 0; idx < PROFILE_NUM; idx++) {
+            if (gattc_if == ESP_GATT_IF_NONE || /* ESP_GATT_IF_NONE, not specify a certain gatt_if, need to call every profile cb function */
+                    gattc_if == gl_profile_tab[idx].gattc_if) {
+                if (gl_profile_tab[idx].gattc_cb) {
+                    gl_profile_tab[idx].gattc_cb(event, gattc_if, param);
+                }
+            }
+        }
+    } while (0);
+}
+
+int bluetooth_bulb_count(void)
+{
+    return bulb_count;
+}
+
+uint32_t bluetooth_state_version(void)
+{
+    uint32_t version = 0;
+    portENTER_CRITICAL(&bulb_state_lock);
+    for (int i = 0; i < bulb_count; i++) {
+        version += bulb_state[i].version;
+    }
+    portEXIT_CRITICAL(&bulb_state_lock);
+    return version + link_version;
+}
+
+/**
+ * @brief Leave a value for the bulb characteristic in its mailbox, replacing any value not yet sent
+ * The bridge task is only woken when the mailbox was empty, a full one is already waiting to be sent.
+ */
+static bool write_bulb(const int bulb, const uint8_t * value)
+{
+    if ( bulb < 0 || bulb >= bulb_count || bulbs[bulb].link_state != BULB_READY ) {
+        return false;
+    }
+
+    struct tx_mailbox * mailbox = &bulbs[bulb].mailbox;
+    portENTER_CRITICAL(&mailbox_lock);
+    const bool was_full = mailbox->full;
+    memcpy(mailbox->value, value, TX_VALUE_LEN);
+    mailbox->posted_time = esp_timer_get_time();
+    mailbox->full = true;
+    tx_stats.queued++;
+    if (was_full) tx_stats.superseded++;
+    portEXIT_CRITICAL(&mailbox_lock);
+
+    if (!was_full) {
+        /* if the queue is full the bridge task is busy, and looks at every mailbox after each event anyway */
+        struct bridge_event event = { .type = BRIDGE_EVENT_WRITE, .command.bulb = bulb };
+        post_event(&event);
+    }
     return true;
 }
 
-void bluetooth_request_bulb_state()
+static struct rgb_colour shown_rgb(const struct light_state * state)
 {
-    current_state.up_to_date = false;
+    const struct rgb_colour off = { .r = 0, .g = 0, .b = 0 };
+    return state->on_off ? colours_hsv_to_rgb(state->colour) : off;
+}
 
-    if ( gl_profile_tab[PROFILE_A_APP_ID].char_handle == 0 ) {
+/**
+ * @brief Send a bulb its desired state if its state differs
+ * Nothing is done while a write or a fade is on its way to the bulb, since that is about to change its state anyway,
+ * nor while the bulb is still to report the last value sent.
+ */
+static void reconcile_bulb(const int bulb)
+{
+    struct bulb_connection * connection = &bulbs[bulb];
+    portENTER_CRITICAL(&desired_lock);
+    const struct light_state desired = bulb_desired[bulb];
+    portEXIT_CRITICAL(&desired_lock);
+    const struct light_state * reported = &bulb_state[bulb];
+    if (desired.version == 0 || connection->link_state != BULB_READY
+        || connection->mailbox.full || connection->in_flight_count > 0 || connection->awaiting_confirmation
+        || transition_active(bulb)) {
         return;
     }
 
-    /* read RGB value from characteristic */
-    esp_ble_gattc_read_char(
-        gl_profile_tab[PROFILE_A_APP_ID].gattc_if,
-        gl_profile_tab[PROFILE_A_APP_ID].conn_id,
-        gl_profile_tab[PROFILE_A_APP_ID].char_handle,
-        ESP_GATT_AUTH_REQ_NONE);
+    /* an unknown state counts as different, the colour conversions may round by one either way */
+    const struct rgb_colour want = shown_rgb(&desired);
+    const struct rgb_colour have = shown_rgb(reported);
+    if (reported->up_to_date && abs(want.r - have.r) <= 1 && abs(want.g - have.g) <= 1 && abs(want.b - have.b) <= 1) {
+        /* the writes worked, so a later drift from the same state gets attempts of its own */
+        connection->reconcile_attempts = 0;
+        return;
+    }
+    if (connection->reconcile_attempts >= RECONCILE_MAX_ATTEMPTS) {
+        return;
+    }
+
+    connection->reconcile_attempts++;
+    command_stats.reconciled++;
+    ESP_LOGI(log_tag, "Bulb %d differs from its desired state, sending it again", bulb);
+    const uint8_t value[TX_VALUE_LEN] = { 0xD0, want.r, want.g, want.b };
+    write_bulb(bulb, value);
 }
 
-bool bluetooth_turn_bulb_off()
+/**
+ * @brief Send the value in a bulb's mailbox once the link can take it
+ * @return true if a value is left waiting for a buffer or the next connection event
+ */
+static bool drain_bulb(const int bulb)
 {
-    if ( gl_profile_tab[PROFILE_A_APP_ID].char_handle == 0 ) {
+    struct bulb_connection * connection = &bulbs[bulb];
+    struct tx_mailbox * mailbox = &connection->mailbox;
+    if (!mailbox->full) {
+        return false;
+    }
+    if (connection->link_state != BULB_READY) {
+        portENTER_CRITICAL(&mailbox_lock);
+        if (mailbox->full) tx_stats.dropped++;
+        mailbox->full = false;
+        portEXIT_CRITICAL(&mailbox_lock);
         return false;
     }
 
-    /* write off value to characteristic */
-    uint8_t value [4] = { 0xD0, 0, 0, 0 };
+    /* a value the bulb already shows is dropped, unless a write still on its way may be changing it */
+    const int64_t now = esp_timer_get_time();
+    bool reassert = false;
+    if (CONFIG_SMARTBULB_WRITE_REASSERT_S > 0 && connection->shadow_valid && connection->in_flight_count == 0) {
+        portENTER_CRITICAL(&mailbox_lock);
+        const bool unchanged = memcmp(mailbox->value, connection->shadow, TX_VALUE_LEN) == 0;
+        const bool stale = now - connection->shadow_time >= CONFIG_SMARTBULB_WRITE_REASSERT_S * 1000000LL;
+        if (unchanged && !stale) {
+            mailbox->full = false;
+        }
+        portEXIT_CRITICAL(&mailbox_lock);
+        if (unchanged && !stale) {
+            tx_stats.deduplicated++;
+            tx_stats.airtime_saved_us += TX_WRITE_AIRTIME_US;
+            return false;
+        }
+        reassert = unchanged;
+    }
+
+    /* after a write, whatever arrives before the next connection event replaces the value rather than queueing */
+    if (now < connection->next_send_time) {
+        return true;
+    }
+    /* writes without response are only safe to hand over while the controller has a buffer for them */
+    if (esp_ble_get_cur_sendable_packets_num(connection->conn_id) == 0) {
+        tx_stats.stalls++;
+        return true;
+    }
+
+    uint8_t value[TX_VALUE_LEN];
+    portENTER_CRITICAL(&mailbox_lock);
+    memcpy(value, mailbox->value, TX_VALUE_LEN);
+    const int64_t posted_time = mailbox->posted_time;
+    mailbox->full = false;
+    portEXIT_CRITICAL(&mailbox_lock);
+
+    if (connection->in_flight_count == IN_FLIGHT_DEPTH) {
+        /* a write event went missing, forget the oldest rather than misattribute the rest */
+        connection->in_flight_head = (connection->in_flight_head + 1) % IN_FLIGHT_DEPTH;
+        connection->in_flight_count--;
+    }
+    const int slot = (connection->in_flight_head + connection->in_flight_count) % IN_FLIGHT_DEPTH;
+    connection->in_flight[slot].posted_time = posted_time;
+    memcpy(connection->in_flight[slot].value, value, TX_VALUE_LEN);
+    connection->in_flight_count++;
+
     esp_ble_gattc_write_char(
         gl_profile_tab[PROFILE_A_APP_ID].gattc_if,
-        gl_profile_tab[PROFILE_A_APP_ID].conn_id,
-        gl_profile_tab[PROFILE_A_APP_ID].char_handle,
+        connection->conn_id,
+        connection->char_handle,
         sizeof(value),
         value,
         ESP_GATT_WRITE_TYPE_NO_RSP,
         ESP_GATT_AUTH_REQ_NONE);
+    connection->next_send_time = now + connection->conn_interval * 1250LL;
+
+    const uint32_t latency_us = esp_timer_get_time() - posted_time;
+    tx_stats.sent++;
+    if (reassert) tx_stats.reasserted++;
+    tx_stats.latency_total_us += latency_us;
+    if (latency_us > tx_stats.latency_max_us) tx_stats.latency_max_us = latency_us;
+    return false;
+}
+
+static void read_bulb(const int bulb)
+{
+    if ( bulbs[bulb].link_state != BULB_READY ) {
+        /* nothing will answer, so do not keep anybody waiting */
+        read_done(bulb);
+        return;
+    }
+    portENTER_CRITICAL(&state_stats_lock);
+    state_stats.reads++;
+    portEXIT_CRITICAL(&state_stats_lock);
+    if (bulbs[bulb].read_sent_time == 0) {
+        bulbs[bulb].read_sent_time = esp_timer_get_time();
+    }
+
+    /* read RGB value from characteristic */
+    if (esp_ble_gattc_read_char(
+        gl_profile_tab[PROFILE_A_APP_ID].gattc_if,
+        bulbs[bulb].conn_id,
+        bulbs[bulb].char_handle,
+        ESP_GATT_AUTH_REQ_NONE) == ESP_OK) {
+        bulbs[bulb].reads_sent++;
+    }
+}
+
+/**
+ * @brief Note a response from a bulb, which shows its link is working
+ */
+static void link_heard(const int bulb)
+{
+    bulbs[bulb].last_heard = esp_timer_get_time();
+    bulbs[bulb].read_sent_time = 0;
+}
+
+/**
+ * @brief Publish the link quality of a bulb to clients if it has moved by a whole step
+ */
+static void link_report(const int bulb)
+{
+    struct bulb_connection * connection = &bulbs[bulb];
+    if (abs(connection->rssi - connection->reported.rssi) >= LINK_REPORT_RSSI_STEP
+        || abs(connection->health - connection->reported.health) >= LINK_REPORT_HEALTH_STEP
+        || (connection->rssi == BLUETOOTH_RSSI_UNKNOWN) != (connection->reported.rssi == BLUETOOTH_RSSI_UNKNOWN)
+        || (connection->health == 0) != (connection->reported.health == 0)) {
+        connection->reported.rssi = connection->rssi;
+        connection->reported.health = connection->health;
+        link_version++;
+    }
+}
+
+/**
+ * @brief Count a lost link and the time from last hearing the bulb to noticing, and start the recovery clock there
+ * @param early true if the link monitor noticed, false if the controller's supervision timeout did
+ */
+static void link_drop_detected(const int bulb, const bool early)
+{
+    struct bulb_connection * connection = &bulbs[bulb];
+    const int64_t now = esp_timer_get_time();
+    const uint32_t detect_ms = connection->last_heard > 0 ? (now - connection->last_heard) / 1000 : 0;
+    if (early) {
+        link_stats.early_drops++;
+    } else {
+        link_stats.timeout_drops++;
+    }
+    link_stats.detect_total_ms += detect_ms;
+    if (detect_ms > link_stats.detect_max_ms) link_stats.detect_max_ms = detect_ms;
+    connection->lost_time = connection->last_heard > 0 ? connection->last_heard : now;
+    ESP_LOGW(log_tag, "Bulb %d link lost %d ms after it was last heard (%s)", bulb, detect_ms, early ? "monitor" : "timeout");
+}
+
+/**
+ * @brief Health of a link over the last sample, from its RSSI and the writes which failed
+ */
+static int link_sample_score(const struct bulb_connection * connection)
+{
+    int score = 100;
+    if (connection->rssi != BLUETOOTH_RSSI_UNKNOWN) {
+        score = (connection->rssi - LINK_RSSI_FLOOR) * 100 / (LINK_RSSI_GOOD - LINK_RSSI_FLOOR);
+    }
+    score -= connection->write_failures * LINK_WRITE_FAILURE_PENALTY;
+    return score < 0 ? 0 : (score > 100 ? 100 : score);
+}
+
+/**
+ * @brief Supervision timeout of a link in ms, that of the idle parameters if the bulb has not said
+ */
+static int64_t link_supervision_ms(const struct bulb_connection * connection)
+{
+    const uint16_t timeout = connection->supervision_timeout > 0
+        ? connection->supervision_timeout : conn_mode_params[CONN_MODE_IDLE].timeout;
+    return timeout * 10LL;
+}
+
+/**
+ * @brief How long a bulb may stay quiet before it is probed, see LINK_PROBE_DIVISOR
+ */
+static int64_t link_probe_after_ms(const struct bulb_connection * connection)
+{
+    return link_supervision_ms(connection) / LINK_PROBE_DIVISOR;
+}
+
+/**
+ * @brief How long a read may go unanswered before the link is taken as dead, see LINK_RESPONSE_EVENTS
+ */
+static int64_t link_response_timeout_ms(const struct bulb_connection * connection)
+{
+    uint16_t interval = connection->conn_interval;
+    uint16_t latency = connection->conn_latency;
+    if (interval == 0) {
+        interval = conn_mode_params[CONN_MODE_IDLE].max_int;
+        latency = conn_mode_params[CONN_MODE_IDLE].latency;
+    }
+    /* units of 1.25 ms */
+    const int64_t window_ms = interval * (latency + 1) * 5LL / 4;
+    int64_t timeout_ms = LINK_RESPONSE_EVENTS * window_ms;
+    if (timeout_ms < LINK_RESPONSE_MIN_MS) {
+        timeout_ms = LINK_RESPONSE_MIN_MS;
+    }
+    const int64_t limit_ms = link_supervision_ms(connection) - link_probe_after_ms(connection) - LINK_SAMPLE_MS;
+    if (timeout_ms > limit_ms) {
+        /* never shorter than a round trip, even if the controller may then notice first */
+        const int64_t round_trip_ms = interval * (latency + 2) * 5LL / 4;
+        timeout_ms = limit_ms > round_trip_ms ? limit_ms : round_trip_ms;
+    }
+    return timeout_ms;
+}
+
+/**
+ * @brief Sample the link of every connected bulb, dropping the ones which have stopped answering
+ */
+static void link_sample(void)
+{
+    const int64_t now = esp_timer_get_time();
+
+    /* the stack only has one RSSI read in progress at a time, so the bulbs take turns */
+    for (int i = 0; i < bulb_count; i++) {
+        link_rssi_bulb = (link_rssi_bulb + 1) % bulb_count;
+        if (bulbs[link_rssi_bulb].link_state == BULB_READY && !bulbs[link_rssi_bulb].dropping) {
+            esp_ble_gap_read_rssi(bulbs[link_rssi_bulb].remote_bda);
+            break;
+        }
+    }
+
+    for (int bulb = 0; bulb < bulb_count; bulb++) {
+        struct bulb_connection * connection = &bulbs[bulb];
+        if (connection->link_state != BULB_READY || connection->dropping) {
+            continue;
+        }
+
+        const bool unanswered = connection->read_sent_time > 0
+            && now - connection->read_sent_time > link_response_timeout_ms(connection) * 1000;
+        if (unanswered) {
+            link_stats.missed_responses++;
+            connection->health = 0;
+        } else {
+            connection->health = (connection->health * 3 + link_sample_score(connection)) / 4;
+        }
+
+        if (unanswered || (connection->health < LINK_HEALTH_RECONNECT && connection->write_failures > 0)) {
+            /* the bridge would otherwise keep the link until the supervision timeout */
+            link_drop_detected(bulb, true);
+            connection->dropping = true;
+            connection->health = 0;
+            esp_ble_gap_disconnect(connection->remote_bda);
+        } else if (connection->read_sent_time == 0 && now - connection->last_heard > link_probe_after_ms(connection) * 1000) {
+            /* a quiet link is only known to work once the bulb answers something */
+            link_stats.probes++;
+            read_bulb(bulb);
+        }
+        connection->write_failures = 0;
+        link_report(bulb);
+    }
+}
+
+static void link_timer_callback(void * arg)
+{
+    struct bridge_event event = { .type = BRIDGE_EVENT_LINK };
+    post_event(&event);
+}
+
+static void frame_timer_callback(void * arg)
+{
+    portENTER_CRITICAL(&frame_lock);
+    const bool posted = frame_posted;
+    frame_posted = true;
+    portEXIT_CRITICAL(&frame_lock);
+    if (posted) {
+        /* the waiting frame is worked out from the time it is handled, so this one is not needed */
+        return;
+    }
+    struct bridge_event event = { .type = BRIDGE_EVENT_FRAME };
+    if (!post_event(&event)) {
+        portENTER_CRITICAL(&frame_lock);
+        frame_posted = false;
+        portEXIT_CRITICAL(&frame_lock);
+    }
+}
+
+/**
+ * @brief Run the frame timer at the shortest connection interval of the fading bulbs, stopping it once none is left
+ * A bulb takes one value per connection event, so until its fast parameters are granted the frames sent
+ * faster than its idle interval would only overwrite each other in its mailbox.
+ */
+static void update_frame_timer(void)
+{
+    uint64_t period_us = 0;
+    for (int i = 0; i < bulb_count; i++) {
+        const uint64_t interval_us = bulbs[i].conn_interval * 1250ULL;
+        if (transition_active(i) && interval_us > 0 && (period_us == 0 || interval_us < period_us)) {
+            period_us = interval_us;
+        }
+    }
+    if (period_us < TRANSITION_FRAME_US) {
+        period_us = TRANSITION_FRAME_US;
+    }
+
+    if (frame_timer_running && (!transition_running() || period_us != frame_period_us)) {
+        esp_timer_stop(frame_timer);
+        frame_timer_running = false;
+    }
+    if (!frame_timer_running && transition_running()) {
+        esp_timer_start_periodic(frame_timer, period_us);
+        frame_timer_running = true;
+        frame_period_us = period_us;
+    }
+}
+
+/**
+ * @brief Send the next frame of every fade, following any change of the connection intervals
+ */
+static void frame_step(void)
+{
+    portENTER_CRITICAL(&frame_lock);
+    frame_posted = false;
+    portEXIT_CRITICAL(&frame_lock);
+    transition_step(esp_timer_get_time());
+    update_frame_timer();
+}
+
+static void handle_event(struct bridge_event * event)
+{
+    switch (event->type) {
+    case BRIDGE_EVENT_GAP:
+        handle_gap_event(event->gap.event, &event->gap.param);
+        break;
+    case BRIDGE_EVENT_GATTC:
+        if (event->gattc.event == ESP_GATTC_READ_CHAR_EVT) {
+            event->gattc.param.read.value = event->gattc.value;
+        }
+        if (event->gattc.event == ESP_GATTC_NOTIFY_EVT) {
+            event->gattc.param.notify.value = event->gattc.value;
+        }
+        handle_gattc_event(event->gattc.event, event->gattc.gattc_if, &event->gattc.param);
+        break;
+    case BRIDGE_EVENT_STACK:
+    case BRIDGE_EVENT_RETRY:
+        /* the work itself is taken from the stack ring and retry_pending at every step */
+        break;
+    case BRIDGE_EVENT_IDLE:
+        bulb_idle(event->command.bulb);
+        break;
+    case BRIDGE_EVENT_WRITE:
+        /* the value itself is sent from the mailbox once the event has been handled */
+        bulb_activity(event->command.bulb);
+        break;
+    case BRIDGE_EVENT_READ:
+        read_bulb(event->command.bulb);
+        break;
+    case BRIDGE_EVENT_COMMAND:
+        bulbs[event->lighting.bulb].reconcile_attempts = 0;
+        if (event->lighting.force) {
+            /* with the shadow forgotten the next value is sent whatever the bulb is thought to show */
+            bulbs[event->lighting.bulb].shadow_valid = false;
+        }
+        transition_set_bulb_state(event->lighting.bulb, event->lighting.colour, event->lighting.on_off, event->lighting.period_ms);
+        update_frame_timer();
+        break;
+    case BRIDGE_EVENT_LINK:
+        link_sample();
+        break;
+    case BRIDGE_EVENT_FRAME:
+        frame_step();
+        break;
+    }
+}
+
+/**
+ * @brief Handle the next event, waiting for one up to the given time, then send what the mailboxes hold
+ * @return true if a value is held back for lack of buffers or the next connection event
+ */
+static void count_event(const struct bridge_event * event, const uint32_t depth)
+{
+    const uint32_t latency_us = esp_timer_get_time() - event->posted_time;
+    bridge_stats.events++;
+    if (depth > bridge_stats.max_depth) bridge_stats.max_depth = depth;
+    bridge_stats.latency_total_us += latency_us;
+    if (latency_us > bridge_stats.latency_max_us) bridge_stats.latency_max_us = latency_us;
+}
+
+/**
+ * @brief Handle the Bluedroid events in the stack ring, up to those there when it is looked at
+ */
+static void drain_stack_ring(void)
+{
+    /* cleared first, so an event added from here on posts a wake-up of its own */
+    atomic_store(&stack_posted, false);
+    const unsigned head = atomic_load_explicit(&stack_head, memory_order_acquire);
+    unsigned tail = atomic_load_explicit(&stack_tail, memory_order_relaxed);
+    const uint32_t depth = head - tail;
+    while (tail != head) {
+        /* copied out before the slot is handed back, the handlers point the event at its own value */
+        struct bridge_event event = stack_ring[tail % STACK_RING_LEN];
+        atomic_store_explicit(&stack_tail, ++tail, memory_order_release);
+        count_event(&event, depth);
+        handle_event(&event);
+    }
+}
+
+static bool bridge_step(const TickType_t wait)
+{
+    struct bridge_event event;
+    if (xQueueReceive(bridge_queue, &event, wait) == pdTRUE) {
+        count_event(&event, uxQueueMessagesWaiting(bridge_queue) + 1);
+        handle_event(&event);
+    }
+    drain_stack_ring();
+    unsigned retries = atomic_exchange(&retry_pending, 0);
+    for (int i = 0; retries != 0; i++, retries >>= 1) {
+        if (retries & 1) {
+            bulb_retry(i);
+        }
+    }
+
+    bool waiting_for_credits = false;
+    for (int i = 0; i < bulb_count; i++) {
+        if (drain_bulb(i)) {
+            waiting_for_credits = true;
+        }
+    }
+    return waiting_for_credits;
+}
+
+/**
+ * @brief The one task which drives the BLE stack, so connection state has a single writer
+ */
+static void bridge_task(void *pvParameters)
+{
+    bool waiting_for_credits = false;
+    while (true) {
+        /* while writes are held back for lack of buffers, poll for the controller to free some */
+        waiting_for_credits = bridge_step(waiting_for_credits ? pdMS_TO_TICKS(TX_CREDIT_POLL_MS) : portMAX_DELAY);
+    }
+}
+
+/* Bluedroid callbacks, which run in the BTC task and only copy the event for the bridge task */
+
+static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
+{
+    struct bridge_event bridge_event = { .type = BRIDGE_EVENT_GAP, .gap = { .event = event, .param = *param } };
+    post_stack_event(&bridge_event);
+}
+
+static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t *param)
+{
+    struct bridge_event bridge_event = {
+        .type = BRIDGE_EVENT_GATTC,
+        .gattc = { .event = event, .gattc_if = gattc_if, .param = *param },
+    };
+    if (event == ESP_GATTC_READ_CHAR_EVT) {
+        /* a longer value than fits is cut short, which no valid bulb state is */
+        const uint16_t len = param->read.value_len < BRIDGE_VALUE_LEN ? param->read.value_len : BRIDGE_VALUE_LEN;
+        if (param->read.value != NULL) {
+            memcpy(bridge_event.gattc.value, param->read.value, len);
+        }
+        bridge_event.gattc.param.read.value_len = len;
+        bridge_event.gattc.param.read.value = NULL;
+    } else if (event == ESP_GATTC_NOTIFY_EVT) {
+        const uint16_t len = param->notify.value_len < BRIDGE_VALUE_LEN ? param->notify.value_len : BRIDGE_VALUE_LEN;
+        memcpy(bridge_event.gattc.value, param->notify.value, len);
+        bridge_event.gattc.param.notify.value_len = len;
+        bridge_event.gattc.param.notify.value = NULL;
+    }
+    post_stack_event(&bridge_event);
+}
+
+/* apart from the command and state counters, which have their own locks, the counters are written by the */
+/* bridge task only and are copied without a lock */
+
+struct bluetooth_bridge_stats bluetooth_get_bridge_stats(void)
+{
+    struct bluetooth_bridge_stats stats = bridge_stats;
+    portENTER_CRITICAL(&bridge_dropped_lock);
+    stats.dropped = bridge_dropped;
+    stats.stack_waits = stack_waits;
+    stats.stack_dropped = stack_dropped;
+    portEXIT_CRITICAL(&bridge_dropped_lock);
+    return stats;
+}
+
+struct bluetooth_command_stats bluetooth_get_command_stats(void)
+{
+    portENTER_CRITICAL(&command_stats_lock);
+    const struct bluetooth_command_stats stats = command_stats;
+    portEXIT_CRITICAL(&command_stats_lock);
+    return stats;
+}
+
+struct bluetooth_state_stats bluetooth_get_state_stats(void)
+{
+    portENTER_CRITICAL(&state_stats_lock);
+    const struct bluetooth_state_stats stats = state_stats;
+    portEXIT_CRITICAL(&state_stats_lock);
+    return stats;
+}
+
+struct bluetooth_link_stats bluetooth_get_link_stats(void)
+{
+    return link_stats;
+}
+
+struct bluetooth_link_quality bluetooth_link_quality(const int bulb)
+{
+    return bulbs[bulb].reported;
+}
+
+struct bluetooth_conn_stats bluetooth_get_conn_stats(void)
+{
+    return conn_stats;
+}
+
+struct bluetooth_tx_stats bluetooth_get_tx_stats(void)
+{
+    return tx_stats;
+}
+
+bool bluetooth_set_bulb_colour(const int bulb, const struct rgb_colour rgb)
+{
+    /* write RGB value to characteristic */
+    const uint8_t value [TX_VALUE_LEN] = { 0xD0, rgb.r, rgb.g, rgb.b };
+    return write_bulb(bulb, value);
+}
+
+bool bluetooth_bulb_connected(const int bulb)
+{
+    return bulb >= 0 && bulb < bulb_count && bulbs[bulb].link_state == BULB_READY;
+}
+
+struct light_state bluetooth_desired_state(const int bulb)
+{
+    portENTER_CRITICAL(&desired_lock);
+    const struct light_state desired = bulb_desired[bulb];
+    portEXIT_CRITICAL(&desired_lock);
+    return desired.version > 0 ? desired : bluetooth_reported_state(bulb);
+}
+
+struct light_state bluetooth_reported_state(const int bulb)
+{
+    portENTER_CRITICAL(&bulb_state_lock);
+    const struct light_state reported = bulb_state[bulb];
+    portEXIT_CRITICAL(&bulb_state_lock);
+    return reported;
+}
+
+bool bluetooth_send_command(const struct bulb_command * command)
+{
+    if ( command->bulb < 0 || command->bulb >= bulb_count ) {
+        return false;
+    }
+
+    struct bridge_event event = { .type = BRIDGE_EVENT_COMMAND, .lighting = *command };
+    const bool posted = post_event(&event);
+    portENTER_CRITICAL(&command_stats_lock);
+    if (posted) {
+        command_stats.submitted++;
+    } else {
+        command_stats.rejected++;
+    }
+    portEXIT_CRITICAL(&command_stats_lock);
+    if (!posted) {
+        /* the bulb will not be sent it, so it must not be reported or reconciled as its desired state */
+        return false;
+    }
 
+    /* the reply is built from the desired state straight away, the bulb state catches up once it is written */
+    /* the request handlers are serialised, so commands reach the queue and the desired state in the same order */
+    portENTER_CRITICAL(&desired_lock);
+    struct light_state * desired = &bulb_desired[command->bulb];
+    desired->colour = command->colour;
+    desired->on_off = command->on_off;
+    desired->up_to_date = true;
+    desired->version++;
+    portEXIT_CRITICAL(&desired_lock);
     return true;
 }
 
+void bluetooth_request_bulb_state(const int bulb)
+{
+    if ( bulb < 0 || bulb >= bulb_count ) {
+        return;
+    }
+
+    /* a subscribed bulb has already told us its state, so only reads cost BLE traffic */
+    if ( bulbs[bulb].notifying ) {
+        portENTER_CRITICAL(&state_stats_lock);
+        state_stats.reads_skipped++;
+        portEXIT_CRITICAL(&state_stats_lock);
+        return;
+    }
+
+    bulb_state_stale(bulb);
+
+    if ( bulbs[bulb].link_state != BULB_READY ) {
+        return;
+    }
+
+    struct bridge_event event = { .type = BRIDGE_EVENT_READ, .command.bulb = bulb };
+    post_event(&event);
+}
+
+bool bluetooth_wait_fresh_state(const uint32_t max_age_ms, const uint32_t timeout_ms)
+{
+    const int64_t now = esp_timer_get_time();
+    EventBits_t wait_bits = 0;
+
+    for (int bulb = 0; bulb < bulb_count; bulb++) {
+        const struct light_state state = bluetooth_reported_state(bulb);
+        /* a subscribed bulb's state is current however long ago it last changed */
+        if ( bulbs[bulb].link_state != BULB_READY || bulbs[bulb].notifying
+            || (state.up_to_date && now - state.read_time <= max_age_ms * 1000LL) ) {
+            portENTER_CRITICAL(&state_stats_lock);
+            state_stats.fresh_hits++;
+            portEXIT_CRITICAL(&state_stats_lock);
+            continue;
+        }
+
+        /* only the first waiter sends the read, the others wait for the same completion */
+        portENTER_CRITICAL(&read_lock);
+        const bool send_read = !read_pending[bulb];
+        read_pending[bulb] = true;
+        portEXIT_CRITICAL(&read_lock);
+        if (send_read) {
+            xEventGroupClearBits(read_events, BIT(bulb));
+            struct bridge_event event = { .type = BRIDGE_EVENT_READ, .command.bulb = bulb };
+            if (!post_event(&event)) {
+                read_done(bulb);
+                continue;
+            }
+        }
+        wait_bits |= BIT(bulb);
+    }
+
+    if (wait_bits == 0) {
+        return true;
+    }
+
+    const EventBits_t done_bits = xEventGroupWaitBits(read_events, wait_bits, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms)) & wait_bits;
+    portENTER_CRITICAL(&state_stats_lock);
+    for (int bulb = 0; bulb < bulb_count; bulb++) {
+        if (done_bits & BIT(bulb)) {
+            state_stats.fresh_misses++;
+        } else if (wait_bits & BIT(bulb)) {
+            state_stats.fresh_timeouts++;
+        }
+    }
+    portEXIT_CRITICAL(&state_stats_lock);
+    return done_bits == wait_bits;
+}
+
+bool bluetooth_turn_bulb_off(const int bulb)
+{
+    /* write off value to characteristic */
+    const uint8_t value [TX_VALUE_LEN] = { 0xD0, 0, 0, 0 };
+    return write_bulb(bulb, value);
+}
+
 void bluetooth_start(void)
 {
-    // convert user defined MAC address from string to bytes
-    sscanf(
-      CONFIG_SMARTBULB_MAC_ADDRESS,
-      "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
-      &mac_address[0], &mac_address[1], &mac_address[2], &mac_address[3], &mac_address[4], &mac_address[5]);
+    bridge_queue = xQueueCreate(BRIDGE_QUEUE_LEN, sizeof(struct bridge_event));
+    read_events = xEventGroupCreate();
+    /* ready before the bridge task can take the first lighting command */
+    const esp_timer_create_args_t frame_timer_args = {
+        .callback = &frame_timer_callback,
+        .name = "transition",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&frame_timer_args, &frame_timer));
+
+    memset(conn_id_to_bulb, -1, sizeof(conn_id_to_bulb));
+    memset(bda_to_bulb, -1, sizeof(bda_to_bulb));
 
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
+    // convert the comma separated list of user defined MAC addresses from strings to bytes
+    const char * mac_list = CONFIG_SMARTBULB_MAC_ADDRESS;
+    while (*mac_list != '\0' && bulb_count < BLUETOOTH_MAX_BULBS) {
+        uint8_t * mac_address = bulbs[bulb_count].remote_bda;
+        int consumed = 0;
+        if (sscanf(
+              mac_list,
+              " %hhx:%hhx:%hhx:%hhx:%hhx:%hhx%n",
+              &mac_address[0], &mac_address[1], &mac_address[2], &mac_address[3], &mac_address[4], &mac_address[5],
+              &consumed) != 6) {
+            ESP_LOGE(log_tag, "Invalid smartbulb MAC address list: %s", CONFIG_SMARTBULB_MAC_ADDRESS);
+            break;
+        }
+        /* bulbs with a random address only connect, and pass the whitelist, when it is given as such */
+        esp_ble_addr_type_t addr_type = BLE_ADDR_TYPE_PUBLIC;
+        if (mac_list[consumed] == '/') {
+            const char type = mac_list[consumed + 1];
+            if (type == 'r' || type == 'R') {
+                addr_type = BLE_ADDR_TYPE_RANDOM;
+            } else if (type != 'p' && type != 'P') {
+                ESP_LOGE(log_tag, "Invalid smartbulb address type: %s", CONFIG_SMARTBULB_MAC_ADDRESS);
+                break;
+            }
+            consumed += 2;
+        }
+        const esp_timer_create_args_t retry_timer_args = {
+            .callback = &retry_timer_callback,
+            .arg = (void *)(intptr_t)bulb_count,
+            .name = "ble_retry",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&retry_timer_args, &bulbs[bulb_count].retry_timer));
+        const esp_timer_create_args_t idle_timer_args = {
+            .callback = &idle_timer_callback,
+            .arg = (void *)(intptr_t)bulb_count,
+            .name = "ble_idle",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&idle_timer_args, &bulbs[bulb_count].idle_timer));
+        bulbs[bulb_count].conn_mode = CONN_MODES;
+        bulbs[bulb_count].rssi = BLUETOOTH_RSSI_UNKNOWN;
+        bulbs[bulb_count].reported.rssi = BLUETOOTH_RSSI_UNKNOWN;
+        bulbs[bulb_count].link_state = BULB_WAITING;
+        bulbs[bulb_count].addr_type = addr_type;
+        add_bulb_bda(bulb_count);
+        handle_cache_load(bulb_count);
+        bulb_count++;
+        mac_list += consumed;
+        while (*mac_list == ',' || *mac_list == ' ') mac_list++;
     }
-    ESP_ERROR_CHECK( ret );
+    ESP_LOGI(log_tag, "Bridging %d bulbs", bulb_count);
+
+    /* only now are the bulb slots and the lookup tables the bridge task works on filled in */
+    xTaskCreate(bridge_task, "ble_bridge", 4096, NULL, 6, NULL);
+
+    const esp_timer_create_args_t link_timer_args = {
+        .callback = &link_timer_callback,
+        .name = "ble_link",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&link_timer_args, &link_timer));
+    esp_timer_start_periodic(link_timer, LINK_SAMPLE_MS * 1000ULL);
 
+    /* NVS has already been initialised by app_main */
     ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
 
     esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
-    ret = esp_bt_controller_init(&bt_cfg);
+    esp_err_t ret = esp_bt_controller_init(&bt_cfg);
     if (ret) {
         ESP_LOGE(log_tag, "%s initialize controller failed: %s\n", __func__, esp_err_to_name(ret));
         return;
@@ -430,6 +2280,7 @@ void bluetooth_start(void)
         ESP_LOGE(log_tag, "%s enable controller failed: %s\n", __func__, esp_err_to_name(ret));
         return;
     }
+    boot_profile_mark(BOOT_PHASE_BLE_CONTROLLER_READY);
 
     ret = esp_bluedroid_init();
     if (ret) {
@@ -33,25 +33,264 @@ struct light_state
     bool on_off;
     int temperature;
     bool up_to_date;
+    int64_t read_time;  /* when the state was last read or notified from the bulb */
+    uint32_t version;   /* incremented on every change so replies can be cached */
 };
 
-extern struct light_state current_state;
+/* maximum number of bulbs served by one bridge, limited by the BLE connections available */
+#define BLUETOOTH_MAX_BULBS CONFIG_SMARTBULB_MAX_BULBS
+
+/* last known state of each configured bulb, indexed in the order of the MAC address list */
+/* this is what the bulb has reported or been sent, and is only written by the BLE bridge task; */
+/* other tasks must read it through bluetooth_reported_state */
+extern struct light_state bulb_state[BLUETOOTH_MAX_BULBS];
+
+/**
+ * @brief Lighting command for one bulb, copied to the BLE bridge task which carries it out
+ */
+struct bulb_command
+{
+    int bulb;
+    struct hsv_colour colour;   /* kept as the on state colour even when turning off */
+    bool on_off;
+    uint32_t period_ms;         /* length of the fade to the new state, 0 for immediate */
+    bool force;                 /* write the bulb even if it is known to show the state already */
+};
+
+/**
+ * @brief Get the number of bulbs in the configured MAC address list
+ * @return Number of bulbs, at most BLUETOOTH_MAX_BULBS
+ */
+extern int bluetooth_bulb_count(void);
+
+/**
+ * @brief Get the sum of the state versions of all bulbs, which changes whenever any bulb or its reported link quality changes
+ * @return Combined state version
+ */
+extern uint32_t bluetooth_state_version(void);
 
 /**
- * @brief Set the colour of the BLE smart bulb
+ * @brief Set the colour of a BLE smart bulb
+ * @param bulb Index of the bulb
  * @param rgb New colour
+ * @return false if the bulb is not connected
+ */
+extern bool bluetooth_set_bulb_colour(const int bulb, const struct rgb_colour rgb);
+
+/**
+ * @brief Make a command's state the desired state of its bulb and post it to the BLE bridge task
+ * This is the common command path for every control protocol. It never waits for the BLE link, the
+ * bulb state follows once the bulb has been written.
+ * @param command Command to carry out, copied before returning
+ * @return false if the bulb does not exist or the command could not be queued, the desired state is then unchanged
+ */
+extern bool bluetooth_send_command(const struct bulb_command * command);
+
+/**
+ * @brief Get the state a bulb was last told to reach, for optimistic replies to commands
+ * @param bulb Index of the bulb
+ * @return Copy of the desired state, or of the last known state if the bulb has not been commanded yet
+ */
+extern struct light_state bluetooth_desired_state(const int bulb);
+
+/**
+ * @brief Get the last known state of a bulb, copied under the lock the BLE bridge task writes it with
+ * @param bulb Index of the bulb
+ * @return Copy of bulb_state for the bulb
+ */
+extern struct light_state bluetooth_reported_state(const int bulb);
+
+/**
+ * @brief Check whether a bulb can be written to
+ * @param bulb Index of the bulb
+ * @return true if the bulb is connected and its characteristic is known
+ */
+extern bool bluetooth_bulb_connected(const int bulb);
+
+/**
+ * @brief Request a reading of the colour of a BLE smart bulb
+ * Nothing is read from a bulb which notifies its state changes, since its state is already current.
+ * @param bulb Index of the bulb
+ */
+extern void bluetooth_request_bulb_state(const int bulb);
+
+/**
+ * @brief Make sure the state of every connected bulb is no older than a limit, reading it if need be
+ * Waiters share the read already in flight for a bulb rather than sending another.
+ * @param max_age_ms Age beyond which the state of a bulb is read again
+ * @param timeout_ms Longest time to wait for the reads
+ * @return true if every connected bulb has a fresh state, false if a read did not complete in time
+ */
+extern bool bluetooth_wait_fresh_state(const uint32_t max_age_ms, const uint32_t timeout_ms);
+
+/**
+ * @brief Turn off a BLE smart bulb
+ * @param bulb Index of the bulb
+ * @return false if the bulb is not connected
+ */
+extern bool bluetooth_turn_bulb_off(const int bulb);
+
+/**
+ * @brief Counters of the work done scanning for bulbs
+ */
+struct bluetooth_scan_stats
+{
+    uint32_t scans;             /* scans started */
+    uint32_t reports;           /* advertising reports passed up by the controller */
+    uint32_t rejected;          /* reports dropped by the prefilter */
+    uint32_t matches;           /* reports which started a connection */
+    uint32_t scan_time_ms;      /* time with a scan running */
+    uint32_t radio_time_ms;     /* time the receiver was listening, the scan time scaled by the duty cycle */
+    uint64_t cpu_time_us;       /* time spent handling advertising reports */
+};
+
+/**
+ * @brief Get the scan counters
+ */
+extern struct bluetooth_scan_stats bluetooth_get_scan_stats(void);
+
+/**
+ * @brief Counters of the characteristic writes sent to the bulbs
+ */
+struct bluetooth_tx_stats
+{
+    uint32_t queued;            /* values posted by the request handlers */
+    uint32_t sent;              /* writes handed to the controller */
+    uint32_t superseded;        /* values replaced by a newer one before they were sent */
+    uint32_t dropped;           /* values lost with their connection */
+    uint32_t stalls;            /* times sending paused because the controller had no buffer free */
+    uint32_t deduplicated;      /* values not sent because the bulb was known to show them already */
+    uint32_t reasserted;        /* unchanged values sent because the bulb had not confirmed them recently */
+    uint64_t airtime_saved_us;  /* radio time of the writes not sent */
+    uint64_t latency_total_us;  /* sum of the times from posting to sending, for the mean */
+    uint32_t latency_max_us;    /* longest time from posting to sending */
+};
+
+/**
+ * @brief Get the write queue counters
  */
-extern bool bluetooth_set_bulb_colour(const struct rgb_colour rgb);
+extern struct bluetooth_tx_stats bluetooth_get_tx_stats(void);
 
 /**
- * @brief Request a reading of the colour of the BLE smart bulb
+ * @brief Time from queueing a write to the stack reporting it sent
  */
-extern void bluetooth_request_bulb_state();
+struct bluetooth_write_latency
+{
+    uint32_t writes;
+    uint64_t total_us;
+    uint32_t max_us;
+};
+
+/**
+ * @brief Counters of the adaptive connection parameters
+ */
+struct bluetooth_conn_stats
+{
+    uint32_t requests[2];       /* parameter updates requested, fast then idle */
+    uint32_t rejected;          /* parameter updates refused by a bulb */
+    struct bluetooth_write_latency latency[2];  /* write latency with the fast then idle parameters */
+};
+
+/**
+ * @brief Get the connection parameter counters
+ */
+extern struct bluetooth_conn_stats bluetooth_get_conn_stats(void);
+
+/**
+ * @brief Counters of the bridge task, which runs all BLE event handling
+ */
+struct bluetooth_bridge_stats
+{
+    uint32_t events;            /* events handled */
+    uint32_t dropped;           /* timer and request events lost because the queue was full */
+    uint32_t stack_waits;       /* Bluedroid events which waited for room in the stack ring */
+    uint32_t stack_dropped;     /* Bluedroid events lost after waiting too long for room */
+    uint32_t max_depth;         /* most events waiting at once in the queue or the stack ring */
+    uint64_t latency_total_us;  /* time from posting to handling, summed over all events */
+    uint32_t latency_max_us;
+};
+
+/**
+ * @brief Get the bridge task counters
+ */
+extern struct bluetooth_bridge_stats bluetooth_get_bridge_stats(void);
+
+/**
+ * @brief Counters of how the bulb states are kept current
+ */
+struct bluetooth_state_stats
+{
+    uint32_t notifications;     /* state changes notified by bulbs */
+    uint32_t reads;             /* characteristic reads sent */
+    uint32_t reads_skipped;     /* state requests answered from notifications without a read */
+    uint32_t fresh_hits;        /* fresh state wanted and already known */
+    uint32_t fresh_misses;      /* fresh state wanted and read from the bulb in time */
+    uint32_t fresh_timeouts;    /* fresh state wanted but not read before the deadline */
+};
+
+/**
+ * @brief Counters of the lighting command pipeline
+ */
+struct bluetooth_command_stats
+{
+    uint32_t submitted;         /* commands posted to the bridge task */
+    uint32_t rejected;          /* commands lost because the bridge queue was full */
+    uint32_t writes_sent;       /* writes the controller has sent, without response so not known to have arrived */
+    uint32_t writes_confirmed;  /* writes a notification or read showed the bulb took, which update the bulb state */
+    uint32_t writes_failed;     /* writes which failed or were lost with their connection */
+    uint32_t reconciled;        /* writes of the desired state to a bulb found showing something else */
+};
+
+/**
+ * @brief Get the command pipeline counters
+ */
+extern struct bluetooth_command_stats bluetooth_get_command_stats(void);
+
+/**
+ * @brief Get the bulb state counters
+ */
+extern struct bluetooth_state_stats bluetooth_get_state_stats(void);
+
+/* RSSI of a bulb which is not connected or has not been measured yet */
+#define BLUETOOTH_RSSI_UNKNOWN -127
+
+/**
+ * @brief Quality of the link to one bulb
+ */
+struct bluetooth_link_quality
+{
+    int8_t rssi;                /* signal strength in dBm, BLUETOOTH_RSSI_UNKNOWN if not known */
+    uint8_t health;             /* 0 (not connected or failing) to 100, from the RSSI, failed writes and unanswered reads */
+};
+
+/**
+ * @brief Get the link quality of a bulb, which only changes in steps so cached replies stay valid
+ * @param bulb Index of the bulb
+ * @return Link quality as last sampled by the link monitor
+ */
+extern struct bluetooth_link_quality bluetooth_link_quality(const int bulb);
+
+/**
+ * @brief Counters of the link monitor
+ */
+struct bluetooth_link_stats
+{
+    uint32_t rssi_reads;        /* RSSI measurements read from the controller */
+    uint32_t probes;            /* reads sent to bulbs which had been quiet */
+    uint32_t missed_responses;  /* reads which went unanswered */
+    uint32_t early_drops;       /* links dropped by the monitor */
+    uint32_t timeout_drops;     /* links dropped by the controller's supervision timeout */
+    uint64_t detect_total_ms;   /* time from last hearing a bulb to dropping its link, summed over all drops */
+    uint32_t detect_max_ms;
+    uint32_t recoveries;        /* bulbs reconnected after a drop */
+    uint64_t recovery_total_ms; /* time from last hearing a bulb to it being ready again, summed over all recoveries */
+    uint32_t recovery_max_ms;
+};
 
 /**
- * @brief Turn off BLE smart bulb
+ * @brief Get the link monitor counters
  */
-extern bool bluetooth_turn_bulb_off();
+extern struct bluetooth_link_stats bluetooth_get_link_stats(void);
 
 /**
  * @brief Configure bluetooth on the ESP
@@ -0,0 +1,45 @@
+/**
+ * @file Timestamps of the boot phases, from power on to a controllable light
+ */
+
+/* system includes */
+#include <esp_log.h>
+#include <esp_timer.h>
+
+/* local includes */
+#include "boot_profile.h"
+
+static const char *log_tag = "boot";
+
+static const char * phase_names[BOOT_PHASE_COUNT] =
+{
+    [BOOT_PHASE_NVS_READY]              = "nvs_ready",
+    [BOOT_PHASE_WIFI_STARTED]           = "wifi_started",
+    [BOOT_PHASE_BLE_CONTROLLER_READY]   = "ble_controller_ready",
+    [BOOT_PHASE_BLE_SCAN_STARTED]       = "ble_scan_started",
+    [BOOT_PHASE_BULB_CONNECTED]         = "bulb_connected",
+    [BOOT_PHASE_IP_ACQUIRED]            = "ip_acquired",
+    [BOOT_PHASE_FIRST_REQUEST_SERVED]   = "first_request_served",
+};
+
+/* phases are marked from several tasks, but each slot is only ever written once */
+static int64_t phase_times[BOOT_PHASE_COUNT] = { [0 ... BOOT_PHASE_COUNT - 1] = -1 };
+
+void boot_profile_mark(const enum boot_phase phase)
+{
+    if (phase >= BOOT_PHASE_COUNT || phase_times[phase] >= 0) {
+        return;
+    }
+    phase_times[phase] = esp_timer_get_time();
+    ESP_LOGI(log_tag, "%s after %lld ms", phase_names[phase], phase_times[phase] / 1000);
+}
+
+int64_t boot_profile_get(const enum boot_phase phase)
+{
+    return phase < BOOT_PHASE_COUNT ? phase_times[phase] : -1;
+}
+
+const char * boot_profile_name(const enum boot_phase phase)
+{
+    return phase < BOOT_PHASE_COUNT ? phase_names[phase] : "unknown";
+}
@@ -0,0 +1,45 @@
+/**
+ * @file Timestamps of the boot phases, from power on to a controllable light
+ */
+
+#ifndef INTELLILIGHT_BOOT_PROFILE_H
+#define INTELLILIGHT_BOOT_PROFILE_H
+
+#include <stdint.h>
+
+/**
+ * @brief Boot phases, roughly in the order they are expected to complete
+ */
+enum boot_phase
+{
+    BOOT_PHASE_NVS_READY,
+    BOOT_PHASE_WIFI_STARTED,
+    BOOT_PHASE_BLE_CONTROLLER_READY,
+    BOOT_PHASE_BLE_SCAN_STARTED,
+    BOOT_PHASE_BULB_CONNECTED,
+    BOOT_PHASE_IP_ACQUIRED,
+    BOOT_PHASE_FIRST_REQUEST_SERVED,
+    BOOT_PHASE_COUNT
+};
+
+/**
+ * @brief Record that a boot phase has completed (only the first call for each phase counts)
+ * @param phase Phase which has completed
+ */
+extern void boot_profile_mark(const enum boot_phase phase);
+
+/**
+ * @brief Get the time a boot phase completed
+ * @param phase Phase to look up
+ * @return Time since boot in microseconds, or -1 if the phase has not completed yet
+ */
+extern int64_t boot_profile_get(const enum boot_phase phase);
+
+/**
+ * @brief Get the name of a boot phase
+ * @param phase Phase to look up
+ * @return Short name suitable for logs and JSON keys
+ */
+extern const char * boot_profile_name(const enum boot_phase phase);
+
+#endif
@@ -47,7 +47,7 @@ struct rgb_colour colours_hsv_to_rgb(struct hsv_colour hsv)
     struct rgb_colour rgb = {};
     
     double C = (hsv.v / 100) * (hsv.s / 100);
-    double X = C * (1 - abs(fmod((hsv.h / 60), 2) - 1));
+    double X = C * (1 - fabs(fmod((hsv.h / 60), 2) - 1));
     double m = (hsv.v / 100) - C;
 
     double r, g, b;
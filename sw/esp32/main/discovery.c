@@ -0,0 +1,173 @@
+/**
+ * @file Protection against bursts of UDP discovery traffic
+ *
+ * Hubs and apps broadcast get_sysinfo to port 9999, often several at once and
+ * with retries. Every source gets a token bucket and repeats of the same
+ * request inside the dedupe window of the last one answered are dropped before
+ * the request is parsed or any reply is built, so a storm costs a string search
+ * and a hash per datagram. Only MAX_SOURCES senders are tracked and a recycled
+ * slot starts with a full bucket, so a shared bucket across all senders bounds
+ * a storm spread over more addresses than that. Requests which change or ask
+ * for anything else are always answered. Only the network task admits
+ * requests, the counters are also read by the request handlers so they are
+ * kept under a lock.
+ */
+
+/* system includes */
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "freertos/FreeRTOS.h"
+
+/* local includes */
+#include "discovery.h"
+
+static const char *log_tag = "discovery";
+
+#define MAX_SOURCES         8
+#define DEDUPE_WINDOW_US    (CONFIG_DISCOVERY_DEDUPE_WINDOW_MS * 1000LL)
+#define TOKENS_PER_US       (CONFIG_DISCOVERY_RATE_PER_SECOND / 1000000.0f)
+#define BUCKET_SIZE         ((float)CONFIG_DISCOVERY_BURST)
+#define TOTAL_TOKENS_PER_US (CONFIG_DISCOVERY_TOTAL_RATE_PER_SECOND / 1000000.0f)
+#define TOTAL_BUCKET_SIZE   ((float)CONFIG_DISCOVERY_TOTAL_BURST)
+
+/**
+ * @brief State kept for each recent sender
+ */
+struct discovery_source
+{
+    uint32_t ip;
+    float tokens;
+    int64_t last_refill;
+    uint32_t last_hash;         /* request last answered */
+    int64_t last_admitted;
+    int64_t last_request;       /* any request, to find the sender quiet the longest */
+    bool admitted_once;
+    bool in_use;
+};
+
+static struct discovery_source sources[MAX_SOURCES];
+
+/* shared by every sender, filled on first use */
+static float total_tokens = TOTAL_BUCKET_SIZE;
+static int64_t total_last_refill = 0;
+
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct discovery_stats stats;
+
+static uint32_t discovery_hash(const char * data, const int len)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static struct discovery_source * discovery_find_source(const uint32_t ip, const int64_t now)
+{
+    struct discovery_source * oldest = &sources[0];
+    for (int i = 0; i < MAX_SOURCES; i++) {
+        if (sources[i].in_use && sources[i].ip == ip) {
+            return &sources[i];
+        }
+        if (!sources[i].in_use || (oldest->in_use && sources[i].last_request < oldest->last_request)) {
+            oldest = &sources[i];
+        }
+    }
+
+    /* new sender, reuse a free slot or the one which has been quiet the longest */
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->ip = ip;
+    oldest->tokens = BUCKET_SIZE;
+    oldest->last_refill = now;
+    oldest->in_use = true;
+    return oldest;
+}
+
+/**
+ * @brief Check whether a request asks for get_sysinfo without changing the bulbs, as discovery storms do
+ * Only the raw text is searched, a request which merely mentions get_sysinfo is held to the same limits.
+ */
+static bool discovery_is_sysinfo(const char * request)
+{
+    return strstr(request, "\"get_sysinfo\"") != NULL
+        && strstr(request, "\"smartlife.iot.smartbulb.lightingservice\"") == NULL;
+}
+
+/**
+ * @brief Add the tokens earned since the last refill, up to the size of the bucket
+ */
+static void discovery_refill(float * tokens, int64_t * last_refill, const float per_us, const float size,
+    const int64_t now)
+{
+    *tokens += (now - *last_refill) * per_us;
+    if (*tokens > size) {
+        *tokens = size;
+    }
+    *last_refill = now;
+}
+
+bool discovery_admit(const uint32_t source_ip, const char * request, const int request_len)
+{
+    if (!discovery_is_sysinfo(request)) {
+        portENTER_CRITICAL(&stats_lock);
+        stats.passed++;
+        portEXIT_CRITICAL(&stats_lock);
+        return true;
+    }
+
+    const int64_t now = esp_timer_get_time();
+    const uint32_t hash = discovery_hash(request, request_len);
+    struct discovery_source * source = discovery_find_source(source_ip, now);
+    source->last_request = now;
+
+    /* collapse repeats of the request last answered, a sender polling faster than the window is still answered once per window */
+    if (source->admitted_once && source->last_hash == hash && now - source->last_admitted < DEDUPE_WINDOW_US) {
+        portENTER_CRITICAL(&stats_lock);
+        stats.duplicates++;
+        portEXIT_CRITICAL(&stats_lock);
+        ESP_LOGD(log_tag, "Dropping duplicate request");
+        return false;
+    }
+
+    discovery_refill(&source->tokens, &source->last_refill, TOKENS_PER_US, BUCKET_SIZE, now);
+    if (source->tokens < 1.0f) {
+        portENTER_CRITICAL(&stats_lock);
+        stats.rate_limited++;
+        portEXIT_CRITICAL(&stats_lock);
+        ESP_LOGD(log_tag, "Rate limiting request");
+        return false;
+    }
+
+    /* the backstop for storms from more senders than there are slots */
+    if (total_last_refill == 0) {
+        total_last_refill = now;
+    }
+    discovery_refill(&total_tokens, &total_last_refill, TOTAL_TOKENS_PER_US, TOTAL_BUCKET_SIZE, now);
+    if (total_tokens < 1.0f) {
+        portENTER_CRITICAL(&stats_lock);
+        stats.total_limited++;
+        portEXIT_CRITICAL(&stats_lock);
+        ESP_LOGD(log_tag, "Rate limiting request, all senders over the limit");
+        return false;
+    }
+    source->tokens -= 1.0f;
+    total_tokens -= 1.0f;
+    source->last_hash = hash;
+    source->last_admitted = now;
+    source->admitted_once = true;
+    portENTER_CRITICAL(&stats_lock);
+    stats.admitted++;
+    portEXIT_CRITICAL(&stats_lock);
+    return true;
+}
+
+struct discovery_stats discovery_get_stats(void)
+{
+    portENTER_CRITICAL(&stats_lock);
+    const struct discovery_stats copy = stats;
+    portEXIT_CRITICAL(&stats_lock);
+    return copy;
+}
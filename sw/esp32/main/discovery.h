@@ -0,0 +1,40 @@
+/**
+ * @file Protection against bursts of UDP discovery traffic
+ */
+
+#ifndef INTELLILIGHT_DISCOVERY_H
+#define INTELLILIGHT_DISCOVERY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Counters of UDP requests seen by the discovery filter
+ */
+struct discovery_stats
+{
+    uint32_t admitted;      /* get_sysinfo requests answered */
+    uint32_t duplicates;    /* get_sysinfo requests dropped as repeats */
+    uint32_t rate_limited;  /* get_sysinfo requests dropped by the sender's rate limit */
+    uint32_t total_limited; /* get_sysinfo requests dropped by the rate limit shared by all senders */
+    uint32_t passed;        /* other requests, which are never filtered */
+};
+
+/**
+ * @brief Decide whether a UDP request should be answered
+ * Only requests for get_sysinfo are filtered: identical ones from the same source within the
+ * dedupe window are collapsed, each source is limited by a token bucket and all of them together
+ * by another. This runs before the request is parsed, so dropped requests are never parsed.
+ * @param source_ip IPv4 address of the sender (network byte order)
+ * @param request Decrypted, null terminated JSON request
+ * @param request_len Length of request
+ * @return true to process and answer the request, false to drop it silently
+ */
+extern bool discovery_admit(const uint32_t source_ip, const char * request, const int request_len);
+
+/**
+ * @brief Get the discovery filter counters
+ */
+extern struct discovery_stats discovery_get_stats(void);
+
+#endif
@@ -0,0 +1,116 @@
+/**
+ * @file Compact binary UDP protocol for controlling the bulbs without the Kasa JSON overhead
+ *
+ * Requests feed the same command path as Kasa lighting commands, so both
+ * protocols see the same bulb state. The caller must serialise this with the
+ * Kasa request handler.
+ */
+
+/* system includes */
+#include <string.h>
+#include <esp_log.h>
+
+/* local includes */
+#include "bluetooth.h"
+#include "colours.h"
+#include "fast_control.h"
+
+static const char *log_tag = "fast-control";
+
+static const uint8_t magic[2] = { 'I', 'L' };
+
+static uint16_t get_u16(const uint8_t * data)
+{
+    return (data[0] << 8) | data[1];
+}
+
+static void put_u16(uint8_t * data, const uint16_t value)
+{
+    data[0] = value >> 8;
+    data[1] = value & 0xFF;
+}
+
+static void build_reply(uint8_t * reply, const uint8_t * request, const int request_len,
+    const enum fast_control_status status, const int bulb)
+{
+    memset(reply, 0, FAST_CONTROL_REPLY_LEN);
+    memcpy(&reply[0], magic, sizeof(magic));
+    reply[2] = FAST_CONTROL_VERSION;
+    reply[3] = status;
+    /* a short request only has its fields echoed as far as it goes, the rest of the ack is left 0 */
+    if (request_len >= 6) {
+        memcpy(&reply[4], &request[4], 2);     /* sequence number */
+    }
+    if (request_len >= 7) {
+        reply[6] = request[6];
+    }
+
+    if (bulb >= 0 && bulb < bluetooth_bulb_count()) {
+        const struct light_state state = bluetooth_desired_state(bulb);
+        reply[7] = state.on_off;
+        put_u16(&reply[8], (uint16_t)state.colour.h);
+        reply[10] = (uint8_t)state.colour.s;
+        reply[11] = (uint8_t)state.colour.v;
+    }
+}
+
+int fast_control_process(const uint8_t * request, const int request_len, uint8_t * reply)
+{
+    /* anything without the magic is not for us and gets no answer, so it cannot be used to reflect traffic */
+    if (request_len < (int)sizeof(magic) || memcmp(request, magic, sizeof(magic)) != 0) {
+        return 0;
+    }
+    if (request_len != FAST_CONTROL_REQUEST_LEN || request[2] != FAST_CONTROL_VERSION) {
+        ESP_LOGW(log_tag, "Malformed request (%d bytes)", request_len);
+        build_reply(reply, request, request_len, FAST_CONTROL_BAD_REQUEST, -1);
+        return FAST_CONTROL_REPLY_LEN;
+    }
+
+    const uint8_t flags = request[3];
+    const int bulb_count = bluetooth_bulb_count();
+    const bool all_bulbs = request[6] == FAST_CONTROL_ALL_BULBS;
+    const int first = all_bulbs ? 0 : request[6];
+    const int last = all_bulbs ? bulb_count - 1 : request[6];
+    if (first >= bulb_count) {
+        build_reply(reply, request, request_len, FAST_CONTROL_UNKNOWN_BULB, -1);
+        return FAST_CONTROL_REPLY_LEN;
+    }
+
+    if (flags & FAST_CONTROL_FLAG_QUERY) {
+        build_reply(reply, request, request_len, FAST_CONTROL_OK, first);
+        return FAST_CONTROL_REPLY_LEN;
+    }
+
+    struct hsv_colour colour;
+    if (flags & FAST_CONTROL_FLAG_RGB) {
+        const struct rgb_colour rgb = { .r = request[8], .g = request[9], .b = request[10] };
+        colour = colours_rgb_to_hsv(rgb);
+    } else {
+        colour.h = get_u16(&request[8]) % 360;
+        colour.s = request[10] > 100 ? 100 : request[10];
+        colour.v = request[11] > 100 ? 100 : request[11];
+    }
+    const bool on_off = !(flags & FAST_CONTROL_FLAG_OFF);
+
+    const uint16_t period_ms = get_u16(&request[12]);
+    enum fast_control_status status = FAST_CONTROL_OK;
+    for (int bulb = first; bulb <= last; bulb++) {
+        /* turning off keeps the last colour for when the bulb is turned back on */
+        const struct bulb_command command = {
+            .bulb = bulb,
+            .colour = on_off ? colour : bluetooth_desired_state(bulb).colour,
+            .on_off = on_off,
+            .period_ms = period_ms,
+            .force = (flags & FAST_CONTROL_FLAG_FORCE) != 0,
+        };
+        /* a bulb which is not connected is still sent the command, so it takes the colour once it is back */
+        if (!bluetooth_send_command(&command)) {
+            status = FAST_CONTROL_BUSY;
+        } else if (!bluetooth_bulb_connected(bulb) && status == FAST_CONTROL_OK) {
+            status = FAST_CONTROL_NOT_CONNECTED;
+        }
+    }
+
+    build_reply(reply, request, request_len, status, first);
+    return FAST_CONTROL_REPLY_LEN;
+}
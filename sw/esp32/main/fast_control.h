@@ -0,0 +1,62 @@
+/**
+ * @file Compact binary UDP protocol for controlling the bulbs without the Kasa JSON overhead
+ *
+ * All multi-byte fields are big endian. A request is FAST_CONTROL_REQUEST_LEN bytes:
+ *
+ *   0  magic 'I'            8  hue (0-359, HSV) or red (RGB), 2 bytes in HSV
+ *   1  magic 'L'            9  green (RGB)
+ *   2  protocol version     10 saturation (0-100, HSV) or blue (RGB)
+ *   3  flags                11 brightness (0-100, HSV), unused in RGB
+ *   4  sequence number      12 transition time in milliseconds, 0 for immediate
+ *   6  bulb index (0xFF for all bulbs)
+ *   7  reserved (0)
+ *
+ * Every request is answered with a FAST_CONTROL_REPLY_LEN byte ack:
+ *
+ *   0  magic 'I'            6  bulb index
+ *   1  magic 'L'            7  on/off
+ *   2  protocol version     8  hue (0-359)
+ *   3  status               10 saturation (0-100)
+ *   4  sequence number      11 brightness (0-100)
+ */
+
+#ifndef INTELLILIGHT_FAST_CONTROL_H
+#define INTELLILIGHT_FAST_CONTROL_H
+
+#include <stdint.h>
+
+#define FAST_CONTROL_VERSION     1
+#define FAST_CONTROL_REQUEST_LEN 14
+#define FAST_CONTROL_REPLY_LEN   12
+
+/* request flags */
+#define FAST_CONTROL_FLAG_RGB    0x01   /* colour is RGB rather than HSV */
+#define FAST_CONTROL_FLAG_OFF    0x02   /* turn the bulb off, the colour is kept for the next on */
+#define FAST_CONTROL_FLAG_QUERY  0x04   /* change nothing, only report the state */
+#define FAST_CONTROL_FLAG_FORCE  0x08   /* write the bulb even if it is known to show the colour already */
+
+/* bulb index addressing every bulb, the ack then reports the first one */
+#define FAST_CONTROL_ALL_BULBS   0xFF
+
+/**
+ * @brief Status returned in the ack
+ */
+enum fast_control_status
+{
+    FAST_CONTROL_OK = 0,
+    FAST_CONTROL_BAD_REQUEST = 1,
+    FAST_CONTROL_UNKNOWN_BULB = 2,
+    FAST_CONTROL_NOT_CONNECTED = 3,     /* applied, the bulb takes it once it reconnects */
+    FAST_CONTROL_BUSY = 4,              /* the bridge queue was full, the command should be sent again */
+};
+
+/**
+ * @brief Apply a fast control request and build its ack
+ * @param request Received datagram
+ * @param request_len Length of the received datagram
+ * @param reply Buffer of at least FAST_CONTROL_REPLY_LEN bytes for the ack
+ * @return Length of the ack, or 0 if the datagram is not a fast control request and should be ignored
+ */
+extern int fast_control_process(const uint8_t * request, const int request_len, uint8_t * reply);
+
+#endif
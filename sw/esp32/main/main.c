@@ -8,28 +8,73 @@
 #include <string.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/event_groups.h>
 
 /* ESP-IDF includes */
 #include "esp_log.h"
 #include "esp_sleep.h"
+#include "nvs_flash.h"
 #include "driver/i2c.h"
 #include "driver/rtc_io.h"
 
 /* local includes */
 #include "bluetooth.h"
+#include "boot_profile.h"
 #include "wifi.h"
 
+static const char *log_tag = "main";
+
+/* subsystems signal here when their bring-up has finished */
+#define WIFI_READY_BIT      BIT0
+#define BLUETOOTH_READY_BIT BIT1
+
+static EventGroupHandle_t boot_events = NULL;
+
+/* in pairing mode, the ESP32 is configured as an access point */
+/* otherwise connect the ESP32 to an access point */
+static bool bulb_needs_pairing = false;
+
+static esp_err_t configure_nvs_flash(void)
+{
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    
+    return ret;
+}
+
+static void wifi_start_task(void *pvParameters)
+{
+    wifi_setup(bulb_needs_pairing);
+    xEventGroupSetBits(boot_events, WIFI_READY_BIT);
+    vTaskDelete(NULL);
+}
+
+static void bluetooth_start_task(void *pvParameters)
+{
+    /* start bluetooth and connect to BLE smartbulb */
+    bluetooth_start();
+    xEventGroupSetBits(boot_events, BLUETOOTH_READY_BIT);
+    vTaskDelete(NULL);
+}
 
 /**
  * @brief Application main entry point
  */
 void app_main(void)
 {
-    /* in pairing mode, the ESP32 is configured as an access point */
-    /* otherwise connect the ESP32 to an access point */
-    bool bulb_needs_pairing = false;
-    wifi_setup(bulb_needs_pairing);
+    /* NVS is shared by the Wi-Fi driver, the PHY calibration data and Bluedroid, so it comes first */
+    ESP_ERROR_CHECK(configure_nvs_flash());
+    boot_profile_mark(BOOT_PHASE_NVS_READY);
 
-    /* start bluetooth and connect to BLE smartbulb */
-    bluetooth_start();
+    /* Wi-Fi and BLE do not depend on each other, so the slow controller and driver */
+    /* initialisation of each runs in parallel instead of one after the other */
+    boot_events = xEventGroupCreate();
+    xTaskCreate(wifi_start_task, "wifi_start", 4096, NULL, 5, NULL);
+    xTaskCreate(bluetooth_start_task, "ble_start", 4096, NULL, 5, NULL);
+
+    xEventGroupWaitBits(boot_events, WIFI_READY_BIT | BLUETOOTH_READY_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+    ESP_LOGI(log_tag, "Subsystems started");
 }
@@ -0,0 +1,25 @@
+/**
+ * @file Network server for TP-Link Kasa traffic
+ */
+
+#ifndef INTELLILIGHT_NETWORK_H
+#define INTELLILIGHT_NETWORK_H
+
+#include <stdbool.h>
+
+/**
+ * @brief Create the network tasks, which then serve port 9999 whenever the link is up
+ */
+extern void network_init(void);
+
+/**
+ * @brief Tell the network tasks that an IP link is available (or has changed)
+ */
+extern void network_link_up(void);
+
+/**
+ * @brief Tell the network tasks to close their sockets until the link returns
+ */
+extern void network_link_down(void);
+
+#endif
@@ -0,0 +1,365 @@
+/**
+ * @file Network transport for TP-Link Kasa traffic using the lwIP netconn API
+ *
+ * Requests are decrypted straight out of the received pbuf chain and constant
+ * replies are sent by reference (NETCONN_NOCOPY) from their pre-encrypted
+ * buffers. The optional fast control protocol is served from the same task. Readiness is signalled by the netconn callback, which queues the
+ * connection for the single network task. The supervisor wakes the task with a
+ * NULL entry when the link changes.
+ */
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_NETWORK_TRANSPORT_NETCONN
+
+/* system includes */
+#include <string.h>
+#include "lwip/api.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+
+/* local includes */
+#include "discovery.h"
+#include "fast_control.h"
+#include "network_transport.h"
+#include "tplink_kasa.h"
+
+/* constants */
+static const char *log_tag = "network";
+static const uint16_t port = NETWORK_PORT;
+
+#define MAX_TCP_CLIENTS CONFIG_NETWORK_TCP_CLIENTS
+/* buffers hold the longest reply (get_sysinfo with every bulb) whatever size is configured */
+#define BUFFER_LEN      (CONFIG_NETWORK_TCP_BUFFER_SIZE > TPLINK_KASA_REPLY_MAX_LEN ? CONFIG_NETWORK_TCP_BUFFER_SIZE : TPLINK_KASA_REPLY_MAX_LEN)
+#define EVENT_QUEUE_LEN 32
+
+/* time to wait before retrying if the connections cannot be created */
+#define RETRY_DELAY_MS 1000
+
+/* handle to network task */
+TaskHandle_t handle_network = NULL;
+
+/* connections with data (or a pending accept) waiting, a NULL entry wakes the task */
+static QueueHandle_t event_queue = NULL;
+
+static struct netconn * udp_conn = NULL;
+static struct netconn * tcp_conn = NULL;
+static struct netconn * fast_conn = NULL;
+static struct netconn * clients[MAX_TCP_CLIENTS];
+
+/* decrypted request and generated reply */
+static char * json_buffer = NULL;
+static char * reply_buffer = NULL;
+
+static void netconn_event(struct netconn * conn, enum netconn_evt evt, u16_t len)
+{
+    /* runs in the lwIP thread, so only note which connection needs attention */
+    if (evt == NETCONN_EVT_RCVPLUS && event_queue != NULL) {
+        xQueueSend(event_queue, &conn, 0);
+    }
+}
+
+static struct netconn * open_conn(const enum netconn_type type, const uint16_t bind_port)
+{
+    struct netconn * conn = netconn_new_with_callback(type, netconn_event);
+    if (conn == NULL) {
+        ESP_LOGE(log_tag, "Unable to create netconn");
+        return NULL;
+    }
+
+    if (netconn_bind(conn, IP_ADDR_ANY, bind_port) != ERR_OK) {
+        ESP_LOGE(log_tag, "Netconn unable to bind");
+        netconn_delete(conn);
+        return NULL;
+    }
+
+    if (type == NETCONN_TCP) {
+        if (netconn_listen_with_backlog(conn, CONFIG_NETWORK_TCP_BACKLOG) != ERR_OK) {
+            ESP_LOGE(log_tag, "Error listening on TCP netconn");
+            netconn_delete(conn);
+            return NULL;
+        }
+        /* accept is only called once the callback reports a pending connection */
+        netconn_set_nonblocking(conn, 1);
+    }
+
+    ESP_LOGI(log_tag, "Netconn bound, port %d/%s", bind_port, type == NETCONN_TCP ? "TCP" : "UDP");
+    return conn;
+}
+
+/**
+ * @brief Decrypt a received pbuf chain into json_buffer without copying it first
+ * @return Length of the decrypted JSON string
+ */
+static int decrypt_pbuf_chain(const struct pbuf * p, const bool include_header)
+{
+    char key = TPLINK_KASA_CIPHER_KEY;
+    int skip = include_header ? TPLINK_KASA_HEADER_LEN : 0;
+    int json_len = 0;
+
+    for (const struct pbuf * q = p; q != NULL && json_len < BUFFER_LEN - 1; q = q->next) {
+        const char * data = (const char *)q->payload;
+        int len = q->len;
+
+        /* the header may be split across pbufs */
+        const int header_bytes = skip < len ? skip : len;
+        skip -= header_bytes;
+        data += header_bytes;
+        len -= header_bytes;
+
+        if (len > BUFFER_LEN - 1 - json_len) {
+            len = BUFFER_LEN - 1 - json_len;
+        }
+        tplink_kasa_decrypt_fragment(data, len, json_buffer + json_len, &key);
+        json_len += len;
+    }
+
+    json_buffer[json_len] = '\0';
+    return json_len;
+}
+
+/**
+ * @brief Generate the reply to the request in json_buffer, waiting for fresh bulb states first if it needs them
+ * This transport serves everything from one task, so the wait (at most DISCOVERY_STATE_WAIT_MS) holds up
+ * other requests; the sockets transport hands such requests to its handler pool instead.
+ */
+static int process_request(const char ** reply, const bool include_header)
+{
+    if (tplink_kasa_wants_fresh_state(json_buffer)) {
+        tplink_kasa_wait_fresh_state();
+    }
+    return tplink_kasa_process_request(json_buffer, reply_buffer, BUFFER_LEN, reply, include_header);
+}
+
+static void handle_udp(void)
+{
+    struct netbuf * rx_buf;
+
+    /* one callback may stand for several datagrams, so drain them all */
+    while (netconn_recv_udp_raw_netbuf_flags(udp_conn, &rx_buf, NETCONN_DONTBLOCK) == ERR_OK) {
+        const int json_len = decrypt_pbuf_chain(rx_buf->p, false);
+        const ip_addr_t source_addr = *netbuf_fromaddr(rx_buf);
+        const u16_t source_port = netbuf_fromport(rx_buf);
+        netbuf_delete(rx_buf);
+
+        /* collapse discovery storms before parsing anything */
+        if (IP_IS_V4(&source_addr) && !discovery_admit(ip4_addr_get_u32(ip_2_ip4(&source_addr)), json_buffer, json_len)) {
+            continue;
+        }
+
+        const char * reply = reply_buffer;
+        const int reply_len = process_request(&reply, false);
+        ESP_LOGI(log_tag, "Replying with %d bytes", reply_len);
+        if (reply_len <= 0) {
+            continue;
+        }
+
+        /* the datagram references the reply rather than copying it into a new pbuf */
+        struct netbuf * tx_buf = netbuf_new();
+        if (tx_buf == NULL) {
+            ESP_LOGE(log_tag, "No memory for UDP reply");
+            continue;
+        }
+        if (netbuf_ref(tx_buf, reply, reply_len) != ERR_OK
+            || netconn_sendto(udp_conn, tx_buf, &source_addr, source_port) != ERR_OK) {
+            ESP_LOGE(log_tag, "Error occurred during UDP send");
+        } else {
+            network_request_served();
+        }
+        netbuf_delete(tx_buf);
+    }
+}
+
+static void handle_fast_control(void)
+{
+    struct netbuf * rx_buf;
+    /* one spare byte so oversized requests are seen as such rather than truncated */
+    uint8_t request[FAST_CONTROL_REQUEST_LEN + 1];
+    uint8_t reply[FAST_CONTROL_REPLY_LEN];
+
+    while (netconn_recv_udp_raw_netbuf_flags(fast_conn, &rx_buf, NETCONN_DONTBLOCK) == ERR_OK) {
+        const int rx_len = netbuf_copy(rx_buf, request, sizeof(request));
+        const ip_addr_t source_addr = *netbuf_fromaddr(rx_buf);
+        const u16_t source_port = netbuf_fromport(rx_buf);
+        netbuf_delete(rx_buf);
+
+        const int reply_len = fast_control_process(request, rx_len, reply);
+        if (reply_len == 0) {
+            continue;
+        }
+
+        /* the ack is tiny, so it is copied rather than referenced from the stack */
+        struct netbuf * tx_buf = netbuf_new();
+        void * tx_data = tx_buf != NULL ? netbuf_alloc(tx_buf, reply_len) : NULL;
+        if (tx_data == NULL) {
+            ESP_LOGE(log_tag, "No memory for fast control reply");
+            if (tx_buf != NULL) netbuf_delete(tx_buf);
+            continue;
+        }
+        memcpy(tx_data, reply, reply_len);
+        if (netconn_sendto(fast_conn, tx_buf, &source_addr, source_port) != ERR_OK) {
+            ESP_LOGE(log_tag, "Error occurred during fast control send");
+        } else {
+            network_request_served();
+        }
+        netbuf_delete(tx_buf);
+    }
+}
+
+static void close_client(const int slot)
+{
+    netconn_close(clients[slot]);
+    netconn_delete(clients[slot]);
+    clients[slot] = NULL;
+}
+
+/**
+ * @brief Serve one request on a TCP connection and then close it
+ */
+static void handle_tcp(const int slot)
+{
+    struct pbuf * p;
+    const err_t err = netconn_recv_tcp_pbuf_flags(clients[slot], &p, NETCONN_DONTBLOCK);
+    if (err == ERR_WOULDBLOCK) {
+        /* nothing received yet, wait for the next callback */
+        return;
+    }
+
+    if (err != ERR_OK) {
+        ESP_LOGI(log_tag, "Connection closed");
+    } else {
+        decrypt_pbuf_chain(p, true);
+        pbuf_free(p);
+
+        /* constant replies live for the program lifetime so they can be sent by reference */
+        const char * reply = reply_buffer;
+        const int reply_len = process_request(&reply, true);
+        ESP_LOGI(log_tag, "Replying with %d bytes", reply_len);
+        if (reply_len > 0) {
+            const u8_t flags = reply == reply_buffer ? NETCONN_COPY : NETCONN_NOCOPY;
+            if (netconn_write(clients[slot], reply, reply_len, flags) != ERR_OK) {
+                ESP_LOGE(log_tag, "Error occurred during TCP send");
+            } else {
+                network_request_served();
+            }
+        }
+    }
+
+    close_client(slot);
+}
+
+static void handle_accept(void)
+{
+    struct netconn * connection;
+    while (netconn_accept(tcp_conn, &connection) == ERR_OK) {
+        int slot = 0;
+        while (slot < MAX_TCP_CLIENTS && clients[slot] != NULL) {
+            slot++;
+        }
+        if (slot == MAX_TCP_CLIENTS) {
+            ESP_LOGW(log_tag, "Too many TCP clients, dropping connection");
+            netconn_close(connection);
+            netconn_delete(connection);
+            continue;
+        }
+        clients[slot] = connection;
+
+        /* the request may have arrived before the connection was accepted */
+        handle_tcp(slot);
+    }
+}
+
+/**
+ * @brief Serve the bound connections until the supervisor reports a link change
+ */
+static void serve(void)
+{
+    while (!network_link_changed())
+    {
+        struct netconn * conn;
+        if (xQueueReceive(event_queue, &conn, portMAX_DELAY) != pdTRUE || conn == NULL) {
+            continue;
+        }
+
+        /* events for connections which have already been closed are ignored */
+        if (conn == udp_conn) {
+            handle_udp();
+        } else if (conn == fast_conn && conn != NULL) {
+            handle_fast_control();
+        } else if (conn == tcp_conn) {
+            handle_accept();
+        } else {
+            for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+                if (clients[i] == conn) {
+                    handle_tcp(i);
+                    break;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+        if (clients[i] != NULL) close_client(i);
+    }
+}
+
+static void network_task(void *pvParameters)
+{
+    for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+        clients[i] = NULL;
+    }
+
+    json_buffer = malloc(BUFFER_LEN * sizeof(char));
+    reply_buffer = malloc(BUFFER_LEN * sizeof(char));
+    if (json_buffer == NULL || reply_buffer == NULL) {
+        ESP_LOGE(log_tag, "Network task failed to start");
+        free(json_buffer);
+        free(reply_buffer);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    /* the task lives for ever, binding its connections each time the link comes up */
+    while (true)
+    {
+        network_wait_for_link();
+
+        udp_conn = open_conn(NETCONN_UDP, port);
+        tcp_conn = open_conn(NETCONN_TCP, port);
+#ifdef CONFIG_FAST_CONTROL
+        fast_conn = open_conn(NETCONN_UDP, CONFIG_FAST_CONTROL_PORT);
+#endif
+        if (udp_conn != NULL && tcp_conn != NULL) {
+            network_serving();
+            serve();
+            ESP_LOGI(log_tag, "Link changed, closing connections");
+        } else {
+            vTaskDelay(RETRY_DELAY_MS / portTICK_RATE_MS);
+        }
+
+        if (udp_conn != NULL) netconn_delete(udp_conn);
+        if (tcp_conn != NULL) netconn_delete(tcp_conn);
+        if (fast_conn != NULL) netconn_delete(fast_conn);
+        udp_conn = NULL;
+        tcp_conn = NULL;
+        fast_conn = NULL;
+    }
+}
+
+void network_transport_start(void)
+{
+    event_queue = xQueueCreate(EVENT_QUEUE_LEN, sizeof(struct netconn *));
+
+    /* serve TCP (control commands) and UDP (get_sysinfo discovery) on port 9999 from one task */
+    xTaskCreate(network_task, "network", 4096, NULL, 5, &handle_network);
+}
+
+void network_transport_wake(void)
+{
+    struct netconn * wake = NULL;
+    xQueueSend(event_queue, &wake, 0);
+}
+
+#endif
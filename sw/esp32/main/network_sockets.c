@@ -0,0 +1,554 @@
+/**
+ * @file Network transport for TP-Link Kasa traffic using BSD sockets
+ *
+ * A single task multiplexes the UDP socket, the TCP listener, the optional fast
+ * control socket and every accepted TCP connection using select(), so a request
+ * is handled as soon as it arrives. UDP requests are answered inline, except
+ * get_sysinfo requests which wait for fresh bulb states; those, and TCP
+ * connections which become readable, are handed to a bounded pool of handler
+ * tasks so one slow client cannot hold up the others. A loopback control
+ * socket lets the supervisor wake the task when the link changes. The UDP
+ * socket is closed on a link change while a handler may still be waiting for
+ * the bulbs, so handlers reply through it only under a lock and only if it is
+ * still the socket their request came in on.
+ */
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_NETWORK_TRANSPORT_SOCKETS
+
+/* system includes */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+/* local includes */
+#include "discovery.h"
+#include "fast_control.h"
+#include "network_transport.h"
+#include "tplink_kasa.h"
+
+/* constants */
+static const char *log_tag = "network";
+static const uint32_t port = NETWORK_PORT;
+
+#define MAX_TCP_CLIENTS CONFIG_NETWORK_TCP_CLIENTS
+/* buffers hold the longest reply (get_sysinfo with every bulb) whatever size is configured */
+#define TCP_BUFFER_LEN  (CONFIG_NETWORK_TCP_BUFFER_SIZE > TPLINK_KASA_REPLY_MAX_LEN ? CONFIG_NETWORK_TCP_BUFFER_SIZE : TPLINK_KASA_REPLY_MAX_LEN)
+#define UDP_BUFFER_LEN  (2000 > TPLINK_KASA_REPLY_MAX_LEN ? 2000 : TPLINK_KASA_REPLY_MAX_LEN)
+
+/* a client which sends nothing, or stalls mid-request, is dropped after this long so its slot or handler is freed */
+#define TCP_RECV_TIMEOUT_S 2
+
+/* time to wait before retrying if the sockets cannot be created */
+#define RETRY_DELAY_MS 1000
+
+/* handle to network task */
+TaskHandle_t handle_network = NULL;
+
+/**
+ * @brief Work for the handler pool
+ */
+struct network_job
+{
+    int sock;                           /* readable TCP connection, unused for UDP */
+    char * request;                     /* decrypted UDP request (freed by the handler), NULL for TCP */
+    uint32_t udp_generation;            /* UDP socket the request came in on, the reply is dropped if it is gone */
+    struct sockaddr_storage source_addr;
+    socklen_t addr_len;
+};
+
+/**
+ * @brief Accepted TCP connection waiting for its request
+ */
+struct tcp_client
+{
+    int sock;                           /* -1 when the slot is free */
+    TickType_t accepted;                /* closed if nothing arrives within TCP_RECV_TIMEOUT_S of this */
+};
+
+/* connections watched by the network task until they become readable */
+static struct tcp_client clients[MAX_TCP_CLIENTS];
+
+/* readable TCP connections and waiting UDP requests */
+static QueueHandle_t job_queue = NULL;
+
+/* the UDP socket handlers reply on, replaced with a new generation each time the link comes up */
+static SemaphoreHandle_t udp_lock = NULL;
+static int udp_reply_sock = -1;
+static uint32_t udp_generation = 0;
+
+/* serialises access to the Kasa and fast control request handlers (and the bulb state behind them) */
+static SemaphoreHandle_t kasa_lock = NULL;
+
+/* loopback socket used to wake the network task from select() */
+static int control_sock = -1;
+static struct sockaddr_in control_addr;
+
+/* TCP keep-alive settings for accepted connections */
+static const int keep_alive = 1;
+static const int keep_idle = 5;
+static const int keep_interval = 5;
+static const int keep_count = 3;
+
+static int create_socket(const int socket_type, const uint16_t bind_port)
+{
+    struct sockaddr_in dest_addr = {
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_family = AF_INET,
+        .sin_port = htons(bind_port),
+    };
+
+    int sock = socket(AF_INET, socket_type, IPPROTO_IP);
+    if (sock < 0) {
+        ESP_LOGE(log_tag, "Unable to create socket: errno %d", errno);
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    /* the listener must never block the loop if a client goes away between select and accept */
+    if (socket_type == SOCK_STREAM) {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    }
+
+    if (bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) != 0) {
+        ESP_LOGE(log_tag, "Socket unable to bind: errno %d", errno);
+        close(sock);
+        return -1;
+    }
+
+    if (socket_type == SOCK_STREAM && listen(sock, CONFIG_NETWORK_TCP_BACKLOG) != 0) {
+        ESP_LOGE(log_tag, "Error listening on TCP socket: errno %d", errno);
+        close(sock);
+        return -1;
+    }
+
+    ESP_LOGI(log_tag, "Socket bound, port %d/%s", bind_port, socket_type == SOCK_STREAM ? "TCP" : "UDP");
+    return sock;
+}
+
+static int create_control_socket(void)
+{
+    control_addr.sin_family = AF_INET;
+    control_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    control_addr.sin_port = 0;
+    socklen_t addr_len = sizeof(control_addr);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) {
+        ESP_LOGE(log_tag, "Unable to create control socket: errno %d", errno);
+        return -1;
+    }
+
+    /* bind to any free loopback port, then find out which one it was */
+    if (bind(sock, (struct sockaddr *)&control_addr, sizeof(control_addr)) != 0
+        || getsockname(sock, (struct sockaddr *)&control_addr, &addr_len) != 0) {
+        ESP_LOGE(log_tag, "Control socket unable to bind: errno %d", errno);
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    return sock;
+}
+
+static void log_source(const struct sockaddr_storage * source_addr, const bool is_tcp)
+{
+    char addr_str[16] = "";
+    if (source_addr->ss_family == PF_INET) {
+        inet_ntoa_r(((struct sockaddr_in *)source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
+    }
+    ESP_LOGI(log_tag, "Connection from %s:%d/%s", addr_str, port, is_tcp ? "TCP" : "UDP");
+}
+
+/**
+ * @brief Generate the reply to a decrypted request, waiting for fresh bulb states first if it needs them
+ * @param reply Set to the reply, either in buffer or a constant reply
+ */
+static int process_request(const char * json, char * buffer, const int buffer_size, const char ** reply, const bool include_header)
+{
+    /* the wait is not under the lock, so commands and fast control are not held up by it */
+    if (tplink_kasa_wants_fresh_state(json)) {
+        tplink_kasa_wait_fresh_state();
+    }
+    xSemaphoreTake(kasa_lock, portMAX_DELAY);
+    const int reply_len = tplink_kasa_process_request(json, buffer, buffer_size, reply, include_header);
+    xSemaphoreGive(kasa_lock);
+    return reply_len;
+}
+
+static void send_udp_reply(const int sock, const char * reply, const int reply_len,
+    const struct sockaddr_storage * source_addr, const socklen_t addr_len)
+{
+    ESP_LOGI(log_tag, "Replying with %d bytes", reply_len);
+    if (reply_len <= 0) {
+        return;
+    }
+    if (sendto(sock, reply, reply_len, 0, (const struct sockaddr *)source_addr, addr_len) < 0) {
+        ESP_LOGE(log_tag, "Error occurred during UDP send: errno %d", errno);
+    } else {
+        network_request_served();
+    }
+}
+
+static void handle_udp(const int sock, char * buffer, char * json_buffer)
+{
+    struct sockaddr_storage source_addr;
+    socklen_t addr_len = sizeof(source_addr);
+
+    const int rx_len = recvfrom(sock, buffer, UDP_BUFFER_LEN - 1, 0, (struct sockaddr *)&source_addr, &addr_len);
+    if (rx_len < 0) {
+        ESP_LOGE(log_tag, "Error occurred during UDP receive: errno %d", errno);
+        return;
+    }
+
+    /* the discovery filter sees the decrypted request, as it does on the netconn transport */
+    const int json_len = tplink_kasa_decrypt(buffer, rx_len, json_buffer, false);
+
+    /* collapse discovery storms before building any reply */
+    if (source_addr.ss_family == PF_INET) {
+        const uint32_t source_ip = ((struct sockaddr_in *)&source_addr)->sin_addr.s_addr;
+        if (!discovery_admit(source_ip, json_buffer, json_len)) {
+            return;
+        }
+    }
+    log_source(&source_addr, false);
+
+    /* a request which waits for the bulbs is answered by a handler, so this task keeps serving */
+    if (tplink_kasa_wants_fresh_state(json_buffer)) {
+        struct network_job job = {
+            .sock = -1,
+            .request = strdup(json_buffer),
+            .udp_generation = udp_generation,
+            .source_addr = source_addr,
+            .addr_len = addr_len,
+        };
+        if (job.request != NULL && xQueueSend(job_queue, &job, 0) == pdTRUE) {
+            return;
+        }
+        free(job.request);
+        ESP_LOGW(log_tag, "All handlers busy, answering with the last known state");
+    }
+
+    /* process the request and send a response back to the client */
+    const char * reply = buffer;
+    xSemaphoreTake(kasa_lock, portMAX_DELAY);
+    const int reply_len = tplink_kasa_process_request(json_buffer, buffer, UDP_BUFFER_LEN, &reply, false);
+    xSemaphoreGive(kasa_lock);
+    send_udp_reply(sock, reply, reply_len, &source_addr, addr_len);
+}
+
+static void handle_fast_control(const int sock)
+{
+    struct sockaddr_storage source_addr;
+    socklen_t addr_len = sizeof(source_addr);
+    /* one spare byte so oversized requests are seen as such rather than truncated */
+    uint8_t request[FAST_CONTROL_REQUEST_LEN + 1];
+    uint8_t reply[FAST_CONTROL_REPLY_LEN];
+
+    const int rx_len = recvfrom(sock, request, sizeof(request), 0, (struct sockaddr *)&source_addr, &addr_len);
+    if (rx_len < 0) {
+        ESP_LOGE(log_tag, "Error occurred during fast control receive: errno %d", errno);
+        return;
+    }
+
+    xSemaphoreTake(kasa_lock, portMAX_DELAY);
+    const int reply_len = fast_control_process(request, rx_len, reply);
+    xSemaphoreGive(kasa_lock);
+    if (reply_len == 0) {
+        return;
+    }
+
+    if (sendto(sock, reply, reply_len, 0, (struct sockaddr *)&source_addr, addr_len) < 0) {
+        ESP_LOGE(log_tag, "Error occurred during fast control send: errno %d", errno);
+    } else {
+        network_request_served();
+    }
+}
+
+static void handle_accept(const int listen_sock)
+{
+    struct sockaddr_storage source_addr;
+    socklen_t addr_len = sizeof(source_addr);
+
+    const int connection = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+    if (connection < 0) {
+        return;
+    }
+
+    /* find a free slot for the new client, otherwise make room by dropping the one which has waited longest */
+    const TickType_t now = xTaskGetTickCount();
+    int slot = 0;
+    for (int i = 0; i < MAX_TCP_CLIENTS && clients[slot].sock >= 0; i++) {
+        if (clients[i].sock < 0 || now - clients[i].accepted > now - clients[slot].accepted) {
+            slot = i;
+        }
+    }
+    if (clients[slot].sock >= 0) {
+        ESP_LOGW(log_tag, "Too many TCP clients, dropping the longest idle one");
+        close(clients[slot].sock);
+    }
+
+    /* client connection has been accepted, keep it alive */
+    struct timeval timeout = { .tv_sec = TCP_RECV_TIMEOUT_S, .tv_usec = 0 };
+    setsockopt(connection, SOL_SOCKET, SO_KEEPALIVE, &keep_alive, sizeof(int));
+    setsockopt(connection, IPPROTO_TCP, TCP_KEEPIDLE, &keep_idle, sizeof(int));
+    setsockopt(connection, IPPROTO_TCP, TCP_KEEPINTVL, &keep_interval, sizeof(int));
+    setsockopt(connection, IPPROTO_TCP, TCP_KEEPCNT, &keep_count, sizeof(int));
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    clients[slot].sock = connection;
+    clients[slot].accepted = now;
+    log_source(&source_addr, true);
+}
+
+/**
+ * @brief Close connections which have sent nothing within TCP_RECV_TIMEOUT_S of being accepted
+ * @return Ticks until the next connection is due to expire, portMAX_DELAY if none are waiting
+ */
+static TickType_t expire_clients(void)
+{
+    const TickType_t now = xTaskGetTickCount();
+    const TickType_t limit = pdMS_TO_TICKS(TCP_RECV_TIMEOUT_S * 1000);
+    TickType_t next = portMAX_DELAY;
+    for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+        if (clients[i].sock < 0) {
+            continue;
+        }
+        const TickType_t idle = now - clients[i].accepted;
+        if (idle >= limit) {
+            ESP_LOGW(log_tag, "TCP client sent nothing, closing connection");
+            close(clients[i].sock);
+            clients[i].sock = -1;
+        } else if (limit - idle < next) {
+            next = limit - idle;
+        }
+    }
+    return next;
+}
+
+/**
+ * @brief Serve one request on a readable TCP connection and then close it
+ */
+static void handle_tcp(const int connection, char * buffer, char * json_buffer)
+{
+    const int rx_len = recv(connection, buffer, TCP_BUFFER_LEN - 1, 0);
+    if (rx_len < 0) {
+        ESP_LOGE(log_tag, "Error occurred during TCP receive: errno %d", errno);
+    } else if (rx_len == 0) {
+        ESP_LOGI(log_tag, "Connection closed");
+    } else {
+        /* process the request and send a response back to the client */
+        tplink_kasa_decrypt(buffer, rx_len, json_buffer, true);
+        const char * reply = buffer;
+        const int reply_len = process_request(json_buffer, buffer, TCP_BUFFER_LEN, &reply, true);
+        ESP_LOGI(log_tag, "Replying with %d bytes", reply_len);
+        int to_write = reply_len;
+        while (to_write > 0) {
+            const int written = send(connection, reply + (reply_len - to_write), to_write, 0);
+            if (written < 0) {
+                ESP_LOGE(log_tag, "Error occurred during TCP send: errno %d", errno);
+                break;
+            }
+            to_write -= written;
+        }
+        if (to_write == 0) {
+            network_request_served();
+        }
+        shutdown(connection, 0);
+    }
+
+    close(connection);
+}
+
+static void worker_task(void *pvParameters)
+{
+    /* each handler owns its buffers so requests can be served in parallel */
+    char * buffer = malloc(TCP_BUFFER_LEN * sizeof(char));
+    char * json_buffer = malloc(TCP_BUFFER_LEN * sizeof(char));
+    if (buffer == NULL || json_buffer == NULL) {
+        ESP_LOGE(log_tag, "No memory for handler buffers");
+        free(buffer);
+        free(json_buffer);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    while (true) {
+        struct network_job job;
+        if (xQueueReceive(job_queue, &job, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        if (job.request == NULL) {
+            handle_tcp(job.sock, buffer, json_buffer);
+        } else {
+            const char * reply = buffer;
+            const int reply_len = process_request(job.request, buffer, TCP_BUFFER_LEN, &reply, false);
+            /* the network task cannot close the socket, or bind a new one in its place, while this sends */
+            xSemaphoreTake(udp_lock, portMAX_DELAY);
+            if (job.udp_generation == udp_generation) {
+                send_udp_reply(udp_reply_sock, reply, reply_len, &job.source_addr, job.addr_len);
+            } else {
+                ESP_LOGW(log_tag, "Link changed while the request waited, dropping the reply");
+            }
+            xSemaphoreGive(udp_lock);
+            free(job.request);
+        }
+    }
+}
+
+/**
+ * @brief Serve the bound sockets until the supervisor reports a link change
+ */
+static void serve(const int udp_sock, const int tcp_sock, const int fast_sock, char * buffer, char * json_buffer)
+{
+    for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+        clients[i].sock = -1;
+    }
+
+    while (!network_link_changed())
+    {
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(control_sock, &read_fds);
+        FD_SET(udp_sock, &read_fds);
+        FD_SET(tcp_sock, &read_fds);
+        int max_fd = control_sock;
+        if (udp_sock > max_fd) max_fd = udp_sock;
+        if (tcp_sock > max_fd) max_fd = tcp_sock;
+        if (fast_sock >= 0) {
+            FD_SET(fast_sock, &read_fds);
+            if (fast_sock > max_fd) max_fd = fast_sock;
+        }
+        for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+            if (clients[i].sock >= 0) {
+                FD_SET(clients[i].sock, &read_fds);
+                if (clients[i].sock > max_fd) max_fd = clients[i].sock;
+            }
+        }
+
+        /* block until any socket is ready, the supervisor wakes us or an idle client is due to be dropped */
+        const TickType_t wait = expire_clients();
+        const uint32_t wait_ms = wait * portTICK_PERIOD_MS;
+        struct timeval timeout = { .tv_sec = wait_ms / 1000, .tv_usec = (wait_ms % 1000) * 1000 };
+        const int ready = select(max_fd + 1, &read_fds, NULL, NULL, wait == portMAX_DELAY ? NULL : &timeout);
+        if (ready < 0) {
+            ESP_LOGE(log_tag, "Error occurred during select: errno %d", errno);
+            break;
+        }
+
+        if (FD_ISSET(control_sock, &read_fds)) {
+            char wake;
+            while (recv(control_sock, &wake, sizeof(wake), 0) > 0) {
+            }
+        }
+        if (FD_ISSET(udp_sock, &read_fds)) {
+            handle_udp(udp_sock, buffer, json_buffer);
+        }
+        if (fast_sock >= 0 && FD_ISSET(fast_sock, &read_fds)) {
+            handle_fast_control(fast_sock);
+        }
+        /* hand readable connections to the handlers in the order they were accepted */
+        for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+            if (clients[i].sock >= 0 && FD_ISSET(clients[i].sock, &read_fds)) {
+                const struct network_job job = { .sock = clients[i].sock, .request = NULL };
+                if (xQueueSend(job_queue, &job, 0) != pdTRUE) {
+                    ESP_LOGW(log_tag, "All TCP handlers busy, dropping connection");
+                    close(clients[i].sock);
+                }
+                clients[i].sock = -1;
+            }
+        }
+        if (FD_ISSET(tcp_sock, &read_fds)) {
+            handle_accept(tcp_sock);
+        }
+    }
+
+    for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+        if (clients[i].sock >= 0) close(clients[i].sock);
+        clients[i].sock = -1;
+    }
+}
+
+static void network_task(void *pvParameters)
+{
+    /* UDP requests are mostly answered inline, TCP requests are served by the handler pool */
+    char * buffer = malloc(UDP_BUFFER_LEN * sizeof(char));
+    char * json_buffer = malloc(UDP_BUFFER_LEN * sizeof(char));
+    control_sock = create_control_socket();
+    if (buffer == NULL || json_buffer == NULL || control_sock < 0) {
+        ESP_LOGE(log_tag, "Network task failed to start");
+        free(buffer);
+        free(json_buffer);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    /* the task lives for ever, binding its sockets each time the link comes up */
+    while (true)
+    {
+        network_wait_for_link();
+
+        const int udp_sock = create_socket(SOCK_DGRAM, port);
+        const int tcp_sock = create_socket(SOCK_STREAM, port);
+#ifdef CONFIG_FAST_CONTROL
+        const int fast_sock = create_socket(SOCK_DGRAM, CONFIG_FAST_CONTROL_PORT);
+#else
+        const int fast_sock = -1;
+#endif
+        if (udp_sock >= 0 && tcp_sock >= 0) {
+            xSemaphoreTake(udp_lock, portMAX_DELAY);
+            udp_reply_sock = udp_sock;
+            xSemaphoreGive(udp_lock);
+            network_serving();
+            serve(udp_sock, tcp_sock, fast_sock, buffer, json_buffer);
+            ESP_LOGI(log_tag, "Link changed, closing sockets");
+        } else {
+            vTaskDelay(RETRY_DELAY_MS / portTICK_RATE_MS);
+        }
+
+        /* requests still waiting in the handlers came in on this socket, their replies are dropped */
+        xSemaphoreTake(udp_lock, portMAX_DELAY);
+        udp_generation++;
+        udp_reply_sock = -1;
+        if (udp_sock >= 0) close(udp_sock);
+        xSemaphoreGive(udp_lock);
+        if (tcp_sock >= 0) close(tcp_sock);
+        if (fast_sock >= 0) close(fast_sock);
+    }
+}
+
+void network_transport_start(void)
+{
+    kasa_lock = xSemaphoreCreateMutex();
+    udp_lock = xSemaphoreCreateMutex();
+    job_queue = xQueueCreate(CONFIG_NETWORK_JOB_QUEUE_LEN, sizeof(struct network_job));
+
+    /* the handler pool does not own any sockets, so it outlives reconnects too */
+    for (int i = 0; i < CONFIG_NETWORK_TCP_WORKERS; i++) {
+        char name[configMAX_TASK_NAME_LEN];
+        snprintf(name, sizeof(name), "tcp_worker%d", i);
+        xTaskCreate(worker_task, name, 4096, NULL, 5, NULL);
+    }
+
+    /* serve TCP (control commands) and UDP (get_sysinfo discovery) on port 9999 from one task */
+    xTaskCreate(network_task, "network", 4096, NULL, 5, &handle_network);
+}
+
+void network_transport_wake(void)
+{
+    const char wake = 0;
+    if (control_sock >= 0) {
+        sendto(control_sock, &wake, sizeof(wake), 0, (struct sockaddr *)&control_addr, sizeof(control_addr));
+    }
+}
+
+#endif
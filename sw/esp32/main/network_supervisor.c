@@ -0,0 +1,82 @@
+/**
+ * @file Supervisor keeping the network tasks alive across Wi-Fi reconnects
+ *
+ * The transport tasks are created once. Link changes reported by the Wi-Fi event
+ * handler are passed to them through an event group, and they close and rebind
+ * their sockets in response instead of being torn down and recreated.
+ */
+
+/* system includes */
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+/* local includes */
+#include "boot_profile.h"
+#include "network.h"
+#include "network_transport.h"
+
+static const char *log_tag = "network";
+
+#define LINK_UP_BIT      BIT0
+#define LINK_CHANGED_BIT BIT1
+
+static EventGroupHandle_t network_events = NULL;
+
+/* times of the most recent link changes, used to report how long serving took to resume */
+static int64_t link_down_time = 0;
+static int64_t link_up_time = 0;
+
+void network_init(void)
+{
+    if (network_events != NULL) {
+        return;
+    }
+    network_events = xEventGroupCreate();
+    network_transport_start();
+}
+
+void network_link_up(void)
+{
+    link_up_time = esp_timer_get_time();
+    xEventGroupSetBits(network_events, LINK_UP_BIT | LINK_CHANGED_BIT);
+    network_transport_wake();
+}
+
+void network_link_down(void)
+{
+    if (xEventGroupGetBits(network_events) & LINK_UP_BIT) {
+        link_down_time = esp_timer_get_time();
+    }
+    xEventGroupClearBits(network_events, LINK_UP_BIT);
+    xEventGroupSetBits(network_events, LINK_CHANGED_BIT);
+    network_transport_wake();
+}
+
+void network_wait_for_link(void)
+{
+    xEventGroupWaitBits(network_events, LINK_UP_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+    xEventGroupClearBits(network_events, LINK_CHANGED_BIT);
+}
+
+bool network_link_changed(void)
+{
+    return (xEventGroupGetBits(network_events) & LINK_CHANGED_BIT) != 0;
+}
+
+void network_serving(void)
+{
+    const int64_t now = esp_timer_get_time();
+    if (link_down_time > 0) {
+        ESP_LOGI(log_tag, "Serving %lld ms after link up, %lld ms after link loss",
+            (now - link_up_time) / 1000, (now - link_down_time) / 1000);
+    } else {
+        ESP_LOGI(log_tag, "Serving %lld ms after link up", (now - link_up_time) / 1000);
+    }
+}
+
+void network_request_served(void)
+{
+    boot_profile_mark(BOOT_PHASE_FIRST_REQUEST_SERVED);
+}
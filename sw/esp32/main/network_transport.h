@@ -0,0 +1,43 @@
+/**
+ * @file Interface between the network supervisor and the selected transport
+ */
+
+#ifndef INTELLILIGHT_NETWORK_TRANSPORT_H
+#define INTELLILIGHT_NETWORK_TRANSPORT_H
+
+#include <stdbool.h>
+
+/* port used for TP-Link Kasa traffic (TCP and UDP) */
+#define NETWORK_PORT 9999
+
+/**
+ * @brief Create the transport tasks (implemented by the transport, called once)
+ */
+extern void network_transport_start(void);
+
+/**
+ * @brief Interrupt the transport's wait for traffic so it sees a link change (implemented by the transport)
+ */
+extern void network_transport_wake(void);
+
+/**
+ * @brief Block until the link is up and acknowledge any pending link change
+ */
+extern void network_wait_for_link(void);
+
+/**
+ * @brief Check whether sockets must be closed because the link went down or changed
+ */
+extern bool network_link_changed(void);
+
+/**
+ * @brief Report that the transport is bound and serving again
+ */
+extern void network_serving(void);
+
+/**
+ * @brief Report that a request has been answered
+ */
+extern void network_request_served(void);
+
+#endif
@@ -3,11 +3,15 @@
  */
 
 /* system includes */
+#include <stdio.h>
 #include <string.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 
 /* local includes */
 #include "bluetooth.h"
+#include "boot_profile.h"
+#include "discovery.h"
 #include "tplink_kasa.h"
 #include "wifi.h"
 
@@ -19,11 +23,15 @@ union payload_header
     uint32_t payload_length;
 };
 
-const char cipher_key = 171;
+const char cipher_key = TPLINK_KASA_CIPHER_KEY;
 
-static const char * tplink_kasa_bind = "{\"smartlife.iot.common.cloud\":{\"bind\":{\"err_code\":0}}}";
+/* identity of the bridge, children are addressed by this with a two digit index appended */
+#define TPLINK_KASA_DEVICE_ID "80121C1874CF2DEA94DF3127F8DDF7D71DD7112F"
+#define TPLINK_KASA_CHILD_ID_LEN (sizeof(TPLINK_KASA_DEVICE_ID) + 2)
 
-static const char * tplink_kasa_cloudinfo = \
+static const char tplink_kasa_bind[] = "{\"smartlife.iot.common.cloud\":{\"bind\":{\"err_code\":0}}}";
+
+static const char tplink_kasa_cloudinfo[] = \
 "{ \
     \"smartlife.iot.common.cloud\": \
     { \
@@ -53,10 +61,10 @@ static const char * tplink_kasa_sysinfo = \
         \"sw_ver\":\"1.0.0 Build 000001 Rel.000001\", \
         \"hw_ver\":\"1.0\", \
         \"model\":\"KL130B(UN)\", \
-        \"deviceId\":\"80121C1874CF2DEA94DF3127F8DDF7D71DD7112F\", \
+        \"deviceId\":\"" TPLINK_KASA_DEVICE_ID "\", \
         \"oemId\":\"E45F76AD3AF13E60B58D6F68739CD7E5\", \
         \"hwId\":\"1E97141B9F0E939BD8F9679F0B6167C8\", \
-        \"rssi\":-71, \
+        \"rssi\":0, \
         \"latitude_i\":0, \
         \"longitude_i\":0, \
         \"alias\":\"Back Light\", \
@@ -115,29 +123,547 @@ static const char * tplink_kasa_sysinfo = \
     } \
 }";
 
-static void tplink_kasa_generate_light_state(cJSON * parent_node, const bool include_on_off)
+/**
+ * @brief Constant reply which is encrypted once and then served from the same buffer
+ */
+struct static_reply
+{
+    const char * json;
+    char * encrypted;
+    int encrypted_len;
+};
+
+static struct static_reply bind_reply = { .json = tplink_kasa_bind };
+static struct static_reply cloudinfo_reply = { .json = tplink_kasa_cloudinfo };
+
+/**
+ * @brief Encrypted reply which is rebuilt only when the light state version changes
+ */
+struct cached_reply
+{
+    uint32_t version;
+    char * encrypted;
+    int encrypted_len;
+};
+
+static struct cached_reply sysinfo_reply = { .encrypted = NULL };
+
+#if CONFIG_DISCOVERY_STATE_MAX_AGE_MS == 0
+/* time the bulb state was last read because of a get_sysinfo request */
+static int64_t sysinfo_refresh_time = 0;
+#endif
+
+static int tplink_kasa_encrypt_string(const char * payload, char * encrypted_payload, const bool include_header);
+
+static int tplink_kasa_get_static_reply(struct static_reply * static_reply, const char ** reply, const bool include_header)
+{
+    /* encrypt (with header) on first use, the same bytes without the header serve UDP */
+    if (static_reply->encrypted == NULL) {
+        cJSON * response_template = cJSON_Parse(static_reply->json);
+        char * payload = cJSON_PrintUnformatted(response_template);
+        cJSON_Delete(response_template);
+        if (payload == NULL) {
+            return 0;
+        }
+        static_reply->encrypted = malloc(strlen(payload) + TPLINK_KASA_HEADER_LEN);
+        if (static_reply->encrypted != NULL) {
+            static_reply->encrypted_len = tplink_kasa_encrypt_string(payload, static_reply->encrypted, true);
+        }
+        free(payload);
+        if (static_reply->encrypted == NULL) {
+            return 0;
+        }
+    }
+
+    if (include_header) {
+        *reply = static_reply->encrypted;
+        return static_reply->encrypted_len;
+    }
+    *reply = static_reply->encrypted + TPLINK_KASA_HEADER_LEN;
+    return static_reply->encrypted_len - TPLINK_KASA_HEADER_LEN;
+}
+
+static void tplink_kasa_generate_light_state(cJSON * parent_node, const struct light_state * state, const bool include_on_off)
 {
     cJSON_AddItemToObject(parent_node, "mode", cJSON_CreateString("normal"));
-    cJSON_AddItemToObject(parent_node, "hue", cJSON_CreateNumber((int)current_state.colour.h));
-    cJSON_AddItemToObject(parent_node, "saturation", cJSON_CreateNumber((int)current_state.colour.s));
-    cJSON_AddItemToObject(parent_node, "brightness", cJSON_CreateNumber((int)current_state.colour.v));
-    cJSON_AddItemToObject(parent_node, "color_temp", cJSON_CreateNumber((int)current_state.temperature));
-    if (include_on_off) cJSON_AddItemToObject(parent_node, "on_off", cJSON_CreateNumber((int)current_state.on_off));
+    cJSON_AddItemToObject(parent_node, "hue", cJSON_CreateNumber((int)state->colour.h));
+    cJSON_AddItemToObject(parent_node, "saturation", cJSON_CreateNumber((int)state->colour.s));
+    cJSON_AddItemToObject(parent_node, "brightness", cJSON_CreateNumber((int)state->colour.v));
+    cJSON_AddItemToObject(parent_node, "color_temp", cJSON_CreateNumber((int)state->temperature));
+    if (include_on_off) cJSON_AddItemToObject(parent_node, "on_off", cJSON_CreateNumber((int)state->on_off));
     cJSON_AddItemToObject(parent_node, "err_code", cJSON_CreateNumber(0));
 }
 
-int tplink_kasa_process_buffer(char * raw_buffer, const int buffer_len, const bool include_header)
+/**
+ * @brief Fill in a sysinfo light_state node, which reports the colour under dft_on_state while the bulb is off
+ */
+static void tplink_kasa_generate_sysinfo_light_state(cJSON * light_state_node, const struct light_state * state)
+{
+    if (state->on_off) {
+        tplink_kasa_generate_light_state(light_state_node, state, false);
+    } else {
+        cJSON_AddItemToObject(light_state_node, "dft_on_state", cJSON_CreateObject());
+        cJSON * dft_state = cJSON_GetObjectItem(light_state_node, "dft_on_state");
+        tplink_kasa_generate_light_state(dft_state, state, false);
+    }
+}
+
+static void tplink_kasa_child_id(const int bulb, char * child_id)
+{
+    snprintf(child_id, TPLINK_KASA_CHILD_ID_LEN, "%s%02d", TPLINK_KASA_DEVICE_ID, bulb);
+}
+
+/**
+ * @brief Generate the short error reply Kasa devices send for a failed method
+ * @param module Module of the failed request
+ * @param method Method which failed, or NULL to report the error for the whole module
+ * @return Length of the encrypted reply
+ */
+static int tplink_kasa_generate_error(const char * module, const char * method, const int err_code, const char * err_msg,
+    char * reply_buffer, const int reply_size, const bool include_header)
+{
+    cJSON * resp = cJSON_CreateObject();
+    cJSON_AddItemToObject(resp, module, cJSON_CreateObject());
+    cJSON * node = cJSON_GetObjectItem(resp, module);
+    if (method != NULL) {
+        cJSON_AddItemToObject(node, method, cJSON_CreateObject());
+        node = cJSON_GetObjectItem(node, method);
+    }
+    cJSON_AddItemToObject(node, "err_code", cJSON_CreateNumber(err_code));
+    cJSON_AddItemToObject(node, "err_msg", cJSON_CreateString(err_msg));
+    const int encrypted_len = tplink_kasa_encrypt(resp, reply_buffer, reply_size, include_header);
+    cJSON_Delete(resp);
+    return encrypted_len;
+}
+
+/**
+ * @brief Encrypt a generated reply, or an error reply for the same method if it is too long for the buffer
+ */
+static int tplink_kasa_encrypt_reply(const cJSON * resp, const char * module, const char * method,
+    char * reply_buffer, const int reply_size, const bool include_header)
 {
+    const int encrypted_len = tplink_kasa_encrypt(resp, reply_buffer, reply_size, include_header);
+    if (encrypted_len > 0) {
+        return encrypted_len;
+    }
+    return tplink_kasa_generate_error(module, method, TPLINK_KASA_ERR_REPLY_TOO_LONG, "reply too long",
+        reply_buffer, reply_size, include_header);
+}
+
+static int tplink_kasa_generate_sysinfo(char * reply_buffer, const int reply_size, const bool include_header)
+{
+    const int offset = include_header ? 0 : TPLINK_KASA_HEADER_LEN;
+    const uint32_t version = bluetooth_state_version();
+
+    /* serve the cached reply if the light state has not changed since it was built */
+    if (sysinfo_reply.encrypted != NULL && sysinfo_reply.version == version) {
+        if (sysinfo_reply.encrypted_len - offset > reply_size) {
+            ESP_LOGE(log_tag, "System information (%d bytes) does not fit the %d byte buffer", sysinfo_reply.encrypted_len, reply_size);
+            return tplink_kasa_generate_error("system", "get_sysinfo", TPLINK_KASA_ERR_REPLY_TOO_LONG, "reply too long",
+                reply_buffer, reply_size, include_header);
+        }
+        memcpy(reply_buffer, sysinfo_reply.encrypted + offset, sysinfo_reply.encrypted_len - offset);
+        return sysinfo_reply.encrypted_len - offset;
+    }
+
+    /* generate the JSON response from the template */
+    cJSON * response_template = cJSON_Parse(tplink_kasa_sysinfo);
+    if ( response_template == NULL ) {
+        ESP_LOGE(log_tag, "Error generating system info JSON");
+        return 0;
+    }
+    cJSON * resp_system = cJSON_GetObjectItem(response_template, "system");
+    cJSON * resp_sysinfo = cJSON_GetObjectItem(resp_system, "get_sysinfo");
+    cJSON * resp_light_state = cJSON_GetObjectItem(resp_sysinfo, "light_state");
+    cJSON * resp_on_off = cJSON_GetObjectItem(resp_light_state, "on_off");
+
+    /* the device itself reports the first bulb, so single bulb clients see no difference */
+    const struct light_state first_state = bluetooth_reported_state(0);
+    tplink_kasa_generate_sysinfo_light_state(resp_light_state, &first_state);
+    cJSON_SetNumberValue(resp_on_off, (int)first_state.on_off);
+    const struct bluetooth_link_quality link = bluetooth_link_quality(0);
+    cJSON_SetNumberValue(cJSON_GetObjectItem(resp_sysinfo, "rssi"), link.rssi);
+    cJSON_AddItemToObject(resp_sysinfo, "link_health", cJSON_CreateNumber(link.health));
+
+    /* with more than one bulb, each is also listed as a child which can be addressed by its id */
+    const int bulb_count = bluetooth_bulb_count();
+    if (bulb_count > 1) {
+        cJSON * children = cJSON_CreateArray();
+        for (int bulb = 0; bulb < bulb_count; bulb++) {
+            char child_id[TPLINK_KASA_CHILD_ID_LEN];
+            char alias[16];
+            tplink_kasa_child_id(bulb, child_id);
+            snprintf(alias, sizeof(alias), "Light %d", bulb + 1);
+            const struct light_state child_state = bluetooth_reported_state(bulb);
+
+            cJSON * child = cJSON_CreateObject();
+            cJSON_AddItemToObject(child, "id", cJSON_CreateString(child_id));
+            cJSON_AddItemToObject(child, "alias", cJSON_CreateString(alias));
+            cJSON_AddItemToObject(child, "state", cJSON_CreateNumber((int)child_state.on_off));
+            const struct bluetooth_link_quality child_link = bluetooth_link_quality(bulb);
+            cJSON_AddItemToObject(child, "rssi", cJSON_CreateNumber(child_link.rssi));
+            cJSON_AddItemToObject(child, "link_health", cJSON_CreateNumber(child_link.health));
+            cJSON_AddItemToObject(child, "light_state", cJSON_CreateObject());
+            cJSON * child_light_state = cJSON_GetObjectItem(child, "light_state");
+            cJSON_AddItemToObject(child_light_state, "on_off", cJSON_CreateNumber((int)child_state.on_off));
+            tplink_kasa_generate_sysinfo_light_state(child_light_state, &child_state);
+            cJSON_AddItemToArray(children, child);
+        }
+        cJSON_AddItemToObject(resp_sysinfo, "child_num", cJSON_CreateNumber(bulb_count));
+        cJSON_AddItemToObject(resp_sysinfo, "children", children);
+    }
+
+    /* always encrypt with the header so the cached copy can serve both TCP and UDP */
+    char * payload = cJSON_PrintUnformatted(response_template);
+    cJSON_Delete(response_template);
+    free(sysinfo_reply.encrypted);
+    sysinfo_reply.encrypted = payload != NULL ? malloc(strlen(payload) + TPLINK_KASA_HEADER_LEN) : NULL;
+    if (sysinfo_reply.encrypted == NULL) {
+        ESP_LOGE(log_tag, "No memory for system information");
+        free(payload);
+        return 0;
+    }
+    sysinfo_reply.encrypted_len = tplink_kasa_encrypt_string(payload, sysinfo_reply.encrypted, true);
+    sysinfo_reply.version = version;
+    free(payload);
+
+    /* the cached copy is now current, so serving it checks the length */
+    return tplink_kasa_generate_sysinfo(reply_buffer, reply_size, include_header);
+}
+
+/**
+ * @brief Generate the reply to a command some of whose bulbs could not be queued
+ * The bulbs which were queued have already been changed, so the result is listed for each child addressed.
+ * @param targets Bit mask of the bulbs addressed
+ * @param refused Bit mask of the bulbs the bridge refused
+ * @return Length of the encrypted reply
+ */
+static int tplink_kasa_generate_busy(const uint32_t targets, const uint32_t refused,
+    char * reply_buffer, const int reply_size, const bool include_header)
+{
+    cJSON * resp = cJSON_CreateObject();
+    cJSON_AddItemToObject(resp, "smartlife.iot.smartbulb.lightingservice", cJSON_CreateObject());
+    cJSON * light_service = cJSON_GetObjectItem(resp, "smartlife.iot.smartbulb.lightingservice");
+    cJSON_AddItemToObject(light_service, "transition_light_state", cJSON_CreateObject());
+    cJSON * node = cJSON_GetObjectItem(light_service, "transition_light_state");
+    cJSON_AddItemToObject(node, "err_code", cJSON_CreateNumber(TPLINK_KASA_ERR_BRIDGE_BUSY));
+    cJSON_AddItemToObject(node, "err_msg", cJSON_CreateString("bridge busy"));
+
+    cJSON * children = cJSON_CreateArray();
+    for (int bulb = 0; bulb < bluetooth_bulb_count(); bulb++) {
+        if ( !(targets & (1UL << bulb)) ) {
+            continue;
+        }
+        char child_id[TPLINK_KASA_CHILD_ID_LEN];
+        tplink_kasa_child_id(bulb, child_id);
+        cJSON * child = cJSON_CreateObject();
+        cJSON_AddItemToObject(child, "id", cJSON_CreateString(child_id));
+        if (refused & (1UL << bulb)) {
+            cJSON_AddItemToObject(child, "err_code", cJSON_CreateNumber(TPLINK_KASA_ERR_BRIDGE_BUSY));
+            cJSON_AddItemToObject(child, "err_msg", cJSON_CreateString("bridge busy"));
+        } else {
+            cJSON_AddItemToObject(child, "err_code", cJSON_CreateNumber(0));
+        }
+        cJSON_AddItemToArray(children, child);
+    }
+    cJSON_AddItemToObject(node, "children", children);
+
+    const int encrypted_len = tplink_kasa_encrypt_reply(resp, "smartlife.iot.smartbulb.lightingservice",
+        "transition_light_state", reply_buffer, reply_size, include_header);
+    cJSON_Delete(resp);
+    return encrypted_len;
+}
+
+/**
+ * @brief Work out which bulbs a request addresses from its optional context.child_ids list
+ * @return Bit mask of bulb indexes, all bulbs if the request has no context
+ */
+static uint32_t tplink_kasa_get_targets(const cJSON * rx_json_message)
+{
+    const int bulb_count = bluetooth_bulb_count();
+    const uint32_t all_bulbs = (1UL << bulb_count) - 1;
+
+    const cJSON * attr_context = cJSON_GetObjectItem(rx_json_message, "context");
+    const cJSON * attr_child_ids = cJSON_GetObjectItem(attr_context, "child_ids");
+    if (!cJSON_IsArray(attr_child_ids)) {
+        return all_bulbs;
+    }
+
+    uint32_t targets = 0;
+    const cJSON * attr_child_id;
+    cJSON_ArrayForEach(attr_child_id, attr_child_ids) {
+        if (!cJSON_IsString(attr_child_id)) {
+            continue;
+        }
+        for (int bulb = 0; bulb < bulb_count; bulb++) {
+            char child_id[TPLINK_KASA_CHILD_ID_LEN];
+            tplink_kasa_child_id(bulb, child_id);
+            if (strcmp(attr_child_id->valuestring, child_id) == 0) {
+                targets |= 1UL << bulb;
+            }
+        }
+    }
+
+    if (targets == 0) {
+        ESP_LOGW(log_tag, "Request addressed no known children");
+    }
+    return targets;
+}
+
+/**
+ * @brief Create the reply object of a diagnostics method
+ * @param resp Top level reply
+ * @param method Name of the method being answered
+ * @return Object to fill in with the results
+ */
+static cJSON * tplink_kasa_add_diagnostics_reply(cJSON * resp, const char * method)
+{
+    /* several methods in one request are answered together under the one module, as Kasa devices do */
+    cJSON * diagnostics = cJSON_GetObjectItem(resp, TPLINK_KASA_DIAGNOSTICS_MODULE);
+    if (diagnostics == NULL) {
+        cJSON_AddItemToObject(resp, TPLINK_KASA_DIAGNOSTICS_MODULE, cJSON_CreateObject());
+        diagnostics = cJSON_GetObjectItem(resp, TPLINK_KASA_DIAGNOSTICS_MODULE);
+    }
+    cJSON_AddItemToObject(diagnostics, method, cJSON_CreateObject());
+    return cJSON_GetObjectItem(diagnostics, method);
+}
+
+static void tplink_kasa_generate_boot_profile(cJSON * resp)
+{
+    /* milliseconds since boot at which each phase completed, -1 for phases still pending */
+    cJSON * profile = tplink_kasa_add_diagnostics_reply(resp, "get_boot_profile");
+    for (int phase = 0; phase < BOOT_PHASE_COUNT; phase++) {
+        const int64_t time = boot_profile_get(phase);
+        cJSON_AddItemToObject(profile, boot_profile_name(phase), cJSON_CreateNumber(time < 0 ? -1 : (double)(time / 1000)));
+    }
+    cJSON_AddItemToObject(profile, "err_code", cJSON_CreateNumber(0));
+}
+
+static void tplink_kasa_generate_scan_stats(cJSON * resp)
+{
+    const struct bluetooth_scan_stats stats = bluetooth_get_scan_stats();
+    cJSON * node = tplink_kasa_add_diagnostics_reply(resp, "get_scan_stats");
+    cJSON_AddItemToObject(node, "scans", cJSON_CreateNumber(stats.scans));
+    cJSON_AddItemToObject(node, "reports", cJSON_CreateNumber(stats.reports));
+    cJSON_AddItemToObject(node, "rejected", cJSON_CreateNumber(stats.rejected));
+    cJSON_AddItemToObject(node, "matches", cJSON_CreateNumber(stats.matches));
+    cJSON_AddItemToObject(node, "scan_time_ms", cJSON_CreateNumber(stats.scan_time_ms));
+    cJSON_AddItemToObject(node, "radio_time_ms", cJSON_CreateNumber(stats.radio_time_ms));
+    cJSON_AddItemToObject(node, "cpu_time_us", cJSON_CreateNumber((double)stats.cpu_time_us));
+    cJSON_AddItemToObject(node, "err_code", cJSON_CreateNumber(0));
+}
+
+static void tplink_kasa_generate_tx_stats(cJSON * resp)
+{
+    const struct bluetooth_tx_stats stats = bluetooth_get_tx_stats();
+    cJSON * node = tplink_kasa_add_diagnostics_reply(resp, "get_tx_stats");
+    cJSON_AddItemToObject(node, "queued", cJSON_CreateNumber(stats.queued));
+    cJSON_AddItemToObject(node, "sent", cJSON_CreateNumber(stats.sent));
+    cJSON_AddItemToObject(node, "superseded", cJSON_CreateNumber(stats.superseded));
+    cJSON_AddItemToObject(node, "dropped", cJSON_CreateNumber(stats.dropped));
+    cJSON_AddItemToObject(node, "stalls", cJSON_CreateNumber(stats.stalls));
+    cJSON_AddItemToObject(node, "deduplicated", cJSON_CreateNumber(stats.deduplicated));
+    cJSON_AddItemToObject(node, "reasserted", cJSON_CreateNumber(stats.reasserted));
+    cJSON_AddItemToObject(node, "airtime_saved_us", cJSON_CreateNumber((double)stats.airtime_saved_us));
+    cJSON_AddItemToObject(node, "latency_avg_us", cJSON_CreateNumber(stats.sent > 0 ? (double)(stats.latency_total_us / stats.sent) : 0));
+    cJSON_AddItemToObject(node, "latency_max_us", cJSON_CreateNumber(stats.latency_max_us));
+    cJSON_AddItemToObject(node, "err_code", cJSON_CreateNumber(0));
+}
+
+static void tplink_kasa_generate_bridge_stats(cJSON * resp)
+{
+    const struct bluetooth_bridge_stats stats = bluetooth_get_bridge_stats();
+    cJSON * node = tplink_kasa_add_diagnostics_reply(resp, "get_bridge_stats");
+    cJSON_AddItemToObject(node, "events", cJSON_CreateNumber(stats.events));
+    cJSON_AddItemToObject(node, "dropped", cJSON_CreateNumber(stats.dropped));
+    cJSON_AddItemToObject(node, "stack_waits", cJSON_CreateNumber(stats.stack_waits));
+    cJSON_AddItemToObject(node, "stack_dropped", cJSON_CreateNumber(stats.stack_dropped));
+    cJSON_AddItemToObject(node, "max_depth", cJSON_CreateNumber(stats.max_depth));
+    cJSON_AddItemToObject(node, "latency_avg_us", cJSON_CreateNumber(stats.events > 0 ? (double)(stats.latency_total_us / stats.events) : 0));
+    cJSON_AddItemToObject(node, "latency_max_us", cJSON_CreateNumber(stats.latency_max_us));
+    cJSON_AddItemToObject(node, "err_code", cJSON_CreateNumber(0));
+}
+
+static void tplink_kasa_generate_command_stats(cJSON * resp)
+{
+    const struct bluetooth_command_stats stats = bluetooth_get_command_stats();
+    cJSON * node = tplink_kasa_add_diagnostics_reply(resp, "get_command_stats");
+    cJSON_AddItemToObject(node, "submitted", cJSON_CreateNumber(stats.submitted));
+    cJSON_AddItemToObject(node, "rejected", cJSON_CreateNumber(stats.rejected));
+    cJSON_AddItemToObject(node, "writes_sent", cJSON_CreateNumber(stats.writes_sent));
+    cJSON_AddItemToObject(node, "writes_confirmed", cJSON_CreateNumber(stats.writes_confirmed));
+    cJSON_AddItemToObject(node, "writes_failed", cJSON_CreateNumber(stats.writes_failed));
+    cJSON_AddItemToObject(node, "reconciled", cJSON_CreateNumber(stats.reconciled));
+    cJSON_AddItemToObject(node, "err_code", cJSON_CreateNumber(0));
+}
+
+static void tplink_kasa_generate_state_stats(cJSON * resp)
+{
+    const struct bluetooth_state_stats stats = bluetooth_get_state_stats();
+    cJSON * node = tplink_kasa_add_diagnostics_reply(resp, "get_state_stats");
+    cJSON_AddItemToObject(node, "notifications", cJSON_CreateNumber(stats.notifications));
+    cJSON_AddItemToObject(node, "reads", cJSON_CreateNumber(stats.reads));
+    cJSON_AddItemToObject(node, "reads_skipped", cJSON_CreateNumber(stats.reads_skipped));
+    cJSON_AddItemToObject(node, "fresh_hits", cJSON_CreateNumber(stats.fresh_hits));
+    cJSON_AddItemToObject(node, "fresh_misses", cJSON_CreateNumber(stats.fresh_misses));
+    cJSON_AddItemToObject(node, "fresh_timeouts", cJSON_CreateNumber(stats.fresh_timeouts));
+    cJSON_AddItemToObject(node, "err_code", cJSON_CreateNumber(0));
+}
+
+static void tplink_kasa_generate_link_stats(cJSON * resp)
+{
+    const struct bluetooth_link_stats stats = bluetooth_get_link_stats();
+    cJSON * node = tplink_kasa_add_diagnostics_reply(resp, "get_link_stats");
+    const uint32_t drops = stats.early_drops + stats.timeout_drops;
+    cJSON_AddItemToObject(node, "rssi_reads", cJSON_CreateNumber(stats.rssi_reads));
+    cJSON_AddItemToObject(node, "probes", cJSON_CreateNumber(stats.probes));
+    cJSON_AddItemToObject(node, "missed_responses", cJSON_CreateNumber(stats.missed_responses));
+    cJSON_AddItemToObject(node, "early_drops", cJSON_CreateNumber(stats.early_drops));
+    cJSON_AddItemToObject(node, "timeout_drops", cJSON_CreateNumber(stats.timeout_drops));
+    cJSON_AddItemToObject(node, "detect_avg_ms", cJSON_CreateNumber(drops > 0 ? (double)(stats.detect_total_ms / drops) : 0));
+    cJSON_AddItemToObject(node, "detect_max_ms", cJSON_CreateNumber(stats.detect_max_ms));
+    cJSON_AddItemToObject(node, "recoveries", cJSON_CreateNumber(stats.recoveries));
+    cJSON_AddItemToObject(node, "recovery_avg_ms", cJSON_CreateNumber(stats.recoveries > 0 ? (double)(stats.recovery_total_ms / stats.recoveries) : 0));
+    cJSON_AddItemToObject(node, "recovery_max_ms", cJSON_CreateNumber(stats.recovery_max_ms));
+    cJSON * bulbs_node = cJSON_CreateArray();
+    for (int bulb = 0; bulb < bluetooth_bulb_count(); bulb++) {
+        const struct bluetooth_link_quality link = bluetooth_link_quality(bulb);
+        cJSON * bulb_node = cJSON_CreateObject();
+        cJSON_AddItemToObject(bulb_node, "rssi", cJSON_CreateNumber(link.rssi));
+        cJSON_AddItemToObject(bulb_node, "health", cJSON_CreateNumber(link.health));
+        cJSON_AddItemToArray(bulbs_node, bulb_node);
+    }
+    cJSON_AddItemToObject(node, "bulbs", bulbs_node);
+    cJSON_AddItemToObject(node, "err_code", cJSON_CreateNumber(0));
+}
+
+static void tplink_kasa_generate_conn_stats(cJSON * resp)
+{
+    static const char * mode_names[2] = { "fast", "idle" };
+    const struct bluetooth_conn_stats stats = bluetooth_get_conn_stats();
+    cJSON * node = tplink_kasa_add_diagnostics_reply(resp, "get_conn_stats");
+    for (int mode = 0; mode < 2; mode++) {
+        const struct bluetooth_write_latency * latency = &stats.latency[mode];
+        cJSON * mode_node = cJSON_CreateObject();
+        cJSON_AddItemToObject(mode_node, "requests", cJSON_CreateNumber(stats.requests[mode]));
+        cJSON_AddItemToObject(mode_node, "writes", cJSON_CreateNumber(latency->writes));
+        cJSON_AddItemToObject(mode_node, "latency_avg_us", cJSON_CreateNumber(latency->writes > 0 ? (double)(latency->total_us / latency->writes) : 0));
+        cJSON_AddItemToObject(mode_node, "latency_max_us", cJSON_CreateNumber(latency->max_us));
+        cJSON_AddItemToObject(node, mode_names[mode], mode_node);
+    }
+    cJSON_AddItemToObject(node, "rejected", cJSON_CreateNumber(stats.rejected));
+    cJSON_AddItemToObject(node, "err_code", cJSON_CreateNumber(0));
+}
+
+static void tplink_kasa_generate_discovery_stats(cJSON * resp)
+{
+    const struct discovery_stats stats = discovery_get_stats();
+    cJSON * node = tplink_kasa_add_diagnostics_reply(resp, "get_discovery_stats");
+    cJSON_AddItemToObject(node, "admitted", cJSON_CreateNumber(stats.admitted));
+    cJSON_AddItemToObject(node, "duplicates", cJSON_CreateNumber(stats.duplicates));
+    cJSON_AddItemToObject(node, "rate_limited", cJSON_CreateNumber(stats.rate_limited));
+    cJSON_AddItemToObject(node, "total_limited", cJSON_CreateNumber(stats.total_limited));
+    cJSON_AddItemToObject(node, "passed", cJSON_CreateNumber(stats.passed));
+    cJSON_AddItemToObject(node, "err_code", cJSON_CreateNumber(0));
+}
+
+/**
+ * @brief Answer the bridge diagnostics methods present in a request
+ * @return Length of the encrypted reply, 0 if the request asked for no diagnostics
+ */
+static int tplink_kasa_generate_diagnostics(const cJSON * attr_diagnostics, char * reply_buffer, const int reply_size, const bool include_header)
+{
+    cJSON * resp = cJSON_CreateObject();
+    if ( cJSON_HasObjectItem(attr_diagnostics, "get_boot_profile") ) {
+        tplink_kasa_generate_boot_profile(resp);
+    }
+    if ( cJSON_HasObjectItem(attr_diagnostics, "get_scan_stats") ) {
+        tplink_kasa_generate_scan_stats(resp);
+    }
+    if ( cJSON_HasObjectItem(attr_diagnostics, "get_tx_stats") ) {
+        tplink_kasa_generate_tx_stats(resp);
+    }
+    if ( cJSON_HasObjectItem(attr_diagnostics, "get_conn_stats") ) {
+        tplink_kasa_generate_conn_stats(resp);
+    }
+    if ( cJSON_HasObjectItem(attr_diagnostics, "get_bridge_stats") ) {
+        tplink_kasa_generate_bridge_stats(resp);
+    }
+    if ( cJSON_HasObjectItem(attr_diagnostics, "get_state_stats") ) {
+        tplink_kasa_generate_state_stats(resp);
+    }
+    if ( cJSON_HasObjectItem(attr_diagnostics, "get_command_stats") ) {
+        tplink_kasa_generate_command_stats(resp);
+    }
+    if ( cJSON_HasObjectItem(attr_diagnostics, "get_link_stats") ) {
+        tplink_kasa_generate_link_stats(resp);
+    }
+    if ( cJSON_HasObjectItem(attr_diagnostics, "get_discovery_stats") ) {
+        tplink_kasa_generate_discovery_stats(resp);
+    }
+
     int encrypted_len = 0;
-    char * json_string = malloc(buffer_len * sizeof(char));
+    if ( cJSON_HasObjectItem(resp, TPLINK_KASA_DIAGNOSTICS_MODULE) ) {
+        encrypted_len = tplink_kasa_encrypt_reply(resp, TPLINK_KASA_DIAGNOSTICS_MODULE, NULL, reply_buffer, reply_size, include_header);
+    }
+    cJSON_Delete(resp);
+    return encrypted_len;
+}
+
+int tplink_kasa_process_buffer(char * raw_buffer, const int buffer_len, const int buffer_size, const bool include_header)
+{
+    char * json_string = malloc((buffer_len + 1) * sizeof(char));
+    if (json_string == NULL) {
+        ESP_LOGE(log_tag, "No memory to decrypt message");
+        return 0;
+    }
 
     /* decrypt the received buffer to a JSON string */
     raw_buffer[buffer_len] = 0;
     tplink_kasa_decrypt(raw_buffer, buffer_len, json_string, include_header);
 
+    /* generate the reply, constant replies are copied in from their pre-encrypted buffer */
+    const char * reply = raw_buffer;
+    const int encrypted_len = tplink_kasa_process_request(json_string, raw_buffer, buffer_size, &reply, include_header);
+    free(json_string);
+    if (reply != raw_buffer) {
+        if (encrypted_len > buffer_size) {
+            ESP_LOGE(log_tag, "Constant reply (%d bytes) does not fit the %d byte buffer", encrypted_len, buffer_size);
+            return 0;
+        }
+        memcpy(raw_buffer, reply, encrypted_len);
+    }
+
+    return encrypted_len;
+}
+
+bool tplink_kasa_wants_fresh_state(const char * json_string)
+{
+#if CONFIG_DISCOVERY_STATE_MAX_AGE_MS != 0
+    /* a false match only costs a wait which finds the state already fresh */
+    return strstr(json_string, "\"get_sysinfo\"") != NULL;
+#else
+    return false;
+#endif
+}
+
+void tplink_kasa_wait_fresh_state(void)
+{
+#if CONFIG_DISCOVERY_STATE_MAX_AGE_MS != 0
+    /* answer with the state the bulbs are really in, waiting a bounded time for any stale ones to be read */
+    if ( !bluetooth_wait_fresh_state(CONFIG_DISCOVERY_STATE_MAX_AGE_MS, CONFIG_DISCOVERY_STATE_WAIT_MS) ) {
+        ESP_LOGW(log_tag, "Bulb state not read in time, replying with the last known state");
+    }
+#endif
+}
+
+int tplink_kasa_process_request(const char * json_string, char * reply_buffer, const int reply_size, const char ** reply, const bool include_header)
+{
+    int encrypted_len = 0;
+    *reply = reply_buffer;
+
     /* decode JSON message */
     cJSON * rx_json_message = cJSON_Parse(json_string);
-    free(json_string);
 
     if ( rx_json_message == NULL ) {
         ESP_LOGE(log_tag, "Error decoding JSON message");
@@ -152,100 +678,124 @@ int tplink_kasa_process_buffer(char * raw_buffer, const int buffer_len, const bo
         const cJSON * attr_saturation    = cJSON_GetObjectItem(attr_light_state,   "saturation");
         const cJSON * attr_brightness    = cJSON_GetObjectItem(attr_light_state,   "brightness");
         const cJSON * attr_on_off        = cJSON_GetObjectItem(attr_light_state,   "on_off");
-
-        bool need_to_set_colour = false;
+        const cJSON * attr_period        = cJSON_GetObjectItem(attr_light_state,   "transition_period");
 
         if (cJSON_IsNumber(attr_hue)) {
             ESP_LOGI(log_tag, "hue %.0f degrees", attr_hue->valuedouble);
-            current_state.colour.h = attr_hue->valuedouble;
-            need_to_set_colour = true;
         }
         if (cJSON_IsNumber(attr_saturation)) {
             ESP_LOGI(log_tag, "saturation %.0f%%", attr_saturation->valuedouble);
-            current_state.colour.s = attr_saturation->valuedouble;
-            need_to_set_colour = true;
         }
         if (cJSON_IsNumber(attr_brightness)) {
             ESP_LOGI(log_tag, "brightness %.0f%%", attr_brightness->valuedouble);
-            current_state.colour.v = attr_brightness->valuedouble;
-            need_to_set_colour = true;
         }
-
-        /* send command to bluetooth bulb to turn on/off if required */
         if (cJSON_IsNumber(attr_on_off)) {
             ESP_LOGI(log_tag, "on/off %.0f", attr_on_off->valuedouble);
-            const bool turn_off = attr_on_off->valuedouble == 0;
-            if ( turn_off ) {
-                bluetooth_turn_bulb_off();
-                current_state.on_off = false;
-                cJSON * resp = cJSON_CreateObject();
-                cJSON_AddItemToObject(resp, "smartlife.iot.smartbulb.lightingservice", cJSON_CreateObject());
-                cJSON * light_service = cJSON_GetObjectItem(resp, "smartlife.iot.smartbulb.lightingservice");
-                cJSON_AddItemToObject(light_service, "transition_light_state", cJSON_CreateObject());
-                tplink_kasa_generate_light_state(cJSON_GetObjectItem(light_service, "transition_light_state"), true);
-                encrypted_len = tplink_kasa_encrypt(resp, raw_buffer, include_header);
-                cJSON_Delete(resp);
-                need_to_set_colour = false;
-            } else {
-                /* this will turn the bulb back on */
-                need_to_set_colour = true;
+        }
+        /* the fade length in milliseconds, absent or 0 for an immediate change */
+        const uint32_t period_ms = cJSON_IsNumber(attr_period) && attr_period->valuedouble > 0 ? (uint32_t)attr_period->valuedouble : 0;
+        const bool change_colour = cJSON_IsNumber(attr_hue) || cJSON_IsNumber(attr_saturation) || cJSON_IsNumber(attr_brightness);
+        const bool turn_off = cJSON_IsNumber(attr_on_off) && attr_on_off->valuedouble == 0;
+        /* turning on sets the last colour again */
+        const bool turn_on = cJSON_IsNumber(attr_on_off) && !turn_off;
+
+        /* post the change for every addressed bulb to the BLE bridge task, which carries it out on */
+        /* each bulb's own connection while the reply is built from the new desired state */
+        struct light_state reply_state;
+        bool have_reply_state = false;
+        uint32_t targets = 0;
+        uint32_t refused = 0;
+        if (turn_off || turn_on || change_colour) {
+            targets = tplink_kasa_get_targets(rx_json_message);
+            for (int bulb = 0; bulb < bluetooth_bulb_count(); bulb++) {
+                if ( !(targets & (1UL << bulb)) ) {
+                    continue;
+                }
+                struct hsv_colour colour = bluetooth_desired_state(bulb).colour;
+                if (cJSON_IsNumber(attr_hue))        colour.h = attr_hue->valuedouble;
+                if (cJSON_IsNumber(attr_saturation)) colour.s = attr_saturation->valuedouble;
+                if (cJSON_IsNumber(attr_brightness)) colour.v = attr_brightness->valuedouble;
+
+                /* turning off keeps the new colour for when the bulb is turned back on */
+                if ( !turn_off ) {
+                    const struct rgb_colour rgb = colours_hsv_to_rgb(colour);
+                    ESP_LOGI(log_tag, "set bulb %d HSV %.0f,%.0f,%.0f", bulb, colour.h, colour.s, colour.v);
+                    ESP_LOGI(log_tag, "set bulb %d RGB %d,%d,%d", bulb, rgb.r, rgb.g, rgb.b);
+                }
+                const struct bulb_command command = {
+                    .bulb = bulb,
+                    .colour = colour,
+                    .on_off = !turn_off,
+                    .period_ms = period_ms,
+                };
+                if ( !bluetooth_send_command(&command) ) {
+                    ESP_LOGW(log_tag, "Bridge busy, bulb %d not changed", bulb);
+                    refused |= 1UL << bulb;
+                    continue;
+                }
+
+                /* the reply reports the first bulb addressed */
+                if (!have_reply_state) {
+                    reply_state = bluetooth_desired_state(bulb);
+                    have_reply_state = true;
+                }
             }
         }
 
-        /* send command to bluetooth bulb to set the colour */
-        if (need_to_set_colour) {
-            const struct rgb_colour rgb = colours_hsv_to_rgb(current_state.colour);
-            ESP_LOGI(log_tag, "set bulb HSV %.0f,%.0f,%.0f", current_state.colour.h, current_state.colour.s, current_state.colour.v);
-            ESP_LOGI(log_tag, "set bulb RGB %d,%d,%d", rgb.r, rgb.g, rgb.b);
-            bluetooth_set_bulb_colour(colours_hsv_to_rgb(current_state.colour));
-            current_state.on_off = true;
+        if (refused != 0) {
+            /* the client would otherwise believe a bulb has a state it was never sent */
+            encrypted_len = tplink_kasa_generate_busy(targets, refused, reply_buffer, reply_size, include_header);
+        } else if (have_reply_state) {
             cJSON * resp = cJSON_CreateObject();
             cJSON_AddItemToObject(resp, "smartlife.iot.smartbulb.lightingservice", cJSON_CreateObject());
             cJSON * light_service = cJSON_GetObjectItem(resp, "smartlife.iot.smartbulb.lightingservice");
             cJSON_AddItemToObject(light_service, "transition_light_state", cJSON_CreateObject());
-            tplink_kasa_generate_light_state(cJSON_GetObjectItem(light_service, "transition_light_state"), true);
-            encrypted_len = tplink_kasa_encrypt(resp, raw_buffer, include_header);
+            tplink_kasa_generate_light_state(cJSON_GetObjectItem(light_service, "transition_light_state"), &reply_state, true);
+            encrypted_len = tplink_kasa_encrypt_reply(resp, "smartlife.iot.smartbulb.lightingservice", "transition_light_state",
+                reply_buffer, reply_size, include_header);
             cJSON_Delete(resp);
+        } else if (targets == 0 && (turn_off || turn_on || change_colour)) {
+            /* every child id in the context was unknown, so nothing was changed */
+            encrypted_len = tplink_kasa_generate_error("smartlife.iot.smartbulb.lightingservice", "transition_light_state",
+                TPLINK_KASA_ERR_ENTRY_NOT_EXIST, "entry not exist", reply_buffer, reply_size, include_header);
         }
 
         /* check for cloud info request */
         if ( cJSON_HasObjectItem(attr_cloudinfo, "get_info") ) {
-            cJSON * response_template = cJSON_Parse(tplink_kasa_cloudinfo);
-            encrypted_len = tplink_kasa_encrypt(response_template, raw_buffer, include_header);
-            cJSON_Delete(response_template);
+            encrypted_len = tplink_kasa_get_static_reply(&cloudinfo_reply, reply, include_header);
         }
 
         /* check for cloud bind request */
         if ( cJSON_HasObjectItem(attr_cloudinfo, "bind") ) {
-            cJSON * response_template = cJSON_Parse(tplink_kasa_bind);
-            encrypted_len = tplink_kasa_encrypt(response_template, raw_buffer, include_header);
-            cJSON_Delete(response_template);
+            encrypted_len = tplink_kasa_get_static_reply(&bind_reply, reply, include_header);
         }
 
         /* check for system info request */
         const cJSON * attr_system = cJSON_GetObjectItem(rx_json_message, "system");
         if ( cJSON_HasObjectItem(attr_system, "get_sysinfo") ) {
             ESP_LOGI(log_tag, "System information requested");
-            bluetooth_request_bulb_state();
-            /* generate the JSON response from the template */
-            cJSON * response_template = cJSON_Parse(tplink_kasa_sysinfo);
-            if ( response_template == NULL ) {
-                ESP_LOGE(log_tag, "Error generating system info JSON");
-            } else {
-                cJSON * resp_system = cJSON_GetObjectItem(response_template, "system");
-                cJSON * resp_sysinfo = cJSON_GetObjectItem(resp_system, "get_sysinfo");
-                cJSON * resp_light_state = cJSON_GetObjectItem(resp_sysinfo, "light_state");
-                cJSON * resp_on_off = cJSON_GetObjectItem(resp_light_state, "on_off");
-                if (current_state.on_off) {
-                    tplink_kasa_generate_light_state(resp_light_state, false);
-                } else {
-                    cJSON_AddItemToObject(resp_light_state, "dft_on_state", cJSON_CreateObject());
-                    cJSON * resp_dft_state = cJSON_GetObjectItem(resp_light_state, "dft_on_state");
-                    tplink_kasa_generate_light_state(resp_dft_state, false);
+#if CONFIG_DISCOVERY_STATE_MAX_AGE_MS == 0
+            /* many clients poll get_sysinfo, so only let them trigger a BLE read now and then */
+            /* (bulbs which notify their state are not read at all) */
+            const int64_t now = esp_timer_get_time();
+            if (now - sysinfo_refresh_time >= CONFIG_DISCOVERY_STATE_REFRESH_MS * 1000LL) {
+                sysinfo_refresh_time = now;
+                for (int bulb = 0; bulb < bluetooth_bulb_count(); bulb++) {
+                    bluetooth_request_bulb_state(bulb);
                 }
-                cJSON_SetNumberValue(resp_on_off, (int)current_state.on_off);
-                encrypted_len = tplink_kasa_encrypt(response_template, raw_buffer, include_header);
-                cJSON_Delete(response_template);
+            }
+#endif
+            encrypted_len = tplink_kasa_generate_sysinfo(reply_buffer, reply_size, include_header);
+            *reply = reply_buffer;
+        }
+
+        /* check for bridge diagnostics requests */
+        const cJSON * attr_diagnostics = cJSON_GetObjectItem(rx_json_message, TPLINK_KASA_DIAGNOSTICS_MODULE);
+        if ( attr_diagnostics != NULL ) {
+            const int diagnostics_len = tplink_kasa_generate_diagnostics(attr_diagnostics, reply_buffer, reply_size, include_header);
+            if (diagnostics_len > 0) {
+                encrypted_len = diagnostics_len;
+                *reply = reply_buffer;
             }
         }
         /* tidy up */
@@ -300,18 +850,50 @@ int tplink_kasa_decrypt(const char * encrypted_payload, const int encrypted_len,
     return header.payload_length;
 }
 
-int tplink_kasa_encrypt(const cJSON * json, char * encrypted_payload, const bool include_header)
+void tplink_kasa_decrypt_fragment(const char * encrypted_fragment, const int fragment_len, char * decrypted_fragment, char * key)
 {
-    /* autokey cypher key value */
-    char key = cipher_key;
+    /* XOR each byte with the previous encypted byte, which may be the last byte of the previous fragment */
+    for (int i = 0; i < fragment_len; i++)
+    {
+        decrypted_fragment[i] = encrypted_fragment[i] ^ *key;
+        *key = encrypted_fragment[i];
+    }
+}
 
+int tplink_kasa_encrypt(const cJSON * json, char * encrypted_payload, const int encrypted_size, const bool include_header)
+{
     /* convert JSON object to string and allocate on the HEAP (must free memory when finished) */
     char * payload = cJSON_PrintUnformatted(json);
+    if (payload == NULL) {
+        return 0;
+    }
+
+    /* the header is written even when it is not sent, and then overwritten by the payload */
+    const int payload_len = strlen(payload);
+    const int needed_len = include_header ? payload_len + TPLINK_KASA_HEADER_LEN : payload_len;
+    if (needed_len > encrypted_size || encrypted_size < TPLINK_KASA_HEADER_LEN) {
+        ESP_LOGE(log_tag, "Reply (%d bytes) does not fit the %d byte buffer", payload_len, encrypted_size);
+        free(payload);
+        return 0;
+    }
+
+    const int encrypted_len = tplink_kasa_encrypt_string(payload, encrypted_payload, include_header);
+
+    free(payload);
+
+    return encrypted_len;
+}
+
+static int tplink_kasa_encrypt_string(const char * payload, char * encrypted_payload, const bool include_header)
+{
+    /* autokey cypher key value */
+    char key = cipher_key;
+    const int payload_len = strlen(payload);
 
     /* the first 4 bytes in the encrypted data define the length of the payload, encoded in big endian */
     /* since ESP32 is little endian, need to swap the endianness */
     union payload_header header;
-    header.payload_length = strlen(payload);
+    header.payload_length = payload_len;
     encrypted_payload[0] = header.bytes[3];
     encrypted_payload[1] = header.bytes[2];
     encrypted_payload[2] = header.bytes[1];
@@ -321,17 +903,15 @@ int tplink_kasa_encrypt(const cJSON * json, char * encrypted_payload, const bool
     const int header_len = include_header ? sizeof(header) : 0;
     
     /* XOR each byte with the previous encypted byte or 171 for the first byte */
-    for (int i = 0; i < strlen(payload); i++)
+    for (int i = 0; i < payload_len; i++)
     {
         key = encrypted_payload[i + header_len] = payload[i] ^ key;
     }
 
-    const int encrypted_len = strlen(payload) + header_len;
+    const int encrypted_len = payload_len + header_len;
 
     ESP_LOGD(log_tag, "Decrypted payload (%d bytes): %s", header.payload_length, payload);
     ESP_LOGD(log_tag, "Encrypted payload (%d bytes): %s", encrypted_len, encrypted_payload);
 
-    free(payload);
-
     return encrypted_len;
 }
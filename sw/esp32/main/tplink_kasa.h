@@ -15,15 +15,74 @@
 #include "colours.h"
 #include "wifi.h"
 
+/* length of the big endian payload length which prefixes TCP packets */
+#define TPLINK_KASA_HEADER_LEN 4
+
+/* starting key of the XOR Autokey Cipher */
+#define TPLINK_KASA_CIPHER_KEY 171
+
+/* bridge specific module, not part of the Kasa protocol, for querying diagnostics */
+#define TPLINK_KASA_DIAGNOSTICS_MODULE "intellilight.diagnostics"
+
+/* longest replies with every number at its widest: get_sysinfo, the device itself plus one child per bulb, */
+/* and all diagnostics methods in one request, which list each bulb's link quality */
+#define TPLINK_KASA_SYSINFO_BASE_LEN        1100
+#define TPLINK_KASA_SYSINFO_CHILD_LEN       256
+#define TPLINK_KASA_DIAGNOSTICS_BASE_LEN    2000
+#define TPLINK_KASA_DIAGNOSTICS_BULB_LEN    32
+#define TPLINK_KASA_SYSINFO_MAX_LEN \
+    (TPLINK_KASA_HEADER_LEN + TPLINK_KASA_SYSINFO_BASE_LEN + CONFIG_SMARTBULB_MAX_BULBS * TPLINK_KASA_SYSINFO_CHILD_LEN)
+#define TPLINK_KASA_DIAGNOSTICS_MAX_LEN \
+    (TPLINK_KASA_HEADER_LEN + TPLINK_KASA_DIAGNOSTICS_BASE_LEN + CONFIG_SMARTBULB_MAX_BULBS * TPLINK_KASA_DIAGNOSTICS_BULB_LEN)
+
+/* size of a buffer which holds any reply the bridge generates, including the header */
+#define TPLINK_KASA_REPLY_MAX_LEN \
+    (TPLINK_KASA_SYSINFO_MAX_LEN > TPLINK_KASA_DIAGNOSTICS_MAX_LEN ? TPLINK_KASA_SYSINFO_MAX_LEN : TPLINK_KASA_DIAGNOSTICS_MAX_LEN)
+
+/* err_code of a request which addresses only child ids the bridge does not have, as Kasa power strips report */
+#define TPLINK_KASA_ERR_ENTRY_NOT_EXIST -14
+
+/* err_code of a request whose reply does not fit in the buffer it has to be sent from (bridge specific) */
+#define TPLINK_KASA_ERR_REPLY_TOO_LONG -20
+
+/* err_code of a lighting command the BLE bridge could not queue for an addressed bulb (bridge specific) */
+#define TPLINK_KASA_ERR_BRIDGE_BUSY -21
 
 /**
  * @brief Process a received buffer of encrypted data
  * @param raw_buffer Buffer to decrypt, interpret and respond to
  * @param buffer_len Length of input buffer
+ * @param buffer_size Size of raw_buffer, which must be more than buffer_len; a reply which would not fit
+ * is replaced by a short error reply
  * @param include_header True if buffers contain a header
  * @return Length of encrypted reply
  */
-int tplink_kasa_process_buffer(char * raw_buffer, const int buffer_len, const bool include_header);
+int tplink_kasa_process_buffer(char * raw_buffer, const int buffer_len, const int buffer_size, const bool include_header);
+
+/**
+ * @brief Check whether a request should wait for fresh bulb states before it is processed
+ * @param json_string Decrypted, null terminated JSON request
+ * @return true if it asks for get_sysinfo and DISCOVERY_STATE_MAX_AGE_MS is set
+ */
+bool tplink_kasa_wants_fresh_state(const char * json_string);
+
+/**
+ * @brief Wait a bounded time (DISCOVERY_STATE_WAIT_MS) for stale bulb states to be read
+ * Called before taking the lock which serialises the request handlers, so other requests are not held up.
+ */
+void tplink_kasa_wait_fresh_state(void);
+
+/**
+ * @brief Interpret a decrypted request and generate the encrypted reply
+ * @param json_string Decrypted, null terminated JSON request
+ * @param reply_buffer Buffer to hold replies which have to be generated
+ * @param reply_size Size of reply_buffer, a reply which would not fit is replaced by a short error reply
+ * @param reply Output pointer to the reply, either reply_buffer or a pre-encrypted constant reply
+ * which remains valid (and unchanged) for the lifetime of the program
+ * @param include_header True to prepend the reply with a header
+ * @return Length of encrypted reply
+ */
+int tplink_kasa_process_request(const char * json_string, char * reply_buffer, const int reply_size, const char ** reply, const bool include_header);
 
 /**
  * @brief Decrypt using XOR Autokey Cipher with starting key of 171
@@ -35,13 +94,23 @@ int tplink_kasa_process_buffer(char * raw_buffer, const int buffer_len, const bo
  */
 int tplink_kasa_decrypt(const char * encrypted_payload, const int encrypted_len, char * decrypted_payload, const bool include_header);
 
+/**
+ * @brief Decrypt one fragment of a payload which arrived in several pieces
+ * @param encrypted_fragment Input fragment to decrypt (no header)
+ * @param fragment_len Length of input fragment
+ * @param decrypted_fragment Output decrypted fragment (not null terminated)
+ * @param key Cipher state carried between fragments, start with TPLINK_KASA_CIPHER_KEY
+ */
+void tplink_kasa_decrypt_fragment(const char * encrypted_fragment, const int fragment_len, char * decrypted_fragment, char * key);
+
 /**
  * @brief Encrypt using XOR Autokey Cipher with starting key of 171
  * @param payload Input payload to encrypt as cJSON object
  * @param encrypted_payload Output encrypted payload
+ * @param encrypted_size Size of the output buffer
  * @param include_header True to prepend the packet with a header
- * @return length of encrypted data
+ * @return length of encrypted data, 0 if it could not be generated or does not fit
  */
-int tplink_kasa_encrypt(const cJSON * payload, char * encypted_payload, const bool include_header);
+int tplink_kasa_encrypt(const cJSON * payload, char * encypted_payload, const int encrypted_size, const bool include_header);
 
 #endif
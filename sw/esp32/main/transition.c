@@ -0,0 +1,163 @@
+/**
+ * @file Fades between bulb states over the transition_period of a lighting command
+ *
+ * Lighting commands are started here by the BLE bridge task, and the frames
+ * are stepped by the same task when the bridge's frame timer posts an event,
+ * so the fades have a single owner and need no lock. Each frame is left in
+ * the bulb's write mailbox, so a frame the link cannot carry in time is
+ * replaced by the next one rather than delaying it.
+ */
+
+/* system includes */
+#include <esp_log.h>
+#include <esp_timer.h>
+
+/* local includes */
+#include "bluetooth.h"
+#include "colours.h"
+#include "transition.h"
+
+static const char *log_tag = "transition";
+
+/**
+ * @brief Fade of one bulb
+ */
+struct fade {
+    bool active;
+    struct hsv_colour from;
+    struct hsv_colour to;
+    bool on_off;                /* state at the end of the fade */
+    int64_t start_time;
+    int64_t period_us;
+    bool written;               /* a frame has been sent, so last_rgb is valid */
+    struct rgb_colour last_rgb; /* frames which would not change the bulb are skipped */
+};
+
+static struct fade fades[BLUETOOTH_MAX_BULBS];
+
+struct hsv_colour transition_interpolate(const struct hsv_colour from, const struct hsv_colour to,
+    const int64_t elapsed_us, const int64_t period_us)
+{
+    if (elapsed_us <= 0) {
+        return from;
+    }
+    if (elapsed_us >= period_us) {
+        return to;
+    }
+    const float fraction = (float)elapsed_us / period_us;
+
+    float hue_change = to.h - from.h;
+    if (hue_change > 180) {
+        hue_change -= 360;
+    } else if (hue_change < -180) {
+        hue_change += 360;
+    }
+    struct hsv_colour colour = {
+        .h = from.h + hue_change * fraction,
+        .s = from.s + (to.s - from.s) * fraction,
+        .v = from.v + (to.v - from.v) * fraction,
+    };
+    if (colour.h < 0) {
+        colour.h += 360;
+    } else if (colour.h >= 360) {
+        colour.h -= 360;
+    }
+    return colour;
+}
+
+/**
+ * @brief Colour a bulb is showing
+ */
+static struct hsv_colour shown_colour(const int bulb, const int64_t now)
+{
+    const struct fade * fade = &fades[bulb];
+    if (fade->active) {
+        return transition_interpolate(fade->from, fade->to, now - fade->start_time, fade->period_us);
+    }
+    struct hsv_colour colour = bulb_state[bulb].colour;
+    if (!bulb_state[bulb].on_off) {
+        colour.v = 0;
+    }
+    return colour;
+}
+
+bool transition_step(const int64_t now)
+{
+    bool running = false;
+    for (int bulb = 0; bulb < bluetooth_bulb_count(); bulb++) {
+        struct fade * fade = &fades[bulb];
+        if (!fade->active) {
+            continue;
+        }
+
+        const bool finished = now - fade->start_time >= fade->period_us;
+        const struct rgb_colour rgb = colours_hsv_to_rgb(shown_colour(bulb, now));
+        if (finished) {
+            fade->active = false;
+        } else {
+            running = true;
+        }
+        if (!finished && fade->written
+            && rgb.r == fade->last_rgb.r && rgb.g == fade->last_rgb.g && rgb.b == fade->last_rgb.b) {
+            continue;
+        }
+        fade->last_rgb = rgb;
+        fade->written = true;
+        if (finished && !fade->on_off) {
+            bluetooth_turn_bulb_off(bulb);
+        } else {
+            bluetooth_set_bulb_colour(bulb, rgb);
+        }
+    }
+    return running;
+}
+
+bool transition_set_bulb_state(const int bulb, const struct hsv_colour colour, const bool on_off, const uint32_t period_ms)
+{
+    if ( bulb < 0 || bulb >= bluetooth_bulb_count() ) {
+        return false;
+    }
+
+    const int64_t now = esp_timer_get_time();
+    struct fade * fade = &fades[bulb];
+    if (period_ms == 0 || !bluetooth_bulb_connected(bulb)) {
+        /* a direct change cancels any fade, so the next frame does not overwrite it */
+        fade->active = false;
+        return on_off ? bluetooth_set_bulb_colour(bulb, colours_hsv_to_rgb(colour)) : bluetooth_turn_bulb_off(bulb);
+    }
+
+    /* start from wherever the bulb is now, which may be part way through another fade */
+    fade->from = shown_colour(bulb, now);
+    fade->to = colour;
+    if (!on_off) {
+        fade->to.v = 0;
+    }
+    if (fade->from.v == 0) {
+        /* from off, only the brightness needs to change */
+        fade->from.h = fade->to.h;
+        fade->from.s = fade->to.s;
+    }
+    fade->on_off = on_off;
+    fade->start_time = now;
+    fade->period_us = period_ms * 1000LL;
+    fade->written = false;
+    fade->active = true;
+
+    ESP_LOGD(log_tag, "Bulb %d fading over %d ms", bulb, period_ms);
+    return true;
+}
+
+bool transition_active(const int bulb)
+{
+    return fades[bulb].active;
+}
+
+bool transition_running(void)
+{
+    for (int bulb = 0; bulb < bluetooth_bulb_count(); bulb++) {
+        if (fades[bulb].active) {
+            return true;
+        }
+    }
+    return false;
+}
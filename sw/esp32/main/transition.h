@@ -0,0 +1,62 @@
+/**
+ * @file Fades between bulb states over the transition_period of a lighting command
+ */
+
+#ifndef INTELLILIGHT_TRANSITION_H
+#define INTELLILIGHT_TRANSITION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "colours.h"
+
+/* one frame per connection event with the fast connection parameters, the bridge stretches the frame */
+/* period to the connection interval of bulbs still on the idle ones */
+#define TRANSITION_FRAME_US 7500
+
+/* Every function except transition_interpolate is called by the BLE bridge task only. */
+
+/**
+ * @brief Colour part way through a fade, the hue taking the shorter way round the colour wheel
+ * @param from Colour at the start of the fade
+ * @param to Colour at the end of the fade
+ * @param elapsed_us Time since the fade started
+ * @param period_us Length of the fade
+ * @return Interpolated colour, from before the start and to after the end
+ */
+extern struct hsv_colour transition_interpolate(const struct hsv_colour from, const struct hsv_colour to,
+    const int64_t elapsed_us, const int64_t period_us);
+
+/**
+ * @brief Send the frame due at a given time to every fading bulb
+ * Called for each tick of the frame timer, the time is a parameter so frame timing can be checked against any clock.
+ * @param now Current time in microseconds
+ * @return true while any fade is still running
+ */
+extern bool transition_step(const int64_t now);
+
+/**
+ * @brief Change the state of a bulb, fading to it over a period
+ * Called by the BLE bridge task for each lighting command. A fade already running on the bulb is
+ * retargeted from the colour it has reached.
+ * @param bulb Index of the bulb
+ * @param colour Colour to end at, also kept while the bulb is off
+ * @param on_off Whether the bulb ends on
+ * @param period_ms Length of the fade, 0 to change straight away
+ * @return false if the bulb is not connected
+ */
+extern bool transition_set_bulb_state(const int bulb, const struct hsv_colour colour, const bool on_off, const uint32_t period_ms);
+
+/**
+ * @brief Check whether a bulb is part way through a fade
+ * @param bulb Index of the bulb
+ * @return true while frames are still to be sent to the bulb
+ */
+extern bool transition_active(const int bulb);
+
+/**
+ * @brief Check whether any bulb is part way through a fade, so the frame timer is needed
+ */
+extern bool transition_running(void);
+
+#endif
@@ -5,39 +5,161 @@
 /* system includes */
 #include <string.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <errno.h>
-#include <netdb.h>
-#include <arpa/inet.h>
 #include "esp_netif.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "esp_wifi.h"
 #include "esp_log.h"
 #include "esp_event.h"
-#include "nvs_flash.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "nvs.h"
 
 /* local includes */
-#include "bluetooth.h"
-#include "tplink_kasa.h"
+#include "boot_profile.h"
+#include "network.h"
 #include "wifi.h"
 
 /* constants */
 static const char *log_tag = "wifi";
-static const uint32_t port = 9999;
 static const uint8_t mac_address[] = {0xC0, 0xC9, 0xE3, 0xAD, 0x7C, 0x1D};
 
-/* flag to indicate that server threads are running */
-static bool server_running = false;
+/* reconnection backoff, doubled on each failed attempt up to the maximum */
+#define RECONNECT_MIN_DELAY_MS 250
+#define RECONNECT_MAX_DELAY_MS 60000
 
-/* handles to server threads */
-TaskHandle_t handle_tcp_server = NULL;
-TaskHandle_t handle_udp_server = NULL;
+/* timer used to retry the connection without blocking the event loop */
+static esp_timer_handle_t reconnect_timer = NULL;
+
+/* number of reconnection attempts since the link was lost */
+static uint32_t reconnect_attempts = 0;
+
+/* time the link was lost, to report how long reconnection took */
+static int64_t disconnect_time = 0;
+
+/* NVS location of the access point used for the last successful association */
+static const char *nvs_namespace = "wifi";
+static const char *nvs_key_last_ap = "last_ap";
 
 /**
- * @brief Start TCP/UDP servers on port 9999
+ * @brief Access point details needed to associate without scanning
  */
-void start_servers(void);
+struct wifi_last_ap
+{
+    uint8_t bssid[6];
+    uint8_t channel;
+};
+
+/* access point last associated with, as stored in NVS */
+static struct wifi_last_ap last_ap;
+static bool last_ap_valid = false;
+
+/* true while associating directly with the cached access point rather than after a scan */
+static bool direct_attempt = false;
+
+static void wifi_load_last_ap(void)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(last_ap);
+    if (nvs_open(nvs_namespace, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+    last_ap_valid = nvs_get_blob(nvs, nvs_key_last_ap, &last_ap, &len) == ESP_OK && len == sizeof(last_ap);
+    nvs_close(nvs);
+}
+
+static void wifi_save_last_ap(const uint8_t * bssid, const uint8_t channel)
+{
+    /* only write to flash when the access point has actually changed */
+    if (last_ap_valid && memcmp(last_ap.bssid, bssid, sizeof(last_ap.bssid)) == 0 && last_ap.channel == channel) {
+        return;
+    }
+    memcpy(last_ap.bssid, bssid, sizeof(last_ap.bssid));
+    last_ap.channel = channel;
+    last_ap_valid = true;
+
+    nvs_handle_t nvs;
+    if (nvs_open(nvs_namespace, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(nvs, nvs_key_last_ap, &last_ap, sizeof(last_ap)) == ESP_OK) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+static void wifi_use_cached_ap(void)
+{
+    /* associate directly with the last access point on its channel, without scanning */
+    wifi_config_t wifi_config;
+    esp_wifi_get_config(WIFI_IF_STA, &wifi_config);
+    memcpy(wifi_config.sta.bssid, last_ap.bssid, sizeof(wifi_config.sta.bssid));
+    wifi_config.sta.bssid_set = true;
+    wifi_config.sta.channel = last_ap.channel;
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    direct_attempt = true;
+}
+
+static void wifi_use_full_scan(void)
+{
+    /* forget the cached access point and let the driver scan every channel */
+    wifi_config_t wifi_config;
+    esp_wifi_get_config(WIFI_IF_STA, &wifi_config);
+    wifi_config.sta.bssid_set = false;
+    wifi_config.sta.channel = 0;
+    wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    direct_attempt = false;
+}
+
+static void reconnect_timer_callback(void* arg)
+{
+    ESP_LOGI(log_tag, "Reconnecting (attempt %d)", reconnect_attempts);
+    esp_wifi_connect();
+}
+
+static bool wifi_reason_is_transient(const uint8_t reason)
+{
+    /* the access point is probably still there, so it is worth trying again straight away */
+    switch (reason) {
+    case WIFI_REASON_BEACON_TIMEOUT:
+    case WIFI_REASON_AUTH_EXPIRE:
+    case WIFI_REASON_ASSOC_EXPIRE:
+    case WIFI_REASON_NOT_AUTHED:
+    case WIFI_REASON_NOT_ASSOCED:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void wifi_schedule_reconnect(const uint8_t reason)
+{
+    if (reconnect_attempts == 0) {
+        disconnect_time = esp_timer_get_time();
+    }
+
+    /* first retry after a transient loss is immediate */
+    if (reconnect_attempts == 0 && wifi_reason_is_transient(reason)) {
+        reconnect_attempts++;
+        esp_wifi_connect();
+        return;
+    }
+
+    /* exponential backoff with the upper half of the delay randomised, so several bridges do not retry in step */
+    uint32_t delay_ms = RECONNECT_MAX_DELAY_MS;
+    if (reconnect_attempts < 16) {
+        delay_ms = RECONNECT_MIN_DELAY_MS << reconnect_attempts;
+        if (delay_ms > RECONNECT_MAX_DELAY_MS) delay_ms = RECONNECT_MAX_DELAY_MS;
+    }
+    delay_ms = delay_ms / 2 + esp_random() % (delay_ms / 2 + 1);
+    reconnect_attempts++;
+
+    ESP_LOGI(log_tag, "Reconnecting in %d ms", delay_ms);
+    esp_timer_stop(reconnect_timer);
+    esp_timer_start_once(reconnect_timer, delay_ms * 1000ULL);
+}
 
 static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
@@ -53,37 +175,46 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
         // 1) call esp_wifi_connect() to reconnect the Wi-Fi
         // 2) close all sockets
         // 3) re-create them if necessary
-        ESP_LOGE(log_tag, "WiFi disconnected, reconnecting...");
-        server_running = false;
-        vTaskDelay(1000 / portTICK_RATE_MS);
-        esp_wifi_connect();
+        // the event loop must never sleep, so the reconnection is scheduled on a timer
+        wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
+        ESP_LOGE(log_tag, "WiFi disconnected (reason %d), reconnecting...", event->reason);
+        network_link_down();
+        if (direct_attempt) {
+            ESP_LOGW(log_tag, "Direct association with cached access point failed, falling back to a full scan");
+            wifi_use_full_scan();
+        } else if (reconnect_attempts == 0 && last_ap_valid) {
+            wifi_use_cached_ap();
+        }
+        wifi_schedule_reconnect(event->reason);
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        // remember the access point so the next boot or reconnect can skip the scan
+        wifi_event_sta_connected_t* event = (wifi_event_sta_connected_t*) event_data;
+        wifi_save_last_ap(event->bssid, event->channel);
+        direct_attempt = false;
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         // ESP has successfully connected to the configured wifi access point
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        start_servers();
+        network_link_up();
         ESP_LOGI(log_tag, "ESP acquired IP address:" IPSTR, IP2STR(&event->ip_info.ip));
-    } else if (event_id == WIFI_EVENT_AP_STACONNECTED) {
+        boot_profile_mark(BOOT_PHASE_IP_ACQUIRED);
+        if (reconnect_attempts > 0) {
+            ESP_LOGI(log_tag, "Reconnected after %d attempts in %lld ms",
+                reconnect_attempts, (esp_timer_get_time() - disconnect_time) / 1000);
+            reconnect_attempts = 0;
+        }
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_START) {
+        // the access point of the ESP is up, so it can serve devices which join it
+        network_link_up();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STACONNECTED) {
         // a wifi device has connected to the access point of the ESP
-        start_servers();
         wifi_event_ap_staconnected_t* event = (wifi_event_ap_staconnected_t*) event_data;
         ESP_LOGI(log_tag, "station "MACSTR" join, AID=%d", MAC2STR(event->mac), event->aid);
     }
 }
 
-static esp_err_t configure_nvs_flash(void)
-{
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
-    }
-    
-    return ret;
-}
-
 void wifi_setup(bool access_point)
 {
-    ESP_ERROR_CHECK(configure_nvs_flash());
+    /* NVS has already been initialised by app_main */
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
@@ -131,155 +262,25 @@ void wifi_setup(bool access_point)
         ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
         ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
         ESP_ERROR_CHECK(esp_wifi_set_mac(WIFI_IF_STA, &mac_address[0]));
-    }
-    
-    ESP_ERROR_CHECK(esp_wifi_start());
-}
-
-static void server_task(void *pvParameters)
-{
-    char addr_str[128];
-    const int socket_type = (int)pvParameters;
-    const bool is_tcp_server = socket_type == SOCK_STREAM;
-    const bool is_udp_server = socket_type == SOCK_DGRAM;
-    struct sockaddr_storage source_addr;
-    socklen_t addr_len = sizeof(source_addr);
-    struct sockaddr_storage dest_addr;
-    struct sockaddr_in *dest_addr_ip4 = (struct sockaddr_in *)&dest_addr;
-    dest_addr_ip4->sin_addr.s_addr = htonl(INADDR_ANY);
-    dest_addr_ip4->sin_family = AF_INET;
-    dest_addr_ip4->sin_port = htons(port);
-
-    /* TCP timeout settings */
-    int keepAlive = 1;
-    int keepIdle = 5;
-    int keepInterval = 5;
-    int keepCount = 3;
-
-    /* allocate receive buffer */
-    const int buffer_len = 2000;
-    char * raw_buffer = malloc(buffer_len * sizeof(char));
-
-    /* create TCP/UDP socket */
-    int my_sock = socket(AF_INET, socket_type, IPPROTO_IP);
-    if (my_sock < 0) {
-        ESP_LOGE(log_tag, "Unable to create socket: errno %d", errno);
-        return;
-    }
-    int opt = 1;
-    setsockopt(my_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    ESP_LOGI(log_tag, "Socket created");
-
-    /* set UDP receive timeout */
-    if (is_udp_server) {
-        struct timeval timeout;
-        timeout.tv_sec = 5;
-        timeout.tv_usec = 0;
-        setsockopt(my_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
-    }
-
-    /* configure TCP socket as non-blocking */
-    if (is_tcp_server) {
-        fcntl(my_sock, F_SETFL, fcntl(my_sock, F_GETFL) | O_NONBLOCK);
-    }
 
-    /* bind to TCP/UDP port */
-    int err = bind(my_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-    if (err != 0) {
-        ESP_LOGE(log_tag, "Socket unable to bind: errno %d", errno);
-        goto CLEAN_UP;
-    }
-    ESP_LOGI(log_tag, "Socket bound, port %d", port);
-
-    /* for TCP server, set socket into listening mode */
-    if (is_tcp_server && (listen(my_sock, 1) != 0)) {
-        ESP_LOGE(log_tag, "Error listening on TCP socket: errno %d", errno);
-        goto CLEAN_UP;
-    }
-
-    /* receive loop */
-    server_running = true;
-    while (server_running)
-    {
-        int rx_len = 0;
-        int connection = 0;
-
-        /* for UDP server, periodically try to read a buffer of data from the socket */
-        if (is_udp_server) {
-            rx_len = recvfrom(my_sock, raw_buffer, buffer_len - 1, 0, (struct sockaddr *)&source_addr, &addr_len);
-            if (rx_len < 0) {
-                vTaskDelay(500 / portTICK_RATE_MS);
-                continue;
-            }
-        }
-
-        /* for TCP server, wait to accept client connection */
-        if (is_tcp_server) {
-            connection = accept(my_sock, (struct sockaddr *)&source_addr, &addr_len);
-            if (connection < 0) {
-                vTaskDelay(500 / portTICK_RATE_MS);
-                continue;
-            }
-            /* client connection has been accepted, kepp it alive */
-            setsockopt(connection, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
-            setsockopt(connection, IPPROTO_TCP, 5, &keepIdle, sizeof(int));
-            setsockopt(connection, IPPROTO_TCP, 5, &keepInterval, sizeof(int));
-            setsockopt(connection, IPPROTO_TCP, 3, &keepCount, sizeof(int));
-            /* get a buffer of data */
-            rx_len = recv(connection, raw_buffer, buffer_len - 1, 0);
-            if (rx_len < 0) {
-                ESP_LOGE(log_tag, "Error occurred during TCP receive: errno %d", errno);
-                continue;
-            } else if (rx_len == 0) {
-                ESP_LOGI(log_tag, "Connection closed");
-                continue;
-            }
-        }
-
-        /* connection has now been made, so get the client IP address */
-        if (source_addr.ss_family == PF_INET) {
-            inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
-        }
-        ESP_LOGI(log_tag, "Connection from %s:%d/%s", addr_str, port, is_tcp_server ? "TCP" : "UDP");
-
-        /* process the buffer and generate a response */
-        int reply_len = tplink_kasa_process_buffer(raw_buffer, rx_len, is_tcp_server);
-
-        /* send a response back to the client */
-        ESP_LOGI(log_tag, "Replying with %d bytes", reply_len);
-        if (is_udp_server) {
-            int err = sendto(my_sock, raw_buffer, reply_len, 0, (struct sockaddr *)&source_addr, sizeof(source_addr));
-            if (err < 0) {
-                ESP_LOGE(log_tag, "Error occurred during UDP send: errno %d", errno);
-            }
-        }
-        if (is_tcp_server) {
-            int to_write = reply_len;
-            while (to_write > 0) {
-                int written = send(connection, raw_buffer + (reply_len - to_write), to_write, 0);
-                if (written < 0) {
-                    ESP_LOGE(log_tag, "Error occurred during TCP send: errno %d", errno);
-                    break;
-                }
-                to_write -= written;
-            }
-            shutdown(connection, 0);
-            close(connection);
+        /* associate straight away with the last access point if known, the driver keeps the PMK in NVS */
+        /* (WIFI_STORAGE_FLASH is the default) so the handshake does not have to derive it again */
+        wifi_load_last_ap();
+        if (last_ap_valid) {
+            ESP_LOGI(log_tag, "Trying cached access point "MACSTR" on channel %d", MAC2STR(last_ap.bssid), last_ap.channel);
+            wifi_use_cached_ap();
         }
     }
+    
+    const esp_timer_create_args_t reconnect_timer_args = {
+        .callback = &reconnect_timer_callback,
+        .name = "wifi_reconnect",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&reconnect_timer_args, &reconnect_timer));
 
-CLEAN_UP:
-    free(raw_buffer);
-    close(my_sock);
-    if (is_tcp_server) ESP_LOGI(log_tag, "TCP server ended");
-    if (is_udp_server) ESP_LOGI(log_tag, "UDP server ended");
-    vTaskDelete(NULL);
-}
+    /* the network tasks are created once and follow the link state from here on */
+    network_init();
 
-void start_servers(void)
-{   
-    /* start a TCP server on port 9999 for control commands (e.g. colour/on/off) */
-    xTaskCreate(server_task, "tcp_server", 4096, (void*)SOCK_STREAM, 5, &handle_tcp_server);
-    /* start a UDP server on port 9999 for get_sysinfo commands */
-    xTaskCreate(server_task, "udp_server", 4096, (void*)SOCK_DGRAM, 5, &handle_udp_server);
+    ESP_ERROR_CHECK(esp_wifi_start());
+    boot_profile_mark(BOOT_PHASE_WIFI_STARTED);
 }
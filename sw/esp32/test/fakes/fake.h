@@ -0,0 +1,54 @@
+/**
+ * @file Controls for the host fakes of ESP-IDF, FreeRTOS and Bluedroid
+ */
+
+#ifndef INTELLILIGHT_FAKE_H
+#define INTELLILIGHT_FAKE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "idf_stub.h"
+
+/**
+ * @brief Advance the simulated clock, running every esp_timer that expires on the way
+ * @param us Microseconds to advance by
+ */
+extern void fake_clock_advance(const int64_t us);
+
+/**
+ * @brief Run a timer callback directly when the simulated clock reaches its expiry (default),
+ * or switch to the monotonic clock of the host for tests with real threads
+ * @param real true to follow the host clock, timers then no longer fire
+ */
+extern void fake_clock_use_real(const bool real);
+
+/**
+ * @brief Choose whether xTaskCreate starts a thread or only records the task (default)
+ * @param run true to start a thread for every task created from now on
+ */
+extern void fake_tasks_run(const bool run);
+
+/**
+ * @brief Number of times an esp_timer or queue function was called inside a critical section
+ */
+extern uint32_t fake_critical_violations;
+
+/**
+ * @brief Seed the pseudo random numbers returned by esp_random
+ */
+extern void fake_random_seed(const uint32_t seed);
+
+/**
+ * @brief Wi-Fi driver activity recorded by the fake
+ */
+struct fake_wifi
+{
+    uint32_t connect_calls;
+    int64_t last_connect_time;
+    wifi_config_t sta_config;
+    esp_event_handler_t handler;
+};
+extern struct fake_wifi fake_wifi;
+
+#endif
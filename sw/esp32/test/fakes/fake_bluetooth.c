@@ -0,0 +1,140 @@
+/**
+ * @file Fake of the bluetooth.h interface, for testing the protocol handlers without the BLE bridge
+ */
+
+#include <unistd.h>
+
+#include "fake_bluetooth.h"
+#include "esp_timer.h"
+
+struct light_state bulb_state[BLUETOOTH_MAX_BULBS];
+struct fake_bluetooth fake_bluetooth;
+
+void fake_bluetooth_reset(const int bulb_count)
+{
+    memset(&fake_bluetooth, 0, sizeof(fake_bluetooth));
+    memset(bulb_state, 0, sizeof(bulb_state));
+    fake_bluetooth.bulb_count = bulb_count;
+    fake_bluetooth.accept_commands = true;
+    for (int bulb = 0; bulb < BLUETOOTH_MAX_BULBS; bulb++) {
+        fake_bluetooth.connected[bulb] = true;
+        fake_bluetooth.link[bulb].rssi = BLUETOOTH_RSSI_UNKNOWN;
+    }
+}
+
+int bluetooth_bulb_count(void)
+{
+    return fake_bluetooth.bulb_count;
+}
+
+uint32_t bluetooth_state_version(void)
+{
+    return fake_bluetooth.version;
+}
+
+struct light_state bluetooth_reported_state(const int bulb)
+{
+    return bulb_state[bulb];
+}
+
+static bool fake_bluetooth_write(const int bulb, const bool off, const struct rgb_colour rgb)
+{
+    if (!bluetooth_bulb_connected(bulb)) {
+        return false;
+    }
+    if (fake_bluetooth.write_count < FAKE_BLUETOOTH_MAX_WRITES) {
+        fake_bluetooth.writes[fake_bluetooth.write_count++] = (struct fake_bluetooth_write){
+            .bulb = bulb, .off = off, .rgb = rgb, .time = esp_timer_get_time(),
+        };
+    }
+    return true;
+}
+
+bool bluetooth_set_bulb_colour(const int bulb, const struct rgb_colour rgb)
+{
+    return fake_bluetooth_write(bulb, false, rgb);
+}
+
+bool bluetooth_turn_bulb_off(const int bulb)
+{
+    return fake_bluetooth_write(bulb, true, (struct rgb_colour){ 0 });
+}
+
+bool bluetooth_send_command(const struct bulb_command * command)
+{
+    if (command->bulb < 0 || command->bulb >= fake_bluetooth.bulb_count || !fake_bluetooth.accept_commands
+        || (fake_bluetooth.busy_bulbs & (1UL << command->bulb))) {
+        return false;
+    }
+    if (fake_bluetooth.command_count < FAKE_BLUETOOTH_MAX_COMMANDS) {
+        fake_bluetooth.commands[fake_bluetooth.command_count++] = *command;
+    }
+    struct light_state * desired = &fake_bluetooth.desired[command->bulb];
+    desired->colour = command->colour;
+    desired->on_off = command->on_off;
+    return true;
+}
+
+struct light_state bluetooth_desired_state(const int bulb)
+{
+    return fake_bluetooth.desired[bulb];
+}
+
+bool bluetooth_bulb_connected(const int bulb)
+{
+    return bulb >= 0 && bulb < fake_bluetooth.bulb_count && fake_bluetooth.connected[bulb];
+}
+
+void bluetooth_request_bulb_state(const int bulb)
+{
+    fake_bluetooth.state_requests++;
+}
+
+bool bluetooth_wait_fresh_state(const uint32_t max_age_ms, const uint32_t timeout_ms)
+{
+    fake_bluetooth.fresh_waits++;
+    if (fake_bluetooth.fresh_wait_ms > 0) {
+        usleep(fake_bluetooth.fresh_wait_ms * 1000);
+    }
+    return true;
+}
+
+struct bluetooth_link_quality bluetooth_link_quality(const int bulb)
+{
+    return fake_bluetooth.link[bulb];
+}
+
+struct bluetooth_scan_stats bluetooth_get_scan_stats(void)
+{
+    return fake_bluetooth.scan_stats;
+}
+
+struct bluetooth_tx_stats bluetooth_get_tx_stats(void)
+{
+    return fake_bluetooth.tx_stats;
+}
+
+struct bluetooth_conn_stats bluetooth_get_conn_stats(void)
+{
+    return fake_bluetooth.conn_stats;
+}
+
+struct bluetooth_bridge_stats bluetooth_get_bridge_stats(void)
+{
+    return fake_bluetooth.bridge_stats;
+}
+
+struct bluetooth_state_stats bluetooth_get_state_stats(void)
+{
+    return fake_bluetooth.state_stats;
+}
+
+struct bluetooth_command_stats bluetooth_get_command_stats(void)
+{
+    return fake_bluetooth.command_stats;
+}
+
+struct bluetooth_link_stats bluetooth_get_link_stats(void)
+{
+    return fake_bluetooth.link_stats;
+}
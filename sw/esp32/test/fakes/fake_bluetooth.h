@@ -0,0 +1,59 @@
+/**
+ * @file Fake of the bluetooth.h interface, for testing the protocol handlers without the BLE bridge
+ */
+
+#ifndef INTELLILIGHT_FAKE_BLUETOOTH_H
+#define INTELLILIGHT_FAKE_BLUETOOTH_H
+
+#include "bluetooth.h"
+
+#define FAKE_BLUETOOTH_MAX_COMMANDS 64
+#define FAKE_BLUETOOTH_MAX_WRITES   256
+
+/**
+ * @brief Colour written to a bulb
+ */
+struct fake_bluetooth_write
+{
+    int bulb;
+    bool off;
+    struct rgb_colour rgb;
+    int64_t time;
+};
+
+/**
+ * @brief State reported by the fake and the commands it was sent
+ */
+struct fake_bluetooth
+{
+    int bulb_count;
+    bool connected[BLUETOOTH_MAX_BULBS];
+    bool accept_commands;           /* value returned by bluetooth_send_command */
+    uint32_t busy_bulbs;            /* bulbs whose commands are refused even so */
+    struct light_state desired[BLUETOOTH_MAX_BULBS];
+    struct bluetooth_link_quality link[BLUETOOTH_MAX_BULBS];
+    struct bulb_command commands[FAKE_BLUETOOTH_MAX_COMMANDS];
+    int command_count;
+    struct fake_bluetooth_write writes[FAKE_BLUETOOTH_MAX_WRITES];
+    int write_count;
+    uint32_t state_requests;
+    uint32_t fresh_waits;
+    uint32_t fresh_wait_ms;         /* time bluetooth_wait_fresh_state takes, as reading a slow bulb would */
+    uint32_t version;
+
+    struct bluetooth_scan_stats scan_stats;
+    struct bluetooth_tx_stats tx_stats;
+    struct bluetooth_conn_stats conn_stats;
+    struct bluetooth_bridge_stats bridge_stats;
+    struct bluetooth_state_stats state_stats;
+    struct bluetooth_command_stats command_stats;
+    struct bluetooth_link_stats link_stats;
+};
+extern struct fake_bluetooth fake_bluetooth;
+
+/**
+ * @brief Reset the fake to a number of connected bulbs which accept commands
+ */
+extern void fake_bluetooth_reset(const int bulb_count);
+
+#endif
@@ -0,0 +1,525 @@
+/**
+ * @file Fake of the Bluedroid API with simulated bulbs, for testing the BLE bridge
+ *
+ * Events are kept in a list with the time they are due and delivered by
+ * fake_bt_run, so the bridge sees them arrive from the stack as it would on the
+ * device. Responses from a connected bulb take one or two connection intervals.
+ */
+
+#include <string.h>
+
+#include "esp_timer.h"
+#include "fake_bt.h"
+
+#define MAX_PENDING 256
+#define CONN_INTERVAL_DEFAULT   24      /* 30 ms, units of 1.25 ms */
+#define CONN_TIMEOUT_DEFAULT    400     /* 4 s, units of 10 ms */
+#define GATTC_IF                3
+#define RSSI                    -60
+
+struct pending_event
+{
+    int64_t due;
+    const struct fake_bt_bulb * bulb;   /* bulb the event comes from, NULL for the controller */
+    bool gap;
+    esp_gap_ble_cb_event_t gap_event;
+    esp_ble_gap_cb_param_t gap_param;
+    esp_gattc_cb_event_t gattc_event;
+    esp_ble_gattc_cb_param_t gattc_param;
+    uint8_t value[4];
+};
+
+struct fake_bt fake_bt;
+
+static struct pending_event pending[MAX_PENDING];
+static int pending_count = 0;
+static esp_gap_ble_cb_t gap_cb = NULL;
+static esp_gattc_cb_t gattc_cb = NULL;
+
+static void add_gap_event(const struct fake_bt_bulb * bulb, const int64_t delay_us,
+    const esp_gap_ble_cb_event_t event, const esp_ble_gap_cb_param_t * param)
+{
+    if (pending_count == MAX_PENDING) {
+        return;
+    }
+    pending[pending_count++] = (struct pending_event){
+        .due = esp_timer_get_time() + delay_us, .bulb = bulb, .gap = true, .gap_event = event, .gap_param = *param,
+    };
+}
+
+static struct pending_event * add_gattc_event(const struct fake_bt_bulb * bulb, const int64_t delay_us,
+    const esp_gattc_cb_event_t event, const esp_ble_gattc_cb_param_t * param)
+{
+    if (pending_count == MAX_PENDING) {
+        return NULL;
+    }
+    pending[pending_count] = (struct pending_event){
+        .due = esp_timer_get_time() + delay_us, .bulb = bulb, .gap = false, .gattc_event = event, .gattc_param = *param,
+    };
+    return &pending[pending_count++];
+}
+
+static struct fake_bt_bulb * find_bda(const uint8_t * bda)
+{
+    for (int i = 0; i < fake_bt.bulb_count; i++) {
+        if (memcmp(fake_bt.bulbs[i].bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+            return &fake_bt.bulbs[i];
+        }
+    }
+    return NULL;
+}
+
+static struct fake_bt_bulb * find_conn_id(const uint16_t conn_id)
+{
+    if (conn_id < fake_bt.bulb_count && fake_bt.bulbs[conn_id].connected) {
+        return &fake_bt.bulbs[conn_id];
+    }
+    return NULL;
+}
+
+/* a connected bulb in range answers at its next connection event, one out of range never does */
+static bool answers(const struct fake_bt_bulb * bulb)
+{
+    return bulb != NULL && bulb->connected && bulb->in_range;
+}
+
+static int64_t interval_us(const struct fake_bt_bulb * bulb, const int events)
+{
+    return bulb->interval * 1250LL * events;
+}
+
+static void drop_link(struct fake_bt_bulb * bulb, const esp_gatt_conn_reason_t reason)
+{
+    bulb->connected = false;
+    bulb->notifying = false;
+    bulb->lost_time = 0;
+    /* whatever the bulb had still to answer is lost with the link */
+    int kept = 0;
+    for (int i = 0; i < pending_count; i++) {
+        if (pending[i].bulb != bulb) {
+            pending[kept++] = pending[i];
+        }
+    }
+    pending_count = kept;
+    esp_ble_gattc_cb_param_t param = { .disconnect = { .reason = reason, .conn_id = bulb->conn_id } };
+    memcpy(param.disconnect.remote_bda, bulb->bda, sizeof(esp_bd_addr_t));
+    add_gattc_event(bulb, 0, ESP_GATTC_DISCONNECT_EVT, &param);
+}
+
+static void connect_bulb(struct fake_bt_bulb * bulb)
+{
+    bulb->opening = false;
+    bulb->connected = true;
+    bulb->notifying = false;
+    bulb->lost_time = 0;
+    bulb->interval = CONN_INTERVAL_DEFAULT;
+    bulb->latency = 0;
+    bulb->timeout = CONN_TIMEOUT_DEFAULT;
+
+    esp_ble_gattc_cb_param_t param = { .connect = { .conn_id = bulb->conn_id,
+        .conn_params = { .interval = bulb->interval, .latency = bulb->latency, .timeout = bulb->timeout } } };
+    memcpy(param.connect.remote_bda, bulb->bda, sizeof(esp_bd_addr_t));
+    add_gattc_event(bulb, 0, ESP_GATTC_CONNECT_EVT, &param);
+
+    param = (esp_ble_gattc_cb_param_t){ .open = { .status = ESP_GATT_OK, .conn_id = bulb->conn_id, .mtu = 23 } };
+    memcpy(param.open.remote_bda, bulb->bda, sizeof(esp_bd_addr_t));
+    add_gattc_event(bulb, 0, ESP_GATTC_OPEN_EVT, &param);
+
+    param = (esp_ble_gattc_cb_param_t){ .dis_srvc_cmpl = { .status = ESP_GATT_OK, .conn_id = bulb->conn_id } };
+    add_gattc_event(bulb, FAKE_BT_DISCOVERY_US, ESP_GATTC_DIS_SRVC_CMPL_EVT, &param);
+}
+
+void fake_bt_reset(const int bulb_count)
+{
+    memset(&fake_bt, 0, sizeof(fake_bt));
+    pending_count = 0;
+    fake_bt.bulb_count = bulb_count;
+    fake_bt.sendable_packets = 10;
+    for (int i = 0; i < bulb_count; i++) {
+        struct fake_bt_bulb * bulb = &fake_bt.bulbs[i];
+        const esp_bd_addr_t bda = { 0xa4, 0xc1, 0x38, 0x00, 0x00, i + 1 };
+        memcpy(bulb->bda, bda, sizeof(bda));
+        bulb->in_range = true;
+        bulb->has_char = true;
+        bulb->can_notify = true;
+        bulb->value[0] = 0xD0;
+        bulb->conn_id = i;
+    }
+}
+
+void fake_bt_set_in_range(const int bulb, const bool in_range)
+{
+    struct fake_bt_bulb * sim = &fake_bt.bulbs[bulb];
+    sim->in_range = in_range;
+    sim->lost_time = !in_range && sim->connected ? esp_timer_get_time() : 0;
+}
+
+void fake_bt_set_value(const int bulb, const uint8_t * value)
+{
+    struct fake_bt_bulb * sim = &fake_bt.bulbs[bulb];
+    memcpy(sim->value, value, sizeof(sim->value));
+    if (!answers(sim) || !sim->notifying) {
+        return;
+    }
+    esp_ble_gattc_cb_param_t param = { .notify = { .conn_id = sim->conn_id, .handle = FAKE_BT_CHAR_HANDLE,
+        .value_len = sizeof(sim->value), .is_notify = true } };
+    memcpy(param.notify.remote_bda, sim->bda, sizeof(esp_bd_addr_t));
+    struct pending_event * event = add_gattc_event(sim, interval_us(sim, 1), ESP_GATTC_NOTIFY_EVT, &param);
+    if (event != NULL) {
+        memcpy(event->value, sim->value, sizeof(sim->value));
+    }
+}
+
+void fake_bt_run(void)
+{
+    const int64_t now = esp_timer_get_time();
+
+    for (int i = 0; i < fake_bt.bulb_count; i++) {
+        struct fake_bt_bulb * bulb = &fake_bt.bulbs[i];
+        if (bulb->connected && bulb->lost_time > 0 && now - bulb->lost_time >= bulb->timeout * 10000LL) {
+            bulb->timeouts++;
+            drop_link(bulb, ESP_GATT_CONN_TIMEOUT);
+        }
+        if (bulb->opening) {
+            if (bulb->in_range && now - bulb->open_time >= FAKE_BT_CONNECT_US) {
+                connect_bulb(bulb);
+            } else if (now - bulb->open_time >= FAKE_BT_DIRECT_TIMEOUT_US) {
+                bulb->opening = false;
+                esp_ble_gattc_cb_param_t param = { .open = { .status = ESP_GATT_ERROR, .conn_id = bulb->conn_id } };
+                memcpy(param.open.remote_bda, bulb->bda, sizeof(esp_bd_addr_t));
+                add_gattc_event(bulb, 0, ESP_GATTC_OPEN_EVT, &param);
+            }
+        }
+        /* the scan only reports the bulbs in the whitelist, which are all of them */
+        if (fake_bt.scanning && bulb->in_range && !bulb->connected && now >= bulb->next_adv) {
+            bulb->next_adv = now + FAKE_BT_ADV_INTERVAL_US;
+            esp_ble_gap_cb_param_t param = { .scan_rst = {
+                .search_evt = ESP_GAP_SEARCH_INQ_RES_EVT, .ble_addr_type = BLE_ADDR_TYPE_PUBLIC,
+                .ble_evt_type = ESP_BLE_EVT_CONN_ADV, .rssi = RSSI } };
+            memcpy(param.scan_rst.bda, bulb->bda, sizeof(esp_bd_addr_t));
+            add_gap_event(bulb, 0, ESP_GAP_BLE_SCAN_RESULT_EVT, &param);
+        }
+    }
+    if (fake_bt.scanning && now >= fake_bt.scan_end) {
+        fake_bt.scanning = false;
+        const esp_ble_gap_cb_param_t param = { .scan_rst = { .search_evt = ESP_GAP_SEARCH_INQ_CMPL_EVT } };
+        add_gap_event(NULL, 0, ESP_GAP_BLE_SCAN_RESULT_EVT, &param);
+    }
+
+    /* in the order they are due, the callbacks only queue them for the bridge so none are added meanwhile */
+    for (;;) {
+        int next = -1;
+        for (int i = 0; i < pending_count; i++) {
+            if (pending[i].due <= now && (next < 0 || pending[i].due < pending[next].due)) {
+                next = i;
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+        struct pending_event event = pending[next];
+        memmove(&pending[next], &pending[next + 1], (pending_count - next - 1) * sizeof(pending[0]));
+        pending_count--;
+        if (event.gap) {
+            if (gap_cb != NULL) gap_cb(event.gap_event, &event.gap_param);
+        } else {
+            if (event.gattc_event == ESP_GATTC_READ_CHAR_EVT) {
+                event.gattc_param.read.value = event.value;
+            }
+            if (event.gattc_event == ESP_GATTC_NOTIFY_EVT) {
+                event.gattc_param.notify.value = event.value;
+            }
+            if (gattc_cb != NULL) gattc_cb(event.gattc_event, GATTC_IF, &event.gattc_param);
+        }
+    }
+}
+
+/* controller and host stack */
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode) { return ESP_OK; }
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t * config) { return ESP_OK; }
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode) { return ESP_OK; }
+esp_err_t esp_bluedroid_init(void) { return ESP_OK; }
+esp_err_t esp_bluedroid_enable(void) { return ESP_OK; }
+esp_err_t esp_ble_gatt_set_local_mtu(uint16_t mtu) { return ESP_OK; }
+uint16_t esp_ble_get_sendable_packets_num(void) { return fake_bt.sendable_packets; }
+uint16_t esp_ble_get_cur_sendable_packets_num(uint16_t conn_id) { return fake_bt.sendable_packets; }
+
+uint8_t *esp_ble_resolve_adv_data(uint8_t * adv_data, uint8_t type, uint8_t * length)
+{
+    *length = 0;
+    return NULL;
+}
+
+/* GAP */
+
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t callback)
+{
+    gap_cb = callback;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_set_scan_params(esp_ble_scan_params_t * params)
+{
+    const esp_ble_gap_cb_param_t param = { .scan_param_cmpl = { .status = ESP_BT_STATUS_SUCCESS } };
+    add_gap_event(NULL, 0, ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_start_scanning(uint32_t duration)
+{
+    fake_bt.scanning = true;
+    fake_bt.scan_end = esp_timer_get_time() + duration * 1000000LL;
+    fake_bt.scans++;
+    const esp_ble_gap_cb_param_t param = { .scan_start_cmpl = { .status = ESP_BT_STATUS_SUCCESS } };
+    add_gap_event(NULL, 0, ESP_GAP_BLE_SCAN_START_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_stop_scanning(void)
+{
+    fake_bt.scanning = false;
+    const esp_ble_gap_cb_param_t param = { .scan_stop_cmpl = { .status = ESP_BT_STATUS_SUCCESS } };
+    add_gap_event(NULL, 0, ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t * params)
+{
+    struct fake_bt_bulb * bulb = find_bda(params->bda);
+    if (!answers(bulb)) {
+        return ESP_OK;
+    }
+    /* takes effect at the instant the update names, a few events on */
+    const int64_t delay_us = interval_us(bulb, 6);
+    bulb->interval = params->max_int;
+    bulb->latency = params->latency;
+    bulb->timeout = params->timeout;
+    esp_ble_gap_cb_param_t param = { .update_conn_params = { .status = ESP_BT_STATUS_SUCCESS,
+        .min_int = params->min_int, .max_int = params->max_int, .latency = params->latency,
+        .conn_int = params->max_int, .timeout = params->timeout } };
+    memcpy(param.update_conn_params.bda, bulb->bda, sizeof(esp_bd_addr_t));
+    add_gap_event(bulb, delay_us, ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_read_rssi(esp_bd_addr_t bda)
+{
+    struct fake_bt_bulb * bulb = find_bda(bda);
+    if (!answers(bulb)) {
+        return ESP_OK;
+    }
+    esp_ble_gap_cb_param_t param = { .read_rssi_cmpl = { .status = ESP_BT_STATUS_SUCCESS, .rssi = RSSI } };
+    memcpy(param.read_rssi_cmpl.remote_addr, bda, sizeof(esp_bd_addr_t));
+    add_gap_event(bulb, interval_us(bulb, 1), ESP_GAP_BLE_READ_RSSI_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_update_whitelist(bool add, esp_bd_addr_t bda, esp_ble_wl_addr_type_t type) { return ESP_OK; }
+esp_err_t esp_ble_gap_clear_whitelist(void) { return ESP_OK; }
+
+esp_err_t esp_ble_gap_get_whitelist_size(uint16_t * length)
+{
+    *length = 12;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_disconnect(esp_bd_addr_t bda)
+{
+    struct fake_bt_bulb * bulb = find_bda(bda);
+    if (bulb == NULL || !bulb->connected) {
+        return ESP_FAIL;
+    }
+    bulb->disconnects++;
+    drop_link(bulb, ESP_GATT_CONN_TERMINATE_LOCAL_HOST);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_set_prefer_conn_params(esp_bd_addr_t bda, uint16_t min_int, uint16_t max_int, uint16_t latency, uint16_t timeout)
+{
+    return ESP_OK;
+}
+
+/* GATT client */
+
+esp_err_t esp_ble_gattc_register_callback(esp_gattc_cb_t callback)
+{
+    gattc_cb = callback;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gattc_app_register(uint16_t app_id)
+{
+    const esp_ble_gattc_cb_param_t param = { .reg = { .status = ESP_GATT_OK, .app_id = app_id } };
+    add_gattc_event(NULL, 0, ESP_GATTC_REG_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gattc_open(esp_gatt_if_t gattc_if, esp_bd_addr_t bda, esp_ble_addr_type_t type, bool direct)
+{
+    struct fake_bt_bulb * bulb = find_bda(bda);
+    if (bulb == NULL || bulb->connected || bulb->opening) {
+        return ESP_FAIL;
+    }
+    if (bulb->opens < FAKE_BT_MAX_OPENS) {
+        bulb->open_times[bulb->opens] = esp_timer_get_time();
+    }
+    bulb->opens++;
+    bulb->opening = true;
+    bulb->open_direct = direct;
+    bulb->open_time = esp_timer_get_time();
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gattc_close(esp_gatt_if_t gattc_if, uint16_t conn_id)
+{
+    struct fake_bt_bulb * bulb = find_conn_id(conn_id);
+    if (bulb == NULL) {
+        return ESP_FAIL;
+    }
+    bulb->closes++;
+    drop_link(bulb, ESP_GATT_CONN_TERMINATE_LOCAL_HOST);
+    esp_ble_gattc_cb_param_t param = { .close = { .status = ESP_GATT_OK, .conn_id = conn_id,
+        .reason = ESP_GATT_CONN_TERMINATE_LOCAL_HOST } };
+    memcpy(param.close.remote_bda, bulb->bda, sizeof(esp_bd_addr_t));
+    add_gattc_event(bulb, 0, ESP_GATTC_CLOSE_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gattc_send_mtu_req(esp_gatt_if_t gattc_if, uint16_t conn_id)
+{
+    struct fake_bt_bulb * bulb = find_conn_id(conn_id);
+    if (!answers(bulb)) {
+        return ESP_OK;
+    }
+    const esp_ble_gattc_cb_param_t param = { .cfg_mtu = { .status = ESP_GATT_OK, .conn_id = conn_id, .mtu = 23 } };
+    add_gattc_event(bulb, interval_us(bulb, 2), ESP_GATTC_CFG_MTU_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gattc_search_service(esp_gatt_if_t gattc_if, uint16_t conn_id, esp_bt_uuid_t * uuid)
+{
+    struct fake_bt_bulb * bulb = find_conn_id(conn_id);
+    if (!answers(bulb)) {
+        return ESP_OK;
+    }
+    /* discovery has already read the database, so the search is answered from it */
+    esp_ble_gattc_cb_param_t param = { .search_res = { .conn_id = conn_id, .start_handle = 0x28, .end_handle = 0x30,
+        .srvc_id = { .uuid = *uuid }, .is_primary = true } };
+    add_gattc_event(bulb, 0, ESP_GATTC_SEARCH_RES_EVT, &param);
+    param = (esp_ble_gattc_cb_param_t){ .search_cmpl = { .status = ESP_GATT_OK, .conn_id = conn_id,
+        .searched_service_source = ESP_GATT_SERVICE_FROM_REMOTE_DEVICE } };
+    add_gattc_event(bulb, 0, ESP_GATTC_SEARCH_CMPL_EVT, &param);
+    return ESP_OK;
+}
+
+esp_gatt_status_t esp_ble_gattc_get_attr_count(esp_gatt_if_t gattc_if, uint16_t conn_id, esp_gatt_db_attr_type_t type,
+    uint16_t start_handle, uint16_t end_handle, uint16_t char_handle, uint16_t * count)
+{
+    const struct fake_bt_bulb * bulb = find_conn_id(conn_id);
+    if (bulb == NULL) {
+        return ESP_GATT_ERROR;
+    }
+    *count = bulb->has_char ? 3 : 0;
+    return ESP_GATT_OK;
+}
+
+esp_gatt_status_t esp_ble_gattc_get_char_by_uuid(esp_gatt_if_t gattc_if, uint16_t conn_id, uint16_t start_handle,
+    uint16_t end_handle, esp_bt_uuid_t uuid, esp_gattc_char_elem_t * result, uint16_t * count)
+{
+    const struct fake_bt_bulb * bulb = find_conn_id(conn_id);
+    if (bulb == NULL || !bulb->has_char) {
+        *count = 0;
+        return ESP_GATT_ERROR;
+    }
+    result[0] = (esp_gattc_char_elem_t){ .char_handle = FAKE_BT_CHAR_HANDLE, .uuid = uuid,
+        .properties = ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_WRITE_NR
+            | (bulb->can_notify ? ESP_GATT_CHAR_PROP_BIT_NOTIFY : 0) };
+    *count = 1;
+    return ESP_GATT_OK;
+}
+
+esp_gatt_status_t esp_ble_gattc_get_descr_by_char_handle(esp_gatt_if_t gattc_if, uint16_t conn_id, uint16_t char_handle,
+    esp_bt_uuid_t uuid, esp_gattc_descr_elem_t * result, uint16_t * count)
+{
+    const struct fake_bt_bulb * bulb = find_conn_id(conn_id);
+    if (bulb == NULL || !bulb->can_notify || char_handle != FAKE_BT_CHAR_HANDLE) {
+        *count = 0;
+        return ESP_GATT_ERROR;
+    }
+    result[0] = (esp_gattc_descr_elem_t){ .handle = FAKE_BT_CCCD_HANDLE, .uuid = uuid };
+    *count = 1;
+    return ESP_GATT_OK;
+}
+
+esp_err_t esp_ble_gattc_write_char(esp_gatt_if_t gattc_if, uint16_t conn_id, uint16_t handle, uint16_t len,
+    uint8_t * value, esp_gatt_write_type_t write_type, esp_gatt_auth_req_t auth)
+{
+    struct fake_bt_bulb * bulb = find_conn_id(conn_id);
+    if (bulb == NULL) {
+        return ESP_FAIL;
+    }
+    bulb->writes++;
+    if (!answers(bulb)) {
+        return ESP_OK;
+    }
+    esp_gatt_status_t status = handle == FAKE_BT_CHAR_HANDLE && len == sizeof(bulb->value)
+        ? ESP_GATT_OK : ESP_GATT_INVALID_HANDLE;
+    if (status == ESP_GATT_OK && bulb->refuses_writes) {
+        status = ESP_GATT_ERROR;
+    }
+    if (status == ESP_GATT_OK) {
+        memcpy(bulb->value, value, sizeof(bulb->value));
+    }
+    /* a write without response is reported once the controller has sent it */
+    const esp_ble_gattc_cb_param_t param = { .write = { .status = status, .conn_id = conn_id, .handle = handle } };
+    add_gattc_event(bulb, interval_us(bulb, 1), ESP_GATTC_WRITE_CHAR_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gattc_write_char_descr(esp_gatt_if_t gattc_if, uint16_t conn_id, uint16_t handle, uint16_t len,
+    uint8_t * value, esp_gatt_write_type_t write_type, esp_gatt_auth_req_t auth)
+{
+    struct fake_bt_bulb * bulb = find_conn_id(conn_id);
+    if (!answers(bulb)) {
+        return ESP_OK;
+    }
+    const bool ok = handle == FAKE_BT_CCCD_HANDLE && bulb->can_notify;
+    bulb->notifying = ok && value[0] != 0;
+    const esp_ble_gattc_cb_param_t param = { .write = { .status = ok ? ESP_GATT_OK : ESP_GATT_INVALID_HANDLE,
+        .conn_id = conn_id, .handle = handle } };
+    add_gattc_event(bulb, interval_us(bulb, 2), ESP_GATTC_WRITE_DESCR_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gattc_read_char(esp_gatt_if_t gattc_if, uint16_t conn_id, uint16_t handle, esp_gatt_auth_req_t auth)
+{
+    struct fake_bt_bulb * bulb = find_conn_id(conn_id);
+    if (bulb == NULL) {
+        return ESP_FAIL;
+    }
+    bulb->reads++;
+    if (!answers(bulb)) {
+        return ESP_OK;
+    }
+    const bool ok = handle == FAKE_BT_CHAR_HANDLE;
+    const esp_ble_gattc_cb_param_t param = { .read = { .status = ok ? ESP_GATT_OK : ESP_GATT_INVALID_HANDLE,
+        .conn_id = conn_id, .handle = handle, .value_len = ok ? sizeof(bulb->value) : 0 } };
+    /* the request waits for an event the bulb listens at, the response comes back at the next one, */
+    /* and ATT has one request outstanding at a time so it is never answered before an earlier one */
+    int64_t delay_us = interval_us(bulb, bulb->latency + 2);
+    for (int i = 0; i < pending_count; i++) {
+        if (pending[i].bulb == bulb && !pending[i].gap && pending[i].gattc_event == ESP_GATTC_READ_CHAR_EVT
+            && pending[i].due - esp_timer_get_time() > delay_us) {
+            delay_us = pending[i].due - esp_timer_get_time();
+        }
+    }
+    struct pending_event * event = add_gattc_event(bulb, delay_us, ESP_GATTC_READ_CHAR_EVT, &param);
+    if (event != NULL) {
+        memcpy(event->value, bulb->value, sizeof(bulb->value));
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gattc_register_for_notify(esp_gatt_if_t gattc_if, esp_bd_addr_t bda, uint16_t handle) { return ESP_OK; }
+esp_err_t esp_ble_gattc_cache_refresh(esp_bd_addr_t bda) { return ESP_OK; }
@@ -0,0 +1,95 @@
+/**
+ * @file Fake of the Bluedroid API with simulated bulbs, for testing the BLE bridge
+ *
+ * Calls made by the bridge are answered with the events the stack would send,
+ * each delivered to the registered callbacks once the simulated clock reaches
+ * its time. Bulbs can be taken out of range and brought back to exercise the
+ * reconnect state machine.
+ */
+
+#ifndef INTELLILIGHT_FAKE_BT_H
+#define INTELLILIGHT_FAKE_BT_H
+
+#include "bt_stub.h"
+
+#define FAKE_BT_MAX_BULBS       9
+#define FAKE_BT_MAX_OPENS       32
+
+/* handles of the colour characteristic and of its CCCD */
+#define FAKE_BT_CHAR_HANDLE     0x2a
+#define FAKE_BT_CCCD_HANDLE     0x2b
+
+/* controller timing */
+#define FAKE_BT_CONNECT_US      50000       /* from a bulb advertising to the connection */
+#define FAKE_BT_DISCOVERY_US    100000      /* from the connection to the end of service discovery */
+#define FAKE_BT_DIRECT_TIMEOUT_US 30000000  /* link establishment timeout */
+#define FAKE_BT_ADV_INTERVAL_US 100000      /* advertising interval of a bulb */
+
+/**
+ * @brief A simulated bulb and the requests it was sent
+ */
+struct fake_bt_bulb
+{
+    esp_bd_addr_t bda;
+    bool in_range;              /* advertising while not connected, answering while connected */
+    bool has_char;              /* offers the colour characteristic */
+    bool can_notify;
+    bool refuses_writes;        /* answers writes with an error and keeps its colour */
+    uint8_t value[4];           /* characteristic value, the colour shown */
+
+    bool connected;
+    bool notifying;
+    uint16_t conn_id;
+    uint16_t interval;          /* connection parameters in force */
+    uint16_t latency;
+    uint16_t timeout;
+    int64_t lost_time;          /* when it went out of range while connected, 0 if it has not */
+    bool opening;
+    bool open_direct;
+    int64_t open_time;
+    int64_t next_adv;
+
+    uint32_t opens;
+    int64_t open_times[FAKE_BT_MAX_OPENS];
+    uint32_t closes;
+    uint32_t disconnects;       /* links dropped by the bridge */
+    uint32_t timeouts;          /* links dropped by the supervision timeout */
+    uint32_t writes;
+    uint32_t reads;
+};
+
+/**
+ * @brief State of the fake controller and its bulbs
+ */
+struct fake_bt
+{
+    struct fake_bt_bulb bulbs[FAKE_BT_MAX_BULBS];
+    int bulb_count;
+    bool scanning;
+    int64_t scan_end;
+    uint32_t scans;
+    uint16_t sendable_packets;  /* returned by esp_ble_get_cur_sendable_packets_num */
+};
+extern struct fake_bt fake_bt;
+
+/**
+ * @brief Reset the fake to a number of bulbs in range, with the BDAs of the host sdkconfig (a4:c1:38:00:00:01 on)
+ */
+extern void fake_bt_reset(const int bulb_count);
+
+/**
+ * @brief Take a bulb out of range or bring it back, a connected bulb is lost after its supervision timeout
+ */
+extern void fake_bt_set_in_range(const int bulb, const bool in_range);
+
+/**
+ * @brief Change the colour a bulb shows as its own remote would, notifying the bridge if it subscribed
+ */
+extern void fake_bt_set_value(const int bulb, const uint8_t * value);
+
+/**
+ * @brief Deliver the events due by now and let the bulbs advertise, call after each step of the clock
+ */
+extern void fake_bt_run(void);
+
+#endif
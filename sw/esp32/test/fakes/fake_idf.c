@@ -0,0 +1,707 @@
+/**
+ * @file Host implementation of the ESP-IDF and FreeRTOS functions used by the firmware
+ *
+ * esp_timer runs from a simulated clock which only moves when a test advances it, so
+ * timing behaviour is deterministic. Queues, semaphores and event groups are real and
+ * thread safe, so tests which start tasks as threads exercise the actual concurrency.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fake.h"
+
+/* time */
+static int64_t clock_now = 0;
+static bool clock_real = false;
+
+/* critical sections share one recursive lock, the depth is tracked per thread */
+static pthread_mutex_t critical_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static __thread int critical_depth = 0;
+uint32_t fake_critical_violations = 0;
+
+static bool tasks_run = false;
+static uint32_t random_state = 0x12345678;
+
+struct fake_wifi fake_wifi;
+esp_event_base_t WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t IP_EVENT = "IP_EVENT";
+
+static void check_not_critical(const char * function)
+{
+    if (critical_depth > 0) {
+        fprintf(stderr, "%s called inside a critical section\n", function);
+        __atomic_add_fetch(&fake_critical_violations, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int64_t host_time_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static void deadline_after(struct timespec * deadline, const TickType_t ticks)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += ticks / 1000;
+    deadline->tv_nsec += (ticks % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/* logging */
+
+void fake_log(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    static int verbose = -1;
+    if (verbose < 0) {
+        verbose = getenv("INTELLILIGHT_TEST_VERBOSE") != NULL;
+    }
+    if (!verbose) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    printf("%c (%lld) %s: ", "NEWIDV"[level], (long long)(esp_timer_get_time() / 1000), tag);
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+}
+
+void esp_log_buffer_hex_internal(const char *tag, const void *buffer, uint16_t len, esp_log_level_t level)
+{
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    return code == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+/* system */
+
+uint32_t esp_get_free_internal_heap_size(void)
+{
+    return 100000;
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return 100000;
+}
+
+void fake_random_seed(const uint32_t seed)
+{
+    random_state = seed != 0 ? seed : 1;
+}
+
+uint32_t esp_random(void)
+{
+    /* xorshift32, deterministic so failures can be reproduced */
+    uint32_t x = random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    random_state = x;
+    return x;
+}
+
+/* critical sections */
+
+void vPortEnterCritical(portMUX_TYPE *mux)
+{
+    pthread_mutex_lock(&critical_mutex);
+    critical_depth++;
+}
+
+void vPortExitCritical(portMUX_TYPE *mux)
+{
+    critical_depth--;
+    pthread_mutex_unlock(&critical_mutex);
+}
+
+/* esp_timer */
+
+struct esp_timer
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    bool active;
+    uint64_t period;
+    int64_t expiry;
+    struct esp_timer *next;
+};
+
+static struct esp_timer *timers = NULL;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    struct esp_timer *timer = calloc(1, sizeof(*timer));
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    timer->next = timers;
+    timers = timer;
+    *handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    check_not_critical(__func__);
+    if (timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->active = true;
+    timer->period = 0;
+    timer->expiry = clock_now + timeout_us;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    check_not_critical(__func__);
+    if (timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->active = true;
+    timer->period = period_us;
+    timer->expiry = clock_now + period_us;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    check_not_critical(__func__);
+    if (!timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->active = false;
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer)
+{
+    return timer->active;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return clock_real ? host_time_us() : clock_now;
+}
+
+void fake_clock_use_real(const bool real)
+{
+    clock_real = real;
+}
+
+void fake_clock_advance(const int64_t us)
+{
+    const int64_t target = clock_now + us;
+    for (;;) {
+        /* run the earliest timer due by the target, callbacks may start or stop timers */
+        struct esp_timer *due = NULL;
+        for (struct esp_timer *timer = timers; timer != NULL; timer = timer->next) {
+            if (timer->active && timer->expiry <= target && (due == NULL || timer->expiry < due->expiry)) {
+                due = timer;
+            }
+        }
+        if (due == NULL) {
+            break;
+        }
+        clock_now = due->expiry;
+        if (due->period > 0) {
+            due->expiry += due->period;
+        } else {
+            due->active = false;
+        }
+        due->callback(due->arg);
+    }
+    clock_now = target;
+}
+
+/* tasks */
+
+struct task_start
+{
+    TaskFunction_t function;
+    void *arg;
+};
+
+static void * task_thread(void *arg)
+{
+    struct task_start start = *(struct task_start *)arg;
+    free(arg);
+    start.function(start.arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack, void *arg, UBaseType_t priority, TaskHandle_t *handle)
+{
+    if (handle != NULL) {
+        *handle = (TaskHandle_t)function;
+    }
+    if (!tasks_run) {
+        return pdPASS;
+    }
+    struct task_start *start = malloc(sizeof(*start));
+    start->function = function;
+    start->arg = arg;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, task_thread, start) != 0) {
+        free(start);
+        return pdFAIL;
+    }
+    pthread_detach(thread);
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack, void *arg, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    return xTaskCreate(function, name, stack, arg, priority, handle);
+}
+
+void fake_tasks_run(const bool run)
+{
+    tasks_run = run;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL && tasks_run) {
+        pthread_exit(NULL);
+    }
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    if (clock_real) {
+        usleep(ticks * 1000);
+    } else {
+        fake_clock_advance(ticks * 1000LL);
+    }
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return esp_timer_get_time() / 1000;
+}
+
+/* queues, mutexes and binary semaphores */
+
+struct fake_queue
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    uint8_t *items;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct fake_queue *queue = calloc(1, sizeof(*queue));
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+    queue->items = calloc(length, item_size > 0 ? item_size : 1);
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+static bool queue_wait(QueueHandle_t queue, const bool for_space, TickType_t wait)
+{
+    struct timespec deadline;
+    if (wait != portMAX_DELAY) {
+        deadline_after(&deadline, wait);
+    }
+    while (for_space ? queue->count == queue->length : queue->count == 0) {
+        if (wait == 0) {
+            return false;
+        }
+        if (wait == portMAX_DELAY) {
+            pthread_cond_wait(&queue->changed, &queue->mutex);
+        } else if (pthread_cond_timedwait(&queue->changed, &queue->mutex, &deadline) == ETIMEDOUT) {
+            return for_space ? queue->count < queue->length : queue->count > 0;
+        }
+    }
+    return true;
+}
+
+static BaseType_t queue_send(QueueHandle_t queue, const void *item, TickType_t wait, const bool front)
+{
+    check_not_critical(__func__);
+    pthread_mutex_lock(&queue->mutex);
+    if (!queue_wait(queue, true, wait)) {
+        pthread_mutex_unlock(&queue->mutex);
+        return errQUEUE_FULL;
+    }
+    UBaseType_t slot;
+    if (front) {
+        queue->head = (queue->head + queue->length - 1) % queue->length;
+        slot = queue->head;
+    } else {
+        slot = (queue->head + queue->count) % queue->length;
+    }
+    if (queue->item_size > 0) {
+        memcpy(queue->items + slot * queue->item_size, item, queue->item_size);
+    }
+    queue->count++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->mutex);
+    return pdTRUE;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait)
+{
+    return queue_send(queue, item, wait, false);
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t wait)
+{
+    return queue_send(queue, item, wait, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t wait)
+{
+    return queue_send(queue, item, wait, true);
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item)
+{
+    xQueueReset(queue);
+    return queue_send(queue, item, 0, false);
+}
+
+static BaseType_t queue_receive(QueueHandle_t queue, void *item, TickType_t wait, const bool remove)
+{
+    check_not_critical(__func__);
+    pthread_mutex_lock(&queue->mutex);
+    if (!queue_wait(queue, false, wait)) {
+        pthread_mutex_unlock(&queue->mutex);
+        return pdFALSE;
+    }
+    if (queue->item_size > 0) {
+        memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+    }
+    if (remove) {
+        queue->head = (queue->head + 1) % queue->length;
+        queue->count--;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait)
+{
+    return queue_receive(queue, item, wait, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t wait)
+{
+    return queue_receive(queue, item, wait, false);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    const UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+    return queue->length - uxQueueMessagesWaiting(queue);
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->head = 0;
+    queue->count = 0;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->mutex);
+    return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t semaphore = xQueueCreate(1, 0);
+    xSemaphoreGive(semaphore);
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return xQueueCreate(1, 0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t wait)
+{
+    return xQueueReceive(semaphore, NULL, wait);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    return xQueueSend(semaphore, NULL, 0);
+}
+
+/* event groups */
+
+struct fake_event_group
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    EventBits_t bits;
+};
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    struct fake_event_group *group = calloc(1, sizeof(*group));
+    pthread_mutex_init(&group->mutex, NULL);
+    pthread_cond_init(&group->changed, NULL);
+    return group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&group->mutex);
+    group->bits |= bits;
+    const EventBits_t result = group->bits;
+    pthread_cond_broadcast(&group->changed);
+    pthread_mutex_unlock(&group->mutex);
+    return result;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&group->mutex);
+    const EventBits_t result = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&group->mutex);
+    return result;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+    pthread_mutex_lock(&group->mutex);
+    const EventBits_t result = group->bits;
+    pthread_mutex_unlock(&group->mutex);
+    return result;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t wait)
+{
+    struct timespec deadline;
+    if (wait != portMAX_DELAY) {
+        deadline_after(&deadline, wait);
+    }
+    pthread_mutex_lock(&group->mutex);
+    for (;;) {
+        const EventBits_t set = group->bits & bits;
+        if (all ? set == bits : set != 0) {
+            break;
+        }
+        if (wait == 0) {
+            break;
+        }
+        if (wait == portMAX_DELAY) {
+            pthread_cond_wait(&group->changed, &group->mutex);
+        } else if (pthread_cond_timedwait(&group->changed, &group->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    const EventBits_t result = group->bits;
+    const EventBits_t set = result & bits;
+    if (clear && (all ? set == bits : set != 0)) {
+        group->bits &= ~bits;
+    }
+    pthread_mutex_unlock(&group->mutex);
+    return result;
+}
+
+/* NVS */
+
+#define NVS_ENTRIES 16
+
+struct nvs_entry
+{
+    char name[16];
+    char key[16];
+    uint8_t value[64];
+    size_t length;
+    bool used;
+};
+
+static struct nvs_entry nvs_entries[NVS_ENTRIES];
+static const char *nvs_names[NVS_ENTRIES];
+
+static struct nvs_entry * nvs_find(nvs_handle_t handle, const char *key, const bool create)
+{
+    struct nvs_entry *free_entry = NULL;
+    for (int i = 0; i < NVS_ENTRIES; i++) {
+        struct nvs_entry *entry = &nvs_entries[i];
+        if (!entry->used) {
+            if (free_entry == NULL) free_entry = entry;
+        } else if (strcmp(entry->name, nvs_names[handle]) == 0 && strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+    }
+    if (!create || free_entry == NULL) {
+        return NULL;
+    }
+    strncpy(free_entry->name, nvs_names[handle], sizeof(free_entry->name) - 1);
+    strncpy(free_entry->key, key, sizeof(free_entry->key) - 1);
+    free_entry->used = true;
+    return free_entry;
+}
+
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    memset(nvs_entries, 0, sizeof(nvs_entries));
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+    for (nvs_handle_t i = 0; i < NVS_ENTRIES; i++) {
+        if (nvs_names[i] == NULL || strcmp(nvs_names[i], name) == 0) {
+            nvs_names[i] = name;
+            *handle = i;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *length)
+{
+    const struct nvs_entry *entry = nvs_find(handle, key, false);
+    if (entry == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (value != NULL) {
+        memcpy(value, entry->value, entry->length < *length ? entry->length : *length);
+    }
+    *length = entry->length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    struct nvs_entry *entry = nvs_find(handle, key, true);
+    if (entry == NULL || length > sizeof(entry->value)) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(entry->value, value, length);
+    entry->length = length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    struct nvs_entry *entry = nvs_find(handle, key, false);
+    if (entry == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    entry->used = false;
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+/* events, netif and Wi-Fi */
+
+esp_err_t esp_event_loop_create_default(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_register(esp_event_base_t base, int32_t id, esp_event_handler_t handler, void *arg, esp_event_handler_instance_t *instance)
+{
+    fake_wifi.handler = handler;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_init(void)
+{
+    return ESP_OK;
+}
+
+esp_netif_t *esp_netif_create_default_wifi_ap(void)
+{
+    return (esp_netif_t *)&fake_wifi;
+}
+
+esp_netif_t *esp_netif_create_default_wifi_sta(void)
+{
+    return (esp_netif_t *)&fake_wifi;
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *config)
+{
+    if (interface == WIFI_IF_STA) {
+        fake_wifi.sta_config = *config;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_config(wifi_interface_t interface, wifi_config_t *config)
+{
+    *config = fake_wifi.sta_config;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mac(wifi_interface_t interface, const uint8_t *mac)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_connect(void)
+{
+    fake_wifi.connect_calls++;
+    fake_wifi.last_connect_time = esp_timer_get_time();
+    return ESP_OK;
+}
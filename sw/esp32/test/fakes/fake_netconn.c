@@ -0,0 +1,289 @@
+/**
+ * @file Fake of the lwIP netconn API, standing in for the loopback interface in tests of the netconn transport
+ *
+ * A pbuf and its payload are one allocation, except for a pbuf made by
+ * netbuf_ref whose payload points at the caller's bytes, which is how a reply
+ * sent by reference is told apart from a copied one.
+ */
+
+#include <string.h>
+
+#include "fake_netconn.h"
+
+const ip_addr_t ip_addr_any = { .u_addr_ip4 = { .addr = 0 }, .type = IPADDR_TYPE_V4 };
+
+struct fake_netconn fake_netconn;
+
+static struct netconn * conns[FAKE_NETCONN_MAX_CONNS];
+static int conn_count = 0;
+
+static struct pbuf * pbuf_new(const int len)
+{
+    struct pbuf * p = malloc(sizeof(struct pbuf) + len);
+    p->next = NULL;
+    p->payload = p + 1;
+    p->len = len;
+    p->tot_len = len;
+    fake_netconn.pbufs++;
+    return p;
+}
+
+static bool pbuf_is_ref(const struct pbuf * p)
+{
+    return p->payload != (const void *)(p + 1);
+}
+
+static struct netconn * conn_new(const enum netconn_type type, const netconn_callback callback)
+{
+    if (conn_count == FAKE_NETCONN_MAX_CONNS) {
+        return NULL;
+    }
+    struct netconn * conn = calloc(1, sizeof(struct netconn));
+    conn->type = type;
+    conn->callback = callback;
+    conns[conn_count++] = conn;
+    fake_netconn.conns++;
+    return conn;
+}
+
+/* record what went out, the data is copied here either way so a test can read it */
+static void record_send(struct netconn * conn, const struct pbuf * p, const void * ref)
+{
+    conn->sends++;
+    conn->sent_len = 0;
+    for (; p != NULL && conn->sent_len + p->len <= FAKE_NETCONN_SENT_LEN; p = p->next) {
+        memcpy(conn->sent + conn->sent_len, p->payload, p->len);
+        conn->sent_len += p->len;
+    }
+    conn->sent_ref = ref;
+}
+
+void fake_netconn_reset(void)
+{
+    for (int i = 0; i < conn_count; i++) {
+        for (int j = 0; j < conns[i]->rx_count; j++) {
+            pbuf_free(conns[i]->rx[j]);
+        }
+        free(conns[i]);
+    }
+    conn_count = 0;
+    memset(&fake_netconn, 0, sizeof(fake_netconn));
+}
+
+struct pbuf * fake_netconn_chain(const void * data, const int len, const int first_len, const int segment_len)
+{
+    struct pbuf * head = NULL;
+    struct pbuf ** tail = &head;
+    int offset = 0;
+    while (offset < len) {
+        int seg = offset == 0 ? first_len : segment_len;
+        if (seg > len - offset) seg = len - offset;
+        struct pbuf * p = pbuf_new(seg);
+        memcpy(p->payload, (const uint8_t *)data + offset, seg);
+        *tail = p;
+        tail = &p->next;
+        offset += seg;
+    }
+    /* tot_len counts this pbuf and the ones after it */
+    int remaining = offset;
+    for (struct pbuf * p = head; p != NULL; p = p->next) {
+        p->tot_len = remaining;
+        remaining -= p->len;
+    }
+    return head;
+}
+
+struct netconn * fake_netconn_connect(struct netconn * listener)
+{
+    struct netconn * conn = conn_new(NETCONN_TCP, listener->callback);
+    if (conn == NULL || listener->backlog_count == FAKE_NETCONN_QUEUE_LEN) {
+        return NULL;
+    }
+    listener->backlog[listener->backlog_count++] = conn;
+    if (listener->callback != NULL) listener->callback(listener, NETCONN_EVT_RCVPLUS, 0);
+    return conn;
+}
+
+void fake_netconn_deliver(struct netconn * conn, struct pbuf * p, const u32_t addr, const u16_t port)
+{
+    if (conn->deleted || conn->rx_count == FAKE_NETCONN_QUEUE_LEN) {
+        pbuf_free(p);
+        return;
+    }
+    conn->rx[conn->rx_count] = p;
+    conn->rx_addr[conn->rx_count] = (ip_addr_t){ .u_addr_ip4 = { .addr = addr }, .type = IPADDR_TYPE_V4 };
+    conn->rx_port[conn->rx_count] = port;
+    conn->rx_count++;
+    if (conn->callback != NULL) conn->callback(conn, NETCONN_EVT_RCVPLUS, p->tot_len);
+}
+
+/* connections */
+
+struct netconn * netconn_new_with_callback(enum netconn_type type, netconn_callback callback)
+{
+    return conn_new(type, callback);
+}
+
+err_t netconn_bind(struct netconn * conn, const ip_addr_t * addr, u16_t port)
+{
+    for (int i = 0; i < conn_count; i++) {
+        if (conns[i] != conn && !conns[i]->deleted && conns[i]->type == conn->type && conns[i]->port == port) {
+            return ERR_CONN;
+        }
+    }
+    conn->port = port;
+    return ERR_OK;
+}
+
+err_t netconn_listen_with_backlog(struct netconn * conn, u8_t backlog)
+{
+    conn->listening = true;
+    return ERR_OK;
+}
+
+void netconn_set_nonblocking(struct netconn * conn, int val)
+{
+    conn->nonblocking = val != 0;
+}
+
+err_t netconn_accept(struct netconn * conn, struct netconn ** new_conn)
+{
+    if (conn->backlog_count == 0) {
+        return ERR_WOULDBLOCK;
+    }
+    *new_conn = conn->backlog[0];
+    conn->backlog_count--;
+    memmove(&conn->backlog[0], &conn->backlog[1], conn->backlog_count * sizeof(conn->backlog[0]));
+    return ERR_OK;
+}
+
+static struct pbuf * take_rx(struct netconn * conn, ip_addr_t * addr, u16_t * port)
+{
+    struct pbuf * p = conn->rx[0];
+    if (addr != NULL) *addr = conn->rx_addr[0];
+    if (port != NULL) *port = conn->rx_port[0];
+    conn->rx_count--;
+    memmove(&conn->rx[0], &conn->rx[1], conn->rx_count * sizeof(conn->rx[0]));
+    memmove(&conn->rx_addr[0], &conn->rx_addr[1], conn->rx_count * sizeof(conn->rx_addr[0]));
+    memmove(&conn->rx_port[0], &conn->rx_port[1], conn->rx_count * sizeof(conn->rx_port[0]));
+    return p;
+}
+
+err_t netconn_recv_tcp_pbuf_flags(struct netconn * conn, struct pbuf ** new_buf, u8_t apiflags)
+{
+    if (conn->rx_count == 0) {
+        return conn->peer_closed ? ERR_CLSD : ERR_WOULDBLOCK;
+    }
+    *new_buf = take_rx(conn, NULL, NULL);
+    return ERR_OK;
+}
+
+err_t netconn_recv_udp_raw_netbuf_flags(struct netconn * conn, struct netbuf ** new_buf, u8_t apiflags)
+{
+    if (conn->rx_count == 0) {
+        return ERR_WOULDBLOCK;
+    }
+    struct netbuf * buf = netbuf_new();
+    buf->p = take_rx(conn, &buf->addr, &buf->port);
+    *new_buf = buf;
+    return ERR_OK;
+}
+
+err_t netconn_write(struct netconn * conn, const void * dataptr, size_t size, u8_t apiflags)
+{
+    if (conn->closed) {
+        return ERR_CLSD;
+    }
+    const struct pbuf p = { .payload = (void *)dataptr, .len = size, .tot_len = size };
+    record_send(conn, &p, (apiflags & NETCONN_COPY) ? NULL : dataptr);
+    return ERR_OK;
+}
+
+err_t netconn_sendto(struct netconn * conn, struct netbuf * buf, const ip_addr_t * addr, u16_t port)
+{
+    if (buf->p == NULL) {
+        return ERR_MEM;
+    }
+    record_send(conn, buf->p, pbuf_is_ref(buf->p) ? buf->p->payload : NULL);
+    conn->sent_addr = *addr;
+    conn->sent_port = port;
+    return ERR_OK;
+}
+
+err_t netconn_close(struct netconn * conn)
+{
+    conn->closed = true;
+    return ERR_OK;
+}
+
+err_t netconn_delete(struct netconn * conn)
+{
+    /* kept until the reset so a test can still look at what it sent */
+    while (conn->rx_count > 0) {
+        pbuf_free(take_rx(conn, NULL, NULL));
+    }
+    conn->closed = true;
+    conn->deleted = true;
+    fake_netconn.conns--;
+    return ERR_OK;
+}
+
+/* buffers */
+
+u8_t pbuf_free(struct pbuf * p)
+{
+    u8_t count = 0;
+    while (p != NULL) {
+        struct pbuf * next = p->next;
+        free(p);
+        fake_netconn.pbufs--;
+        count++;
+        p = next;
+    }
+    return count;
+}
+
+struct netbuf * netbuf_new(void)
+{
+    struct netbuf * buf = calloc(1, sizeof(struct netbuf));
+    fake_netconn.netbufs++;
+    return buf;
+}
+
+void netbuf_delete(struct netbuf * buf)
+{
+    if (buf == NULL) {
+        return;
+    }
+    pbuf_free(buf->p);
+    free(buf);
+    fake_netconn.netbufs--;
+}
+
+void * netbuf_alloc(struct netbuf * buf, u16_t size)
+{
+    pbuf_free(buf->p);
+    buf->p = pbuf_new(size);
+    return buf->p->payload;
+}
+
+err_t netbuf_ref(struct netbuf * buf, const void * dataptr, u16_t size)
+{
+    pbuf_free(buf->p);
+    buf->p = pbuf_new(0);
+    buf->p->payload = (void *)dataptr;
+    buf->p->len = size;
+    buf->p->tot_len = size;
+    return ERR_OK;
+}
+
+u16_t netbuf_copy(struct netbuf * buf, void * dataptr, u16_t len)
+{
+    u16_t copied = 0;
+    for (const struct pbuf * p = buf->p; p != NULL && copied < len; p = p->next) {
+        const u16_t n = p->len < len - copied ? p->len : len - copied;
+        memcpy((uint8_t *)dataptr + copied, p->payload, n);
+        copied += n;
+    }
+    return copied;
+}
@@ -0,0 +1,78 @@
+/**
+ * @file Fake of the lwIP netconn API, standing in for the loopback interface in tests of the netconn transport
+ *
+ * Traffic is handed to a connection as a pbuf chain split wherever the test
+ * chooses, and the connection's callback is told as lwIP would. Replies are
+ * recorded with whether they were copied or sent by reference.
+ */
+
+#ifndef INTELLILIGHT_FAKE_NETCONN_H
+#define INTELLILIGHT_FAKE_NETCONN_H
+
+#include "lwip/api.h"
+
+#define FAKE_NETCONN_MAX_CONNS  64
+#define FAKE_NETCONN_QUEUE_LEN  8
+#define FAKE_NETCONN_SENT_LEN   8192
+
+/**
+ * @brief A connection, with the traffic waiting for it and the last reply it sent
+ */
+struct netconn
+{
+    enum netconn_type type;
+    netconn_callback callback;
+    u16_t port;                 /* port bound to, 0 for an accepted connection */
+    bool listening;
+    bool nonblocking;
+    bool closed;
+    bool deleted;
+
+    struct pbuf * rx[FAKE_NETCONN_QUEUE_LEN];   /* segments or datagrams in the order they arrived */
+    ip_addr_t rx_addr[FAKE_NETCONN_QUEUE_LEN];
+    u16_t rx_port[FAKE_NETCONN_QUEUE_LEN];
+    int rx_count;
+    bool peer_closed;           /* the client has closed its side once everything queued is read */
+    struct netconn * backlog[FAKE_NETCONN_QUEUE_LEN];
+    int backlog_count;
+
+    uint32_t sends;
+    uint8_t sent[FAKE_NETCONN_SENT_LEN];
+    int sent_len;
+    const void * sent_ref;      /* the bytes the last reply referenced, NULL if they were copied */
+    ip_addr_t sent_addr;
+    u16_t sent_port;
+};
+
+/**
+ * @brief Buffers and connections currently allocated, to check nothing is leaked
+ */
+struct fake_netconn
+{
+    int pbufs;
+    int netbufs;
+    int conns;
+};
+extern struct fake_netconn fake_netconn;
+
+/**
+ * @brief Free every connection and reset the counters
+ */
+extern void fake_netconn_reset(void);
+
+/**
+ * @brief Copy data into a pbuf chain, the first pbuf first_len bytes long and the rest segment_len bytes each
+ */
+extern struct pbuf * fake_netconn_chain(const void * data, const int len, const int first_len, const int segment_len);
+
+/**
+ * @brief Have a client connect to a listening connection, to be returned by its next accept
+ */
+extern struct netconn * fake_netconn_connect(struct netconn * listener);
+
+/**
+ * @brief Hand a received segment or datagram to a connection and signal its callback
+ */
+extern void fake_netconn_deliver(struct netconn * conn, struct pbuf * p, const u32_t addr, const u16_t port);
+
+#endif
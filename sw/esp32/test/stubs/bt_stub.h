@@ -0,0 +1,111 @@
+/**
+ * @file Minimal Bluedroid declarations for building bluetooth.c on the host
+ *
+ * The functions are implemented by fakes/fake_bt.c, which records every call.
+ */
+
+#ifndef INTELLILIGHT_BT_STUB_H
+#define INTELLILIGHT_BT_STUB_H
+#include "idf_stub.h"
+typedef uint8_t esp_bd_addr_t[6];
+typedef uint8_t esp_gatt_if_t;
+#define ESP_GATT_IF_NONE 0xff
+typedef enum { ESP_BT_MODE_IDLE, ESP_BT_MODE_BLE, ESP_BT_MODE_CLASSIC_BT, ESP_BT_MODE_BTDM } esp_bt_mode_t;
+typedef struct { int x; } esp_bt_controller_config_t;
+#define BT_CONTROLLER_INIT_CONFIG_DEFAULT() {0}
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t); esp_err_t esp_bt_controller_init(esp_bt_controller_config_t*);
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t); esp_err_t esp_bluedroid_init(void); esp_err_t esp_bluedroid_enable(void);
+typedef enum { ESP_BT_STATUS_SUCCESS = 0, ESP_BT_STATUS_FAIL } esp_bt_status_t;
+typedef enum { BLE_ADDR_TYPE_PUBLIC, BLE_ADDR_TYPE_RANDOM, BLE_ADDR_TYPE_RPA_PUBLIC, BLE_ADDR_TYPE_RPA_RANDOM } esp_ble_addr_type_t;
+typedef enum { BLE_WL_ADDR_TYPE_PUBLIC, BLE_WL_ADDR_TYPE_RANDOM } esp_ble_wl_addr_type_t;
+typedef enum { BLE_SCAN_TYPE_PASSIVE, BLE_SCAN_TYPE_ACTIVE } esp_ble_scan_type_t;
+typedef enum { BLE_SCAN_FILTER_ALLOW_ALL, BLE_SCAN_FILTER_ALLOW_ONLY_WLST, BLE_SCAN_FILTER_ALLOW_UND_RPA_DIR, BLE_SCAN_FILTER_ALLOW_WLIST_RPA_DIR } esp_ble_scan_filter_t;
+typedef enum { BLE_SCAN_DUPLICATE_DISABLE, BLE_SCAN_DUPLICATE_ENABLE } esp_ble_scan_duplicate_t;
+typedef struct { esp_ble_scan_type_t scan_type; esp_ble_addr_type_t own_addr_type; esp_ble_scan_filter_t scan_filter_policy; uint16_t scan_interval; uint16_t scan_window; esp_ble_scan_duplicate_t scan_duplicate; } esp_ble_scan_params_t;
+typedef struct { esp_bd_addr_t bda; uint16_t min_int; uint16_t max_int; uint16_t latency; uint16_t timeout; } esp_ble_conn_update_params_t;
+typedef enum { ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT=2, ESP_GAP_BLE_SCAN_RESULT_EVT=3, ESP_GAP_BLE_SCAN_START_COMPLETE_EVT=7, ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT=18, ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT=17, ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT=20, ESP_GAP_BLE_READ_RSSI_COMPLETE_EVT=23, ESP_GAP_BLE_UPDATE_WHITELIST_COMPLETE_EVT=24 } esp_gap_ble_cb_event_t;
+typedef enum { ESP_GAP_SEARCH_INQ_RES_EVT=0, ESP_GAP_SEARCH_INQ_CMPL_EVT=1 } esp_gap_search_evt_t;
+typedef enum { ESP_BLE_EVT_CONN_ADV=0, ESP_BLE_EVT_CONN_DIR_ADV, ESP_BLE_EVT_DISC_ADV, ESP_BLE_EVT_NON_CONN_ADV, ESP_BLE_EVT_SCAN_RSP } esp_ble_evt_type_t;
+typedef enum { ESP_BLE_WHITELIST_REMOVE=0, ESP_BLE_WHITELIST_ADD, ESP_BLE_WHITELIST_CLEAR } esp_ble_wl_opration_t;
+#define ESP_BLE_ADV_DATA_LEN_MAX 31
+#define ESP_BLE_SCAN_RSP_DATA_LEN_MAX 31
+typedef enum { ESP_BLE_AD_TYPE_FLAG=1, ESP_BLE_AD_TYPE_16SRV_PART=2, ESP_BLE_AD_TYPE_16SRV_CMPL=3, ESP_BLE_AD_TYPE_NAME_SHORT=8, ESP_BLE_AD_TYPE_NAME_CMPL=9 } esp_ble_adv_data_type;
+uint8_t *esp_ble_resolve_adv_data(uint8_t*, uint8_t, uint8_t*);
+typedef union {
+  struct { esp_bt_status_t status; } scan_param_cmpl;
+  struct { esp_gap_search_evt_t search_evt; esp_bd_addr_t bda; int dev_type; esp_ble_addr_type_t ble_addr_type; esp_ble_evt_type_t ble_evt_type; int rssi; uint8_t ble_adv[ESP_BLE_ADV_DATA_LEN_MAX + ESP_BLE_SCAN_RSP_DATA_LEN_MAX]; int flag; int num_resps; uint8_t adv_data_len; uint8_t scan_rsp_len; uint32_t num_dis; } scan_rst;
+  struct { esp_bt_status_t status; } scan_start_cmpl;
+  struct { esp_bt_status_t status; } scan_stop_cmpl;
+  struct { esp_bt_status_t status; } adv_stop_cmpl;
+  struct { esp_bt_status_t status; esp_bd_addr_t bda; uint16_t min_int; uint16_t max_int; uint16_t latency; uint16_t conn_int; uint16_t timeout; } update_conn_params;
+  struct { esp_bt_status_t status; int8_t rssi; esp_bd_addr_t remote_addr; } read_rssi_cmpl;
+  struct { esp_bt_status_t status; esp_ble_wl_opration_t wl_opration; } update_whitelist_cmpl;
+} esp_ble_gap_cb_param_t;
+typedef void (*esp_gap_ble_cb_t)(esp_gap_ble_cb_event_t, esp_ble_gap_cb_param_t*);
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t);
+esp_err_t esp_ble_gap_set_scan_params(esp_ble_scan_params_t*);
+esp_err_t esp_ble_gap_start_scanning(uint32_t); esp_err_t esp_ble_gap_stop_scanning(void);
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t*);
+esp_err_t esp_ble_gap_read_rssi(esp_bd_addr_t);
+esp_err_t esp_ble_gap_update_whitelist(bool, esp_bd_addr_t, esp_ble_wl_addr_type_t);
+esp_err_t esp_ble_gap_clear_whitelist(void);
+esp_err_t esp_ble_gap_get_whitelist_size(uint16_t*);
+esp_err_t esp_ble_gap_disconnect(esp_bd_addr_t);
+esp_err_t esp_ble_gap_set_prefer_conn_params(esp_bd_addr_t, uint16_t, uint16_t, uint16_t, uint16_t);
+uint16_t esp_ble_get_sendable_packets_num(void);
+uint16_t esp_ble_get_cur_sendable_packets_num(uint16_t);
+/* gatt */
+typedef enum { ESP_GATT_OK=0, ESP_GATT_INVALID_HANDLE=1, ESP_GATT_ERROR=0x85, ESP_GATT_CONGESTED=0x8f } esp_gatt_status_t;
+#define ESP_UUID_LEN_16 2
+#define ESP_UUID_LEN_32 4
+#define ESP_UUID_LEN_128 16
+typedef struct { uint16_t len; union { uint16_t uuid16; uint32_t uuid32; uint8_t uuid128[16]; } uuid; } esp_bt_uuid_t;
+typedef struct { esp_bt_uuid_t uuid; uint8_t inst_id; } esp_gatt_id_t;
+typedef enum { ESP_GATT_WRITE_TYPE_NO_RSP=1, ESP_GATT_WRITE_TYPE_RSP } esp_gatt_write_type_t;
+typedef enum { ESP_GATT_AUTH_REQ_NONE=0 } esp_gatt_auth_req_t;
+typedef enum { ESP_GATT_DB_PRIMARY_SERVICE, ESP_GATT_DB_SECONDARY_SERVICE, ESP_GATT_DB_CHARACTERISTIC, ESP_GATT_DB_DESCRIPTOR, ESP_GATT_DB_INCLUDED_SERVICE, ESP_GATT_DB_ALL } esp_gatt_db_attr_type_t;
+typedef enum { ESP_GATT_SERVICE_FROM_REMOTE_DEVICE=0, ESP_GATT_SERVICE_FROM_NVS_FLASH=1, ESP_GATT_SERVICE_FROM_UNKNOWN=2 } esp_service_source_t;
+typedef uint8_t esp_gatt_char_prop_t;
+#define ESP_GATT_CHAR_PROP_BIT_BROADCAST (1<<0)
+#define ESP_GATT_CHAR_PROP_BIT_READ (1<<1)
+#define ESP_GATT_CHAR_PROP_BIT_WRITE_NR (1<<2)
+#define ESP_GATT_CHAR_PROP_BIT_WRITE (1<<3)
+#define ESP_GATT_CHAR_PROP_BIT_NOTIFY (1<<4)
+#define ESP_GATT_CHAR_PROP_BIT_INDICATE (1<<5)
+#define ESP_GATT_UUID_CHAR_CLIENT_CONFIG 0x2902
+typedef struct { uint16_t char_handle; esp_gatt_char_prop_t properties; esp_bt_uuid_t uuid; } esp_gattc_char_elem_t;
+typedef struct { uint16_t handle; esp_bt_uuid_t uuid; } esp_gattc_descr_elem_t;
+typedef enum { ESP_GATT_CONN_UNKNOWN=0, ESP_GATT_CONN_TIMEOUT=0x08, ESP_GATT_CONN_TERMINATE_PEER_USER=0x13, ESP_GATT_CONN_TERMINATE_LOCAL_HOST=0x16, ESP_GATT_CONN_FAIL_ESTABLISH=0x3e } esp_gatt_conn_reason_t;
+typedef enum { ESP_GATTC_REG_EVT=0, ESP_GATTC_UNREG_EVT=1, ESP_GATTC_OPEN_EVT=2, ESP_GATTC_READ_CHAR_EVT=3, ESP_GATTC_WRITE_CHAR_EVT=4, ESP_GATTC_CLOSE_EVT=5, ESP_GATTC_SEARCH_CMPL_EVT=6, ESP_GATTC_SEARCH_RES_EVT=7, ESP_GATTC_READ_DESCR_EVT=8, ESP_GATTC_WRITE_DESCR_EVT=9, ESP_GATTC_NOTIFY_EVT=10, ESP_GATTC_CFG_MTU_EVT=18, ESP_GATTC_REG_FOR_NOTIFY_EVT=38, ESP_GATTC_UNREG_FOR_NOTIFY_EVT=39, ESP_GATTC_CONNECT_EVT=40, ESP_GATTC_DISCONNECT_EVT=41, ESP_GATTC_DIS_SRVC_CMPL_EVT=46 } esp_gattc_cb_event_t;
+typedef union {
+  struct { esp_gatt_status_t status; uint16_t app_id; } reg;
+  struct { esp_gatt_status_t status; uint16_t conn_id; esp_bd_addr_t remote_bda; uint16_t mtu; } open;
+  struct { esp_gatt_status_t status; uint16_t conn_id; esp_bd_addr_t remote_bda; esp_gatt_conn_reason_t reason; } close;
+  struct { esp_gatt_status_t status; uint16_t conn_id; uint16_t mtu; } cfg_mtu;
+  struct { esp_gatt_status_t status; uint16_t conn_id; esp_service_source_t searched_service_source; } search_cmpl;
+  struct { uint16_t conn_id; uint16_t start_handle; uint16_t end_handle; esp_gatt_id_t srvc_id; bool is_primary; } search_res;
+  struct { esp_gatt_status_t status; uint16_t conn_id; uint16_t handle; uint8_t *value; uint16_t value_len; } read;
+  struct { esp_gatt_status_t status; uint16_t conn_id; uint16_t handle; uint16_t offset; } write;
+  struct { uint16_t conn_id; esp_bd_addr_t remote_bda; uint16_t handle; uint16_t value_len; uint8_t *value; bool is_notify; } notify;
+  struct { esp_gatt_status_t status; uint16_t handle; } reg_for_notify;
+  struct { esp_gatt_status_t status; uint16_t handle; } unreg_for_notify;
+  struct { uint16_t conn_id; uint8_t link_role; esp_bd_addr_t remote_bda; struct { uint16_t interval; uint16_t latency; uint16_t timeout; } conn_params; } connect;
+  struct { esp_gatt_conn_reason_t reason; uint16_t conn_id; esp_bd_addr_t remote_bda; } disconnect;
+  struct { esp_gatt_status_t status; uint16_t conn_id; } dis_srvc_cmpl;
+} esp_ble_gattc_cb_param_t;
+typedef void (*esp_gattc_cb_t)(esp_gattc_cb_event_t, esp_gatt_if_t, esp_ble_gattc_cb_param_t*);
+esp_err_t esp_ble_gattc_register_callback(esp_gattc_cb_t); esp_err_t esp_ble_gattc_app_register(uint16_t);
+esp_err_t esp_ble_gattc_open(esp_gatt_if_t, esp_bd_addr_t, esp_ble_addr_type_t, bool);
+esp_err_t esp_ble_gattc_close(esp_gatt_if_t, uint16_t);
+esp_err_t esp_ble_gattc_send_mtu_req(esp_gatt_if_t, uint16_t);
+esp_err_t esp_ble_gattc_search_service(esp_gatt_if_t, uint16_t, esp_bt_uuid_t*);
+esp_gatt_status_t esp_ble_gattc_get_attr_count(esp_gatt_if_t, uint16_t, esp_gatt_db_attr_type_t, uint16_t, uint16_t, uint16_t, uint16_t*);
+esp_gatt_status_t esp_ble_gattc_get_char_by_uuid(esp_gatt_if_t, uint16_t, uint16_t, uint16_t, esp_bt_uuid_t, esp_gattc_char_elem_t*, uint16_t*);
+esp_gatt_status_t esp_ble_gattc_get_descr_by_char_handle(esp_gatt_if_t, uint16_t, uint16_t, esp_bt_uuid_t, esp_gattc_descr_elem_t*, uint16_t*);
+esp_err_t esp_ble_gattc_write_char(esp_gatt_if_t, uint16_t, uint16_t, uint16_t, uint8_t*, esp_gatt_write_type_t, esp_gatt_auth_req_t);
+esp_err_t esp_ble_gattc_write_char_descr(esp_gatt_if_t, uint16_t, uint16_t, uint16_t, uint8_t*, esp_gatt_write_type_t, esp_gatt_auth_req_t);
+esp_err_t esp_ble_gattc_read_char(esp_gatt_if_t, uint16_t, uint16_t, esp_gatt_auth_req_t);
+esp_err_t esp_ble_gattc_register_for_notify(esp_gatt_if_t, esp_bd_addr_t, uint16_t);
+esp_err_t esp_ble_gattc_cache_refresh(esp_bd_addr_t);
+esp_err_t esp_ble_gatt_set_local_mtu(uint16_t);
+#endif
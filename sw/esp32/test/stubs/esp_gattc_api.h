@@ -0,0 +1,2 @@
+/* host stub, see bt_stub.h */
+#include "bt_stub.h"
@@ -0,0 +1,2 @@
+/* host stub, see idf_stub.h */
+#include "idf_stub.h"
@@ -0,0 +1,85 @@
+/**
+ * @file Host stub of the lwIP netconn API, the subset used by the netconn transport
+ *
+ * Types keep the fields the transport reads; the functions are implemented by
+ * fakes/fake_netconn.c.
+ */
+
+#ifndef INTELLILIGHT_LWIP_API_STUB_H
+#define INTELLILIGHT_LWIP_API_STUB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+typedef int8_t err_t;
+
+#define ERR_OK          0
+#define ERR_MEM         -1
+#define ERR_WOULDBLOCK  -7
+#define ERR_CONN        -11
+#define ERR_CLSD        -15
+
+#define NETCONN_NOFLAG      0x00
+#define NETCONN_NOCOPY      0x00
+#define NETCONN_COPY        0x01
+#define NETCONN_DONTBLOCK   0x04
+
+typedef struct { u32_t addr; } ip4_addr_t;
+typedef struct { ip4_addr_t u_addr_ip4; u8_t type; } ip_addr_t;
+
+#define IPADDR_TYPE_V4          0
+#define IP_IS_V4(ipaddr)        ((ipaddr)->type == IPADDR_TYPE_V4)
+#define ip_2_ip4(ipaddr)        (&((ipaddr)->u_addr_ip4))
+#define ip4_addr_get_u32(ip4addr) ((ip4addr)->addr)
+
+extern const ip_addr_t ip_addr_any;
+#define IP_ADDR_ANY (&ip_addr_any)
+
+struct pbuf
+{
+    struct pbuf * next;
+    void * payload;
+    u16_t tot_len;
+    u16_t len;
+};
+
+struct netbuf
+{
+    struct pbuf * p;
+    ip_addr_t addr;
+    u16_t port;
+};
+
+enum netconn_type { NETCONN_TCP = 0x10, NETCONN_UDP = 0x20 };
+enum netconn_evt { NETCONN_EVT_RCVPLUS, NETCONN_EVT_RCVMINUS, NETCONN_EVT_SENDPLUS, NETCONN_EVT_SENDMINUS, NETCONN_EVT_ERROR };
+
+struct netconn;
+typedef void (* netconn_callback)(struct netconn *, enum netconn_evt, u16_t len);
+
+struct netconn * netconn_new_with_callback(enum netconn_type type, netconn_callback callback);
+err_t netconn_bind(struct netconn * conn, const ip_addr_t * addr, u16_t port);
+err_t netconn_listen_with_backlog(struct netconn * conn, u8_t backlog);
+void netconn_set_nonblocking(struct netconn * conn, int val);
+err_t netconn_accept(struct netconn * conn, struct netconn ** new_conn);
+err_t netconn_recv_tcp_pbuf_flags(struct netconn * conn, struct pbuf ** new_buf, u8_t apiflags);
+err_t netconn_recv_udp_raw_netbuf_flags(struct netconn * conn, struct netbuf ** new_buf, u8_t apiflags);
+err_t netconn_write(struct netconn * conn, const void * dataptr, size_t size, u8_t apiflags);
+err_t netconn_sendto(struct netconn * conn, struct netbuf * buf, const ip_addr_t * addr, u16_t port);
+err_t netconn_close(struct netconn * conn);
+err_t netconn_delete(struct netconn * conn);
+
+u8_t pbuf_free(struct pbuf * p);
+
+struct netbuf * netbuf_new(void);
+void netbuf_delete(struct netbuf * buf);
+void * netbuf_alloc(struct netbuf * buf, u16_t size);
+err_t netbuf_ref(struct netbuf * buf, const void * dataptr, u16_t size);
+u16_t netbuf_copy(struct netbuf * buf, void * dataptr, u16_t len);
+#define netbuf_fromaddr(buf)    (&((buf)->addr))
+#define netbuf_fromport(buf)    ((buf)->port)
+
+#endif
@@ -0,0 +1,79 @@
+/**
+ * @file Configuration used by the host tests
+ *
+ * Values follow the Kconfig defaults except where a test needs the worst case
+ * (the largest number of bulbs) or an optional feature enabled. A test can override
+ * any of them with a compile definition.
+ */
+
+#ifndef INTELLILIGHT_HOST_SDKCONFIG_H
+#define INTELLILIGHT_HOST_SDKCONFIG_H
+
+#ifndef CONFIG_WIFI_SSID
+#define CONFIG_WIFI_SSID "mywifissid"
+#endif
+#ifndef CONFIG_WIFI_PASSWORD
+#define CONFIG_WIFI_PASSWORD "mypassword"
+#endif
+#ifndef CONFIG_SMARTBULB_MAC_ADDRESS
+#define CONFIG_SMARTBULB_MAC_ADDRESS "a4:c1:38:00:00:01,a4:c1:38:00:00:02,a4:c1:38:00:00:03"
+#endif
+#ifndef CONFIG_SMARTBULB_MAX_BULBS
+#define CONFIG_SMARTBULB_MAX_BULBS 9
+#endif
+#ifndef CONFIG_SMARTBULB_SCAN_FILTER_DUPLICATES
+#define CONFIG_SMARTBULB_SCAN_FILTER_DUPLICATES 1
+#endif
+#ifndef CONFIG_SMARTBULB_WRITE_REASSERT_S
+#define CONFIG_SMARTBULB_WRITE_REASSERT_S 60
+#endif
+#ifndef CONFIG_NETWORK_TRANSPORT_SOCKETS
+#define CONFIG_NETWORK_TRANSPORT_SOCKETS 1
+#endif
+#ifndef CONFIG_NETWORK_TCP_WORKERS
+#define CONFIG_NETWORK_TCP_WORKERS 3
+#endif
+#ifndef CONFIG_NETWORK_TCP_BUFFER_SIZE
+#define CONFIG_NETWORK_TCP_BUFFER_SIZE 2000
+#endif
+#ifndef CONFIG_NETWORK_TCP_BACKLOG
+#define CONFIG_NETWORK_TCP_BACKLOG 8
+#endif
+#ifndef CONFIG_NETWORK_TCP_CLIENTS
+#define CONFIG_NETWORK_TCP_CLIENTS 8
+#endif
+#ifndef CONFIG_NETWORK_JOB_QUEUE_LEN
+#define CONFIG_NETWORK_JOB_QUEUE_LEN 8
+#endif
+#ifndef CONFIG_DISCOVERY_DEDUPE_WINDOW_MS
+#define CONFIG_DISCOVERY_DEDUPE_WINDOW_MS 1000
+#endif
+#ifndef CONFIG_DISCOVERY_RATE_PER_SECOND
+#define CONFIG_DISCOVERY_RATE_PER_SECOND 2
+#endif
+#ifndef CONFIG_DISCOVERY_BURST
+#define CONFIG_DISCOVERY_BURST 5
+#endif
+#ifndef CONFIG_DISCOVERY_TOTAL_RATE_PER_SECOND
+#define CONFIG_DISCOVERY_TOTAL_RATE_PER_SECOND 10
+#endif
+#ifndef CONFIG_DISCOVERY_TOTAL_BURST
+#define CONFIG_DISCOVERY_TOTAL_BURST 20
+#endif
+#ifndef CONFIG_DISCOVERY_STATE_REFRESH_MS
+#define CONFIG_DISCOVERY_STATE_REFRESH_MS 5000
+#endif
+#ifndef CONFIG_DISCOVERY_STATE_MAX_AGE_MS
+#define CONFIG_DISCOVERY_STATE_MAX_AGE_MS 0
+#endif
+#ifndef CONFIG_DISCOVERY_STATE_WAIT_MS
+#define CONFIG_DISCOVERY_STATE_WAIT_MS 200
+#endif
+#ifndef CONFIG_FAST_CONTROL
+#define CONFIG_FAST_CONTROL 1
+#endif
+#ifndef CONFIG_FAST_CONTROL_PORT
+#define CONFIG_FAST_CONTROL_PORT 9998
+#endif
+
+#endif
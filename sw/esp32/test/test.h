@@ -0,0 +1,46 @@
+/**
+ * @file Assertions shared by the host tests
+ */
+
+#ifndef INTELLILIGHT_TEST_H
+#define INTELLILIGHT_TEST_H
+
+#include <stdio.h>
+
+static int test_failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define CHECK_EQ(actual, expected) do { \
+    const long long actual_ = (long long)(actual); \
+    const long long expected_ = (long long)(expected); \
+    if (actual_ != expected_) { \
+        fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, actual_, expected_); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define CHECK_RANGE(actual, low, high) do { \
+    const long long actual_ = (long long)(actual); \
+    if (actual_ < (long long)(low) || actual_ > (long long)(high)) { \
+        fprintf(stderr, "%s:%d: %s is %lld, expected %lld to %lld\n", __FILE__, __LINE__, #actual, actual_, \
+            (long long)(low), (long long)(high)); \
+        test_failures++; \
+    } \
+} while (0)
+
+/**
+ * @brief Report the result, for use as the return value of main
+ */
+static inline int test_result(const char * name)
+{
+    printf("%s: %s\n", name, test_failures == 0 ? "passed" : "FAILED");
+    return test_failures == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,440 @@
+/**
+ * @file BLE bridge against simulated bulbs: connecting, losing and recovering links
+ *
+ * Runs the bridge task's event loop and the fake Bluedroid stack together in
+ * 1 ms steps of the simulated clock, taking bulbs out of range to check how
+ * quickly a lost link is noticed and recovered and that bulbs which cannot be
+ * used are backed off rather than retried in a loop, and that a bulb is brought
+ * back to the state it was last told to show.
+ */
+
+#include "fake.h"
+#include "fake_bt.h"
+#include "test.h"
+
+#include "bluetooth.c"
+
+#define BULBS 3
+
+/* run the simulated bulbs and the bridge for a time, in steps of 1 ms */
+static void run_ms(const int64_t ms)
+{
+    for (int64_t i = 0; i < ms; i++) {
+        fake_clock_advance(1000);
+        fake_bt_run();
+        do {
+            bridge_step(0);
+        } while (uxQueueMessagesWaiting(bridge_queue) > 0);
+    }
+}
+
+/* run until the bulb is connected or not, returns the time taken in ms or -1 */
+static int64_t run_until(const int bulb, const bool connected, const int64_t limit_ms)
+{
+    for (int64_t ms = 0; ms <= limit_ms; ms++) {
+        if (bluetooth_bulb_connected(bulb) == connected) {
+            return ms;
+        }
+        run_ms(1);
+    }
+    return -1;
+}
+
+/* run until the bulb shows the colour, returns the time taken in ms or -1 */
+static int64_t run_until_shown(const int bulb, const struct rgb_colour rgb, const int64_t limit_ms)
+{
+    const uint8_t value[4] = { 0xD0, rgb.r, rgb.g, rgb.b };
+    for (int64_t ms = 0; ms <= limit_ms; ms++) {
+        if (memcmp(fake_bt.bulbs[bulb].value, value, sizeof(value)) == 0) {
+            return ms;
+        }
+        run_ms(1);
+    }
+    return -1;
+}
+
+static bool send_colour(const int bulb, const struct hsv_colour colour)
+{
+    const struct bulb_command command = { .bulb = bulb, .colour = colour, .on_off = true };
+    return bluetooth_send_command(&command);
+}
+
+static void test_bulbs_connect(void)
+{
+    bluetooth_start();
+    int64_t longest = 0;
+    for (int bulb = 0; bulb < BULBS; bulb++) {
+        const int64_t ms = run_until(bulb, true, 5000);
+        CHECK(ms >= 0);
+        longest += ms;
+    }
+    printf("%d bulbs connected after %lld ms\n", BULBS, (long long)longest);
+
+    /* settle into the idle parameters */
+    run_ms(10000);
+    for (int bulb = 0; bulb < BULBS; bulb++) {
+        CHECK(bluetooth_bulb_connected(bulb));
+        /* one direct connect each, no scan needed */
+        CHECK_EQ(fake_bt.bulbs[bulb].opens, 1);
+        CHECK(bulbs[bulb].handles_cached);
+        CHECK(bulbs[bulb].notifying);
+        CHECK_EQ(bulbs[bulb].conn_mode, CONN_MODE_IDLE);
+    }
+    CHECK_EQ(fake_bt.scans, 0);
+}
+
+static void test_lost_link_recovers(void)
+{
+    const struct bluetooth_link_stats before = bluetooth_get_link_stats();
+    fake_bt_set_in_range(1, false);
+
+    /* the link monitor notices before the controller's supervision timeout */
+    const int64_t detect_ms = run_until(1, false, 10000);
+    printf("idle link lost, noticed after %lld ms\n", (long long)detect_ms);
+    CHECK_RANGE(detect_ms, 0, link_supervision_ms(&bulbs[1]) - 1);
+    CHECK_EQ(bluetooth_get_link_stats().early_drops, before.early_drops + 1);
+    CHECK_EQ(fake_bt.bulbs[1].disconnects, 1);
+    CHECK_EQ(fake_bt.bulbs[1].timeouts, 0);
+
+    /* the direct connect is still waiting when the bulb comes back, so it reconnects at once */
+    run_ms(3000);
+    CHECK(!bluetooth_bulb_connected(1));
+    fake_bt_set_in_range(1, true);
+    const int64_t recover_ms = run_until(1, true, 5000);
+    printf("bulb back in range, reconnected after %lld ms\n", (long long)recover_ms);
+    CHECK_RANGE(recover_ms, 0, FAKE_BT_CONNECT_US / 1000 + 10);
+    CHECK_EQ(bluetooth_get_link_stats().recoveries, before.recoveries + 1);
+
+    /* the other bulbs were not disturbed */
+    CHECK(bluetooth_bulb_connected(0));
+    CHECK(bluetooth_bulb_connected(2));
+    CHECK_EQ(fake_bt.bulbs[0].opens, 1);
+    CHECK_EQ(fake_bt.bulbs[2].opens, 1);
+    run_ms(10000);
+}
+
+static void test_stack_events_survive_full_queue(void)
+{
+    const struct bluetooth_bridge_stats before = bluetooth_get_bridge_stats();
+    fake_bt_set_in_range(1, false);
+
+    /* the bridge task falls behind with the queue full of link samples, and meanwhile the link times out */
+    struct bridge_event link = { .type = BRIDGE_EVENT_LINK };
+    int queued = 0;
+    while (post_event(&link)) {
+        queued++;
+    }
+    CHECK_EQ(queued, BRIDGE_QUEUE_LEN);
+    fake_clock_advance(fake_bt.bulbs[1].timeout * 10000LL);
+    fake_bt_run();
+    CHECK_EQ(fake_bt.bulbs[1].timeouts, 1);
+    CHECK(atomic_load(&stack_head) != atomic_load(&stack_tail));
+
+    /* the disconnect was not lost with the queue full, so the bulb is reconnected once it is back */
+    run_ms(1);
+    CHECK(!bluetooth_bulb_connected(1));
+    const struct bluetooth_bridge_stats after = bluetooth_get_bridge_stats();
+    CHECK(after.dropped > before.dropped);
+    CHECK_EQ(after.stack_dropped, 0);
+    fake_bt_set_in_range(1, true);
+    CHECK(run_until(1, true, 5000) >= 0);
+    run_ms(10000);
+}
+
+static void test_long_outage_backs_off(void)
+{
+    const uint32_t opens = fake_bt.bulbs[2].opens;
+    const uint32_t scans = fake_bt.scans;
+    fake_bt_set_in_range(2, false);
+    CHECK(run_until(2, false, 10000) >= 0);
+
+    /* each round is a direct connect and a scan, each bounded, and then a growing delay */
+    const int outage_s = 300;
+    run_ms(outage_s * 1000);
+    const uint32_t attempts = fake_bt.bulbs[2].opens - opens;
+    printf("%d s out of range: %d connects, %d scans\n", outage_s, attempts, fake_bt.scans - scans);
+    CHECK_RANGE(attempts, 1, outage_s * 1000000LL / (FAKE_BT_DIRECT_TIMEOUT_US + scan_duration * 1000000LL) + 1);
+    CHECK(fake_bt.scans > scans);
+    CHECK(bulbs[2].failures > 1);
+    CHECK(bulbs[2].link_state == BULB_WAITING || bulbs[2].link_state == BULB_CONNECTING
+        || bulbs[2].link_state == BULB_BACKOFF);
+
+    /* back within the longest backoff */
+    fake_bt_set_in_range(2, true);
+    const int64_t recover_ms = run_until(2, true, 60000);
+    printf("bulb back after the outage, reconnected after %lld ms\n", (long long)recover_ms);
+    CHECK_RANGE(recover_ms, 0, RECONNECT_MAX_DELAY_MS + FAKE_BT_CONNECT_US / 1000 + 10);
+    CHECK(bluetooth_bulb_connected(0));
+    CHECK(bluetooth_bulb_connected(1));
+    run_ms(10000);
+}
+
+static void test_missing_characteristic_backs_off(void)
+{
+    /* the bulb comes back without the characteristic, after a firmware update say */
+    fake_bt_set_in_range(0, false);
+    CHECK(run_until(0, false, 10000) >= 0);
+    fake_bt.bulbs[0].has_char = false;
+    fake_bt_set_in_range(0, true);
+    const uint32_t opens = fake_bt.bulbs[0].opens;
+    run_ms(20000);
+
+    /* each connection is closed, the stale cached handles forgotten and the retries spaced out */
+    const uint32_t attempts = fake_bt.bulbs[0].opens - opens;
+    printf("bulb without the characteristic: %d connects in 20 s\n", attempts);
+    CHECK_RANGE(attempts, 3, 8);
+    /* the first connection closed was the direct connect already waiting when the bulb came back */
+    CHECK_EQ(fake_bt.bulbs[0].closes, attempts + 1);
+    CHECK(!bulbs[0].handles_cached);
+    CHECK(!bluetooth_bulb_connected(0));
+    CHECK(bulbs[0].link_state != BULB_DISCOVERING || fake_bt.bulbs[0].connected);
+    int64_t last_gap = 0;
+    for (uint32_t i = opens + 1; i < fake_bt.bulbs[0].opens && i < FAKE_BT_MAX_OPENS; i++) {
+        const int64_t gap = fake_bt.bulbs[0].open_times[i] - fake_bt.bulbs[0].open_times[i - 1];
+        CHECK(gap >= RECONNECT_MIN_DELAY_MS * 1000LL);
+        CHECK(gap > last_gap);
+        last_gap = gap;
+    }
+
+    /* once the characteristic is back the bulb is found on the next attempt */
+    fake_bt.bulbs[0].has_char = true;
+    CHECK(run_until(0, true, RECONNECT_MAX_DELAY_MS + 1000) >= 0);
+    run_ms(1000);
+    CHECK(bulbs[0].handles_cached);
+    CHECK_EQ(bulbs[0].failures, 0);
+}
+
+static void test_command_replayed_after_outage(void)
+{
+    const struct hsv_colour red = { .h = 0, .s = 100, .v = 100 };
+    fake_bt_set_in_range(1, false);
+    CHECK(run_until(1, false, 10000) >= 0);
+
+    /* the command is taken while the bulb is away, and nothing can be written */
+    const struct bluetooth_command_stats before = bluetooth_get_command_stats();
+    const uint32_t writes = fake_bt.bulbs[1].writes;
+    CHECK(send_colour(1, red));
+    run_ms(5000);
+    CHECK_EQ(fake_bt.bulbs[1].writes, writes);
+    CHECK_EQ(bluetooth_desired_state(1).colour.h, 0);
+
+    /* written as soon as the bulb is ready again, without waiting for its state to be read */
+    fake_bt_set_in_range(1, true);
+    const int64_t shown_ms = run_until_shown(1, colours_hsv_to_rgb(red), 5000);
+    printf("command sent while away, shown %lld ms after the bulb came back\n", (long long)shown_ms);
+    CHECK_RANGE(shown_ms, 0, FAKE_BT_CONNECT_US / 1000 + 100);
+    CHECK_EQ(bluetooth_get_command_stats().reconciled, before.reconciled + 1);
+
+    /* and left alone once it shows it */
+    run_ms(10000);
+    CHECK_EQ(bluetooth_get_command_stats().reconciled, before.reconciled + 1);
+    CHECK_EQ(fake_bt.bulbs[1].writes, writes + 1);
+}
+
+static void test_drift_reconciled(void)
+{
+    const struct rgb_colour red = colours_hsv_to_rgb((struct hsv_colour){ .h = 0, .s = 100, .v = 100 });
+    const uint8_t blue[4] = { 0xD0, 0, 0, 255 };
+    const struct bluetooth_command_stats before = bluetooth_get_command_stats();
+    const uint32_t notifications = bluetooth_get_state_stats().notifications;
+
+    /* the bulb's own remote changes it, the notification shows it is no longer in the desired state */
+    CHECK(bulbs[1].notifying);
+    fake_bt_set_value(1, blue);
+    const int64_t shown_ms = run_until_shown(1, red, 5000);
+    printf("bulb changed behind the bridge, back after %lld ms\n", (long long)shown_ms);
+    CHECK(shown_ms > 0);
+    CHECK(shown_ms <= link_supervision_ms(&bulbs[1]));
+    CHECK_EQ(bluetooth_get_state_stats().notifications, notifications + 1);
+    CHECK_EQ(bluetooth_get_command_stats().reconciled, before.reconciled + 1);
+    run_ms(5000);
+}
+
+static void test_refused_writes_give_up(void)
+{
+    const uint8_t blue[4] = { 0xD0, 0, 0, 255 };
+    const struct bluetooth_command_stats before = bluetooth_get_command_stats();
+    const uint32_t writes = fake_bt.bulbs[1].writes;
+
+    /* a bulb which refuses the desired state is retried a few times, not forever */
+    fake_bt.bulbs[1].refuses_writes = true;
+    fake_bt_set_value(1, blue);
+    run_ms(20000);
+    CHECK_EQ(fake_bt.bulbs[1].writes - writes, RECONCILE_MAX_ATTEMPTS);
+    CHECK_EQ(bluetooth_get_command_stats().reconciled - before.reconciled, RECONCILE_MAX_ATTEMPTS);
+    CHECK_EQ(bluetooth_get_command_stats().writes_failed - before.writes_failed, RECONCILE_MAX_ATTEMPTS);
+    CHECK(memcmp(fake_bt.bulbs[1].value, blue, sizeof(blue)) == 0);
+    CHECK(bluetooth_bulb_connected(1));
+
+    /* a new command is a new desired state, and gets its own attempts */
+    fake_bt.bulbs[1].refuses_writes = false;
+    const struct hsv_colour green = { .h = 120, .s = 100, .v = 100 };
+    CHECK(send_colour(1, green));
+    CHECK(run_until_shown(1, colours_hsv_to_rgb(green), 5000) >= 0);
+    run_ms(5000);
+}
+
+static void test_sent_write_waits_for_bulb(void)
+{
+    const struct hsv_colour magenta = { .h = 300, .s = 100, .v = 100 };
+    const struct bluetooth_command_stats before = bluetooth_get_command_stats();
+    const uint32_t reads = bluetooth_get_state_stats().reads;
+    CHECK(send_colour(1, magenta));
+
+    /* the write event only says the controller sent the value, the bulb has not reported it yet */
+    int64_t ms = 0;
+    while (bluetooth_get_command_stats().writes_sent == before.writes_sent && ms++ < 1000) {
+        run_ms(1);
+    }
+    CHECK_EQ(bluetooth_get_command_stats().writes_sent, before.writes_sent + 1);
+    CHECK_EQ(bluetooth_get_command_stats().writes_confirmed, before.writes_confirmed);
+    CHECK(bluetooth_reported_state(1).colour.h != magenta.h);
+
+    /* with the writes settled the bulb is read, and what it reports becomes its state */
+    run_ms(1000);
+    CHECK_EQ(bluetooth_get_state_stats().reads, reads + 1);
+    CHECK_EQ(bluetooth_get_command_stats().writes_confirmed, before.writes_confirmed + 1);
+    CHECK_EQ(bluetooth_reported_state(1).colour.h, magenta.h);
+    CHECK_EQ(bluetooth_get_command_stats().reconciled, before.reconciled);
+    run_ms(5000);
+}
+
+static void test_writes_wait_for_credits(void)
+{
+    const struct rgb_colour first = { .r = 10, .g = 20, .b = 30 };
+    const struct rgb_colour last = { .r = 40, .g = 50, .b = 60 };
+    const struct bluetooth_tx_stats before = bluetooth_get_tx_stats();
+    const uint32_t writes = fake_bt.bulbs[2].writes;
+
+    /* with no buffer free in the controller the value is held, and the newest replaces it */
+    fake_bt.sendable_packets = 0;
+    CHECK(bluetooth_set_bulb_colour(2, first));
+    CHECK(bluetooth_set_bulb_colour(2, last));
+    run_ms(500);
+    CHECK_EQ(fake_bt.bulbs[2].writes, writes);
+    CHECK(bluetooth_get_tx_stats().stalls > before.stalls);
+    CHECK_EQ(bluetooth_get_tx_stats().superseded, before.superseded + 1);
+    CHECK(bulbs[2].mailbox.full);
+
+    /* and sent once one is */
+    fake_bt.sendable_packets = 1;
+    const int64_t shown_ms = run_until_shown(2, last, 1000);
+    printf("held for 500 ms without credits, shown %lld ms after one was freed\n", (long long)shown_ms);
+    CHECK_RANGE(shown_ms, 0, TX_CREDIT_POLL_MS);
+    fake_bt.sendable_packets = 10;
+    run_ms(1000);
+    const struct bluetooth_tx_stats after = bluetooth_get_tx_stats();
+    CHECK_EQ(fake_bt.bulbs[2].writes, writes + 1);
+    CHECK_EQ(after.sent, before.sent + 1);
+    CHECK_EQ(after.queued, before.queued + 2);
+    CHECK(after.latency_max_us >= 500000);
+
+    /* a value still held when the link drops is counted as lost, not sent to the next connection */
+    fake_bt.sendable_packets = 0;
+    CHECK(bluetooth_set_bulb_colour(2, first));
+    fake_bt_set_in_range(2, false);
+    CHECK(run_until(2, false, 10000) >= 0);
+    CHECK_EQ(bluetooth_get_tx_stats().dropped, after.dropped + 1);
+    CHECK(!bulbs[2].mailbox.full);
+    fake_bt.sendable_packets = 10;
+    fake_bt_set_in_range(2, true);
+    CHECK(run_until(2, true, RECONNECT_MAX_DELAY_MS + 1000) >= 0);
+    run_ms(5000);
+    CHECK_EQ(fake_bt.bulbs[2].writes, writes + 1);
+    CHECK_EQ(bluetooth_get_tx_stats().sent, after.sent);
+}
+
+static void test_fade_frames_follow_interval(void)
+{
+    /* a bulb left alone is on the idle parameters when a fade starts */
+    run_ms(CONN_IDLE_AFTER_MS + 2000);
+    CHECK_EQ(bulbs[1].conn_mode, CONN_MODE_IDLE);
+    const int64_t idle_us = bulbs[1].conn_interval * 1250LL;
+    const struct bluetooth_tx_stats before = bluetooth_get_tx_stats();
+    const struct hsv_colour blue = { .h = 240, .s = 100, .v = 100 };
+    const struct bulb_command command = { .bulb = 1, .colour = blue, .on_off = true, .period_ms = 2000 };
+    CHECK(bluetooth_send_command(&command));
+    run_ms(1);
+
+    /* frames come no faster than the bulb takes them, until it is given the fast parameters */
+    CHECK(frame_timer_running);
+    CHECK_EQ(frame_period_us, idle_us);
+    int64_t fast_ms = 0;
+    while (bulbs[1].conn_mode != CONN_MODE_FAST && fast_ms++ < 2000) {
+        run_ms(1);
+    }
+    CHECK_EQ(bulbs[1].conn_mode, CONN_MODE_FAST);
+    run_ms(idle_us / 1000 + 1);
+    CHECK_EQ(frame_period_us, bulbs[1].conn_interval * 1250LL);
+    CHECK(frame_period_us < idle_us);
+
+    const int64_t shown_ms = run_until_shown(1, colours_hsv_to_rgb(blue), 5000);
+    run_ms(100);
+    const struct bluetooth_tx_stats after = bluetooth_get_tx_stats();
+    printf("2 s fade from idle: fast after %lld ms, %d frames sent, %d overwritten\n", (long long)fast_ms,
+        after.sent - before.sent, after.superseded - before.superseded);
+    CHECK(shown_ms >= 0);
+    CHECK(!frame_timer_running);
+    CHECK(after.superseded - before.superseded < (after.sent - before.sent) / 10);
+}
+
+static void test_slider_drag_coalesced(void)
+{
+    /* the first value moves the link to the fast parameters */
+    CHECK(bluetooth_set_bulb_colour(0, (struct rgb_colour){ .r = 1 }));
+    run_ms(2000);
+    CHECK_EQ(bulbs[0].conn_mode, CONN_MODE_FAST);
+    const int64_t interval_us = bulbs[0].conn_interval * 1250LL;
+
+    /* a slider sends a value every 2 ms, faster than the link can carry them */
+    const struct bluetooth_tx_stats before = bluetooth_get_tx_stats();
+    const uint32_t writes = fake_bt.bulbs[0].writes;
+    const int drag_ms = 1000;
+    const int step_ms = 2;
+    struct rgb_colour rgb = { 0 };
+    for (int i = 0; i < drag_ms / step_ms; i++) {
+        rgb = (struct rgb_colour){ .r = i & 0xff, .g = i >> 8, .b = 0x80 };
+        CHECK(bluetooth_set_bulb_colour(0, rgb));
+        run_ms(step_ms);
+    }
+    const int64_t lag_ms = run_until_shown(0, rgb, 1000);
+    run_ms(100);
+
+    /* one write per connection event, each the newest value, and the light stops with the slider */
+    const struct bluetooth_tx_stats after = bluetooth_get_tx_stats();
+    const uint32_t posted = after.queued - before.queued;
+    const uint32_t sent = after.sent - before.sent;
+    const uint32_t events = drag_ms * 1000LL / interval_us;
+    const int64_t mean_wait_us = (after.latency_total_us - before.latency_total_us) / sent;
+    const int64_t fifo_lag_ms = posted * interval_us / 1000 - drag_ms;
+    printf("slider: %d values in %d ms, %d writes, mean wait %lld us, shown %lld ms after the last "
+        "(%lld ms if every value were queued)\n", posted, drag_ms, sent, (long long)mean_wait_us,
+        (long long)lag_ms, (long long)fifo_lag_ms);
+    CHECK_EQ(posted, drag_ms / step_ms);
+    CHECK_RANGE(sent, events / 2, events + 1);
+    CHECK_EQ(fake_bt.bulbs[0].writes - writes, sent);
+    CHECK_EQ(after.superseded - before.superseded, posted - sent);
+    CHECK_RANGE(mean_wait_us, 0, interval_us);
+    CHECK_RANGE(lag_ms, 0, interval_us / 1000 + 1);
+}
+
+int main(void)
+{
+    fake_bt_reset(BULBS);
+
+    test_bulbs_connect();
+    test_lost_link_recovers();
+    test_stack_events_survive_full_queue();
+    test_long_outage_backs_off();
+    test_missing_characteristic_backs_off();
+    test_command_replayed_after_outage();
+    test_drift_reconciled();
+    test_refused_writes_give_up();
+    test_sent_write_waits_for_bulb();
+    test_writes_wait_for_credits();
+    test_fade_frames_follow_interval();
+    test_slider_drag_coalesced();
+
+    CHECK_EQ(fake_critical_violations, 0);
+    return test_result("test_bluetooth");
+}
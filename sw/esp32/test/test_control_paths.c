@@ -0,0 +1,194 @@
+/**
+ * @file Fast control and the Kasa protocol against the BLE bridge: the same colour change down both paths
+ *
+ * Each colour change is sent once as a Kasa transition_light_state request and
+ * once as a fast control datagram, both handled as the network task does and
+ * both reaching the real bridge through bluetooth_send_command. The time to
+ * handle the request is taken from the host clock, and the time until the
+ * simulated bulb shows the colour from the simulated one, so the two paths are
+ * compared on the same bridge in the same run.
+ */
+
+#include <time.h>
+
+#include "fake.h"
+#include "fake_bt.h"
+#include "test.h"
+
+#include "bluetooth.c"
+#include "fast_control.h"
+#include "tplink_kasa.h"
+
+#define BULBS       3
+#define CHANGES     200
+#define BUFFER_LEN  2048
+
+static const struct hsv_colour colours[] = {
+    { .h = 0, .s = 100, .v = 100 },
+    { .h = 120, .s = 100, .v = 100 },
+    { .h = 240, .s = 100, .v = 100 },
+};
+
+/* handling times from the host clock, bulb times from the simulated one */
+static int64_t kasa_handle_ns[CHANGES];
+static int64_t fast_handle_ns[CHANGES];
+static int64_t kasa_shown_ms[CHANGES];
+static int64_t fast_shown_ms[CHANGES];
+
+static int64_t host_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int compare_time(const void * a, const void * b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int64_t percentile(int64_t * times, const int count, const int percent)
+{
+    qsort(times, count, sizeof(times[0]), compare_time);
+    return times[(count - 1) * percent / 100];
+}
+
+/* run the simulated bulbs and the bridge for a time, in steps of 1 ms */
+static void run_ms(const int64_t ms)
+{
+    for (int64_t i = 0; i < ms; i++) {
+        fake_clock_advance(1000);
+        fake_bt_run();
+        do {
+            bridge_step(0);
+        } while (uxQueueMessagesWaiting(bridge_queue) > 0);
+    }
+}
+
+/* run until every bulb shows the colour, returns the time taken in ms or -1 */
+static int64_t run_until_shown(const struct hsv_colour colour, const int64_t limit_ms)
+{
+    const struct rgb_colour rgb = colours_hsv_to_rgb(colour);
+    const uint8_t value[4] = { 0xD0, rgb.r, rgb.g, rgb.b };
+    for (int64_t ms = 0; ms <= limit_ms; ms++) {
+        int shown = 0;
+        for (int bulb = 0; bulb < BULBS; bulb++) {
+            shown += memcmp(fake_bt.bulbs[bulb].value, value, sizeof(value)) == 0;
+        }
+        if (shown == BULBS) {
+            return ms;
+        }
+        run_ms(1);
+    }
+    return -1;
+}
+
+/* a Kasa request for every bulb as it arrives over TCP, handled in place as the sockets transport does */
+static int64_t kasa_change(const struct hsv_colour colour)
+{
+    char json[256];
+    static char buffer[BUFFER_LEN];
+    const int json_len = snprintf(json, sizeof(json), "{\"smartlife.iot.smartbulb.lightingservice\":"
+        "{\"transition_light_state\":{\"hue\":%.0f,\"saturation\":%.0f,\"brightness\":%.0f,\"on_off\":1,"
+        "\"transition_period\":0}}}", colour.h, colour.s, colour.v);
+
+    buffer[0] = json_len >> 24;
+    buffer[1] = json_len >> 16;
+    buffer[2] = json_len >> 8;
+    buffer[3] = json_len;
+    char key = TPLINK_KASA_CIPHER_KEY;
+    for (int i = 0; i < json_len; i++) {
+        buffer[TPLINK_KASA_HEADER_LEN + i] = json[i] ^ key;
+        key = buffer[TPLINK_KASA_HEADER_LEN + i];
+    }
+
+    const int64_t start = host_ns();
+    const int reply_len = tplink_kasa_process_buffer(buffer, TPLINK_KASA_HEADER_LEN + json_len, BUFFER_LEN, true);
+    const int64_t handle_ns = host_ns() - start;
+    CHECK(reply_len > 0);
+    return handle_ns;
+}
+
+/* the same change as a fast control datagram */
+static int64_t fast_change(const struct hsv_colour colour, const uint16_t sequence)
+{
+    const uint16_t hue = colour.h;
+    const uint8_t request[FAST_CONTROL_REQUEST_LEN] = {
+        'I', 'L', FAST_CONTROL_VERSION, 0, sequence >> 8, sequence & 0xff, FAST_CONTROL_ALL_BULBS, 0,
+        hue >> 8, hue & 0xff, colour.s, colour.v, 0, 0,
+    };
+    uint8_t reply[FAST_CONTROL_REPLY_LEN];
+
+    const int64_t start = host_ns();
+    const int reply_len = fast_control_process(request, sizeof(request), reply);
+    const int64_t handle_ns = host_ns() - start;
+    CHECK_EQ(reply_len, FAST_CONTROL_REPLY_LEN);
+    CHECK_EQ(reply[3], FAST_CONTROL_OK);
+    return handle_ns;
+}
+
+static void report(const char * name, int64_t * handle_ns, int64_t * shown_ms)
+{
+    printf("%s: handled in p50 %lld ns, p99 %lld ns; shown after p50 %lld ms, p99 %lld ms over %d changes\n", name,
+        (long long)percentile(handle_ns, CHANGES, 50), (long long)percentile(handle_ns, CHANGES, 99),
+        (long long)percentile(shown_ms, CHANGES, 50), (long long)percentile(shown_ms, CHANGES, 99), CHANGES);
+}
+
+static void test_bulbs_connect(void)
+{
+    bluetooth_start();
+    for (int bulb = 0; bulb < BULBS; bulb++) {
+        int64_t ms = 0;
+        while (!bluetooth_bulb_connected(bulb) && ms++ < 5000) {
+            run_ms(1);
+        }
+        CHECK(bluetooth_bulb_connected(bulb));
+    }
+    /* settle into the idle parameters, as a bridge left alone would be */
+    run_ms(10000);
+}
+
+static void test_same_change_both_paths(void)
+{
+    const struct bluetooth_command_stats before = bluetooth_get_command_stats();
+    for (int i = 0; i < CHANGES; i++) {
+        /* both paths are given the bridge in the same state, each changing the bulbs from another colour */
+        kasa_handle_ns[i] = kasa_change(colours[2 * i % 3]);
+        kasa_shown_ms[i] = run_until_shown(colours[2 * i % 3], 2000);
+        CHECK(kasa_shown_ms[i] >= 0);
+        run_ms(500);
+
+        fast_handle_ns[i] = fast_change(colours[(2 * i + 1) % 3], i);
+        fast_shown_ms[i] = run_until_shown(colours[(2 * i + 1) % 3], 2000);
+        CHECK(fast_shown_ms[i] >= 0);
+        run_ms(500);
+    }
+    CHECK_EQ(bluetooth_get_command_stats().submitted - before.submitted, 2 * CHANGES * BULBS);
+
+    report("Kasa transition_light_state", kasa_handle_ns, kasa_shown_ms);
+    report("fast control", fast_handle_ns, fast_shown_ms);
+
+    /* fast control skips the JSON, which is most of the work before the bridge */
+    const int64_t kasa_p50 = percentile(kasa_handle_ns, CHANGES, 50);
+    const int64_t fast_p50 = percentile(fast_handle_ns, CHANGES, 50);
+    printf("fast control handles a change %.1f times faster\n", (double)kasa_p50 / fast_p50);
+    CHECK(fast_p50 < kasa_p50);
+
+    /* past bluetooth_send_command the two are the same, so the bulb is reached as quickly either way */
+    CHECK_RANGE(percentile(fast_shown_ms, CHANGES, 50), 0, percentile(kasa_shown_ms, CHANGES, 50) + 1);
+}
+
+int main(void)
+{
+    /* start away from zero, as the device does by the time the network is up */
+    fake_clock_advance(1000000);
+    fake_bt_reset(BULBS);
+
+    test_bulbs_connect();
+    test_same_change_both_paths();
+
+    CHECK_EQ(fake_critical_violations, 0);
+    return test_result("test_control_paths");
+}
@@ -0,0 +1,174 @@
+/**
+ * @file Discovery filter under replayed bursts of UDP requests
+ *
+ * Replays request timelines against the simulated clock and checks that only
+ * get_sysinfo is filtered, that repeats are collapsed without starving a fast
+ * poller, that each sender is held to its token bucket and that a storm from
+ * more senders than are tracked is held to the shared one. The test is linked
+ * without cJSON, as nothing is parsed before a request is admitted.
+ */
+
+#include "fake.h"
+#include "test.h"
+
+#include "discovery.c"
+
+#define SYSINFO "{\"system\":{\"get_sysinfo\":null}}"
+#define WINDOW_MS CONFIG_DISCOVERY_DEDUPE_WINDOW_MS
+
+static bool admit(const uint32_t ip, const char * request)
+{
+    return discovery_admit(ip, request, strlen(request));
+}
+
+/* the same request written differently each time, so it is never a repeat */
+static const char * varied_sysinfo(const int n)
+{
+    static char request[64];
+    snprintf(request, sizeof(request), "{\"system\":{\"get_sysinfo\":{}}%*s}", n % 32, "");
+    return request;
+}
+
+/* leave every bucket full and every window closed before the next test */
+static void settle(void)
+{
+    fake_clock_advance(60 * 1000000LL);
+}
+
+static void test_other_requests_pass(void)
+{
+    const struct discovery_stats before = discovery_get_stats();
+    int admitted = 0;
+    for (int i = 0; i < 50; i++) {
+        admitted += admit(0x0a000001, "{\"smartlife.iot.smartbulb.lightingservice\":{\"transition_light_state\":{\"on_off\":1}}}");
+        admitted += admit(0x0a000001, "{\"intellilight.diagnostics\":{\"get_discovery_stats\":null}}");
+        /* a command which also asks for the state is a command */
+        admitted += admit(0x0a000001, "{\"system\":{\"get_sysinfo\":null},"
+            "\"smartlife.iot.smartbulb.lightingservice\":{\"transition_light_state\":{\"on_off\":0}}}");
+        fake_clock_advance(1000);
+    }
+    const struct discovery_stats after = discovery_get_stats();
+    CHECK_EQ(admitted, 150);
+    CHECK_EQ(after.passed - before.passed, 150);
+    CHECK_EQ(after.admitted, before.admitted);
+    settle();
+}
+
+static void test_repeats_collapse(void)
+{
+    const struct discovery_stats before = discovery_get_stats();
+    int admitted = 0;
+    /* a client retrying its broadcast every 10 ms */
+    for (int i = 0; i < 20; i++) {
+        admitted += admit(0x0a000002, SYSINFO);
+        fake_clock_advance(10 * 1000);
+    }
+    CHECK_EQ(admitted, 1);
+    CHECK_EQ(discovery_get_stats().duplicates - before.duplicates, 19);
+
+    /* answered again once the window has passed */
+    fake_clock_advance(WINDOW_MS * 1000LL);
+    CHECK(admit(0x0a000002, SYSINFO));
+    /* another sender is not affected by the first one's repeats */
+    CHECK(admit(0x0a000003, SYSINFO));
+    settle();
+}
+
+static void test_fast_poller_answered_each_window(void)
+{
+    /* the window runs from the last answer, so a sender polling faster than it is not starved */
+    const int poll_ms = 200;
+    const int duration_ms = 10000;
+    int admitted = 0;
+    for (int t = 0; t < duration_ms; t += poll_ms) {
+        admitted += admit(0x0a000004, SYSINFO);
+        fake_clock_advance(poll_ms * 1000LL);
+    }
+    printf("polling every %d ms for %d s: %d answered\n", poll_ms, duration_ms / 1000, admitted);
+    CHECK_RANGE(admitted, duration_ms / WINDOW_MS - 1, duration_ms / WINDOW_MS + 1);
+    settle();
+}
+
+static void test_burst_replay(void)
+{
+    /* three clients broadcasting discovery every 50 ms for 5 s, as seen when a hub and apps start together */
+    const uint32_t ips[3] = { 0x0a000010, 0x0a000011, 0x0a000012 };
+    const int period_ms = 50;
+    const int duration_ms = 5000;
+    int admitted[3] = { 0 };
+    const struct discovery_stats before = discovery_get_stats();
+    for (int n = 0; n * period_ms < duration_ms; n++) {
+        for (int i = 0; i < 3; i++) {
+            admitted[i] += admit(ips[i], varied_sysinfo(n));
+        }
+        fake_clock_advance(period_ms * 1000LL);
+    }
+    const struct discovery_stats after = discovery_get_stats();
+
+    /* each sender gets its burst and then the sustained rate */
+    const int expected = CONFIG_DISCOVERY_BURST + CONFIG_DISCOVERY_RATE_PER_SECOND * duration_ms / 1000;
+    for (int i = 0; i < 3; i++) {
+        printf("sender %d: %d of %d answered\n", i, admitted[i], duration_ms / period_ms);
+        CHECK_RANGE(admitted[i], expected - 1, expected);
+    }
+    CHECK_EQ(after.admitted - before.admitted, admitted[0] + admitted[1] + admitted[2]);
+    CHECK_EQ(after.rate_limited - before.rate_limited, 3 * (duration_ms / period_ms) - (admitted[0] + admitted[1] + admitted[2]));
+    settle();
+}
+
+static void test_sources_recycled(void)
+{
+    /* more senders than slots: each new one takes the slot quiet the longest and starts with a full bucket */
+    int admitted = 0;
+    for (int i = 0; i < MAX_SOURCES + 4; i++) {
+        admitted += admit(0x0a000100 + i, varied_sysinfo(0));
+        fake_clock_advance(1000);
+    }
+    CHECK_EQ(admitted, MAX_SOURCES + 4);
+    int in_use = 0;
+    for (int i = 0; i < MAX_SOURCES; i++) {
+        in_use += sources[i].in_use;
+    }
+    CHECK_EQ(in_use, MAX_SOURCES);
+    settle();
+}
+
+static void test_storm_across_sources(void)
+{
+    /* a storm from 64 addresses every 50 ms for 5 s recycles every slot, so only the shared bucket holds it */
+    const int senders = 64;
+    const int period_ms = 50;
+    const int duration_ms = 5000;
+    int admitted = 0;
+    const struct discovery_stats before = discovery_get_stats();
+    for (int n = 0; n * period_ms < duration_ms; n++) {
+        for (int i = 0; i < senders; i++) {
+            admitted += admit(0x0a000200 + i, varied_sysinfo(n));
+            fake_clock_advance(period_ms * 1000LL / senders);
+        }
+    }
+    const struct discovery_stats after = discovery_get_stats();
+
+    const int expected = CONFIG_DISCOVERY_TOTAL_BURST + CONFIG_DISCOVERY_TOTAL_RATE_PER_SECOND * duration_ms / 1000;
+    printf("%d senders: %d of %d answered\n", senders, admitted, senders * (duration_ms / period_ms));
+    CHECK_RANGE(admitted, expected - 1, expected);
+    CHECK_EQ(after.admitted - before.admitted, admitted);
+    CHECK_EQ(after.rate_limited - before.rate_limited, 0);
+    CHECK_EQ(after.total_limited - before.total_limited, senders * (duration_ms / period_ms) - admitted);
+    settle();
+}
+
+int main(void)
+{
+    /* start away from zero, as the device does by the time the network is up */
+    fake_clock_advance(1000000);
+
+    test_other_requests_pass();
+    test_repeats_collapse();
+    test_fast_poller_answered_each_window();
+    test_burst_replay();
+    test_sources_recycled();
+    test_storm_across_sources();
+
+    return test_result("test_discovery");
+}
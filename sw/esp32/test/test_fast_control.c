@@ -0,0 +1,215 @@
+/**
+ * @file Fast control requests: parsing, the commands sent and the acks
+ */
+
+#include "fake.h"
+#include "fake_bluetooth.h"
+#include "test.h"
+
+#include "fast_control.c"
+
+/* request padded with bytes which must never reach the ack, whatever length is given */
+static uint8_t request[FAST_CONTROL_REQUEST_LEN + 8];
+static uint8_t reply[FAST_CONTROL_REPLY_LEN + 4];
+
+static void make_request(const uint8_t flags, const uint16_t sequence, const uint8_t bulb,
+    const uint16_t hue_red, const uint8_t green, const uint8_t sat_blue, const uint8_t brightness, const uint16_t period_ms)
+{
+    memset(request, 0x5a, sizeof(request));
+    request[0] = 'I';
+    request[1] = 'L';
+    request[2] = FAST_CONTROL_VERSION;
+    request[3] = flags;
+    put_u16(&request[4], sequence);
+    request[6] = bulb;
+    request[7] = 0;
+    if (flags & FAST_CONTROL_FLAG_RGB) {
+        request[8] = hue_red;
+        request[9] = green;
+    } else {
+        put_u16(&request[8], hue_red);
+    }
+    request[10] = sat_blue;
+    request[11] = brightness;
+    put_u16(&request[12], period_ms);
+}
+
+static int process(const int request_len)
+{
+    memset(reply, 0xa5, sizeof(reply));
+    const int reply_len = fast_control_process(request, request_len, reply);
+    /* never more than the ack */
+    CHECK_EQ(reply[FAST_CONTROL_REPLY_LEN], 0xa5);
+    return reply_len;
+}
+
+static void check_ack(const enum fast_control_status status, const uint16_t sequence, const uint8_t bulb)
+{
+    CHECK_EQ(reply[0], 'I');
+    CHECK_EQ(reply[1], 'L');
+    CHECK_EQ(reply[2], FAST_CONTROL_VERSION);
+    CHECK_EQ(reply[3], status);
+    CHECK_EQ(get_u16(&reply[4]), sequence);
+    CHECK_EQ(reply[6], bulb);
+}
+
+static void test_other_datagrams_ignored(void)
+{
+    fake_bluetooth_reset(3);
+    make_request(0, 1, 0, 0, 0, 0, 0, 0);
+    request[1] = 'X';
+    CHECK_EQ(process(FAST_CONTROL_REQUEST_LEN), 0);
+    make_request(0, 1, 0, 0, 0, 0, 0, 0);
+    CHECK_EQ(process(1), 0);
+    CHECK_EQ(process(0), 0);
+    CHECK_EQ(fake_bluetooth.command_count, 0);
+}
+
+static void test_short_request_echoes_what_was_received(void)
+{
+    fake_bluetooth_reset(3);
+    /* the bytes past the end of the datagram are whatever the buffer held before */
+    for (int len = 2; len < FAST_CONTROL_REQUEST_LEN; len++) {
+        make_request(0, 0x1234, 2, 120, 0, 100, 100, 0);
+        CHECK_EQ(process(len), FAST_CONTROL_REPLY_LEN);
+        CHECK_EQ(reply[3], FAST_CONTROL_BAD_REQUEST);
+        CHECK_EQ(get_u16(&reply[4]), len >= 6 ? 0x1234 : 0);
+        CHECK_EQ(reply[6], len >= 7 ? 2 : 0);
+        for (int i = 7; i < FAST_CONTROL_REPLY_LEN; i++) {
+            CHECK_EQ(reply[i], 0);
+        }
+    }
+    CHECK_EQ(fake_bluetooth.command_count, 0);
+
+    /* a longer request and another version are malformed too */
+    make_request(0, 7, 0, 0, 0, 0, 0, 0);
+    CHECK_EQ(process(FAST_CONTROL_REQUEST_LEN + 1), FAST_CONTROL_REPLY_LEN);
+    check_ack(FAST_CONTROL_BAD_REQUEST, 7, 0);
+    request[2] = FAST_CONTROL_VERSION + 1;
+    CHECK_EQ(process(FAST_CONTROL_REQUEST_LEN), FAST_CONTROL_REPLY_LEN);
+    check_ack(FAST_CONTROL_BAD_REQUEST, 7, 0);
+    CHECK_EQ(fake_bluetooth.command_count, 0);
+}
+
+static void test_hsv_command(void)
+{
+    fake_bluetooth_reset(3);
+    make_request(0, 42, 1, 300, 0, 50, 80, 250);
+    CHECK_EQ(process(FAST_CONTROL_REQUEST_LEN), FAST_CONTROL_REPLY_LEN);
+    check_ack(FAST_CONTROL_OK, 42, 1);
+    CHECK_EQ(fake_bluetooth.command_count, 1);
+    const struct bulb_command * command = &fake_bluetooth.commands[0];
+    CHECK_EQ(command->bulb, 1);
+    CHECK_EQ(command->colour.h, 300);
+    CHECK_EQ(command->colour.s, 50);
+    CHECK_EQ(command->colour.v, 80);
+    CHECK(command->on_off);
+    CHECK_EQ(command->period_ms, 250);
+    CHECK(!command->force);
+    /* the ack reports the state asked for */
+    CHECK_EQ(reply[7], 1);
+    CHECK_EQ(get_u16(&reply[8]), 300);
+    CHECK_EQ(reply[10], 50);
+    CHECK_EQ(reply[11], 80);
+
+    /* out of range values are brought into range */
+    make_request(FAST_CONTROL_FLAG_FORCE, 43, 1, 400, 0, 200, 101, 0);
+    process(FAST_CONTROL_REQUEST_LEN);
+    command = &fake_bluetooth.commands[1];
+    CHECK_EQ(command->colour.h, 40);
+    CHECK_EQ(command->colour.s, 100);
+    CHECK_EQ(command->colour.v, 100);
+    CHECK(command->force);
+}
+
+static void test_rgb_command(void)
+{
+    fake_bluetooth_reset(3);
+    make_request(FAST_CONTROL_FLAG_RGB, 1, 0, 0, 0, 255, 0, 0);
+    process(FAST_CONTROL_REQUEST_LEN);
+    check_ack(FAST_CONTROL_OK, 1, 0);
+    CHECK_EQ(fake_bluetooth.command_count, 1);
+    CHECK_EQ(fake_bluetooth.commands[0].colour.h, 240);
+    CHECK_EQ(fake_bluetooth.commands[0].colour.s, 100);
+    CHECK_EQ(fake_bluetooth.commands[0].colour.v, 100);
+}
+
+static void test_off_keeps_colour(void)
+{
+    fake_bluetooth_reset(3);
+    make_request(0, 1, 0, 120, 0, 100, 60, 0);
+    process(FAST_CONTROL_REQUEST_LEN);
+    make_request(FAST_CONTROL_FLAG_OFF, 2, 0, 0, 0, 0, 0, 0);
+    process(FAST_CONTROL_REQUEST_LEN);
+    check_ack(FAST_CONTROL_OK, 2, 0);
+    CHECK_EQ(fake_bluetooth.command_count, 2);
+    CHECK(!fake_bluetooth.commands[1].on_off);
+    CHECK_EQ(fake_bluetooth.commands[1].colour.h, 120);
+    CHECK_EQ(fake_bluetooth.commands[1].colour.v, 60);
+    CHECK_EQ(reply[7], 0);
+    CHECK_EQ(get_u16(&reply[8]), 120);
+}
+
+static void test_query_changes_nothing(void)
+{
+    fake_bluetooth_reset(3);
+    fake_bluetooth.desired[2] = (struct light_state){ .colour = { .h = 30, .s = 90, .v = 10 }, .on_off = true };
+    make_request(FAST_CONTROL_FLAG_QUERY, 9, 2, 200, 0, 0, 0, 0);
+    CHECK_EQ(process(FAST_CONTROL_REQUEST_LEN), FAST_CONTROL_REPLY_LEN);
+    check_ack(FAST_CONTROL_OK, 9, 2);
+    CHECK_EQ(fake_bluetooth.command_count, 0);
+    CHECK_EQ(reply[7], 1);
+    CHECK_EQ(get_u16(&reply[8]), 30);
+    CHECK_EQ(reply[10], 90);
+    CHECK_EQ(reply[11], 10);
+}
+
+static void test_all_bulbs(void)
+{
+    fake_bluetooth_reset(3);
+    make_request(0, 5, FAST_CONTROL_ALL_BULBS, 60, 0, 100, 100, 0);
+    process(FAST_CONTROL_REQUEST_LEN);
+    check_ack(FAST_CONTROL_OK, 5, FAST_CONTROL_ALL_BULBS);
+    CHECK_EQ(fake_bluetooth.command_count, 3);
+    for (int bulb = 0; bulb < 3; bulb++) {
+        CHECK_EQ(fake_bluetooth.commands[bulb].bulb, bulb);
+        CHECK_EQ(fake_bluetooth.commands[bulb].colour.h, 60);
+    }
+}
+
+static void test_status(void)
+{
+    fake_bluetooth_reset(3);
+    make_request(0, 1, 3, 0, 0, 0, 0, 0);
+    process(FAST_CONTROL_REQUEST_LEN);
+    check_ack(FAST_CONTROL_UNKNOWN_BULB, 1, 3);
+    CHECK_EQ(fake_bluetooth.command_count, 0);
+
+    /* a bulb which is away is still sent the command, to take once it is back */
+    fake_bluetooth.connected[1] = false;
+    make_request(0, 2, FAST_CONTROL_ALL_BULBS, 0, 0, 0, 0, 0);
+    process(FAST_CONTROL_REQUEST_LEN);
+    check_ack(FAST_CONTROL_NOT_CONNECTED, 2, FAST_CONTROL_ALL_BULBS);
+    CHECK_EQ(fake_bluetooth.command_count, 3);
+
+    /* a full bridge queue is worse than a missing bulb */
+    fake_bluetooth.accept_commands = false;
+    make_request(0, 3, FAST_CONTROL_ALL_BULBS, 0, 0, 0, 0, 0);
+    process(FAST_CONTROL_REQUEST_LEN);
+    check_ack(FAST_CONTROL_BUSY, 3, FAST_CONTROL_ALL_BULBS);
+    CHECK_EQ(fake_bluetooth.command_count, 3);
+}
+
+int main(void)
+{
+    test_other_datagrams_ignored();
+    test_short_request_echoes_what_was_received();
+    test_hsv_command();
+    test_rgb_command();
+    test_off_keeps_colour();
+    test_query_changes_nothing();
+    test_all_bulbs();
+    test_status();
+
+    return test_result("test_fast_control");
+}
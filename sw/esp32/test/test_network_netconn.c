@@ -0,0 +1,219 @@
+/**
+ * @file Netconn transport over a stand-in for lwIP: decrypting pbuf chains and replying by reference
+ *
+ * Requests are handed to the transport as pbuf chains split at awkward places,
+ * including inside the length header, and the replies are checked for what
+ * was sent and whether it was copied or referenced.
+ */
+
+#include "fake.h"
+#include "fake_bluetooth.h"
+#include "fake_netconn.h"
+#include "test.h"
+
+#include "network_netconn.c"
+
+#define CLIENT_IP   0x1401a8c0      /* 192.168.1.20 */
+#define CLIENT_PORT 50000
+
+static const char * sysinfo_request = "{\"system\":{\"get_sysinfo\":{}}}";
+static const char * cloudinfo_request = "{\"smartlife.iot.common.cloud\":{\"get_info\":{}}}";
+
+static uint32_t requests_served = 0;
+static char encrypted[BUFFER_LEN + 256];
+static char decrypted[FAKE_NETCONN_SENT_LEN];
+
+/* the transport serves until the queue is empty, standing in for a link change */
+void network_wait_for_link(void) {}
+bool network_link_changed(void) { return uxQueueMessagesWaiting(event_queue) == 0; }
+void network_serving(void) {}
+void network_request_served(void) { requests_served++; }
+
+static int encrypt(const char * json, const bool include_header)
+{
+    const int len = strlen(json);
+    char * out = encrypted;
+    if (include_header) {
+        out[0] = len >> 24;
+        out[1] = len >> 16;
+        out[2] = len >> 8;
+        out[3] = len;
+        out += TPLINK_KASA_HEADER_LEN;
+    }
+    char key = TPLINK_KASA_CIPHER_KEY;
+    for (int i = 0; i < len; i++) {
+        out[i] = json[i] ^ key;
+        key = out[i];
+    }
+    return len + (include_header ? TPLINK_KASA_HEADER_LEN : 0);
+}
+
+/* parse the reply a connection sent */
+static cJSON * sent_reply(const struct netconn * conn, const bool include_header)
+{
+    const int len = tplink_kasa_decrypt((const char *)conn->sent, conn->sent_len, decrypted, include_header);
+    decrypted[len] = '\0';
+    return cJSON_Parse(decrypted);
+}
+
+static void start(void)
+{
+    fake_netconn_reset();
+    fake_bluetooth_reset(3);
+    requests_served = 0;
+    if (event_queue == NULL) {
+        event_queue = xQueueCreate(EVENT_QUEUE_LEN, sizeof(struct netconn *));
+        json_buffer = malloc(BUFFER_LEN);
+        reply_buffer = malloc(BUFFER_LEN);
+    }
+    for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+        clients[i] = NULL;
+    }
+    udp_conn = open_conn(NETCONN_UDP, port);
+    tcp_conn = open_conn(NETCONN_TCP, port);
+    fast_conn = open_conn(NETCONN_UDP, CONFIG_FAST_CONTROL_PORT);
+    CHECK(udp_conn != NULL && tcp_conn != NULL && fast_conn != NULL);
+    /* a second transport cannot take the same port */
+    struct netconn * clash = open_conn(NETCONN_UDP, port);
+    CHECK(clash == NULL);
+}
+
+/* serve what is waiting, then check every buffer was given back */
+static void serve_and_check(void)
+{
+    serve();
+    CHECK_EQ(fake_netconn.pbufs, 0);
+    CHECK_EQ(fake_netconn.netbufs, 0);
+}
+
+static void test_chain_decrypts_like_a_buffer(void)
+{
+    start();
+    const int len = encrypt(sysinfo_request, true);
+    const int segment_lens[] = { 1, 3, 7, len };
+    for (int s = 0; s < sizeof(segment_lens) / sizeof(segment_lens[0]); s++) {
+        /* every split of the first pbuf, which puts the end of the header in each place */
+        for (int first = 1; first <= len; first++) {
+            struct pbuf * p = fake_netconn_chain(encrypted, len, first, segment_lens[s]);
+            memset(json_buffer, 0x5a, BUFFER_LEN);
+            const int json_len = decrypt_pbuf_chain(p, true);
+            pbuf_free(p);
+            CHECK_EQ(json_len, strlen(sysinfo_request));
+            CHECK(strcmp(json_buffer, sysinfo_request) == 0);
+        }
+    }
+
+    /* without the header, as UDP sends it */
+    const int udp_len = encrypt(sysinfo_request, false);
+    struct pbuf * p = fake_netconn_chain(encrypted, udp_len, 5, 2);
+    CHECK_EQ(decrypt_pbuf_chain(p, false), strlen(sysinfo_request));
+    CHECK(strcmp(json_buffer, sysinfo_request) == 0);
+    pbuf_free(p);
+    CHECK_EQ(fake_netconn.pbufs, 0);
+}
+
+static void test_oversized_request_is_cut_short(void)
+{
+    start();
+    memset(encrypted, 'x', sizeof(encrypted));
+    struct pbuf * p = fake_netconn_chain(encrypted, sizeof(encrypted), 100, 512);
+    CHECK_EQ(decrypt_pbuf_chain(p, true), BUFFER_LEN - 1);
+    CHECK_EQ(json_buffer[BUFFER_LEN - 1], '\0');
+    pbuf_free(p);
+}
+
+static void test_tcp_request_in_pieces(void)
+{
+    start();
+    struct netconn * client = fake_netconn_connect(tcp_conn);
+    const int len = encrypt(sysinfo_request, true);
+    fake_netconn_deliver(client, fake_netconn_chain(encrypted, len, 3, 4), CLIENT_IP, CLIENT_PORT);
+    serve_and_check();
+
+    /* the reply is built in the reply buffer, so it is copied out */
+    CHECK_EQ(client->sends, 1);
+    CHECK(client->sent_ref == NULL);
+    cJSON * reply = sent_reply(client, true);
+    CHECK(cJSON_GetObjectItem(cJSON_GetObjectItem(reply, "system"), "get_sysinfo") != NULL);
+    cJSON_Delete(reply);
+    CHECK_EQ(requests_served, 1);
+
+    /* one request per connection */
+    CHECK(client->deleted);
+    CHECK_EQ(fake_netconn.conns, 3);
+}
+
+static void test_constant_reply_sent_by_reference(void)
+{
+    start();
+    struct netconn * client = fake_netconn_connect(tcp_conn);
+    handle_accept();
+    /* nothing received yet, so the connection is kept open */
+    CHECK(!client->closed);
+    CHECK(clients[0] == client);
+
+    const int len = encrypt(cloudinfo_request, true);
+    fake_netconn_deliver(client, fake_netconn_chain(encrypted, len, len, len), CLIENT_IP, CLIENT_PORT);
+    serve_and_check();
+    CHECK_EQ(client->sends, 1);
+    CHECK(client->sent_ref != NULL);
+    CHECK((const char *)client->sent_ref < reply_buffer || (const char *)client->sent_ref >= reply_buffer + BUFFER_LEN);
+    cJSON * reply = sent_reply(client, true);
+    CHECK(cJSON_GetObjectItem(reply, "smartlife.iot.common.cloud") != NULL);
+    cJSON_Delete(reply);
+
+    /* the same bytes serve the next client */
+    const void * first_ref = client->sent_ref;
+    client = fake_netconn_connect(tcp_conn);
+    fake_netconn_deliver(client, fake_netconn_chain(encrypted, len, 2, len), CLIENT_IP, CLIENT_PORT + 1);
+    serve_and_check();
+    CHECK(client->sent_ref == first_ref);
+    CHECK_EQ(requests_served, 2);
+}
+
+static void test_udp_datagrams_drained_and_referenced(void)
+{
+    start();
+    /* two datagrams behind one callback, from two senders so discovery admits both */
+    const int len = encrypt(sysinfo_request, false);
+    fake_netconn_deliver(udp_conn, fake_netconn_chain(encrypted, len, 6, 6), CLIENT_IP, CLIENT_PORT);
+    fake_netconn_deliver(udp_conn, fake_netconn_chain(encrypted, len, len, len), CLIENT_IP + (1 << 24), CLIENT_PORT + 1);
+    serve_and_check();
+
+    CHECK_EQ(udp_conn->sends, 2);
+    CHECK_EQ(requests_served, 2);
+    CHECK(udp_conn->sent_ref == reply_buffer);
+    CHECK_EQ(ip4_addr_get_u32(ip_2_ip4(&udp_conn->sent_addr)), CLIENT_IP + (1 << 24));
+    CHECK_EQ(udp_conn->sent_port, CLIENT_PORT + 1);
+    cJSON * reply = sent_reply(udp_conn, false);
+    CHECK(cJSON_GetObjectItem(cJSON_GetObjectItem(reply, "system"), "get_sysinfo") != NULL);
+    cJSON_Delete(reply);
+}
+
+static void test_fast_control_ack_copied(void)
+{
+    start();
+    const uint8_t request[FAST_CONTROL_REQUEST_LEN] = { 'I', 'L', FAST_CONTROL_VERSION, 0, 0x12, 0x34, 1, 0, 0, 120, 100, 100, 0, 0 };
+    fake_netconn_deliver(fast_conn, fake_netconn_chain(request, sizeof(request), 4, 5), CLIENT_IP, CLIENT_PORT);
+    serve_and_check();
+    CHECK_EQ(fast_conn->sends, 1);
+    CHECK(fast_conn->sent_ref == NULL);
+    CHECK_EQ(fast_conn->sent_len, FAST_CONTROL_REPLY_LEN);
+    CHECK_EQ(fast_conn->sent[3], FAST_CONTROL_OK);
+    CHECK_EQ(fast_conn->sent[4], 0x12);
+    CHECK_EQ(fake_bluetooth.command_count, 1);
+    CHECK_EQ(fake_bluetooth.commands[0].colour.h, 120);
+}
+
+int main(void)
+{
+    test_chain_decrypts_like_a_buffer();
+    test_oversized_request_is_cut_short();
+    test_tcp_request_in_pieces();
+    test_constant_reply_sent_by_reference();
+    test_udp_datagrams_drained_and_referenced();
+    test_fast_control_ack_copied();
+
+    fake_netconn_reset();
+    return test_result("test_network_netconn");
+}
@@ -0,0 +1,460 @@
+/**
+ * @file Sockets transport over the host's loopback interface: request latency and concurrent clients
+ *
+ * The transport runs in real threads on the Kasa and fast control ports, and
+ * clients time their requests with the host clock. The same commands are timed
+ * against a copy of the polling TCP server the select() loop replaced, so the
+ * improvement is measured on the same host in the same run rather than against
+ * a fixed limit. Neither a client whose request waits on the bulbs nor a full
+ * table of clients which never send anything should hold up the rest, and a
+ * reply still waiting on the bulbs when the link changes is not sent at all.
+ */
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "fake.h"
+#include "fake_bluetooth.h"
+#include "test.h"
+
+/* lwIP has the reentrant inet_ntoa_r, the host C library does not */
+static char * inet_ntoa_r(const struct in_addr addr, char * buf, const int buflen)
+{
+    return (char *)inet_ntop(AF_INET, &addr, buf, buflen);
+}
+
+#include "network_sockets.c"
+
+#define REQUESTS        50
+#define REQUEST_GAP_MS  10
+#define BASELINE_PORT   9997
+#define BASELINE_POLL_MS 500
+#define BASELINE_REQUESTS 8
+#define CLIENTS         6
+#define CLIENT_REQUESTS 30
+#define SLOW_CLIENTS    2
+#define CLIENT_GAP_MS   30
+#define SLOW_WAIT_MS    200
+#define REPLY_TIMEOUT_S 2
+
+static const char * command_request =
+    "{\"smartlife.iot.smartbulb.lightingservice\":{\"transition_light_state\":"
+    "{\"on_off\":1,\"hue\":120,\"saturation\":100,\"brightness\":50}}}";
+static const char * sysinfo_request = "{\"system\":{\"get_sysinfo\":{}}}";
+
+/* the supervisor's side, the link can be made to change to check the task rebinds */
+static atomic_int link_waits = 0;
+static atomic_bool link_change = false;
+static atomic_int serving = 0;
+static atomic_int requests_served = 0;
+
+void network_wait_for_link(void)
+{
+    link_waits++;
+    link_change = false;
+}
+bool network_link_changed(void) { return link_change; }
+void network_serving(void) { serving++; }
+void network_request_served(void) { requests_served++; }
+
+static int64_t elapsed_us(const int64_t start)
+{
+    return esp_timer_get_time() - start;
+}
+
+static int compare_latency(const void * a, const void * b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int64_t percentile(int64_t * latencies, const int count, const int percent)
+{
+    qsort(latencies, count, sizeof(latencies[0]), compare_latency);
+    return latencies[(count - 1) * percent / 100];
+}
+
+static int encrypt(const char * json, char * buffer, const int size, const bool include_header)
+{
+    cJSON * request = cJSON_Parse(json);
+    const int len = tplink_kasa_encrypt(request, buffer, size, include_header);
+    cJSON_Delete(request);
+    return len;
+}
+
+static int client_socket(const int type)
+{
+    const int sock = socket(AF_INET, type, 0);
+    const struct timeval timeout = { .tv_sec = REPLY_TIMEOUT_S };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+static struct sockaddr_in local_addr(const uint16_t local_port)
+{
+    return (struct sockaddr_in){
+        .sin_family = AF_INET, .sin_port = htons(local_port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+}
+
+/* one request over its own connection, as the Kasa app sends them, timed from connect to the whole reply */
+static int64_t tcp_request_to(const uint16_t local_port, const char * json)
+{
+    char request[1024];
+    char reply[TCP_BUFFER_LEN];
+    const int request_len = encrypt(json, request, sizeof(request), true);
+
+    const int64_t start = esp_timer_get_time();
+    const int sock = client_socket(SOCK_STREAM);
+    const struct sockaddr_in addr = local_addr(local_port);
+    if (connect(sock, (const struct sockaddr *)&addr, sizeof(addr)) != 0
+        || send(sock, request, request_len, 0) != request_len) {
+        close(sock);
+        return -1;
+    }
+    int reply_len = 0;
+    int expected = -1;
+    while (expected < 0 || reply_len < expected) {
+        const int len = recv(sock, reply + reply_len, sizeof(reply) - reply_len, 0);
+        if (len <= 0) {
+            break;
+        }
+        reply_len += len;
+        if (expected < 0 && reply_len >= TPLINK_KASA_HEADER_LEN) {
+            expected = TPLINK_KASA_HEADER_LEN + ((uint8_t)reply[2] << 8 | (uint8_t)reply[3]);
+        }
+    }
+    close(sock);
+    return expected > 0 && reply_len == expected ? elapsed_us(start) : -1;
+}
+
+static int64_t tcp_request(const char * json)
+{
+    return tcp_request_to(NETWORK_PORT, json);
+}
+
+static int64_t udp_request(const int sock, const uint16_t local_port, const void * request, const int request_len)
+{
+    char reply[UDP_BUFFER_LEN];
+    const struct sockaddr_in addr = local_addr(local_port);
+    const int64_t start = esp_timer_get_time();
+    if (sendto(sock, request, request_len, 0, (const struct sockaddr *)&addr, sizeof(addr)) != request_len
+        || recv(sock, reply, sizeof(reply), 0) <= 0) {
+        return -1;
+    }
+    return elapsed_us(start);
+}
+
+/* print the spread of the latencies, returns the median */
+static int64_t report(const char * name, int64_t * latencies, const int count)
+{
+    const int64_t p50 = percentile(latencies, count, 50);
+    const int64_t p99 = percentile(latencies, count, 99);
+    printf("%s: p50 %lld us, p99 %lld us, max %lld us over %d requests\n", name,
+        (long long)p50, (long long)p99, (long long)latencies[count - 1], count);
+    return p50;
+}
+
+/* the TCP server the select() loop replaced: a non-blocking accept polled every 500 ms, one client at a time */
+static void * polling_server(void * arg)
+{
+    const int listen_sock = (int)(intptr_t)arg;
+    char * buffer = malloc(TCP_BUFFER_LEN);
+    char * json_buffer = malloc(TCP_BUFFER_LEN);
+    while (true) {
+        const int connection = accept(listen_sock, NULL, NULL);
+        if (connection < 0) {
+            usleep(BASELINE_POLL_MS * 1000);
+            continue;
+        }
+        handle_tcp(connection, buffer, json_buffer);
+    }
+    return NULL;
+}
+
+/* median latency of the polling server, which the transport is measured against */
+static int64_t baseline_p50 = 0;
+
+/* the handler counts a request once its reply is sent, which can be just after the client has it */
+static void wait_served(const int count)
+{
+    const int64_t start = esp_timer_get_time();
+    while (requests_served < count && elapsed_us(start) < 1000000) {
+        usleep(1000);
+    }
+}
+
+static void test_transport_starts(void)
+{
+    network_transport_start();
+    const int64_t start = esp_timer_get_time();
+    while (serving == 0 && elapsed_us(start) < 5000000) {
+        usleep(1000);
+    }
+    CHECK_EQ(serving, 1);
+    CHECK_EQ(link_waits, 1);
+}
+
+static void test_command_latency(void)
+{
+    int64_t latencies[REQUESTS];
+
+    /* the same commands through the old polling server first, with the same gap between them */
+    const int listen_sock = create_socket(SOCK_STREAM, BASELINE_PORT);
+    CHECK(listen_sock >= 0);
+    pthread_t baseline;
+    pthread_create(&baseline, NULL, polling_server, (void *)(intptr_t)listen_sock);
+    pthread_detach(baseline);
+    for (int i = 0; i < BASELINE_REQUESTS; i++) {
+        usleep(REQUEST_GAP_MS * 1000);
+        latencies[i] = tcp_request_to(BASELINE_PORT, command_request);
+        CHECK(latencies[i] >= 0);
+    }
+    baseline_p50 = report("TCP command, polling baseline", latencies, BASELINE_REQUESTS);
+    const int served = requests_served;
+
+    /* nothing polls any more, so the request is answered as soon as it is handled */
+    for (int i = 0; i < REQUESTS; i++) {
+        usleep(REQUEST_GAP_MS * 1000);
+        latencies[i] = tcp_request(command_request);
+        CHECK(latencies[i] >= 0);
+    }
+    report("TCP command", latencies, REQUESTS);
+    const int64_t select_p99 = percentile(latencies, REQUESTS, 99);
+    printf("TCP command p99 is %lld times below the polling median\n",
+        (long long)(baseline_p50 / (select_p99 > 0 ? select_p99 : 1)));
+    CHECK(select_p99 * 10 < baseline_p50);
+
+    char request[1024];
+    const int request_len = encrypt(command_request, request, sizeof(request), false);
+    int sock = client_socket(SOCK_DGRAM);
+    for (int i = 0; i < REQUESTS; i++) {
+        latencies[i] = udp_request(sock, NETWORK_PORT, request, request_len);
+        CHECK(latencies[i] >= 0);
+    }
+    close(sock);
+    report("UDP command", latencies, REQUESTS);
+
+    const uint8_t fast[FAST_CONTROL_REQUEST_LEN] = { 'I', 'L', FAST_CONTROL_VERSION, 0, 0, 1, 0, 0, 0, 120, 100, 50, 0, 0 };
+    sock = client_socket(SOCK_DGRAM);
+    for (int i = 0; i < REQUESTS; i++) {
+        latencies[i] = udp_request(sock, CONFIG_FAST_CONTROL_PORT, fast, sizeof(fast));
+        CHECK(latencies[i] >= 0);
+    }
+    close(sock);
+    report("fast control", latencies, REQUESTS);
+
+    wait_served(served + 3 * REQUESTS);
+    CHECK_EQ(requests_served, served + 3 * REQUESTS);
+    CHECK(fake_bluetooth.command_count > 0);
+}
+
+static void test_wake_rebinds(void)
+{
+    /* the supervisor's wake interrupts select straight away, the sockets are closed and bound again */
+    const int64_t start = esp_timer_get_time();
+    link_change = true;
+    network_transport_wake();
+    while (serving < 2 && elapsed_us(start) < 5000000) {
+        usleep(100);
+    }
+    const int64_t rebind_us = elapsed_us(start);
+    printf("link change seen and sockets bound again after %lld us\n", (long long)rebind_us);
+    CHECK_EQ(serving, 2);
+    CHECK_EQ(link_waits, 2);
+    /* the polling servers took as long to notice anything at all */
+    CHECK(rebind_us < baseline_p50);
+    CHECK(tcp_request(command_request) >= 0);
+}
+
+static int64_t command_latencies[CLIENTS * CLIENT_REQUESTS];
+static atomic_int command_count = 0;
+static atomic_int failures = 0;
+static atomic_bool slow_clients_stop = false;
+static atomic_int slow_requests = 0;
+
+static void * command_client(void * arg)
+{
+    for (int i = 0; i < CLIENT_REQUESTS; i++) {
+        const int64_t latency = tcp_request(command_request);
+        if (latency < 0) {
+            failures++;
+        } else {
+            command_latencies[command_count++] = latency;
+        }
+        usleep(CLIENT_GAP_MS * 1000);
+    }
+    return NULL;
+}
+
+static void * slow_client(void * arg)
+{
+    while (!slow_clients_stop) {
+        const int64_t latency = tcp_request(sysinfo_request);
+        if (latency < SLOW_WAIT_MS * 1000LL) {
+            failures++;
+        }
+        slow_requests++;
+    }
+    return NULL;
+}
+
+static void test_concurrent_clients(void)
+{
+    /* get_sysinfo waits for fresh bulb states, which here takes as long as the read timeout */
+    fake_bluetooth.fresh_wait_ms = SLOW_WAIT_MS;
+    pthread_t slow[SLOW_CLIENTS];
+    for (int i = 0; i < SLOW_CLIENTS; i++) {
+        pthread_create(&slow[i], NULL, slow_client, NULL);
+    }
+
+    /* and one client connects without ever sending anything */
+    const int idle_sock = client_socket(SOCK_STREAM);
+    const struct sockaddr_in addr = local_addr(NETWORK_PORT);
+    CHECK_EQ(connect(idle_sock, (const struct sockaddr *)&addr, sizeof(addr)), 0);
+    while (fake_bluetooth.fresh_waits < SLOW_CLIENTS) {
+        usleep(1000);
+    }
+
+    const int64_t start = esp_timer_get_time();
+    pthread_t clients[CLIENTS];
+    for (int i = 0; i < CLIENTS; i++) {
+        pthread_create(&clients[i], NULL, command_client, NULL);
+    }
+    for (int i = 0; i < CLIENTS; i++) {
+        pthread_join(clients[i], NULL);
+    }
+    const int64_t run_us = elapsed_us(start);
+    slow_clients_stop = true;
+    for (int i = 0; i < SLOW_CLIENTS; i++) {
+        pthread_join(slow[i], NULL);
+    }
+    close(idle_sock);
+    fake_bluetooth.fresh_wait_ms = 0;
+
+    /* the commands are not queued behind the slow requests, which hold CONFIG_NETWORK_TCP_WORKERS - 1 handlers */
+    printf("%d clients with %d slow ones and an idle one, %d requests each in %lld ms, %d slow requests\n",
+        CLIENTS, SLOW_CLIENTS, CLIENT_REQUESTS, (long long)run_us / 1000, (int)slow_requests);
+    CHECK_EQ(failures, 0);
+    CHECK_EQ(command_count, CLIENTS * CLIENT_REQUESTS);
+    report("concurrent TCP command", command_latencies, command_count);
+    CHECK_RANGE(percentile(command_latencies, command_count, 99), 0, SLOW_WAIT_MS * 1000LL / 2);
+    CHECK(slow_requests >= SLOW_CLIENTS * run_us / (SLOW_WAIT_MS * 1000LL));
+}
+
+static int clients_waiting(void)
+{
+    int waiting = 0;
+    for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+        if (clients[i].sock >= 0) waiting++;
+    }
+    return waiting;
+}
+
+static void test_idle_clients_expire(void)
+{
+    /* fill every slot with a client which connects and never sends anything */
+    int idle[MAX_TCP_CLIENTS];
+    const struct sockaddr_in addr = local_addr(NETWORK_PORT);
+    const struct timeval timeout = { .tv_sec = TCP_RECV_TIMEOUT_S * 2 };
+    while (clients_waiting() > 0) {
+        usleep(1000);
+    }
+    const int64_t start = esp_timer_get_time();
+    for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+        idle[i] = client_socket(SOCK_STREAM);
+        setsockopt(idle[i], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        CHECK_EQ(connect(idle[i], (const struct sockaddr *)&addr, sizeof(addr)), 0);
+        /* accepted in order, so the first is the one to make room */
+        while (clients_waiting() < i + 1 && elapsed_us(start) < 1000000) {
+            usleep(1000);
+        }
+    }
+    CHECK_EQ(clients_waiting(), MAX_TCP_CLIENTS);
+
+    /* a new client is still served, in place of the one which has waited longest */
+    const int64_t latency = tcp_request(command_request);
+    printf("TCP command with %d idle clients waiting: %lld us\n", MAX_TCP_CLIENTS, (long long)latency);
+    CHECK(latency >= 0);
+    CHECK(latency * 10 < baseline_p50);
+    char byte;
+    CHECK_EQ(recv(idle[0], &byte, sizeof(byte), 0), 0);
+
+    /* the rest are closed once they have sent nothing for the whole timeout */
+    for (int i = 1; i < MAX_TCP_CLIENTS; i++) {
+        CHECK_EQ(recv(idle[i], &byte, sizeof(byte), 0), 0);
+    }
+    const int64_t expired_us = elapsed_us(start);
+    printf("idle clients closed after %lld ms\n", (long long)expired_us / 1000);
+    CHECK_RANGE(expired_us, TCP_RECV_TIMEOUT_S * 1000000LL, (TCP_RECV_TIMEOUT_S + 1) * 1000000LL);
+    /* the slot is freed just after the close the clients saw */
+    const int64_t closed = esp_timer_get_time();
+    while (clients_waiting() > 0 && elapsed_us(closed) < 100000) {
+        usleep(1000);
+    }
+    CHECK_EQ(clients_waiting(), 0);
+    for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+        close(idle[i]);
+    }
+}
+
+static void test_link_change_drops_waiting_udp_reply(void)
+{
+    /* a discovery request which waits for the bulbs, in a handler, when the link changes */
+    fake_bluetooth.fresh_wait_ms = SLOW_WAIT_MS;
+    const uint32_t waits = fake_bluetooth.fresh_waits;
+    const int served = requests_served;
+    const int bound = serving;
+    char request[1024];
+    const int request_len = encrypt("{\"system\":{\"get_sysinfo\":null}}", request, sizeof(request), false);
+    const int sock = client_socket(SOCK_DGRAM);
+    const struct sockaddr_in addr = local_addr(NETWORK_PORT);
+    CHECK_EQ(sendto(sock, request, request_len, 0, (const struct sockaddr *)&addr, sizeof(addr)), request_len);
+    const int64_t start = esp_timer_get_time();
+    while (fake_bluetooth.fresh_waits == waits && elapsed_us(start) < 1000000) {
+        usleep(1000);
+    }
+    CHECK_EQ(fake_bluetooth.fresh_waits, waits + 1);
+
+    /* the socket is closed, and a new one bound likely on the same descriptor, before the handler replies */
+    link_change = true;
+    network_transport_wake();
+    while (serving == bound && elapsed_us(start) < 1000000) {
+        usleep(100);
+    }
+    CHECK_EQ(serving, bound + 1);
+    CHECK(elapsed_us(start) < SLOW_WAIT_MS * 1000LL);
+
+    /* the reply belonged to the old socket and is dropped rather than sent on whatever replaced it */
+    char reply[UDP_BUFFER_LEN];
+    const struct timeval timeout = { .tv_usec = SLOW_WAIT_MS * 2000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    CHECK(recv(sock, reply, sizeof(reply), 0) < 0);
+    CHECK_EQ(requests_served, served);
+    close(sock);
+    fake_bluetooth.fresh_wait_ms = 0;
+
+    /* and the new socket answers */
+    CHECK(tcp_request(command_request) >= 0);
+}
+
+int main(void)
+{
+    fake_tasks_run(true);
+    fake_clock_use_real(true);
+    fake_bluetooth_reset(3);
+
+    test_transport_starts();
+    test_command_latency();
+    test_wake_rebinds();
+    test_concurrent_clients();
+    test_idle_clients_expire();
+    test_link_change_drops_waiting_udp_reply();
+
+    return test_result("test_network_sockets");
+}
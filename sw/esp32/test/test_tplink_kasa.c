@@ -0,0 +1,229 @@
+/**
+ * @file Kasa request handling: reply sizes, error replies and child addressing
+ */
+
+#include <stdint.h>
+
+#include "fake.h"
+#include "fake_bluetooth.h"
+#include "test.h"
+
+#include "tplink_kasa.c"
+
+static struct discovery_stats discovery_stats;
+
+struct discovery_stats discovery_get_stats(void)
+{
+    return discovery_stats;
+}
+
+#define BUFFER_SIZE 8192
+
+static char reply_buffer[BUFFER_SIZE];
+static char decrypted[BUFFER_SIZE];
+static uint32_t state_version = 0;
+
+/* process a request as the TCP server does and parse the decrypted reply */
+static cJSON * send_request(const char * json, const int reply_size, int * reply_len)
+{
+    const char * reply = reply_buffer;
+    *reply_len = tplink_kasa_process_request(json, reply_buffer, reply_size, &reply, true);
+    if (*reply_len <= 0) {
+        return NULL;
+    }
+    tplink_kasa_decrypt(reply, *reply_len, decrypted, true);
+    return cJSON_Parse(decrypted);
+}
+
+static int get_err_code(const cJSON * reply, const char * module, const char * method)
+{
+    const cJSON * node = cJSON_GetObjectItem(reply, module);
+    if (method != NULL) {
+        node = cJSON_GetObjectItem(node, method);
+    }
+    const cJSON * err_code = cJSON_GetObjectItem(node, "err_code");
+    return cJSON_IsNumber(err_code) ? err_code->valueint : INT32_MIN;
+}
+
+/* every bulb with the widest numbers the replies can contain */
+static void set_worst_case(const int bulb_count, const bool on)
+{
+    fake_bluetooth_reset(bulb_count);
+    for (int bulb = 0; bulb < bulb_count; bulb++) {
+        bulb_state[bulb].colour = (struct hsv_colour){ .h = 360, .s = 100, .v = 100 };
+        bulb_state[bulb].on_off = on;
+        bulb_state[bulb].temperature = 9000;
+        fake_bluetooth.link[bulb] = (struct bluetooth_link_quality){ .rssi = -127, .health = 100 };
+    }
+    memset(&fake_bluetooth.scan_stats, 0xff, sizeof(fake_bluetooth.scan_stats));
+    memset(&fake_bluetooth.tx_stats, 0xff, sizeof(fake_bluetooth.tx_stats));
+    memset(&fake_bluetooth.conn_stats, 0xff, sizeof(fake_bluetooth.conn_stats));
+    memset(&fake_bluetooth.bridge_stats, 0xff, sizeof(fake_bluetooth.bridge_stats));
+    memset(&fake_bluetooth.state_stats, 0xff, sizeof(fake_bluetooth.state_stats));
+    memset(&fake_bluetooth.command_stats, 0xff, sizeof(fake_bluetooth.command_stats));
+    memset(&fake_bluetooth.link_stats, 0xff, sizeof(fake_bluetooth.link_stats));
+    memset(&discovery_stats, 0xff, sizeof(discovery_stats));
+    /* invalidate the cached sysinfo reply */
+    fake_bluetooth.version = ++state_version;
+}
+
+static const char sysinfo_request[] = "{\"system\":{\"get_sysinfo\":null}}";
+static const char diagnostics_request[] = "{\"" TPLINK_KASA_DIAGNOSTICS_MODULE "\":{\"get_boot_profile\":null,"
+    "\"get_scan_stats\":null,\"get_tx_stats\":null,\"get_conn_stats\":null,\"get_bridge_stats\":null,"
+    "\"get_state_stats\":null,\"get_command_stats\":null,\"get_link_stats\":null,\"get_discovery_stats\":null}}";
+
+static void test_longest_replies_fit(void)
+{
+    for (int bulb_count = 1; bulb_count <= BLUETOOTH_MAX_BULBS; bulb_count++) {
+        /* a bulb which is off reports its colour under dft_on_state, which is longer */
+        int longest = 0;
+        for (int on = 0; on < 2; on++) {
+            set_worst_case(bulb_count, on);
+            int reply_len;
+            cJSON * reply = send_request(sysinfo_request, BUFFER_SIZE, &reply_len);
+            CHECK_EQ(get_err_code(reply, "system", "get_sysinfo"), 0);
+            cJSON_Delete(reply);
+            if (reply_len > longest) longest = reply_len;
+        }
+        const int children = bulb_count > 1 ? bulb_count : 0;
+        CHECK(longest <= TPLINK_KASA_HEADER_LEN + TPLINK_KASA_SYSINFO_BASE_LEN + children * TPLINK_KASA_SYSINFO_CHILD_LEN);
+        printf("get_sysinfo with %d bulbs: %d bytes\n", bulb_count, longest);
+
+        int reply_len;
+        cJSON * reply = send_request(diagnostics_request, BUFFER_SIZE, &reply_len);
+        CHECK_EQ(get_err_code(reply, TPLINK_KASA_DIAGNOSTICS_MODULE, "get_link_stats"), 0);
+        CHECK_EQ(get_err_code(reply, TPLINK_KASA_DIAGNOSTICS_MODULE, "get_discovery_stats"), 0);
+        CHECK(reply_len <= TPLINK_KASA_HEADER_LEN + TPLINK_KASA_DIAGNOSTICS_BASE_LEN + bulb_count * TPLINK_KASA_DIAGNOSTICS_BULB_LEN);
+        printf("all diagnostics with %d bulbs: %d bytes\n", bulb_count, reply_len);
+        cJSON_Delete(reply);
+    }
+
+    /* the network buffers are sized for the most bulbs configured */
+    CHECK(TPLINK_KASA_REPLY_MAX_LEN >= TPLINK_KASA_SYSINFO_MAX_LEN);
+    CHECK(TPLINK_KASA_REPLY_MAX_LEN >= TPLINK_KASA_DIAGNOSTICS_MAX_LEN);
+}
+
+static void test_too_long_reply_is_an_error(void)
+{
+    /* a buffer sized for a single bulb cannot hold the sysinfo of every bulb */
+    const int reply_size = TPLINK_KASA_HEADER_LEN + TPLINK_KASA_SYSINFO_BASE_LEN;
+    set_worst_case(BLUETOOTH_MAX_BULBS, false);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        /* the second attempt is served from the cached reply */
+        memset(reply_buffer + reply_size, 0x5a, 64);
+        int reply_len;
+        cJSON * reply = send_request(sysinfo_request, reply_size, &reply_len);
+        CHECK(reply_len > 0 && reply_len <= reply_size);
+        CHECK_EQ(get_err_code(reply, "system", "get_sysinfo"), TPLINK_KASA_ERR_REPLY_TOO_LONG);
+        CHECK_EQ(reply_buffer[reply_size], 0x5a);
+        cJSON_Delete(reply);
+    }
+
+    int reply_len;
+    cJSON * reply = send_request(diagnostics_request, 600, &reply_len);
+    CHECK(reply_len > 0 && reply_len <= 600);
+    CHECK_EQ(get_err_code(reply, TPLINK_KASA_DIAGNOSTICS_MODULE, NULL), TPLINK_KASA_ERR_REPLY_TOO_LONG);
+    cJSON_Delete(reply);
+}
+
+static void test_process_buffer_respects_size(void)
+{
+    /* a UDP discovery request answered in place, without the header */
+    set_worst_case(BLUETOOTH_MAX_BULBS, true);
+    char buffer[TPLINK_KASA_REPLY_MAX_LEN];
+    const int request_len = tplink_kasa_encrypt_string(sysinfo_request, buffer, false);
+    const int reply_len = tplink_kasa_process_buffer(buffer, request_len, sizeof(buffer), false);
+    CHECK(reply_len > 0 && reply_len <= (int)sizeof(buffer));
+
+    char key = TPLINK_KASA_CIPHER_KEY;
+    tplink_kasa_decrypt_fragment(buffer, reply_len, decrypted, &key);
+    decrypted[reply_len] = '\0';
+    cJSON * reply = cJSON_Parse(decrypted);
+    cJSON * children = cJSON_GetObjectItem(cJSON_GetObjectItem(cJSON_GetObjectItem(reply, "system"), "get_sysinfo"), "children");
+    CHECK_EQ(cJSON_GetArraySize(children), BLUETOOTH_MAX_BULBS);
+    cJSON_Delete(reply);
+}
+
+static void test_unknown_child_is_an_error(void)
+{
+    fake_bluetooth_reset(3);
+    int reply_len;
+    cJSON * reply = send_request("{\"context\":{\"child_ids\":[\"0000\"]},"
+        "\"smartlife.iot.smartbulb.lightingservice\":{\"transition_light_state\":{\"on_off\":1}}}", BUFFER_SIZE, &reply_len);
+    CHECK(reply_len > 0);
+    CHECK_EQ(get_err_code(reply, "smartlife.iot.smartbulb.lightingservice", "transition_light_state"), TPLINK_KASA_ERR_ENTRY_NOT_EXIST);
+    CHECK_EQ(fake_bluetooth.command_count, 0);
+    cJSON_Delete(reply);
+}
+
+static void test_child_is_addressed(void)
+{
+    fake_bluetooth_reset(3);
+    char child_id[TPLINK_KASA_CHILD_ID_LEN];
+    char request[256];
+    tplink_kasa_child_id(2, child_id);
+    snprintf(request, sizeof(request), "{\"context\":{\"child_ids\":[\"%s\"]},"
+        "\"smartlife.iot.smartbulb.lightingservice\":{\"transition_light_state\":{\"hue\":120,\"saturation\":100,\"brightness\":50}}}",
+        child_id);
+    int reply_len;
+    cJSON * reply = send_request(request, BUFFER_SIZE, &reply_len);
+    CHECK_EQ(get_err_code(reply, "smartlife.iot.smartbulb.lightingservice", "transition_light_state"), 0);
+    CHECK_EQ(fake_bluetooth.command_count, 1);
+    CHECK_EQ(fake_bluetooth.commands[0].bulb, 2);
+    CHECK_EQ(fake_bluetooth.commands[0].colour.h, 120);
+    cJSON_Delete(reply);
+}
+
+static void test_busy_bridge_is_an_error(void)
+{
+    fake_bluetooth_reset(3);
+    fake_bluetooth.accept_commands = false;
+    int reply_len;
+    cJSON * reply = send_request("{\"smartlife.iot.smartbulb.lightingservice\":{\"transition_light_state\":{\"hue\":240,\"on_off\":1}}}",
+        BUFFER_SIZE, &reply_len);
+    CHECK(reply_len > 0);
+    CHECK_EQ(get_err_code(reply, "smartlife.iot.smartbulb.lightingservice", "transition_light_state"), TPLINK_KASA_ERR_BRIDGE_BUSY);
+    /* the desired state is left as it was, so later replies do not report the lost change */
+    CHECK_EQ(bluetooth_desired_state(0).colour.h, 0);
+    cJSON_Delete(reply);
+}
+
+static void test_busy_bulb_reported_per_child(void)
+{
+    /* the bridge takes the command for two of three bulbs, which are changed whatever the reply says */
+    fake_bluetooth_reset(3);
+    fake_bluetooth.busy_bulbs = 1UL << 1;
+    int reply_len;
+    cJSON * reply = send_request("{\"smartlife.iot.smartbulb.lightingservice\":{\"transition_light_state\":{\"hue\":240,\"on_off\":1}}}",
+        BUFFER_SIZE, &reply_len);
+    CHECK(reply_len > 0);
+    CHECK_EQ(get_err_code(reply, "smartlife.iot.smartbulb.lightingservice", "transition_light_state"), TPLINK_KASA_ERR_BRIDGE_BUSY);
+    CHECK_EQ(fake_bluetooth.command_count, 2);
+
+    /* each child addressed gets its own result */
+    const cJSON * children = cJSON_GetObjectItem(cJSON_GetObjectItem(cJSON_GetObjectItem(reply,
+        "smartlife.iot.smartbulb.lightingservice"), "transition_light_state"), "children");
+    CHECK_EQ(cJSON_GetArraySize(children), 3);
+    for (int bulb = 0; bulb < 3; bulb++) {
+        const cJSON * child = cJSON_GetArrayItem(children, bulb);
+        char child_id[TPLINK_KASA_CHILD_ID_LEN];
+        tplink_kasa_child_id(bulb, child_id);
+        CHECK(strcmp(cJSON_GetObjectItem(child, "id")->valuestring, child_id) == 0);
+        CHECK_EQ(cJSON_GetObjectItem(child, "err_code")->valueint, bulb == 1 ? TPLINK_KASA_ERR_BRIDGE_BUSY : 0);
+        CHECK_EQ(bluetooth_desired_state(bulb).colour.h, bulb == 1 ? 0 : 240);
+    }
+    cJSON_Delete(reply);
+}
+
+int main(void)
+{
+    test_longest_replies_fit();
+    test_too_long_reply_is_an_error();
+    test_process_buffer_respects_size();
+    test_unknown_child_is_an_error();
+    test_child_is_addressed();
+    test_busy_bridge_is_an_error();
+    test_busy_bulb_reported_per_child();
+
+    return test_result("test_tplink_kasa");
+}
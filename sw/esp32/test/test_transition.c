@@ -0,0 +1,181 @@
+/**
+ * @file Fades: colour interpolation and the frames sent to the bulbs
+ *
+ * Steps the fades once per TRANSITION_FRAME_US of simulated time, as the
+ * bridge task does for each frame timer event, and checks the frames written.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "fake.h"
+#include "fake_bluetooth.h"
+#include "test.h"
+
+#include "transition.c"
+
+static const struct hsv_colour red = { .h = 0, .s = 100, .v = 100 };
+static const struct hsv_colour green = { .h = 120, .s = 100, .v = 100 };
+static const struct hsv_colour blue = { .h = 240, .s = 100, .v = 100 };
+
+#define CHECK_NEAR(actual, expected) CHECK(fabs((double)(actual) - (double)(expected)) < 0.01)
+
+/* step the fades once per frame until they finish, returns the number of frames */
+static int run_frames(const int64_t limit_us)
+{
+    int frames = 0;
+    const int64_t start = esp_timer_get_time();
+    while (esp_timer_get_time() - start < limit_us) {
+        fake_clock_advance(TRANSITION_FRAME_US);
+        frames++;
+        if (!transition_step(esp_timer_get_time())) {
+            break;
+        }
+    }
+    return frames;
+}
+
+static void reset(const struct hsv_colour colour, const bool on_off)
+{
+    fake_bluetooth_reset(2);
+    memset(fades, 0, sizeof(fades));
+    bulb_state[0].colour = colour;
+    bulb_state[0].on_off = on_off;
+}
+
+static void test_interpolate(void)
+{
+    const struct hsv_colour from = { .h = 0, .s = 100, .v = 100 };
+    const struct hsv_colour to = { .h = 120, .s = 0, .v = 50 };
+    struct hsv_colour colour = transition_interpolate(from, to, 500, 1000);
+    CHECK_NEAR(colour.h, 60);
+    CHECK_NEAR(colour.s, 50);
+    CHECK_NEAR(colour.v, 75);
+
+    /* before the start and after the end */
+    colour = transition_interpolate(from, to, -1, 1000);
+    CHECK_NEAR(colour.h, 0);
+    colour = transition_interpolate(from, to, 2000, 1000);
+    CHECK_NEAR(colour.h, 120);
+    CHECK_NEAR(colour.v, 50);
+
+    /* the hue takes the shorter way round, through 0 */
+    const struct hsv_colour near_end = { .h = 350, .s = 100, .v = 100 };
+    const struct hsv_colour near_start = { .h = 10, .s = 100, .v = 100 };
+    CHECK_NEAR(transition_interpolate(near_end, near_start, 500, 1000).h, 0);
+    CHECK_NEAR(transition_interpolate(near_end, near_start, 250, 1000).h, 355);
+    CHECK_NEAR(transition_interpolate(near_start, near_end, 750, 1000).h, 355);
+}
+
+static void test_frame_timing(void)
+{
+    reset(red, true);
+    const int64_t start = esp_timer_get_time();
+    CHECK(transition_set_bulb_state(0, blue, true, 300));
+    CHECK(transition_running());
+    const int frames = run_frames(1000000);
+    printf("300 ms fade: %d frames, %d written\n", frames, fake_bluetooth.write_count);
+
+    CHECK_RANGE(frames, 300000 / TRANSITION_FRAME_US, 300000 / TRANSITION_FRAME_US + 1);
+    CHECK(fake_bluetooth.write_count > 1 && fake_bluetooth.write_count <= frames);
+    CHECK(!transition_running());
+    CHECK(!transition_active(0));
+
+    const struct fake_bluetooth_write * last = &fake_bluetooth.writes[fake_bluetooth.write_count - 1];
+    CHECK_RANGE(last->time - start, 300000, 300000 + TRANSITION_FRAME_US);
+    CHECK(!last->off);
+    CHECK_EQ(last->rgb.r, 0);
+    CHECK_EQ(last->rgb.g, 0);
+    CHECK_EQ(last->rgb.b, 255);
+
+    for (int i = 0; i < fake_bluetooth.write_count; i++) {
+        /* red to blue the short way is through magenta, never green */
+        CHECK_EQ(fake_bluetooth.writes[i].rgb.g, 0);
+        /* at most one frame per frame period */
+        if (i > 0) {
+            CHECK(fake_bluetooth.writes[i].time - fake_bluetooth.writes[i - 1].time >= TRANSITION_FRAME_US);
+        }
+    }
+}
+
+static void test_unchanged_frames_skipped(void)
+{
+    /* a slow fade over a few RGB steps writes only when the colour changes */
+    const struct hsv_colour dim = { .h = 0, .s = 100, .v = 50 };
+    const struct hsv_colour less_dim = { .h = 0, .s = 100, .v = 52 };
+    reset(dim, true);
+    transition_set_bulb_state(0, less_dim, true, 1000);
+    const int frames = run_frames(2000000);
+    printf("1 s fade over 2%% brightness: %d frames, %d written\n", frames, fake_bluetooth.write_count);
+    CHECK(frames > 100);
+    CHECK_RANGE(fake_bluetooth.write_count, 2, 8);
+}
+
+static void test_fade_to_off(void)
+{
+    reset(green, true);
+    transition_set_bulb_state(0, green, false, 100);
+    run_frames(1000000);
+    CHECK(fake_bluetooth.write_count > 0);
+    CHECK(fake_bluetooth.writes[fake_bluetooth.write_count - 1].off);
+    CHECK(!transition_active(0));
+}
+
+static void test_retarget_continues(void)
+{
+    reset(red, true);
+    transition_set_bulb_state(0, blue, true, 400);
+    run_frames(200000);
+    CHECK(transition_active(0));
+    const struct rgb_colour before = fake_bluetooth.writes[fake_bluetooth.write_count - 1].rgb;
+
+    /* the new fade starts from the colour reached, so the bulb does not jump */
+    const int written = fake_bluetooth.write_count;
+    transition_set_bulb_state(0, green, true, 400);
+    run_frames(TRANSITION_FRAME_US);
+    CHECK(fake_bluetooth.write_count > written);
+    const struct rgb_colour after = fake_bluetooth.writes[written].rgb;
+    CHECK(abs(after.r - before.r) <= 16 && abs(after.g - before.g) <= 16 && abs(after.b - before.b) <= 16);
+    run_frames(1000000);
+    CHECK_EQ(fake_bluetooth.writes[fake_bluetooth.write_count - 1].rgb.g, 255);
+}
+
+static void test_direct_change_cancels(void)
+{
+    reset(red, true);
+    transition_set_bulb_state(0, blue, true, 400);
+    run_frames(100000);
+    transition_set_bulb_state(0, green, true, 0);
+    CHECK(!transition_active(0));
+    CHECK(!transition_running());
+    const struct fake_bluetooth_write * last = &fake_bluetooth.writes[fake_bluetooth.write_count - 1];
+    CHECK_EQ(last->rgb.g, 255);
+    CHECK_EQ(last->rgb.b, 0);
+    /* no frame of the old fade follows it */
+    const int written = fake_bluetooth.write_count;
+    CHECK(!transition_step(esp_timer_get_time() + TRANSITION_FRAME_US));
+    CHECK_EQ(fake_bluetooth.write_count, written);
+}
+
+static void test_disconnected_bulb(void)
+{
+    reset(red, true);
+    fake_bluetooth.connected[1] = false;
+    CHECK(!transition_set_bulb_state(1, blue, true, 300));
+    CHECK(!transition_active(1));
+    CHECK(!transition_set_bulb_state(5, blue, true, 300));
+    CHECK_EQ(fake_bluetooth.write_count, 0);
+}
+
+int main(void)
+{
+    test_interpolate();
+    test_frame_timing();
+    test_unchanged_frames_skipped();
+    test_fade_to_off();
+    test_retarget_continues();
+    test_direct_change_cancels();
+    test_disconnected_bulb();
+
+    return test_result("test_transition");
+}
@@ -0,0 +1,177 @@
+/**
+ * @file Wi-Fi reconnection under simulated access point outages
+ *
+ * Drives the Wi-Fi event handler with disconnect reasons and the simulated clock,
+ * and checks the immediate retry after transient losses, the jittered exponential
+ * backoff, its cap, the cached access point fallback and the time to reconnect.
+ */
+
+#include "fake.h"
+#include "test.h"
+
+#include "wifi.c"
+
+static uint32_t link_downs = 0;
+
+void network_init(void)
+{
+}
+
+void network_link_up(void)
+{
+}
+
+void network_link_down(void)
+{
+    link_downs++;
+}
+
+static const uint8_t ap_bssid[6] = {0x10, 0x20, 0x30, 0x40, 0x50, 0x60};
+
+static void deliver_disconnect(const uint8_t reason)
+{
+    wifi_event_sta_disconnected_t event = { .reason = reason };
+    fake_wifi.handler(NULL, WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &event);
+}
+
+static void deliver_connected(void)
+{
+    wifi_event_sta_connected_t connected = { .channel = 6 };
+    memcpy(connected.bssid, ap_bssid, sizeof(connected.bssid));
+    fake_wifi.handler(NULL, WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &connected);
+    ip_event_got_ip_t got_ip = { 0 };
+    fake_wifi.handler(NULL, IP_EVENT, IP_EVENT_STA_GOT_IP, &got_ip);
+}
+
+/* advance in 1 ms steps until the driver is asked to connect again, returns the wait in ms or -1 */
+static int64_t wait_for_connect_after(const uint32_t calls, const int64_t limit_ms)
+{
+    const int64_t start = esp_timer_get_time();
+    while (fake_wifi.connect_calls == calls) {
+        if (esp_timer_get_time() - start > limit_ms * 1000) {
+            return -1;
+        }
+        fake_clock_advance(1000);
+    }
+    return (fake_wifi.last_connect_time - start) / 1000;
+}
+
+static int64_t wait_for_connect(const int64_t limit_ms)
+{
+    return wait_for_connect_after(fake_wifi.connect_calls, limit_ms);
+}
+
+static void test_transient_loss_retries_immediately(void)
+{
+    const uint32_t calls = fake_wifi.connect_calls;
+    deliver_disconnect(WIFI_REASON_BEACON_TIMEOUT);
+    CHECK_EQ(fake_wifi.connect_calls, calls + 1);
+    CHECK_EQ(fake_wifi.last_connect_time, esp_timer_get_time());
+    deliver_connected();
+    CHECK_EQ(reconnect_attempts, 0);
+}
+
+/* the access point disappears for outage_ms, returns how long reconnecting took after it came back */
+static int64_t simulate_outage(const uint8_t reason, const int64_t outage_ms, uint32_t * attempts)
+{
+    const int64_t ap_back = esp_timer_get_time() + outage_ms * 1000;
+    uint32_t attempt = 0;
+    uint32_t calls = fake_wifi.connect_calls;
+    deliver_disconnect(reason);
+    for (;;) {
+        const int64_t waited = wait_for_connect_after(calls, RECONNECT_MAX_DELAY_MS + 1);
+        CHECK(waited >= 0);
+        if (waited < 0) {
+            return -1;
+        }
+
+        /* every delay is the doubled backoff with its upper half randomised */
+        uint32_t backoff = attempt < 16 ? RECONNECT_MIN_DELAY_MS << attempt : RECONNECT_MAX_DELAY_MS;
+        if (backoff > RECONNECT_MAX_DELAY_MS) backoff = RECONNECT_MAX_DELAY_MS;
+        if (attempt == 0 && wifi_reason_is_transient(reason)) backoff = 0;
+        CHECK_RANGE(waited, backoff / 2, backoff);
+        attempt++;
+
+        if (esp_timer_get_time() >= ap_back) {
+            break;
+        }
+        calls = fake_wifi.connect_calls;
+        deliver_disconnect(WIFI_REASON_NO_AP_FOUND);
+    }
+    const int64_t reconnect_ms = (esp_timer_get_time() - ap_back) / 1000;
+    deliver_connected();
+    CHECK_EQ(reconnect_attempts, 0);
+    *attempts = attempt;
+    return reconnect_ms;
+}
+
+static void test_short_outage(void)
+{
+    uint32_t attempts;
+    const int64_t reconnect_ms = simulate_outage(WIFI_REASON_BEACON_TIMEOUT, 5000, &attempts);
+    /* 0 + 125..250 + 250..500 + ... stays well below the cap for a 5 s outage */
+    CHECK_RANGE(attempts, 5, 10);
+    CHECK_RANGE(reconnect_ms, 0, 8000);
+    printf("5 s outage: reconnected %lld ms after the access point returned, %u attempts\n",
+        (long long)reconnect_ms, attempts);
+}
+
+static void test_long_outage_is_capped(void)
+{
+    uint32_t attempts;
+    const int64_t reconnect_ms = simulate_outage(WIFI_REASON_NO_AP_FOUND, 10 * 60 * 1000, &attempts);
+    /* the delay never exceeds the cap, so neither does the time to notice the access point */
+    CHECK_RANGE(reconnect_ms, 0, RECONNECT_MAX_DELAY_MS);
+    CHECK_RANGE(attempts, 15, 40);
+    printf("10 min outage: reconnected %lld ms after the access point returned, %u attempts\n",
+        (long long)reconnect_ms, attempts);
+}
+
+static void test_cached_access_point_falls_back_to_scan(void)
+{
+    /* the first retry associates directly with the remembered access point */
+    deliver_disconnect(WIFI_REASON_AUTH_EXPIRE);
+    CHECK(fake_wifi.sta_config.sta.bssid_set);
+    CHECK(memcmp(fake_wifi.sta_config.sta.bssid, ap_bssid, sizeof(ap_bssid)) == 0);
+    CHECK_EQ(fake_wifi.sta_config.sta.channel, 6);
+
+    /* if that fails, the next one scans all channels */
+    deliver_disconnect(WIFI_REASON_NO_AP_FOUND);
+    CHECK(!fake_wifi.sta_config.sta.bssid_set);
+    CHECK_EQ(fake_wifi.sta_config.sta.scan_method, WIFI_ALL_CHANNEL_SCAN);
+    CHECK(wait_for_connect(RECONNECT_MAX_DELAY_MS) >= 0);
+    deliver_connected();
+}
+
+static void test_bridges_do_not_retry_in_step(void)
+{
+    /* two bridges losing the same access point at the same time pick different delays */
+    int64_t delays[2];
+    for (int i = 0; i < 2; i++) {
+        fake_random_seed(1000 + i);
+        deliver_disconnect(WIFI_REASON_NO_AP_FOUND);
+        deliver_disconnect(WIFI_REASON_NO_AP_FOUND);
+        deliver_disconnect(WIFI_REASON_NO_AP_FOUND);
+        delays[i] = wait_for_connect(RECONNECT_MAX_DELAY_MS);
+        deliver_connected();
+    }
+    CHECK(delays[0] != delays[1]);
+}
+
+int main(void)
+{
+    wifi_setup(false);
+    fake_wifi.handler(NULL, WIFI_EVENT, WIFI_EVENT_STA_START, NULL);
+    CHECK_EQ(fake_wifi.connect_calls, 1);
+    deliver_connected();
+
+    test_transient_loss_retries_immediately();
+    test_short_outage();
+    test_long_outage_is_capped();
+    test_cached_access_point_falls_back_to_scan();
+    test_bridges_do_not_retry_in_step();
+    CHECK(link_downs > 0);
+    CHECK_EQ(fake_critical_violations, 0);
+
+    return test_result("test_wifi_reconnect");
+}